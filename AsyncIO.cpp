@@ -0,0 +1,446 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <condition_variable>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+
+#include "AsyncIO.h"
+#include "ThreadPool.h"
+#include "PerfTrace.h"
+
+//! Threads doing blocking calls when io_uring is unavailable.
+static const size_t fallback_threads = 16;
+
+//! Largest single read or write submitted.
+static const size_t max_transfer = 1 << 30;
+
+/**
+ * \brief Submission and completion rings shared with the kernel.
+ *
+ * There is no liburing, so the rings are set up with the raw system
+ * calls and driven through the head and tail indexes the kernel
+ * exposes, like liburing does.
+ */
+struct AsyncIO::Ring
+{
+	int fd;
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	io_uring_sqe *sqes;
+	size_t sqes_size;
+	unsigned entries;
+
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	io_uring_cqe *cqes;
+
+	//! Create a ring with room for depth requests, or return nullptr.
+	static Ring *create(unsigned depth);
+
+	~Ring();
+
+	//! Next free submission entry, cleared.
+	io_uring_sqe *next_sqe();
+
+	//! Pass all new submission entries to the kernel and wait for at
+	//! least one completion.
+	bool submit_and_wait();
+};
+
+template<class T>
+static T *
+ring_field(void *ring, unsigned offset)
+{
+	return reinterpret_cast<T *>(static_cast<char *>(ring) + offset);
+}
+
+AsyncIO::Ring *
+AsyncIO::Ring::create(unsigned depth)
+{
+	const char *disable = std::getenv("WYAG_NO_IO_URING");
+	if (disable && *disable)
+		return nullptr;
+
+	io_uring_params p;
+	std::memset(&p, 0, sizeof(p));
+	int fd = syscall(__NR_io_uring_setup, depth, &p);
+	if (fd < 0)
+		return nullptr;
+
+	// Opening and closing files needs Linux 5.6
+	const unsigned char needed[] = {IORING_OP_OPENAT, IORING_OP_STATX,
+		IORING_OP_READ, IORING_OP_WRITE, IORING_OP_CLOSE};
+	size_t probe_size = sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op);
+	std::vector<unsigned char> probe_buf(probe_size);
+	auto *probe = reinterpret_cast<io_uring_probe *>(probe_buf.data());
+	if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) < 0)
+	{
+		close(fd);
+		return nullptr;
+	}
+	for (auto op : needed)
+	{
+		if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED))
+		{
+			close(fd);
+			return nullptr;
+		}
+	}
+
+	Ring *r = new Ring();
+	r->fd = fd;
+	r->entries = p.sq_entries;
+	r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+	r->sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+	bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+	if (single)
+		r->sq_ring_size = r->cq_ring_size = std::max(r->sq_ring_size, r->cq_ring_size);
+
+	r->sq_ring = mmap(nullptr, r->sq_ring_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	r->cq_ring = MAP_FAILED;
+	r->sqes = static_cast<io_uring_sqe *>(MAP_FAILED);
+	if (r->sq_ring != MAP_FAILED)
+	{
+		r->cq_ring = single ? r->sq_ring : mmap(nullptr, r->cq_ring_size,
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		r->sqes = static_cast<io_uring_sqe *>(mmap(nullptr, r->sqes_size,
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES));
+	}
+	if (r->sq_ring == MAP_FAILED || r->cq_ring == MAP_FAILED || r->sqes == MAP_FAILED)
+	{
+		delete r;
+		return nullptr;
+	}
+
+	r->sq_head = ring_field<unsigned>(r->sq_ring, p.sq_off.head);
+	r->sq_tail = ring_field<unsigned>(r->sq_ring, p.sq_off.tail);
+	r->sq_mask = ring_field<unsigned>(r->sq_ring, p.sq_off.ring_mask);
+	r->sq_array = ring_field<unsigned>(r->sq_ring, p.sq_off.array);
+	r->cq_head = ring_field<unsigned>(r->cq_ring, p.cq_off.head);
+	r->cq_tail = ring_field<unsigned>(r->cq_ring, p.cq_off.tail);
+	r->cq_mask = ring_field<unsigned>(r->cq_ring, p.cq_off.ring_mask);
+	r->cqes = ring_field<io_uring_cqe>(r->cq_ring, p.cq_off.cqes);
+	return r;
+}
+
+AsyncIO::Ring::~Ring()
+{
+	if (sqes != MAP_FAILED)
+		munmap(sqes, sqes_size);
+	if (cq_ring != MAP_FAILED && cq_ring != sq_ring)
+		munmap(cq_ring, cq_ring_size);
+	if (sq_ring != MAP_FAILED)
+		munmap(sq_ring, sq_ring_size);
+	close(fd);
+}
+
+io_uring_sqe *
+AsyncIO::Ring::next_sqe()
+{
+	// Only this thread moves the tail, the kernel only reads it
+	unsigned tail = *sq_tail;
+	unsigned index = tail & *sq_mask;
+	io_uring_sqe *sqe = &sqes[index];
+	std::memset(sqe, 0, sizeof(*sqe));
+	sq_array[index] = index;
+	__atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+	return sqe;
+}
+
+bool
+AsyncIO::Ring::submit_and_wait()
+{
+	unsigned pending = *sq_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+	PERF_COUNT(syscalls, 1);
+	int ret;
+	do
+	{
+		ret = syscall(__NR_io_uring_enter, fd, pending, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+	} while (ret < 0 && (errno == EINTR || errno == EAGAIN || errno == EBUSY));
+	return ret >= 0;
+}
+
+//! Progress of one request on the ring.
+struct Transfer
+{
+	enum Stage { open, stat, transfer, close };
+	Stage stage;
+	int fd;
+	size_t done;
+	struct statx stx;
+};
+
+//! Read or write a whole file with blocking calls, returns errno or 0.
+static int
+blocking_transfer(AsyncIO::Request &r)
+{
+	PERF_COUNT(syscalls, 1);
+	int fd = r.write ? ::open(r.path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, r.mode) :
+		::open(r.path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return errno;
+
+	int error = 0;
+	size_t done = 0;
+	if (!r.write)
+	{
+		struct stat st;
+		if (fstat(fd, &st) == 0)
+			r.data.resize(st.st_size);
+		else
+			error = errno;
+	}
+	while (error == 0 && done < r.data.size())
+	{
+		size_t len = std::min(r.data.size() - done, max_transfer);
+		ssize_t n = r.write ? ::write(fd, r.data.data() + done, len) :
+			::read(fd, r.data.data() + done, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			error = errno;
+		else if (n == 0 && r.write)
+			error = EIO;
+		else if (n == 0)
+			r.data.resize(done);
+		else
+			done += n;
+	}
+	if (::close(fd) != 0 && error == 0)
+		error = errno;
+	return error;
+}
+
+AsyncIO::AsyncIO(size_t depth) :
+	m_depth(std::max<size_t>(1, depth)),
+	m_ring(Ring::create(m_depth))
+{
+}
+
+AsyncIO::~AsyncIO()
+{
+	delete m_ring;
+}
+
+bool
+AsyncIO::uses_io_uring() const
+{
+	return m_ring != nullptr;
+}
+
+void
+AsyncIO::run(std::vector<Request> &requests, const Done &done)
+{
+	PERF_SCOPE("async_io");
+	for (auto &r : requests)
+	{
+		r.error = 0;
+		if (!r.write)
+			r.data.clear();
+	}
+	if (m_ring)
+		run_ring(requests, done);
+	else
+		run_threads(requests, done);
+}
+
+void
+AsyncIO::run_ring(std::vector<Request> &requests, const Done &done)
+{
+	std::vector<Transfer> transfers(requests.size());
+	static const char empty_path[] = "";
+
+	// Queue the next operation of request i
+	auto submit = [&](size_t i) {
+		auto &r = requests[i];
+		auto &t = transfers[i];
+		io_uring_sqe *sqe = m_ring->next_sqe();
+		sqe->user_data = i;
+		switch (t.stage)
+		{
+		case Transfer::open:
+			sqe->opcode = IORING_OP_OPENAT;
+			sqe->fd = AT_FDCWD;
+			sqe->addr = reinterpret_cast<uintptr_t>(r.path.c_str());
+			sqe->len = r.write ? r.mode : 0;
+			sqe->open_flags = r.write ? (O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC) :
+				(O_RDONLY | O_CLOEXEC);
+			break;
+		case Transfer::stat:
+			sqe->opcode = IORING_OP_STATX;
+			sqe->fd = t.fd;
+			sqe->addr = reinterpret_cast<uintptr_t>(empty_path);
+			sqe->len = STATX_SIZE;
+			sqe->off = reinterpret_cast<uintptr_t>(&t.stx);
+			sqe->statx_flags = AT_EMPTY_PATH;
+			break;
+		case Transfer::transfer:
+			sqe->opcode = r.write ? IORING_OP_WRITE : IORING_OP_READ;
+			sqe->fd = t.fd;
+			sqe->addr = reinterpret_cast<uintptr_t>(r.data.data() + t.done);
+			sqe->len = std::min(r.data.size() - t.done, max_transfer);
+			sqe->off = t.done;
+			break;
+		case Transfer::close:
+			sqe->opcode = IORING_OP_CLOSE;
+			sqe->fd = t.fd;
+			break;
+		}
+	};
+
+	// The stage after the data was read or written, or a call failed
+	auto after_transfer = [&](size_t i) {
+		transfers[i].stage = Transfer::close;
+		submit(i);
+	};
+
+	size_t started = 0;
+	size_t finished = 0;
+	size_t in_flight = 0;
+	size_t limit = std::min<size_t>(m_depth, m_ring->entries);
+	while (finished < requests.size())
+	{
+		while (in_flight < limit && started < requests.size())
+		{
+			transfers[started].stage = Transfer::open;
+			transfers[started].fd = -1;
+			transfers[started].done = 0;
+			submit(started++);
+			in_flight++;
+		}
+
+		if (!m_ring->submit_and_wait())
+		{
+			// The kernel may still be using the buffers, so they must
+			// not be freed before the operations complete
+			std::cerr << "io_uring_enter failed: " << std::strerror(errno) << std::endl;
+			std::abort();
+		}
+
+		unsigned head = *m_ring->cq_head;
+		unsigned tail = __atomic_load_n(m_ring->cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++)
+		{
+			const io_uring_cqe &cqe = m_ring->cqes[head & *m_ring->cq_mask];
+			size_t i = cqe.user_data;
+			int res = cqe.res;
+			auto &r = requests[i];
+			auto &t = transfers[i];
+			switch (t.stage)
+			{
+			case Transfer::open:
+				if (res < 0)
+				{
+					r.error = -res;
+					break;
+				}
+				t.fd = res;
+				t.stage = r.write ? Transfer::transfer : Transfer::stat;
+				if (r.write && r.data.empty())
+					after_transfer(i);
+				else
+					submit(i);
+				continue;
+			case Transfer::stat:
+				if (res < 0)
+				{
+					r.error = -res;
+					after_transfer(i);
+					continue;
+				}
+				r.data.resize(t.stx.stx_size);
+				t.stage = Transfer::transfer;
+				if (r.data.empty())
+					after_transfer(i);
+				else
+					submit(i);
+				continue;
+			case Transfer::transfer:
+				if (res < 0 && res != -EINTR && res != -EAGAIN)
+				{
+					r.error = -res;
+				}
+				else if (res == 0)
+				{
+					// A file shorter than it was when stat'ed
+					if (r.write)
+						r.error = EIO;
+					else
+						r.data.resize(t.done);
+				}
+				else if (res > 0)
+				{
+					t.done += res;
+				}
+				if (r.error == 0 && t.done < r.data.size())
+					submit(i);
+				else
+					after_transfer(i);
+				continue;
+			case Transfer::close:
+				if (res < 0 && r.error == 0)
+					r.error = -res;
+				break;
+			}
+
+			// Request i is finished
+			in_flight--;
+			finished++;
+			if (done)
+				done(i);
+		}
+		__atomic_store_n(m_ring->cq_head, head, __ATOMIC_RELEASE);
+	}
+}
+
+void
+AsyncIO::run_threads(std::vector<Request> &requests, const Done &done)
+{
+	std::mutex mutex;
+	std::condition_variable cond;
+	std::deque<size_t> finished;
+
+	{
+		ThreadPool pool(std::min(m_depth, fallback_threads));
+		for (size_t i = 0; i < requests.size(); i++)
+		{
+			pool.submit([&, i]() {
+				requests[i].error = blocking_transfer(requests[i]);
+				std::lock_guard<std::mutex> lock(mutex);
+				finished.push_back(i);
+				cond.notify_one();
+			});
+		}
+
+		for (size_t n = 0; n < requests.size(); n++)
+		{
+			size_t i;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				cond.wait(lock, [&] { return !finished.empty(); });
+				i = finished.front();
+				finished.pop_front();
+			}
+			if (done)
+				done(i);
+		}
+	}
+}
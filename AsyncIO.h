@@ -0,0 +1,64 @@
+#ifndef ASYNC_IO_H
+#define ASYNC_IO_H
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <sys/types.h>
+
+/**
+ * \brief Reads and writes many whole files with many requests in
+ * flight at once.
+ *
+ * Checking out thousands of small files one open, write and close
+ * after another waits for the disk each time.  Here each file passes
+ * through opening, reading or writing and closing independently, up
+ * to depth files at once, submitted in batches to an io_uring.  Where
+ * io_uring is unavailable, or WYAG_NO_IO_URING is set, the same
+ * requests run as blocking calls on a thread pool.
+ */
+class AsyncIO
+{
+public:
+	struct Request
+	{
+		std::string path;
+		//! Write data to path instead of reading path into it.
+		bool write;
+		//! Permissions of a file created by a write.
+		mode_t mode;
+		std::vector<unsigned char> data;
+		//! errno of the failed call, or 0.
+		int error;
+	};
+
+	//! Called on the thread calling run() when request i is done,
+	//! it must not throw.
+	using Done = std::function<void(size_t i)>;
+
+	AsyncIO(size_t depth = 64);
+
+	~AsyncIO();
+
+	AsyncIO(const AsyncIO &) = delete;
+	AsyncIO &operator=(const AsyncIO &) = delete;
+
+	//! Does it use io_uring rather than threads?
+	bool uses_io_uring() const;
+
+	//! Run all requests and wait for them, calling done for each one
+	//! as soon as it finishes.
+	void run(std::vector<Request> &requests, const Done &done = nullptr);
+
+private:
+	struct Ring;
+
+	size_t m_depth;
+	Ring *m_ring;
+
+	void run_ring(std::vector<Request> &requests, const Done &done);
+
+	void run_threads(std::vector<Request> &requests, const Done &done);
+};
+
+#endif
@@ -0,0 +1,42 @@
+#include "AtomicBitset.h"
+
+AtomicBitset::AtomicBitset(size_t size) :
+	m_size(size),
+	m_words(new std::atomic<uint64_t>[(size + 63) / 64])
+{
+	for (size_t i = 0; i < (size + 63) / 64; i++)
+	{
+		m_words[i].store(0, std::memory_order_relaxed);
+	}
+}
+
+size_t
+AtomicBitset::size() const
+{
+	return m_size;
+}
+
+bool
+AtomicBitset::set(size_t i)
+{
+	uint64_t bit = uint64_t(1) << (i % 64);
+	return (m_words[i / 64].fetch_or(bit, std::memory_order_relaxed) & bit) == 0;
+}
+
+bool
+AtomicBitset::test(size_t i) const
+{
+	uint64_t bit = uint64_t(1) << (i % 64);
+	return (m_words[i / 64].load(std::memory_order_relaxed) & bit) != 0;
+}
+
+size_t
+AtomicBitset::count() const
+{
+	size_t n = 0;
+	for (size_t i = 0; i < (m_size + 63) / 64; i++)
+	{
+		n += __builtin_popcountll(m_words[i].load(std::memory_order_relaxed));
+	}
+	return n;
+}
@@ -0,0 +1,35 @@
+#ifndef ATOMIC_BITSET_H
+#define ATOMIC_BITSET_H
+
+#include <vector>
+#include <atomic>
+#include <memory>
+#include <cstdint>
+
+/**
+ * \brief Fixed size set of bits which threads may set concurrently.
+ *
+ * One bit per object position takes 16 MiB for a hundred million
+ * objects, where a set of object ids would take gigabytes.
+ */
+class AtomicBitset
+{
+public:
+	AtomicBitset(size_t size);
+
+	size_t size() const;
+
+	//! Set bit i, returns true if it was clear before.
+	bool set(size_t i);
+
+	bool test(size_t i) const;
+
+	//! Number of bits set.
+	size_t count() const;
+
+private:
+	size_t m_size;
+	std::unique_ptr<std::atomic<uint64_t>[]> m_words;
+};
+
+#endif
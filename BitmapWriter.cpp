@@ -0,0 +1,257 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "BitmapWriter.h"
+#include "PackBitmap.h"
+#include "GitException.h"
+#include "PerfTrace.h"
+
+//! Commits between stored bitmaps.
+static const size_t bitmap_interval = 100;
+
+static void
+put16(std::vector<unsigned char> &out, uint16_t v)
+{
+	out.push_back(static_cast<unsigned char>(v >> 8));
+	out.push_back(static_cast<unsigned char>(v));
+}
+
+static void
+put32(std::vector<unsigned char> &out, uint32_t v)
+{
+	put16(out, static_cast<uint16_t>(v >> 16));
+	put16(out, static_cast<uint16_t>(v));
+}
+
+BitmapWriter::BitmapWriter(GitPack &pack) :
+	m_pack(pack),
+	m_count(0)
+{
+}
+
+size_t
+BitmapWriter::bitmap_count() const
+{
+	return m_count;
+}
+
+uint32_t
+BitmapWriter::position(const unsigned char *sha) const
+{
+	size_t i;
+	if (!m_pack.find_index(sha, i))
+		throw GitException("Cannot write bitmap, object not in pack: " + GitPack::to_hex(sha));
+	return i;
+}
+
+uint32_t
+BitmapWriter::position(const std::string &sha) const
+{
+	unsigned char id[20];
+	if (sha.size() != 40)
+		throw GitException("Not an object id: " + sha);
+	GitPack::from_hex(sha, id);
+	return position(id);
+}
+
+void
+BitmapWriter::read(uint32_t i, const std::string &fmt, std::vector<unsigned char> &data)
+{
+	std::string type;
+	if (!m_pack.read(m_pack.object_offset(i), type, data))
+		throw GitException("Cannot read object " + m_pack.object_id(i));
+	if (!fmt.empty() && type != fmt)
+		throw GitException("Object " + m_pack.object_id(i) + " is a " + type + ", not a " + fmt);
+}
+
+void
+BitmapWriter::add_tree(uint32_t i, EwahBitmap &bits)
+{
+	std::vector<uint32_t> todo{i};
+	std::vector<unsigned char> data;
+	bits.set(m_bit[i]);
+	while (!todo.empty())
+	{
+		auto tree = todo.back();
+		todo.pop_back();
+		read(tree, "tree", data);
+		for (size_t p = 0; p < data.size(); )
+		{
+			auto nul = std::find(data.begin() + p, data.end(), '\0');
+			if (data.end() - nul < 21)
+				throw GitException("Corrupt tree " + m_pack.object_id(tree));
+			bool gitlink = std::memcmp(&data[p], "160000 ", 7) == 0;
+			bool subtree = std::memcmp(&data[p], "40000 ", 6) == 0;
+			p = nul - data.begin() + 21;
+			if (gitlink)
+				continue;
+
+			// A subtree already in the bitmap came with all it holds
+			auto entry = position(&*(nul + 1));
+			if (bits.test(m_bit[entry]))
+				continue;
+			bits.set(m_bit[entry]);
+			if (subtree)
+				todo.push_back(entry);
+		}
+	}
+}
+
+void
+BitmapWriter::write(const std::vector<std::string> &tips)
+{
+	PERF_SCOPE("bitmap_write");
+	auto order = m_pack.pack_order();
+	size_t n = order.size();
+	m_bit.resize(n);
+	for (size_t bit = 0; bit < n; bit++)
+	{
+		m_bit[order[bit]] = bit;
+	}
+
+	EwahBitmap types[4] = {EwahBitmap(n), EwahBitmap(n), EwahBitmap(n), EwahBitmap(n)};
+	for (uint32_t i = 0; i < n; i++)
+	{
+		std::string fmt;
+		size_t size;
+		if (!m_pack.info(m_pack.object_offset(i), fmt, size))
+			throw GitException("Cannot read object " + m_pack.object_id(i));
+		auto type = GitPack::type_from_name(fmt);
+		if (type == GitPack::Type::none)
+			throw GitException("Unknown object type " + fmt + ": " + m_pack.object_id(i));
+		types[static_cast<int>(type) - 1].set(m_bit[i]);
+	}
+
+	// Tags stand for the commits they point to
+	std::vector<uint32_t> todo;
+	std::unordered_set<uint32_t> selected;
+	std::vector<unsigned char> data;
+	for (const auto &tip : tips)
+	{
+		auto i = position(tip);
+		while (types[3].test(m_bit[i]))
+		{
+			read(i, "tag", data);
+			std::string head(data.begin(), std::find(data.begin(), data.end(), '\n'));
+			if (head.compare(0, 7, "object ") != 0)
+				throw GitException("Corrupt tag " + m_pack.object_id(i));
+			i = position(head.substr(7));
+		}
+		if (types[0].test(m_bit[i]) && selected.insert(i).second)
+			todo.push_back(i);
+	}
+
+	// Parents before children, found by a depth first walk
+	std::unordered_map<uint32_t, Commit> commits;
+	std::vector<uint32_t> topo;
+	std::vector<std::pair<uint32_t, size_t> > stack;
+	for (auto tip : todo)
+	{
+		if (commits.count(tip))
+			continue;
+		stack.emplace_back(tip, 0);
+		while (!stack.empty())
+		{
+			auto i = stack.back().first;
+			auto it = commits.find(i);
+			if (it == commits.end())
+			{
+				Commit c{0, {}, 0};
+				read(i, "commit", data);
+				for (size_t p = 0; p < data.size() && data[p] != '\n'; )
+				{
+					auto nl = std::find(data.begin() + p, data.end(), '\n');
+					std::string line(data.begin() + p, nl);
+					p = nl - data.begin() + 1;
+					if (line.compare(0, 5, "tree ") == 0)
+						c.tree = position(line.substr(5));
+					else if (line.compare(0, 7, "parent ") == 0)
+						c.parents.push_back(position(line.substr(7)));
+				}
+				it = commits.emplace(i, std::move(c)).first;
+			}
+
+			auto &next = stack.back().second;
+			if (next < it->second.parents.size())
+			{
+				auto parent = it->second.parents[next++];
+				if (!commits.count(parent))
+					stack.emplace_back(parent, 0);
+				continue;
+			}
+			topo.push_back(i);
+			stack.pop_back();
+		}
+	}
+	for (const auto &c : commits)
+	{
+		for (auto parent : c.second.parents)
+			commits.at(parent).children++;
+	}
+
+	for (size_t k = 0; k < topo.size(); k++)
+	{
+		if (k % bitmap_interval == bitmap_interval - 1)
+			selected.insert(topo[k]);
+	}
+
+	// Keep each bitmap until its last child has used it
+	std::unordered_map<uint32_t, EwahBitmap> bitmaps;
+	std::vector<unsigned char> out;
+	std::vector<unsigned char> entries;
+	m_count = 0;
+	for (auto i : topo)
+	{
+		auto &c = commits[i];
+		EwahBitmap bits(n);
+		for (auto parent : c.parents)
+		{
+			auto it = bitmaps.find(parent);
+			bits |= it->second;
+			auto &p = commits[parent];
+			if (--p.children == 0)
+				bitmaps.erase(it);
+		}
+		bits.set(m_bit[i]);
+		if (!bits.test(m_bit[c.tree]))
+			add_tree(c.tree, bits);
+
+		if (selected.count(i))
+		{
+			put32(entries, i);
+			entries.push_back(0);
+			entries.push_back(0);
+			bits.write(entries);
+			m_count++;
+		}
+		if (c.children > 0)
+			bitmaps.emplace(i, std::move(bits));
+	}
+
+	out.insert(out.end(), {'B', 'I', 'T', 'M'});
+	put16(out, 1);
+	put16(out, 1);
+	put32(out, m_count);
+	unsigned char sha[20];
+	GitPack::from_hex(m_pack.pack_checksum(), sha);
+	out.insert(out.end(), sha, sha + 20);
+	for (const auto &t : types)
+	{
+		t.write(out);
+	}
+	out.insert(out.end(), entries.begin(), entries.end());
+	GitPack::from_hex(GitPack::checksum(out.data(), out.size()), sha);
+	out.insert(out.end(), sha, sha + 20);
+
+	auto path = PackBitmap::bitmap_path(m_pack.pack_path());
+	auto tmp = path + ".tmp";
+	std::ofstream f(tmp, std::ios::binary);
+	f.write(reinterpret_cast<const char *>(out.data()), out.size());
+	f.close();
+	if (!f || std::rename(tmp.c_str(), path.c_str()) != 0)
+		throw GitException("Cannot write bitmap: " + path);
+}
@@ -0,0 +1,58 @@
+#ifndef BITMAP_WRITER_H
+#define BITMAP_WRITER_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include "GitPack.h"
+#include "EwahBitmap.h"
+
+/**
+ * \brief Writes the .bitmap file of a pack holding all objects
+ * reachable from some tips.
+ *
+ * Commits are visited parents first, and the bitmap of each commit is
+ * the union of the bitmaps of its parents plus its own tree, of which
+ * only the subtrees not yet in the bitmap are read.  A bitmap is
+ * stored for each tip and for every 100th commit, so that a walk from
+ * any commit soon reaches one.
+ */
+class BitmapWriter
+{
+public:
+	BitmapWriter(GitPack &pack);
+
+	//! Write bitmaps for the commits reachable from tips, which may
+	//! also be tags, to PackBitmap::bitmap_path() of the pack.  Throws
+	//! GitException if an object is not in the pack.
+	void write(const std::vector<std::string> &tips);
+
+	//! Number of commits with a stored bitmap.
+	size_t bitmap_count() const;
+
+private:
+	struct Commit
+	{
+		uint32_t tree;
+		std::vector<uint32_t> parents;
+		//! Children not visited yet, when 0 the bitmap can go
+		size_t children;
+	};
+
+	GitPack &m_pack;
+	std::vector<uint32_t> m_bit;
+	size_t m_count;
+
+	//! Sorted position of object sha, given as hex or raw.
+	uint32_t position(const std::string &sha) const;
+	uint32_t position(const unsigned char *sha) const;
+
+	//! Read object at sorted position i, checking its type.
+	void read(uint32_t i, const std::string &fmt, std::vector<unsigned char> &data);
+
+	//! Set the bits of tree i and of all objects in it.
+	void add_tree(uint32_t i, EwahBitmap &bits);
+};
+
+#endif
@@ -0,0 +1,149 @@
+#include <algorithm>
+#include <set>
+
+#include "BloomFilter.h"
+
+static const uint32_t seed0 = 0x293ae76f;
+static const uint32_t seed1 = 0x7e646e2c;
+
+static uint32_t
+rotate_left(uint32_t v, int n)
+{
+	return (v << n) | (v >> (32 - n));
+}
+
+//! A byte as git's murmur3 reads it, from a signed char.
+static uint32_t
+byte(char c)
+{
+	return static_cast<uint32_t>(static_cast<int32_t>(static_cast<signed char>(c)));
+}
+
+BloomFilter::Key::Key(const std::string &path)
+{
+	uint32_t h0 = murmur3(seed0, path);
+	uint32_t h1 = murmur3(seed1, path);
+	for (uint32_t i = 0; i < num_hashes; i++)
+	{
+		hashes[i] = h0 + i * h1;
+	}
+}
+
+BloomFilter::BloomFilter(const std::vector<std::string> &changed)
+{
+	if (changed.size() > max_changed_paths)
+	{
+		m_data.assign(1, 0xff);
+		return;
+	}
+
+	std::set<std::string> paths;
+	for (const auto &path : changed)
+	{
+		for (auto slash = path.size(); slash != std::string::npos && slash > 0;
+			slash = path.rfind('/', slash - 1))
+		{
+			paths.insert(path.substr(0, slash));
+		}
+	}
+	m_data.assign(std::max<size_t>(1, (paths.size() * bits_per_entry + 7) / 8), 0);
+	for (const auto &path : paths)
+	{
+		add(Key(path));
+	}
+}
+
+BloomFilter::BloomFilter(const unsigned char *data, size_t len) :
+	m_data(data, data + len)
+{
+}
+
+const std::vector<unsigned char> &
+BloomFilter::data() const
+{
+	return m_data;
+}
+
+void
+BloomFilter::add(const Key &key)
+{
+	uint64_t bits = m_data.size() * 8;
+	for (auto h : key.hashes)
+	{
+		uint64_t bit = h % bits;
+		m_data[bit / 8] |= 1 << (bit % 8);
+	}
+}
+
+bool
+BloomFilter::maybe_contains(const Key &key) const
+{
+	uint64_t bits = m_data.size() * 8;
+	if (bits == 0)
+		return true;
+	for (auto h : key.hashes)
+	{
+		uint64_t bit = h % bits;
+		if ((m_data[bit / 8] & (1 << (bit % 8))) == 0)
+			return false;
+	}
+	return true;
+}
+
+std::vector<BloomFilter::Key>
+BloomFilter::keys(const std::string &path)
+{
+	std::vector<Key> keys;
+	for (auto slash = path.size(); slash != std::string::npos && slash > 0;
+		slash = path.rfind('/', slash - 1))
+	{
+		keys.emplace_back(path.substr(0, slash));
+	}
+	return keys;
+}
+
+uint32_t
+BloomFilter::murmur3(uint32_t seed, const std::string &s)
+{
+	const uint32_t c1 = 0xcc9e2d51;
+	const uint32_t c2 = 0x1b873593;
+	uint32_t h = seed;
+	size_t len4 = s.size() / 4;
+	for (size_t i = 0; i < len4; i++)
+	{
+		uint32_t k = byte(s[4 * i]) | (byte(s[4 * i + 1]) << 8) |
+			(byte(s[4 * i + 2]) << 16) | (byte(s[4 * i + 3]) << 24);
+		k *= c1;
+		k = rotate_left(k, 15);
+		k *= c2;
+		h ^= k;
+		h = rotate_left(h, 13);
+		h = h * 5 + 0xe6546b64;
+	}
+
+	uint32_t k = 0;
+	size_t tail = 4 * len4;
+	switch (s.size() & 3)
+	{
+	case 3:
+		k ^= byte(s[tail + 2]) << 16;
+		// fall through
+	case 2:
+		k ^= byte(s[tail + 1]) << 8;
+		// fall through
+	case 1:
+		k ^= byte(s[tail]);
+		k *= c1;
+		k = rotate_left(k, 15);
+		k *= c2;
+		h ^= k;
+	}
+
+	h ^= s.size();
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	return h;
+}
@@ -0,0 +1,57 @@
+#ifndef BLOOM_FILTER_H
+#define BLOOM_FILTER_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+/**
+ * \brief Changed-path Bloom filter of one commit, as stored by git in
+ * the commit-graph.
+ *
+ * The filter holds every path changed against the first parent and
+ * all directories above them.  Each path sets 7 bits chosen by two
+ * murmur3 hashes, in 10 bits per path.  A path whose bits are not all
+ * set was certainly not changed, otherwise it probably was.  Commits
+ * changing more than 512 paths get a filter with all bits set.
+ */
+class BloomFilter
+{
+public:
+	static const uint32_t num_hashes = 7;
+	static const uint32_t bits_per_entry = 10;
+	static const size_t max_changed_paths = 512;
+
+	//! Hashes of a path, computed once to test many filters.
+	struct Key
+	{
+		uint32_t hashes[num_hashes];
+
+		Key(const std::string &path);
+	};
+
+	//! Filter of the changed paths, directories are added here.
+	BloomFilter(const std::vector<std::string> &changed);
+
+	//! Filter stored as len bytes at data.
+	BloomFilter(const unsigned char *data, size_t len);
+
+	//! False if the path of key is certainly not in the filter.
+	bool maybe_contains(const Key &key) const;
+
+	const std::vector<unsigned char> &data() const;
+
+	//! Keys of path and of each directory above it.
+	static std::vector<Key> keys(const std::string &path);
+
+	//! Murmur3 as git's version 1 filters compute it, bytes above
+	//! 0x7f taken as negative.
+	static uint32_t murmur3(uint32_t seed, const std::string &s);
+
+private:
+	std::vector<unsigned char> m_data;
+
+	void add(const Key &key);
+};
+
+#endif
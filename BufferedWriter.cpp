@@ -0,0 +1,67 @@
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+
+#include "BufferedWriter.h"
+#include "GitException.h"
+#include "PerfTrace.h"
+
+BufferedWriter::BufferedWriter(int fd, size_t size) :
+	m_fd(fd),
+	m_size(size)
+{
+	m_buffer.reserve(size);
+}
+
+BufferedWriter::~BufferedWriter()
+{
+	try
+	{
+		flush();
+	}
+	catch (const GitException &)
+	{
+	}
+}
+
+void
+BufferedWriter::write(const char *data, size_t len)
+{
+	if (m_buffer.size() + len > m_size)
+		flush();
+	m_buffer.append(data, len);
+}
+
+BufferedWriter &
+BufferedWriter::operator<<(const std::string &s)
+{
+	write(s.data(), s.size());
+	return *this;
+}
+
+BufferedWriter &
+BufferedWriter::operator<<(char c)
+{
+	write(&c, 1);
+	return *this;
+}
+
+void
+BufferedWriter::flush()
+{
+	size_t done = 0;
+	while (done < m_buffer.size())
+	{
+		PERF_COUNT(syscalls, 1);
+		ssize_t n = ::write(m_fd, m_buffer.data() + done, m_buffer.size() - done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+		{
+			m_buffer.clear();
+			throw GitException(std::string("Write error: ") + std::strerror(errno));
+		}
+		done += n;
+	}
+	m_buffer.clear();
+}
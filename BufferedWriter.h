@@ -0,0 +1,41 @@
+#ifndef BUFFERED_WRITER_H
+#define BUFFERED_WRITER_H
+
+#include <string>
+#include <cstddef>
+
+/**
+ * \brief Collects output in a large buffer and writes it to a file
+ * descriptor in few system calls.
+ *
+ * Listing a million paths through std::cout with std::endl flushes a
+ * million times, here they take a few hundred writes.
+ */
+class BufferedWriter
+{
+public:
+	//! Write to fd, by default standard output, in chunks of size.
+	BufferedWriter(int fd = 1, size_t size = 1 << 16);
+
+	//! Flush, ignoring errors.
+	~BufferedWriter();
+
+	BufferedWriter(const BufferedWriter &) = delete;
+	BufferedWriter &operator=(const BufferedWriter &) = delete;
+
+	void write(const char *data, size_t len);
+
+	BufferedWriter &operator<<(const std::string &s);
+
+	BufferedWriter &operator<<(char c);
+
+	//! Write out the buffer, throws GitException on errors.
+	void flush();
+
+private:
+	int m_fd;
+	size_t m_size;
+	std::string m_buffer;
+};
+
+#endif
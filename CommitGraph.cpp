@@ -0,0 +1,234 @@
+#include <cstring>
+
+#include "CommitGraph.h"
+#include "GitPack.h"
+#include "GitException.h"
+#include "PerfTrace.h"
+
+//! Parent position of no parent, and the flag of positions in EDGE.
+static const uint32_t no_parent = 0x70000000;
+static const uint32_t extra_edges = 0x80000000;
+
+static const size_t commit_data_size = 36;
+
+const uint32_t CommitGraph::npos;
+
+static uint32_t
+get32(const unsigned char *p)
+{
+	return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) |
+		(uint32_t(p[2]) << 8) | uint32_t(p[3]);
+}
+
+static uint64_t
+get64(const unsigned char *p)
+{
+	return (uint64_t(get32(p)) << 32) | get32(p + 4);
+}
+
+CommitGraph::CommitGraph(const std::string &path) :
+	m_file(new MappedFile(path)),
+	m_count(0),
+	m_fanout(nullptr),
+	m_oids(nullptr),
+	m_data(nullptr),
+	m_edges(nullptr),
+	m_edge_count(0),
+	m_bloom_index(nullptr),
+	m_bloom_data(nullptr),
+	m_bloom_len(0)
+{
+	PERF_SCOPE("commit_graph_read");
+	const unsigned char *p = m_file->data();
+	size_t len = m_file->size();
+	auto bad = [&path](const std::string &why) {
+		return GitException("Invalid commit-graph " + path + ": " + why);
+	};
+	if (len < 8 + 12 + 20 || std::memcmp(p, "CGPH", 4) != 0)
+		throw bad("no commit-graph header");
+	if (p[4] != 1 || p[5] != 1)
+		throw bad("unsupported version");
+	if (p[7] != 0)
+		throw bad("commit-graph chains are not supported");
+
+	// Table of chunk ids and offsets, ending with a zero id
+	size_t chunks = p[6];
+	if (len < 8 + 12 * (chunks + 1) + 20)
+		throw bad("truncated");
+	const unsigned char *bloom_index = nullptr;
+	size_t bloom_index_len = 0;
+	const unsigned char *bloom_data = nullptr;
+	size_t bloom_data_len = 0;
+	size_t oid_len = 0;
+	size_t data_len = 0;
+	for (size_t i = 0; i < chunks; i++)
+	{
+		const unsigned char *entry = p + 8 + 12 * i;
+		uint64_t offset = get64(entry + 4);
+		uint64_t end = get64(entry + 16);
+		if (offset > end || end > len - 20)
+			throw bad("bad chunk offset");
+		const unsigned char *chunk = p + offset;
+		size_t size = end - offset;
+		switch (get32(entry))
+		{
+		case 0x4f494446: // OIDF
+			if (size != 1024)
+				throw bad("bad fan-out chunk");
+			m_fanout = chunk;
+			break;
+		case 0x4f49444c: // OIDL
+			m_oids = chunk;
+			oid_len = size;
+			break;
+		case 0x43444154: // CDAT
+			m_data = chunk;
+			data_len = size;
+			break;
+		case 0x45444745: // EDGE
+			m_edges = chunk;
+			m_edge_count = size / 4;
+			break;
+		case 0x42494458: // BIDX
+			bloom_index = chunk;
+			bloom_index_len = size;
+			break;
+		case 0x42444154: // BDAT
+			bloom_data = chunk;
+			bloom_data_len = size;
+			break;
+		}
+	}
+	if (!m_fanout || !m_oids || !m_data)
+		throw bad("missing required chunk");
+	m_count = get32(m_fanout + 4 * 255);
+	if (oid_len != 20 * m_count || data_len != commit_data_size * m_count)
+		throw bad("chunk sizes do not match the commit count");
+
+	// Only filters computed the way BloomFilter does are usable
+	if (bloom_index && bloom_data && bloom_index_len == 4 * m_count &&
+		bloom_data_len >= 12 && get32(bloom_data) == 1 &&
+		get32(bloom_data + 4) == BloomFilter::num_hashes &&
+		get32(bloom_data + 8) == BloomFilter::bits_per_entry &&
+		(m_count == 0 || get32(bloom_index + 4 * (m_count - 1)) <= bloom_data_len - 12))
+	{
+		m_bloom_index = bloom_index;
+		m_bloom_data = bloom_data + 12;
+		m_bloom_len = bloom_data_len - 12;
+	}
+}
+
+size_t
+CommitGraph::commit_count() const
+{
+	return m_count;
+}
+
+bool
+CommitGraph::find(const std::string &sha, uint32_t &pos) const
+{
+	if (sha.size() != 40)
+		return false;
+	unsigned char key[20];
+	GitPack::from_hex(sha, key);
+	size_t lo = key[0] == 0 ? 0 : get32(m_fanout + 4 * (key[0] - 1));
+	size_t hi = get32(m_fanout + 4 * key[0]);
+	while (lo < hi)
+	{
+		size_t mid = lo + (hi - lo) / 2;
+		int cmp = std::memcmp(m_oids + 20 * mid, key, 20);
+		if (cmp == 0)
+		{
+			pos = mid;
+			return true;
+		}
+		if (cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return false;
+}
+
+std::string
+CommitGraph::commit_id(uint32_t pos) const
+{
+	return GitPack::to_hex(m_oids + 20 * pos);
+}
+
+std::string
+CommitGraph::tree_id(uint32_t pos) const
+{
+	return GitPack::to_hex(m_data + commit_data_size * pos);
+}
+
+std::vector<uint32_t>
+CommitGraph::parents(uint32_t pos) const
+{
+	std::vector<uint32_t> parents;
+	const unsigned char *d = m_data + commit_data_size * pos + 20;
+	uint32_t first = get32(d);
+	uint32_t second = get32(d + 4);
+	if (first == no_parent)
+		return parents;
+	parents.push_back(first < m_count ? first : npos);
+	if (second == no_parent)
+		return parents;
+	if ((second & extra_edges) == 0)
+	{
+		parents.push_back(second < m_count ? second : npos);
+		return parents;
+	}
+
+	// Octopus merges list their other parents in the EDGE chunk
+	for (size_t i = second & ~extra_edges; i < m_edge_count; i++)
+	{
+		uint32_t edge = get32(m_edges + 4 * i);
+		uint32_t parent = edge & ~extra_edges;
+		parents.push_back(parent < m_count ? parent : npos);
+		if (edge & extra_edges)
+			break;
+	}
+	return parents;
+}
+
+uint32_t
+CommitGraph::generation(uint32_t pos) const
+{
+	return get32(m_data + commit_data_size * pos + 28) >> 2;
+}
+
+uint64_t
+CommitGraph::commit_time(uint32_t pos) const
+{
+	const unsigned char *d = m_data + commit_data_size * pos + 28;
+	return (uint64_t(get32(d) & 3) << 32) | get32(d + 4);
+}
+
+bool
+CommitGraph::has_bloom_filters() const
+{
+	return m_bloom_index != nullptr;
+}
+
+bool
+CommitGraph::maybe_changed(uint32_t pos, const std::vector<BloomFilter::Key> &keys) const
+{
+	if (!m_bloom_index)
+		return true;
+	size_t begin = pos == 0 ? 0 : get32(m_bloom_index + 4 * (pos - 1));
+	size_t end = get32(m_bloom_index + 4 * pos);
+	if (begin > end || end > m_bloom_len)
+		return true;
+
+	// An empty filter was not computed
+	if (begin == end)
+		return true;
+	BloomFilter filter(m_bloom_data + begin, end - begin);
+	for (const auto &key : keys)
+	{
+		if (!filter.maybe_contains(key))
+			return false;
+	}
+	return true;
+}
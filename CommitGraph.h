@@ -0,0 +1,65 @@
+#ifndef COMMIT_GRAPH_H
+#define COMMIT_GRAPH_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
+
+#include "MappedFile.h"
+#include "BloomFilter.h"
+
+/**
+ * \brief The commit-graph file of a repository, as written by git.
+ *
+ * For each commit, sorted by id, the file stores the tree, the
+ * positions of the parents, the commit time and the generation number,
+ * one more than that of the highest parent.  Walking history from it
+ * needs no commit objects to be inflated and parsed.  It may also hold
+ * a changed-path Bloom filter for each commit.
+ */
+class CommitGraph
+{
+public:
+	//! Position of a missing parent.
+	static const uint32_t npos = 0xffffffff;
+
+	//! Open the commit-graph at path, throws GitException if invalid.
+	CommitGraph(const std::string &path);
+
+	size_t commit_count() const;
+
+	//! Find position of commit sha, returns false if not in the graph.
+	bool find(const std::string &sha, uint32_t &pos) const;
+
+	std::string commit_id(uint32_t pos) const;
+
+	std::string tree_id(uint32_t pos) const;
+
+	std::vector<uint32_t> parents(uint32_t pos) const;
+
+	uint32_t generation(uint32_t pos) const;
+
+	//! Committer time, in seconds since the epoch.
+	uint64_t commit_time(uint32_t pos) const;
+
+	bool has_bloom_filters() const;
+
+	//! False if the commit at pos certainly changed none of the paths
+	//! of keys against its first parent.
+	bool maybe_changed(uint32_t pos, const std::vector<BloomFilter::Key> &keys) const;
+
+private:
+	std::unique_ptr<MappedFile> m_file;
+	size_t m_count;
+	const unsigned char *m_fanout;
+	const unsigned char *m_oids;
+	const unsigned char *m_data;
+	const unsigned char *m_edges;
+	size_t m_edge_count;
+	const unsigned char *m_bloom_index;
+	const unsigned char *m_bloom_data;
+	size_t m_bloom_len;
+};
+
+#endif
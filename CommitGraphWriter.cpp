@@ -0,0 +1,275 @@
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "CommitGraphWriter.h"
+#include "BloomFilter.h"
+#include "DiffTree.h"
+#include "GitPack.h"
+#include "ThreadPool.h"
+#include "GitException.h"
+#include "PerfTrace.h"
+
+static const uint32_t no_parent = 0x70000000;
+static const uint32_t extra_edges = 0x80000000;
+
+//! Generation numbers are stored in 30 bits.
+static const uint32_t max_generation = 0x3fffffff;
+
+static void
+put32(std::vector<unsigned char> &out, uint32_t v)
+{
+	for (int shift = 24; shift >= 0; shift -= 8)
+		out.push_back(static_cast<unsigned char>(v >> shift));
+}
+
+static void
+put64(std::vector<unsigned char> &out, uint64_t v)
+{
+	put32(out, static_cast<uint32_t>(v >> 32));
+	put32(out, static_cast<uint32_t>(v));
+}
+
+static void
+put_id(std::vector<unsigned char> &out, const std::string &sha)
+{
+	unsigned char id[20];
+	GitPack::from_hex(sha, id);
+	out.insert(out.end(), id, id + 20);
+}
+
+CommitGraphWriter::CommitGraphWriter(GitRepository &repo, bool changed_paths,
+	size_t threads) :
+	m_repo(repo),
+	m_changed_paths(changed_paths),
+	m_threads(threads)
+{
+}
+
+void
+CommitGraphWriter::add_tip(const std::string &sha)
+{
+	m_tips.push_back(sha);
+}
+
+size_t
+CommitGraphWriter::commit_count() const
+{
+	return m_commits.size();
+}
+
+void
+CommitGraphWriter::read_commits()
+{
+	PERF_SCOPE("read_commits");
+	std::vector<std::string> todo;
+	std::unordered_set<std::string> seen;
+	std::string fmt;
+	std::vector<unsigned char> data;
+	for (auto sha : m_tips)
+	{
+		// Tags stand for what they point to
+		while (m_repo.object_data(sha, fmt, data) && fmt == "tag")
+		{
+			std::string head(data.begin(), std::find(data.begin(), data.end(), '\n'));
+			if (head.compare(0, 7, "object ") != 0)
+				throw GitException("Corrupt tag " + sha);
+			sha = head.substr(7);
+		}
+		if (fmt == "commit" && seen.insert(sha).second)
+			todo.push_back(sha);
+	}
+
+	while (!todo.empty())
+	{
+		Commit c;
+		c.sha = todo.back();
+		todo.pop_back();
+		c.time = 0;
+		c.generation = 0;
+		if (!m_repo.object_data(c.sha, fmt, data) || fmt != "commit")
+			throw GitException("Not a commit: " + c.sha);
+		for (size_t p = 0; p < data.size() && data[p] != '\n'; )
+		{
+			auto nl = std::find(data.begin() + p, data.end(), '\n');
+			std::string line(data.begin() + p, nl);
+			p = nl - data.begin() + 1;
+			if (line.compare(0, 5, "tree ") == 0)
+			{
+				c.tree = line.substr(5);
+			}
+			else if (line.compare(0, 7, "parent ") == 0)
+			{
+				c.parent_ids.push_back(line.substr(7));
+				if (seen.insert(c.parent_ids.back()).second)
+					todo.push_back(c.parent_ids.back());
+			}
+			else if (line.compare(0, 10, "committer ") == 0)
+			{
+				// "committer Name <email> 1234567890 +0100"
+				auto gt = line.rfind("> ");
+				if (gt != std::string::npos)
+					c.time = std::strtoull(line.c_str() + gt + 2, nullptr, 10);
+			}
+		}
+		if (c.tree.size() != 40)
+			throw GitException("Commit without tree: " + c.sha);
+		m_commits.push_back(std::move(c));
+	}
+
+	std::sort(m_commits.begin(), m_commits.end(), [](const Commit &a, const Commit &b) {
+		return a.sha < b.sha;
+	});
+	std::unordered_map<std::string, uint32_t> positions;
+	for (size_t i = 0; i < m_commits.size(); i++)
+	{
+		positions[m_commits[i].sha] = i;
+	}
+	for (auto &c : m_commits)
+	{
+		for (const auto &parent : c.parent_ids)
+			c.parents.push_back(positions.at(parent));
+	}
+}
+
+void
+CommitGraphWriter::compute_generations()
+{
+	// One more than the highest parent, parents found depth first
+	std::vector<std::pair<uint32_t, size_t> > stack;
+	for (uint32_t i = 0; i < m_commits.size(); i++)
+	{
+		if (m_commits[i].generation != 0)
+			continue;
+		stack.emplace_back(i, 0);
+		while (!stack.empty())
+		{
+			auto &c = m_commits[stack.back().first];
+			auto &next = stack.back().second;
+			if (next < c.parents.size())
+			{
+				auto parent = c.parents[next++];
+				if (m_commits[parent].generation == 0)
+					stack.emplace_back(parent, 0);
+				continue;
+			}
+			uint32_t generation = 0;
+			for (auto parent : c.parents)
+			{
+				generation = std::max(generation, m_commits[parent].generation);
+			}
+			c.generation = std::min(generation + 1, max_generation);
+			stack.pop_back();
+		}
+	}
+}
+
+void
+CommitGraphWriter::compute_filters()
+{
+	PERF_SCOPE("bloom_filters");
+	ThreadPool pool(m_threads);
+	pool.parallel_for(m_commits.size(), [this](size_t i) {
+		auto &c = m_commits[i];
+		auto parent_tree = c.parents.empty() ? std::string() : m_commits[c.parents[0]].tree;
+		DiffTree diff(m_repo, true);
+		std::vector<std::string> paths;
+		for (const auto &e : diff.diff(parent_tree, c.tree))
+		{
+			paths.push_back(e.path);
+		}
+		c.filter = BloomFilter(paths).data();
+	});
+}
+
+void
+CommitGraphWriter::write(const std::string &path)
+{
+	PERF_SCOPE("commit_graph_write");
+	read_commits();
+	compute_generations();
+	if (m_changed_paths)
+		compute_filters();
+
+	std::vector<std::pair<uint32_t, std::vector<unsigned char> > > chunks;
+	std::vector<unsigned char> fanout;
+	std::vector<unsigned char> oids;
+	std::vector<unsigned char> data;
+	std::vector<unsigned char> edges;
+	size_t next = 0;
+	for (int b = 0; b < 256; b++)
+	{
+		while (next < m_commits.size() && std::stoi(m_commits[next].sha.substr(0, 2), nullptr, 16) <= b)
+			next++;
+		put32(fanout, next);
+	}
+	for (const auto &c : m_commits)
+	{
+		put_id(oids, c.sha);
+		put_id(data, c.tree);
+		put32(data, c.parents.size() > 0 ? c.parents[0] : no_parent);
+		if (c.parents.size() > 2)
+		{
+			put32(data, extra_edges | (edges.size() / 4));
+			for (size_t k = 1; k < c.parents.size(); k++)
+			{
+				put32(edges, c.parents[k] | (k + 1 == c.parents.size() ? extra_edges : 0));
+			}
+		}
+		else
+		{
+			put32(data, c.parents.size() > 1 ? c.parents[1] : no_parent);
+		}
+		put32(data, (c.generation << 2) | static_cast<uint32_t>((c.time >> 32) & 3));
+		put32(data, static_cast<uint32_t>(c.time));
+	}
+	chunks.emplace_back(0x4f494446, std::move(fanout));
+	chunks.emplace_back(0x4f49444c, std::move(oids));
+	chunks.emplace_back(0x43444154, std::move(data));
+	if (!edges.empty())
+		chunks.emplace_back(0x45444745, std::move(edges));
+	if (m_changed_paths)
+	{
+		std::vector<unsigned char> index;
+		std::vector<unsigned char> filters;
+		put32(filters, 1);
+		put32(filters, BloomFilter::num_hashes);
+		put32(filters, BloomFilter::bits_per_entry);
+		for (const auto &c : m_commits)
+		{
+			filters.insert(filters.end(), c.filter.begin(), c.filter.end());
+			put32(index, filters.size() - 12);
+		}
+		chunks.emplace_back(0x42494458, std::move(index));
+		chunks.emplace_back(0x42444154, std::move(filters));
+	}
+
+	// Header, chunk table with a terminating entry, chunks, checksum
+	std::vector<unsigned char> out = {'C', 'G', 'P', 'H', 1, 1,
+		static_cast<unsigned char>(chunks.size()), 0};
+	uint64_t offset = 8 + 12 * (chunks.size() + 1);
+	for (const auto &chunk : chunks)
+	{
+		put32(out, chunk.first);
+		put64(out, offset);
+		offset += chunk.second.size();
+	}
+	put32(out, 0);
+	put64(out, offset);
+	for (const auto &chunk : chunks)
+	{
+		out.insert(out.end(), chunk.second.begin(), chunk.second.end());
+	}
+	unsigned char sha[20];
+	GitPack::from_hex(GitPack::checksum(out.data(), out.size()), sha);
+	out.insert(out.end(), sha, sha + 20);
+
+	auto tmp = path + ".tmp";
+	std::ofstream f(tmp, std::ios::binary);
+	f.write(reinterpret_cast<const char *>(out.data()), out.size());
+	f.close();
+	if (!f || std::rename(tmp.c_str(), path.c_str()) != 0)
+		throw GitException("Cannot write commit-graph: " + path);
+}
@@ -0,0 +1,58 @@
+#ifndef COMMIT_GRAPH_WRITER_H
+#define COMMIT_GRAPH_WRITER_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include "GitRepository.h"
+
+/**
+ * \brief Writes the commit-graph file for all commits reachable from
+ * some tips.
+ *
+ * Generation numbers are computed parents first in one pass.  The
+ * changed-path Bloom filters need a recursive diff of each commit
+ * against its first parent, these run on a thread pool.
+ */
+class CommitGraphWriter
+{
+public:
+	CommitGraphWriter(GitRepository &repo, bool changed_paths = false,
+		size_t threads = 0);
+
+	//! Add a commit, or a tag pointing to one.
+	void add_tip(const std::string &sha);
+
+	//! Write the commit-graph to path.
+	void write(const std::string &path);
+
+	size_t commit_count() const;
+
+private:
+	struct Commit
+	{
+		std::string sha;
+		std::string tree;
+		std::vector<std::string> parent_ids;
+		std::vector<uint32_t> parents;
+		uint64_t time;
+		uint32_t generation;
+		std::vector<unsigned char> filter;
+	};
+
+	GitRepository &m_repo;
+	bool m_changed_paths;
+	size_t m_threads;
+	std::vector<std::string> m_tips;
+	std::vector<Commit> m_commits;
+
+	//! Read all commits reachable from the tips, sorted by id.
+	void read_commits();
+
+	void compute_generations();
+
+	void compute_filters();
+};
+
+#endif
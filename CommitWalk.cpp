@@ -0,0 +1,322 @@
+#include <algorithm>
+#include <queue>
+#include <unordered_set>
+
+#include "CommitWalk.h"
+#include "CommitGraph.h"
+#include "DiffTree.h"
+#include "GitException.h"
+#include "PerfTrace.h"
+
+//! Is path equal to, inside or above one of paths?
+static bool
+path_match(const std::string &path, const std::vector<std::string> &paths)
+{
+	for (const auto &p : paths)
+	{
+		size_t n = std::min(p.size(), path.size());
+		if (p.compare(0, n, path, 0, n) == 0 &&
+			(p.size() == path.size() ||
+			(p.size() > path.size() && p[n] == '/') ||
+			(p.size() < path.size() && path[n] == '/')))
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+CommitWalk::CommitWalk(GitRepository &repo) :
+	m_repo(repo),
+	m_graph(repo.commit_graph())
+{
+}
+
+const CommitWalk::Commit &
+CommitWalk::lookup(const std::string &sha)
+{
+	auto it = m_commits.find(sha);
+	if (it != m_commits.end())
+		return it->second;
+
+	Commit c;
+	c.sha = sha;
+	c.time = 0;
+	c.generation = 0;
+	uint32_t pos;
+	if (m_graph && m_graph->find(sha, pos))
+	{
+		c.tree = m_graph->tree_id(pos);
+		for (auto parent : m_graph->parents(pos))
+		{
+			if (parent == CommitGraph::npos)
+				throw GitException("Corrupt commit-graph at " + sha);
+			c.parents.push_back(m_graph->commit_id(parent));
+		}
+		c.time = m_graph->commit_time(pos);
+		c.generation = m_graph->generation(pos);
+		return m_commits.emplace(sha, std::move(c)).first->second;
+	}
+
+	std::string fmt;
+	std::vector<unsigned char> data;
+	if (!m_repo.object_data(sha, fmt, data) || fmt != "commit")
+		throw GitException("Not a commit: " + sha);
+	for (size_t p = 0; p < data.size() && data[p] != '\n'; )
+	{
+		auto nl = std::find(data.begin() + p, data.end(), '\n');
+		std::string line(data.begin() + p, nl);
+		p = nl - data.begin() + 1;
+		if (line.compare(0, 5, "tree ") == 0)
+		{
+			c.tree = line.substr(5);
+		}
+		else if (line.compare(0, 7, "parent ") == 0)
+		{
+			c.parents.push_back(line.substr(7));
+		}
+		else if (line.compare(0, 10, "committer ") == 0)
+		{
+			auto gt = line.rfind("> ");
+			if (gt != std::string::npos)
+				c.time = std::strtoull(line.c_str() + gt + 2, nullptr, 10);
+		}
+	}
+	return m_commits.emplace(sha, std::move(c)).first->second;
+}
+
+bool
+CommitWalk::changed(const Commit &commit, size_t parent,
+	const std::vector<std::string> &paths,
+	const std::vector<std::vector<BloomFilter::Key> > &keys)
+{
+	// Filters only cover the changes against the first parent
+	uint32_t pos;
+	if (parent == 0 && m_graph && m_graph->has_bloom_filters() &&
+		m_graph->find(commit.sha, pos))
+	{
+		bool maybe = false;
+		for (const auto &k : keys)
+		{
+			maybe = maybe || m_graph->maybe_changed(pos, k);
+		}
+		if (!maybe)
+		{
+			PERF_COUNT(bloom_skips, 1);
+			return false;
+		}
+	}
+
+	auto parent_tree = parent < commit.parents.size() ?
+		lookup(commit.parents[parent]).tree : std::string();
+	DiffTree diff(m_repo, true);
+	diff.set_filter([&paths](const std::string &path, bool) {
+		return path_match(path, paths);
+	});
+	return !diff.diff(parent_tree, commit.tree).empty();
+}
+
+uint32_t
+CommitWalk::generation(const std::string &sha)
+{
+	if (lookup(sha).generation != 0)
+		return lookup(sha).generation;
+
+	// Parents first, stopping at commits with a known generation
+	std::vector<std::pair<std::string, size_t> > stack{{sha, 0}};
+	while (!stack.empty())
+	{
+		auto &c = m_commits.at(stack.back().first);
+		auto &next = stack.back().second;
+		if (next < c.parents.size())
+		{
+			const auto &parent = lookup(c.parents[next++]);
+			if (parent.generation == 0)
+				stack.emplace_back(parent.sha, 0);
+			continue;
+		}
+		uint32_t generation = 0;
+		for (const auto &parent : c.parents)
+		{
+			generation = std::max(generation, m_commits.at(parent).generation);
+		}
+		c.generation = generation + 1;
+		stack.pop_back();
+	}
+	return lookup(sha).generation;
+}
+
+bool
+CommitWalk::is_ancestor(const std::string &ancestor, const std::string &commit)
+{
+	PERF_SCOPE("is_ancestor");
+	uint32_t min_generation = generation(ancestor);
+	std::vector<std::string> todo{commit};
+	std::unordered_set<std::string> seen{commit};
+	while (!todo.empty())
+	{
+		auto sha = todo.back();
+		todo.pop_back();
+		if (sha == ancestor)
+			return true;
+
+		// Only commits of a higher generation can reach ancestor
+		for (const auto &parent : lookup(sha).parents)
+		{
+			if ((parent == ancestor || generation(parent) > min_generation) &&
+				seen.insert(parent).second)
+			{
+				todo.push_back(parent);
+			}
+		}
+	}
+	return false;
+}
+
+std::vector<std::string>
+CommitWalk::merge_bases(const std::string &one, const std::vector<std::string> &twos)
+{
+	PERF_SCOPE("merge_bases");
+	enum
+	{
+		parent1 = 1,
+		parent2 = 2,
+		stale = 4,
+		result = 8
+	};
+	std::unordered_map<std::string, unsigned> flags;
+	std::vector<std::string> found;
+
+	// Highest generation first, so that a commit is only taken after
+	// all commits which can reach it
+	auto lower = [this](const std::string &a, const std::string &b) {
+		auto ga = generation(a);
+		auto gb = generation(b);
+		if (ga != gb)
+			return ga < gb;
+		return lookup(a).time < lookup(b).time;
+	};
+	std::vector<std::string> queue;
+	auto push = [&](const std::string &sha) {
+		queue.push_back(sha);
+		std::push_heap(queue.begin(), queue.end(), lower);
+	};
+	flags[one] |= parent1;
+	push(one);
+	for (const auto &two : twos)
+	{
+		if (two == one)
+			return {one};
+		flags[two] |= parent2;
+		push(two);
+	}
+
+	// Paint down both sides until only stale commits are left
+	while (std::any_of(queue.begin(), queue.end(),
+		[&flags](const std::string &sha) { return (flags[sha] & stale) == 0; }))
+	{
+		std::pop_heap(queue.begin(), queue.end(), lower);
+		auto sha = queue.back();
+		queue.pop_back();
+		unsigned paint = flags[sha] & (parent1 | parent2 | stale);
+		if (paint == (parent1 | parent2))
+		{
+			if ((flags[sha] & result) == 0)
+			{
+				flags[sha] |= result;
+				found.push_back(sha);
+			}
+			paint |= stale;
+		}
+		for (const auto &parent : lookup(sha).parents)
+		{
+			if ((flags[parent] & paint) == paint)
+				continue;
+			flags[parent] |= paint;
+			push(parent);
+		}
+	}
+
+	// A result may still be an ancestor of another one
+	found = remove_redundant(found);
+	std::stable_sort(found.begin(), found.end(), [this](const std::string &a, const std::string &b) {
+		return lookup(a).time > lookup(b).time;
+	});
+	return found;
+}
+
+std::vector<std::string>
+CommitWalk::remove_redundant(const std::vector<std::string> &commits)
+{
+	std::vector<std::string> kept;
+	for (size_t i = 0; i < commits.size(); i++)
+	{
+		bool redundant = false;
+		for (size_t j = 0; j < commits.size() && !redundant; j++)
+		{
+			redundant = i != j && commits[i] != commits[j] && is_ancestor(commits[i], commits[j]);
+		}
+		if (!redundant)
+			kept.push_back(commits[i]);
+	}
+	return kept;
+}
+
+void
+CommitWalk::log(const std::string &tip, const std::vector<std::string> &paths,
+	const Visitor &visit)
+{
+	PERF_SCOPE("commit_walk");
+	std::vector<std::vector<BloomFilter::Key> > keys;
+	for (const auto &path : paths)
+	{
+		keys.push_back(BloomFilter::keys(path));
+	}
+
+	// Newest first, ties in the order the commits were found
+	using Entry = std::tuple<uint64_t, uint64_t, std::string>;
+	auto older = [](const Entry &a, const Entry &b) {
+		if (std::get<0>(a) != std::get<0>(b))
+			return std::get<0>(a) < std::get<0>(b);
+		return std::get<1>(a) > std::get<1>(b);
+	};
+	std::priority_queue<Entry, std::vector<Entry>, decltype(older)> queue(older);
+	std::unordered_set<std::string> seen;
+	uint64_t order = 0;
+	auto push = [&](const std::string &sha) {
+		if (seen.insert(sha).second)
+			queue.emplace(lookup(sha).time, order++, sha);
+	};
+
+	push(tip);
+	while (!queue.empty())
+	{
+		auto sha = std::get<2>(queue.top());
+		queue.pop();
+		const auto &c = lookup(sha);
+		if (paths.empty())
+		{
+			visit(c);
+			for (const auto &parent : c.parents)
+				push(parent);
+			continue;
+		}
+
+		// Follow only a parent with the same paths, if there is one
+		bool same = false;
+		for (size_t i = 0; i < std::max<size_t>(1, c.parents.size()) && !same; i++)
+		{
+			if (!changed(c, i, paths, keys))
+			{
+				same = true;
+				if (i < c.parents.size())
+					push(c.parents[i]);
+			}
+		}
+		if (same)
+			continue;
+		visit(c);
+		for (const auto &parent : c.parents)
+			push(parent);
+	}
+}
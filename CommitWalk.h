@@ -0,0 +1,81 @@
+#ifndef COMMIT_WALK_H
+#define COMMIT_WALK_H
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <unordered_map>
+#include <cstdint>
+
+#include "GitRepository.h"
+#include "BloomFilter.h"
+
+class CommitGraph;
+
+/**
+ * \brief Walks the commit history, reading from the commit-graph
+ * where possible.
+ *
+ * Commits in the commit-graph are never inflated, others are parsed
+ * from their objects.  Ancestry queries visit commits by decreasing
+ * generation number, so they stop at the generation of the commits
+ * they look for instead of walking all history.  For history limited to paths, the changed-path
+ * Bloom filter of a commit decides first whether it may have touched
+ * the paths, and only then are the trees compared.
+ */
+class CommitWalk
+{
+public:
+	struct Commit
+	{
+		std::string sha;
+		std::string tree;
+		std::vector<std::string> parents;
+		//! Committer time
+		uint64_t time;
+		//! Generation number, 0 if not in the commit-graph
+		uint32_t generation;
+	};
+
+	using Visitor = std::function<void(const Commit &commit)>;
+
+	CommitWalk(GitRepository &repo);
+
+	//! Commit sha, cached.  Throws GitException if it is not a commit.
+	const Commit &lookup(const std::string &sha);
+
+	//! Generation number of commit sha, one more than its highest
+	//! parent.  Computed and cached for commits not in the commit-graph.
+	uint32_t generation(const std::string &sha);
+
+	//! Is ancestor reachable from commit, or the same commit?  Commits
+	//! with a generation not above that of ancestor are not followed.
+	bool is_ancestor(const std::string &ancestor, const std::string &commit);
+
+	//! Best common ancestors of one and any of twos, none of them an
+	//! ancestor of another, newest first.
+	std::vector<std::string> merge_bases(const std::string &one,
+		const std::vector<std::string> &twos);
+
+	//! Visit the commits reachable from tip, newest first.  If paths
+	//! are given, only those changing them, simplified like git log:
+	//! a merge without changes against one parent is not shown and
+	//! only that parent is followed.
+	void log(const std::string &tip, const std::vector<std::string> &paths,
+		const Visitor &visit);
+
+private:
+	GitRepository &m_repo;
+	const CommitGraph *m_graph;
+	std::unordered_map<std::string, Commit> m_commits;
+
+	//! Remove the commits which are ancestors of another one.
+	std::vector<std::string> remove_redundant(const std::vector<std::string> &commits);
+
+	//! Do the trees of commit and its parent-th parent differ in paths?
+	bool changed(const Commit &commit, size_t parent,
+		const std::vector<std::string> &paths,
+		const std::vector<std::vector<BloomFilter::Key> > &keys);
+};
+
+#endif
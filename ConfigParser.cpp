@@ -1,89 +1,497 @@
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
 #include <fstream>
-#include <regex>
+#include <sstream>
+#include <climits>
+#include <cerrno>
+#include <fnmatch.h>
+#include <stdlib.h>
 
 #include "ConfigParser.h"
+#include "GitException.h"
+#include "PerfTrace.h"
 
-std::string
-ConfigParser::trim(const std::string &s)
+//! Same limit as git, against files including each other.
+static const int max_include_depth = 10;
+
+static std::string
+lower(std::string s)
 {
-	std::regex e("^\\s+|\\s+$");   // remove leading and trailing spaces
-	return regex_replace(s, e, "");
+	std::transform(s.begin(), s.end(), s.begin(), [](unsigned char c) {
+		return std::tolower(c);
+	});
+	return s;
+}
+
+static std::string
+home_dir()
+{
+	const char *home = std::getenv("HOME");
+	return home ? home : "";
 }
 
 void
 ConfigParser::read(const std::string &filename)
 {
-	std::ifstream f(filename);
-	if (f.is_open())
+	read(filename, 0);
+}
+
+void
+ConfigParser::read(const std::string &filename, int depth)
+{
+	PERF_SCOPE("config_read");
+	PERF_COUNT(syscalls, 1);
+	std::ifstream f(filename, std::ios::binary);
+	if (!f.is_open())
+		return;
+	std::ostringstream text;
+	text << f.rdbuf();
+	parse(text.str(), filename, depth);
+}
+
+void
+ConfigParser::read_layers(const std::string &gitdir)
+{
+	char resolved[PATH_MAX];
+	m_gitdir = realpath(gitdir.c_str(), resolved) ? resolved : gitdir;
+
+	if (!std::getenv("GIT_CONFIG_NOSYSTEM"))
+	{
+		const char *system = std::getenv("GIT_CONFIG_SYSTEM");
+		read(system ? system : "/etc/gitconfig");
+	}
+
+	const char *global = std::getenv("GIT_CONFIG_GLOBAL");
+	if (global)
+	{
+		read(global);
+	}
+	else
+	{
+		const char *xdg = std::getenv("XDG_CONFIG_HOME");
+		read(xdg && *xdg ? std::string(xdg) + "/git/config" : home_dir() + "/.config/git/config");
+		read(home_dir() + "/.gitconfig");
+	}
+
+	read(gitdir + "/config");
+}
+
+void
+ConfigParser::parse(const std::string &text, const std::string &filename, int depth)
+{
+	const char *p = text.data();
+	const char *end = p + text.size();
+	int line = 1;
+	auto bad = [&]() {
+		return GitException("Bad config line " + std::to_string(line) + " in file " + filename);
+	};
+	auto skip_line = [&]() {
+		while (p < end && *p != '\n')
+			p++;
+	};
+
+	Entry entry;
+	entry.implicit = false;
+	bool in_section = false;
+	while (p < end)
 	{
-		std::string line;
-		std::string section;
-		while (std::getline(f, line))
+		char c = *p;
+		if (c == '\n')
 		{
-			line = trim(line);
-			if (line.size() > 0 && line.at(0) == '[')
+			line++;
+			p++;
+			continue;
+		}
+		if (c == ' ' || c == '\t' || c == '\r')
+		{
+			p++;
+			continue;
+		}
+		if (c == '#' || c == ';')
+		{
+			skip_line();
+			continue;
+		}
+
+		if (c == '[')
+		{
+			// [section], [section "subsection"] or the old [section.subsection]
+			p++;
+			entry.section.clear();
+			entry.subsection.clear();
+			while (p < end && (std::isalnum(static_cast<unsigned char>(*p)) || *p == '-' || *p == '.'))
+				entry.section += std::tolower(static_cast<unsigned char>(*p++));
+			if (p < end && (*p == ' ' || *p == '\t'))
 			{
-				auto s = line.substr(1);
-				auto index = s.find(']');
-				if (index != std::string::npos)
+				while (p < end && (*p == ' ' || *p == '\t'))
+					p++;
+				if (p == end || *p++ != '"')
+					throw bad();
+				while (p < end && *p != '"')
 				{
-					section = s.substr(0, index);
+					if (*p == '\n')
+						throw bad();
+					if (*p == '\\' && p + 1 < end && p[1] != '\n')
+						p++;
+					entry.subsection += *p++;
 				}
+				if (p == end)
+					throw bad();
+				p++;
 			}
 			else
 			{
-				auto index = line.find('=');
-				if (index != std::string::npos)
+				auto dot = entry.section.find('.');
+				if (dot != std::string::npos)
 				{
-					auto key = trim(line.substr(0, index));
-					auto value = trim(line.substr(index + 1));
-					set(section, key, value);
+					entry.subsection = entry.section.substr(dot + 1);
+					entry.section.erase(dot);
 				}
 			}
+			if (p == end || *p++ != ']' || entry.section.empty())
+				throw bad();
+			in_section = true;
+			continue;
+		}
+
+		if (!std::isalpha(static_cast<unsigned char>(c)) || !in_section)
+			throw bad();
+
+		entry.key.clear();
+		while (p < end && (std::isalnum(static_cast<unsigned char>(*p)) || *p == '-'))
+			entry.key += std::tolower(static_cast<unsigned char>(*p++));
+		while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+			p++;
+		entry.value.clear();
+		entry.implicit = p == end || *p == '\n' || *p == '#' || *p == ';';
+		if (entry.implicit)
+		{
+			add(entry, filename, depth);
+			continue;
 		}
+		if (*p++ != '=')
+			throw bad();
+
+		// Value up to an unquoted comment or the end of the line,
+		// without unquoted spaces at either end
+		while (p < end && (*p == ' ' || *p == '\t'))
+			p++;
+		bool quoted = false;
+		size_t length = 0;
+		while (p < end && *p != '\n')
+		{
+			c = *p++;
+			if (!quoted && (c == '#' || c == ';'))
+			{
+				skip_line();
+				break;
+			}
+			if (c == '"')
+			{
+				quoted = !quoted;
+				length = entry.value.size();
+				continue;
+			}
+			if (c == '\\')
+			{
+				if (p == end)
+					throw bad();
+				c = *p++;
+				if (c == '\r' && p < end && *p == '\n')
+					c = *p++;
+				if (c == '\n')
+				{
+					line++;
+					continue;
+				}
+				switch (c)
+				{
+				case 'n':
+					c = '\n';
+					break;
+				case 't':
+					c = '\t';
+					break;
+				case 'b':
+					c = '\b';
+					break;
+				case '\\':
+				case '"':
+					break;
+				default:
+					throw bad();
+				}
+				entry.value += c;
+				length = entry.value.size();
+				continue;
+			}
+			entry.value += c;
+			if (quoted || !(c == ' ' || c == '\t' || c == '\r'))
+				length = entry.value.size();
+		}
+		if (quoted)
+			throw bad();
+		entry.value.resize(length);
+		add(entry, filename, depth);
 	}
 }
 
+void
+ConfigParser::add(Entry entry, const std::string &filename, int depth)
+{
+	bool include = entry.key == "path" && !entry.implicit &&
+		((entry.section == "include" && entry.subsection.empty()) ||
+		(entry.section == "includeif" && include_applies(entry.subsection, filename)));
+
+	m_index[name(entry)].push_back(m_entries.size());
+	m_entries.push_back(std::move(entry));
+	if (include)
+	{
+		if (depth >= max_include_depth)
+			throw GitException("Too many nested config includes in " + filename);
+		read(include_path(m_entries.back().value, filename), depth + 1);
+	}
+}
+
+std::string
+ConfigParser::include_path(const std::string &path, const std::string &filename)
+{
+	if (path.compare(0, 2, "~/") == 0)
+		return home_dir() + path.substr(1);
+	if (!path.empty() && path[0] == '/')
+		return path;
+	auto slash = filename.rfind('/');
+	return slash == std::string::npos ? path : filename.substr(0, slash + 1) + path;
+}
+
+bool
+ConfigParser::include_applies(const std::string &condition,
+	const std::string &filename) const
+{
+	int flags = 0;
+	std::string pattern;
+	if (condition.compare(0, 7, "gitdir:") == 0)
+	{
+		pattern = condition.substr(7);
+	}
+	else if (condition.compare(0, 9, "gitdir/i:") == 0)
+	{
+		pattern = condition.substr(9);
+		flags = FNM_CASEFOLD;
+	}
+	else
+	{
+		return false;
+	}
+	if (m_gitdir.empty() || pattern.empty())
+		return false;
+
+	// Like git: "./" is relative to the file, other relative patterns
+	// match anywhere, and a trailing "/" matches everything below
+	if (pattern.compare(0, 2, "./") == 0)
+		pattern = include_path(pattern.substr(2), filename);
+	else if (pattern.compare(0, 2, "~/") == 0)
+		pattern = include_path(pattern, filename);
+	else if (pattern[0] != '/')
+		pattern = "**/" + pattern;
+	if (pattern.back() == '/')
+		pattern += "**";
+	return fnmatch(pattern.c_str(), m_gitdir.c_str(), flags) == 0 ||
+		fnmatch(pattern.c_str(), (m_gitdir + "/").c_str(), flags) == 0;
+}
+
+std::string
+ConfigParser::name(const Entry &entry)
+{
+	if (entry.subsection.empty())
+		return entry.section + "." + entry.key;
+	return entry.section + "." + entry.subsection + "." + entry.key;
+}
+
+std::string
+ConfigParser::canonical(const std::string &name)
+{
+	// Only the subsection between the first and last dot keeps its case
+	auto first = name.find('.');
+	auto last = name.rfind('.');
+	if (first == std::string::npos)
+		return lower(name);
+	return lower(name.substr(0, first)) + name.substr(first, last - first) +
+		lower(name.substr(last));
+}
+
+bool
+ConfigParser::has(const std::string &name) const
+{
+	return m_index.count(canonical(name)) > 0;
+}
+
 std::string
-ConfigParser::get(const std::string &section, const std::string &key)
+ConfigParser::get(const std::string &name) const
+{
+	auto it = m_index.find(canonical(name));
+	if (it == m_index.end())
+		return std::string();
+	return m_entries[it->second.back()].value;
+}
+
+std::vector<std::string>
+ConfigParser::get_all(const std::string &name) const
+{
+	std::vector<std::string> values;
+	auto it = m_index.find(canonical(name));
+	if (it != m_index.end())
+	{
+		for (auto i : it->second)
+			values.push_back(m_entries[i].value);
+	}
+	return values;
+}
+
+bool
+ConfigParser::get_bool(const std::string &name, bool def) const
 {
-	auto it = m_values.find(std::make_pair(section, key));
-	if (it != m_values.end())
-		return it->second;
-	return std::string();
+	auto it = m_index.find(canonical(name));
+	if (it == m_index.end())
+		return def;
+	const auto &e = m_entries[it->second.back()];
+	if (e.implicit)
+		return true;
+	auto value = lower(e.value);
+	if (value == "true" || value == "yes" || value == "on")
+		return true;
+	if (value == "false" || value == "no" || value == "off" || value.empty())
+		return false;
+	return get_int(name, 0) != 0;
+}
+
+int64_t
+ConfigParser::get_int(const std::string &name, int64_t def) const
+{
+	auto it = m_index.find(canonical(name));
+	if (it == m_index.end())
+		return def;
+	const auto &value = m_entries[it->second.back()].value;
+	char *end;
+	errno = 0;
+	long long n = std::strtoll(value.c_str(), &end, 0);
+	if (end == value.c_str() || errno != 0)
+		throw GitException("Bad numeric config value '" + value + "' for " + name);
+	switch (std::tolower(static_cast<unsigned char>(*end)))
+	{
+	case '\0':
+		return n;
+	case 'k':
+		n *= 1024;
+		break;
+	case 'm':
+		n *= 1024 * 1024;
+		break;
+	case 'g':
+		n *= 1024 * 1024 * 1024;
+		break;
+	default:
+		throw GitException("Bad numeric config value '" + value + "' for " + name);
+	}
+	if (end[1] != '\0')
+		throw GitException("Bad numeric config value '" + value + "' for " + name);
+	return n;
 }
 
 void
-ConfigParser::set(const std::string &section, const std::string &key,
-	const std::string &value)
+ConfigParser::set(const std::string &name, const std::string &value)
 {
-	auto entry = std::make_pair(std::make_pair(section, key), value);
-	m_values.insert(entry);
+	auto canon = canonical(name);
+	auto it = m_index.find(canon);
+	if (it != m_index.end())
+	{
+		// Keep the first value in place, drop the others
+		auto &first = m_entries[it->second.front()];
+		first.value = value;
+		first.implicit = false;
+		std::vector<size_t> others(it->second.begin() + 1, it->second.end());
+		for (auto i = others.rbegin(); i != others.rend(); ++i)
+			m_entries.erase(m_entries.begin() + *i);
+		m_index.clear();
+		for (size_t i = 0; i < m_entries.size(); i++)
+			m_index[this->name(m_entries[i])].push_back(i);
+		return;
+	}
+
+	auto first = canon.find('.');
+	auto last = canon.rfind('.');
+	if (first == std::string::npos || first == 0 || last + 1 == canon.size())
+		throw GitException("Bad config variable name: " + name);
+	Entry e;
+	e.section = canon.substr(0, first);
+	e.subsection = first == last ? std::string() : canon.substr(first + 1, last - first - 1);
+	e.key = canon.substr(last + 1);
+	e.value = value;
+	e.implicit = false;
+	m_index[canon].push_back(m_entries.size());
+	m_entries.push_back(e);
 }
 
 void
-ConfigParser::write(const std::string &filename)
+ConfigParser::write(const std::string &filename) const
 {
 	std::ofstream f(filename);
-	if (f.is_open())
+	if (!f.is_open())
+		return;
+
+	// Sections in the order they first appear
+	std::vector<std::pair<std::string, std::string> > sections;
+	for (const auto &e : m_entries)
 	{
-		std::vector<std::pair<std::string, std::string> > keys;
-		for (auto const& entry : m_values)
-	       	{
-    			keys.push_back(entry.first);
+		auto s = std::make_pair(e.section, e.subsection);
+		if (std::find(sections.begin(), sections.end(), s) == sections.end())
+			sections.push_back(s);
+	}
+	for (const auto &s : sections)
+	{
+		f << "[" << s.first;
+		if (!s.second.empty())
+		{
+			f << " \"";
+			for (char c : s.second)
+			{
+				if (c == '"' || c == '\\')
+					f << '\\';
+				f << c;
+			}
+			f << "\"";
 		}
-		std::sort(keys.begin(), keys.end());
-		std::string section;
-		for (auto const& key : keys)
+		f << "]" << std::endl;
+		for (const auto &e : m_entries)
 		{
-			if (key.first != section)
+			if (e.section != s.first || e.subsection != s.second)
+				continue;
+			f << "\t" << e.key;
+			if (e.implicit)
+			{
+				f << std::endl;
+				continue;
+			}
+
+			// Quote values which would not read back the same
+			bool quote = !e.value.empty() && (e.value.front() == ' ' || e.value.back() == ' ' ||
+				e.value.find_first_of("#;") != std::string::npos);
+			f << " = " << (quote ? "\"" : "");
+			for (char c : e.value)
 			{
-				section = key.first;
-				f << "[" << section << "]" << std::endl;
+				if (c == '\n')
+					f << "\\n";
+				else if (c == '\t')
+					f << "\\t";
+				else if (c == '\b')
+					f << "\\b";
+				else if (c == '"' || c == '\\')
+					f << '\\' << c;
+				else
+					f << c;
 			}
-			f << key.second << "=" << m_values.at(key) << std::endl;
+			f << (quote ? "\"" : "") << std::endl;
 		}
-		f.close();
 	}
 }
-
@@ -2,25 +2,87 @@
 #define CONFIG_PARSER_H
 
 #include <string>
-#include <utility>
-#include <map>
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
 
-/*
- * \brief Reads and writes .ini configuration files
+/**
+ * \brief Reads and writes git configuration files
+ *
+ * Variables are named "section.key" or "section.subsection.key", the
+ * section and key are case insensitive.  A variable may have several
+ * values, lookups return the last one, so that files read later
+ * override earlier ones.  Each file is parsed in a single pass over its
+ * contents, and values are found through a hash table of their names.
  */
 class ConfigParser
 {
 public:
+	//! Read filename and the files it includes.  A missing file is
+	//! skipped, a malformed one throws GitException.
 	void read(const std::string &filename);
-	std::string get(const std::string &section, const std::string &key);
 
-	void set(const std::string &section, const std::string &key,
-		const std::string &value);
-	void write(const std::string &filename);
+	//! Read the system, global and repository configuration for the
+	//! repository at gitdir, in this order.
+	void read_layers(const std::string &gitdir);
+
+	//! Does name have a value?
+	bool has(const std::string &name) const;
+
+	//! Last value of name, or an empty string.
+	std::string get(const std::string &name) const;
+
+	//! All values of name, in the order they were read.
+	std::vector<std::string> get_all(const std::string &name) const;
+
+	//! Last value of name as a boolean, or def if it has none.
+	bool get_bool(const std::string &name, bool def) const;
+
+	//! Last value of name as a number with an optional k, m or g
+	//! suffix, or def if it has none.
+	int64_t get_int(const std::string &name, int64_t def) const;
+
+	//! Replace all values of name with value.
+	void set(const std::string &name, const std::string &value);
+
+	void write(const std::string &filename) const;
+
+	//! Name with its section and key in lower case.
+	static std::string canonical(const std::string &name);
+
 private:
-	std::map<std::pair<std::string, std::string>, std::string> m_values;
+	struct Entry
+	{
+		std::string section;
+		std::string subsection;
+		std::string key;
+		std::string value;
+		//! A key without "=", which means true
+		bool implicit;
+	};
+
+	std::vector<Entry> m_entries;
+	//! Positions in m_entries of the values of each canonical name.
+	std::unordered_map<std::string, std::vector<size_t> > m_index;
+	//! Repository for includeIf "gitdir:" conditions.
+	std::string m_gitdir;
+
+	void read(const std::string &filename, int depth);
+
+	void parse(const std::string &text, const std::string &filename, int depth);
+
+	//! Add entry, reading the file it includes if any.
+	void add(Entry entry, const std::string &filename, int depth);
+
+	//! Does an includeIf condition hold for this repository?
+	bool include_applies(const std::string &condition,
+		const std::string &filename) const;
+
+	//! Expand "~/" and make path relative to the directory of filename.
+	static std::string include_path(const std::string &path,
+		const std::string &filename);
 
-	std::string trim(const std::string &s);
+	static std::string name(const Entry &entry);
 };
 
 #endif
@@ -0,0 +1,41 @@
+#include "DeltaBaseCache.h"
+
+DeltaBaseCache::DeltaBaseCache(size_t max_bytes) :
+	m_max_bytes(max_bytes),
+	m_bytes(0)
+{
+}
+
+DeltaBaseCache::Data
+DeltaBaseCache::get(uint64_t offset)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	auto it = m_entries.find(offset);
+	if (it == m_entries.end())
+		return nullptr;
+	m_lru.splice(m_lru.begin(), m_lru, it->second.lru);
+	return it->second.data;
+}
+
+void
+DeltaBaseCache::put(uint64_t offset, Data data)
+{
+	// Bases bigger than the whole cache are never worth keeping
+	if (data == nullptr || data->size() > m_max_bytes)
+		return;
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (m_entries.find(offset) != m_entries.end())
+		return;
+
+	while (m_bytes + data->size() > m_max_bytes && !m_lru.empty())
+	{
+		auto old = m_entries.find(m_lru.back());
+		m_bytes -= old->second.data->size();
+		m_entries.erase(old);
+		m_lru.pop_back();
+	}
+	m_lru.push_front(offset);
+	m_entries.insert({offset, Entry{data, m_lru.begin()}});
+	m_bytes += data->size();
+}
@@ -0,0 +1,47 @@
+#ifndef DELTA_BASE_CACHE_H
+#define DELTA_BASE_CACHE_H
+
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <list>
+#include <unordered_map>
+#include <cstdint>
+
+/**
+ * \brief Bounded cache of inflated delta bases, safe for concurrent use.
+ *
+ * Entries are keyed by pack offset.  When the total size of cached
+ * data exceeds the limit, the least recently used entries are dropped
+ * and must be resolved again by the caller.  Data is shared, so an
+ * evicted base stays valid for threads still using it.
+ */
+class DeltaBaseCache
+{
+public:
+	using Data = std::shared_ptr<const std::vector<unsigned char> >;
+
+	//! Same as git's default core.deltaBaseCacheLimit.
+	DeltaBaseCache(size_t max_bytes = 96 * 1024 * 1024);
+
+	//! Return cached data, or nullptr if not cached.
+	Data get(uint64_t offset);
+
+	void put(uint64_t offset, Data data);
+
+private:
+	struct Entry
+	{
+		Data data;
+		std::list<uint64_t>::iterator lru;
+	};
+
+	std::mutex m_mutex;
+	size_t m_max_bytes;
+	size_t m_bytes;
+	std::unordered_map<uint64_t, Entry> m_entries;
+	//! Most recently used first.
+	std::list<uint64_t> m_lru;
+};
+
+#endif
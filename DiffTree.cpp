@@ -0,0 +1,68 @@
+#include <algorithm>
+
+#include "DiffTree.h"
+#include "TreeWalker.h"
+#include "PerfTrace.h"
+
+static const std::string null_mode("000000");
+static const std::string null_sha(40, '0');
+
+DiffTree::DiffTree(GitRepository &repo, bool recursive) :
+	m_repo(repo),
+	m_recursive(recursive)
+{
+}
+
+void
+DiffTree::set_filter(Filter filter)
+{
+	m_filter = filter;
+}
+
+int
+DiffTree::compare(const GitTreeLeaf &a, const GitTreeLeaf &b)
+{
+	size_t len = std::min(a.path.size(), b.path.size());
+	int cmp = a.path.compare(0, len, b.path, 0, len);
+	if (cmp != 0)
+		return cmp;
+
+	unsigned char c1 = len < a.path.size() ? a.path.at(len) : (a.is_tree() ? '/' : '\0');
+	unsigned char c2 = len < b.path.size() ? b.path.at(len) : (b.is_tree() ? '/' : '\0');
+	return c1 < c2 ? -1 : (c1 > c2 ? 1 : 0);
+}
+
+std::vector<DiffEntry>
+DiffTree::diff(const std::string &a, const std::string &b)
+{
+	PERF_SCOPE("diff_tree");
+	std::vector<DiffEntry> out;
+	if (a == b)
+		return out;
+
+	TreeWalker walker(m_repo);
+	walker.set_filter(m_filter);
+	walker.walk({a, b}, [this, &out](const std::string &path, const TreeWalker::Entries &entries) {
+		const GitTreeLeaf *old_leaf = entries[0];
+		const GitTreeLeaf *new_leaf = entries[1];
+		if (old_leaf && new_leaf && old_leaf->sha == new_leaf->sha &&
+			old_leaf->mode == new_leaf->mode)
+		{
+			return false;
+		}
+		// A subtree on one side only is compared with an empty tree
+		if ((old_leaf ? old_leaf : new_leaf)->is_tree() && m_recursive)
+			return true;
+
+		DiffEntry e;
+		e.status = !old_leaf ? 'A' : (!new_leaf ? 'D' : 'M');
+		e.old_mode = old_leaf ? old_leaf->mode : null_mode;
+		e.old_sha = old_leaf ? old_leaf->sha : null_sha;
+		e.new_mode = new_leaf ? new_leaf->mode : null_mode;
+		e.new_sha = new_leaf ? new_leaf->sha : null_sha;
+		e.path = path;
+		out.push_back(e);
+		return false;
+	});
+	return out;
+}
@@ -0,0 +1,61 @@
+#ifndef DIFF_TREE_H
+#define DIFF_TREE_H
+
+#include <string>
+#include <vector>
+#include <functional>
+
+#include "GitRepository.h"
+#include "GitTreeLeaf.h"
+
+/**
+ * \brief One changed path between two trees.
+ */
+struct DiffEntry
+{
+	//! 'A'dded, 'D'eleted, 'M'odified, 'R'enamed or 'C'opied
+	char status;
+	std::string old_mode;
+	std::string new_mode;
+	std::string old_sha;
+	std::string new_sha;
+	std::string path;
+	//! Source path of a rename or copy
+	std::string old_path;
+	//! Similarity percentage of a rename or copy
+	int score = 0;
+};
+
+/**
+ * \brief Compares two trees by merging their sorted entries.
+ *
+ * Subtrees with the same object id on both sides are identical and
+ * are skipped without being read, so only the trees along changed
+ * paths are ever read from the repository.  The trees are walked in
+ * lock-step by a TreeWalker.
+ */
+class DiffTree
+{
+public:
+	//! Decides whether to compare a path, a subtree if is_dir is set.
+	using Filter = std::function<bool(const std::string &path, bool is_dir)>;
+
+	DiffTree(GitRepository &repo, bool recursive = false);
+
+	//! Only compare paths accepted by filter.  Rejected subtrees
+	//! are not read at all.
+	void set_filter(Filter filter);
+
+	//! Compare trees with ids a and b, an empty id is an empty tree.
+	std::vector<DiffEntry> diff(const std::string &a, const std::string &b);
+
+	//! Git sorts tree entries by name, as if subtrees had a trailing '/'.
+	static int compare(const GitTreeLeaf &a, const GitTreeLeaf &b);
+
+private:
+	GitRepository &m_repo;
+	bool m_recursive;
+	Filter m_filter;
+};
+
+#endif
@@ -0,0 +1,203 @@
+#include <algorithm>
+
+#include "EwahBitmap.h"
+
+//! Limits of the fields of a marker word.
+static const uint64_t max_run = (uint64_t(1) << 32) - 1;
+static const uint64_t max_literals = (uint64_t(1) << 31) - 1;
+
+static uint32_t
+get32(const unsigned char *p)
+{
+	return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) |
+		(uint32_t(p[2]) << 8) | uint32_t(p[3]);
+}
+
+static uint64_t
+get64(const unsigned char *p)
+{
+	return (uint64_t(get32(p)) << 32) | get32(p + 4);
+}
+
+static void
+put32(std::vector<unsigned char> &out, uint32_t v)
+{
+	for (int shift = 24; shift >= 0; shift -= 8)
+		out.push_back(static_cast<unsigned char>(v >> shift));
+}
+
+static void
+put64(std::vector<unsigned char> &out, uint64_t v)
+{
+	put32(out, static_cast<uint32_t>(v >> 32));
+	put32(out, static_cast<uint32_t>(v));
+}
+
+EwahBitmap::EwahBitmap(size_t size) :
+	m_size(0)
+{
+	resize(size);
+}
+
+size_t
+EwahBitmap::size() const
+{
+	return m_size;
+}
+
+void
+EwahBitmap::resize(size_t size)
+{
+	if (size > m_size)
+	{
+		m_size = size;
+		m_words.resize((size + 63) / 64, 0);
+	}
+}
+
+void
+EwahBitmap::set(size_t i)
+{
+	resize(i + 1);
+	m_words[i / 64] |= uint64_t(1) << (i % 64);
+}
+
+bool
+EwahBitmap::test(size_t i) const
+{
+	return i < m_size && (m_words[i / 64] & (uint64_t(1) << (i % 64))) != 0;
+}
+
+size_t
+EwahBitmap::count() const
+{
+	size_t n = 0;
+	for (auto w : m_words)
+	{
+		n += __builtin_popcountll(w);
+	}
+	return n;
+}
+
+EwahBitmap &
+EwahBitmap::operator|=(const EwahBitmap &other)
+{
+	resize(other.m_size);
+	for (size_t i = 0; i < other.m_words.size(); i++)
+	{
+		m_words[i] |= other.m_words[i];
+	}
+	return *this;
+}
+
+EwahBitmap &
+EwahBitmap::operator^=(const EwahBitmap &other)
+{
+	resize(other.m_size);
+	for (size_t i = 0; i < other.m_words.size(); i++)
+	{
+		m_words[i] ^= other.m_words[i];
+	}
+	return *this;
+}
+
+void
+EwahBitmap::and_not(const EwahBitmap &other)
+{
+	size_t n = std::min(m_words.size(), other.m_words.size());
+	for (size_t i = 0; i < n; i++)
+	{
+		m_words[i] &= ~other.m_words[i];
+	}
+}
+
+void
+EwahBitmap::for_each(const std::function<void(size_t)> &f) const
+{
+	for (size_t i = 0; i < m_words.size(); i++)
+	{
+		for (uint64_t w = m_words[i]; w != 0; w &= w - 1)
+		{
+			f(64 * i + __builtin_ctzll(w));
+		}
+	}
+}
+
+bool
+EwahBitmap::read(const unsigned char *p, size_t avail,
+	EwahBitmap &out, size_t &consumed)
+{
+	// Bit count, word count, words and the position of the last marker
+	if (avail < 12)
+		return false;
+	size_t bits = get32(p);
+	size_t n = get32(p + 4);
+	if ((avail - 12) / 8 < n)
+		return false;
+	consumed = 12 + 8 * n;
+
+	out.m_size = 0;
+	out.m_words.clear();
+	out.m_words.reserve((bits + 63) / 64);
+	const unsigned char *words = p + 8;
+	for (size_t k = 0; k < n; )
+	{
+		uint64_t marker = get64(words + 8 * k++);
+		uint64_t run = (marker >> 1) & max_run;
+		uint64_t literals = marker >> 33;
+		if (run > (bits + 63) / 64 || literals > n - k)
+			return false;
+		out.m_words.insert(out.m_words.end(), run, (marker & 1) ? ~uint64_t(0) : 0);
+		for (uint64_t j = 0; j < literals; j++)
+		{
+			out.m_words.push_back(get64(words + 8 * k++));
+		}
+	}
+	if (out.m_words.size() > (bits + 63) / 64)
+		return false;
+	out.m_size = bits;
+	out.m_words.resize((bits + 63) / 64, 0);
+	return true;
+}
+
+void
+EwahBitmap::write(std::vector<unsigned char> &out) const
+{
+	std::vector<uint64_t> buffer;
+	size_t marker = 0;
+	size_t i = 0;
+	do
+	{
+		// A run of clean words, then the dirty words up to the next run
+		marker = buffer.size();
+		buffer.push_back(0);
+		uint64_t run = 0;
+		uint64_t bit = 0;
+		if (i < m_words.size() && (m_words[i] == 0 || m_words[i] == ~uint64_t(0)))
+		{
+			bit = m_words[i] & 1;
+			while (i < m_words.size() && m_words[i] == (bit ? ~uint64_t(0) : 0) && run < max_run)
+			{
+				run++;
+				i++;
+			}
+		}
+		uint64_t literals = 0;
+		while (i < m_words.size() && m_words[i] != 0 && m_words[i] != ~uint64_t(0) &&
+			literals < max_literals)
+		{
+			buffer.push_back(m_words[i++]);
+			literals++;
+		}
+		buffer[marker] = bit | (run << 1) | (literals << 33);
+	}
+	while (i < m_words.size());
+
+	put32(out, static_cast<uint32_t>(m_size));
+	put32(out, static_cast<uint32_t>(buffer.size()));
+	for (auto w : buffer)
+	{
+		put64(out, w);
+	}
+	put32(out, static_cast<uint32_t>(marker));
+}
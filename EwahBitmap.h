@@ -0,0 +1,58 @@
+#ifndef EWAH_BITMAP_H
+#define EWAH_BITMAP_H
+
+#include <vector>
+#include <cstdint>
+#include <functional>
+
+/**
+ * \brief Bitmap kept uncompressed in memory, read and written in the
+ * EWAH format of git's .bitmap files.
+ *
+ * EWAH stores runs of all-zero or all-one 64 bit words as a count in a
+ * marker word, followed by the literal words up to the next run.  A
+ * bitmap of a million objects takes 128 KiB uncompressed, so combining
+ * them word by word is faster than working on the compressed form.
+ */
+class EwahBitmap
+{
+public:
+	EwahBitmap(size_t size = 0);
+
+	//! Number of bits, including the clear bits at the end.
+	size_t size() const;
+
+	void set(size_t i);
+
+	bool test(size_t i) const;
+
+	//! Number of bits set.
+	size_t count() const;
+
+	EwahBitmap &operator|=(const EwahBitmap &other);
+
+	EwahBitmap &operator^=(const EwahBitmap &other);
+
+	//! Clear the bits set in other.
+	void and_not(const EwahBitmap &other);
+
+	//! Call f with the position of each bit set, in order.
+	void for_each(const std::function<void(size_t)> &f) const;
+
+	//! Parse the EWAH bitmap at p of at most avail bytes into out,
+	//! returning its length in consumed.
+	static bool read(const unsigned char *p, size_t avail,
+		EwahBitmap &out, size_t &consumed);
+
+	//! Append the EWAH encoding to out.
+	void write(std::vector<unsigned char> &out) const;
+
+private:
+	size_t m_size;
+	std::vector<uint64_t> m_words;
+
+	//! Grow to at least size bits.
+	void resize(size_t size);
+};
+
+#endif
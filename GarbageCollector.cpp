@@ -0,0 +1,247 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "GarbageCollector.h"
+#include "ObjectWalk.h"
+#include "GitPack.h"
+#include "ThreadPool.h"
+#include "GitException.h"
+#include "PerfTrace.h"
+
+//! Objects of one level read by one task.
+static const size_t objects_per_task = 64;
+
+static const char digits[] = "0123456789abcdef";
+
+static bool
+is_hex(const char *s, size_t len)
+{
+	for (size_t i = 0; i < len; i++)
+	{
+		if (!((s[i] >= '0' && s[i] <= '9') || (s[i] >= 'a' && s[i] <= 'f')))
+			return false;
+	}
+	return true;
+}
+
+GarbageCollector::GarbageCollector(GitRepository &repo, size_t threads) :
+	m_repo(repo),
+	m_threads(threads),
+	m_dir_fd(-1),
+	m_expired(256)
+{
+	auto dir = m_repo.object_dir().string();
+	m_dir_fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (m_dir_fd < 0)
+		throw GitException("Cannot open " + dir + ": " + std::strerror(errno));
+}
+
+GarbageCollector::~GarbageCollector()
+{
+	close(m_dir_fd);
+}
+
+void
+GarbageCollector::mark(time_t expire)
+{
+	PERF_SCOPE("gc_mark");
+	m_index.reset(new ObjectIndex(m_repo));
+	m_marked.reset(new AtomicBitset(m_index->size()));
+	ThreadPool pool(m_threads);
+
+	std::vector<std::vector<size_t> > recent(256);
+	pool.parallel_for(256, [&](size_t i) {
+		recent[i] = scan(i, expire);
+	});
+
+	std::vector<size_t> level;
+	auto root = [&](size_t pos) {
+		if (m_marked->set(pos))
+			level.push_back(pos);
+	};
+	ObjectWalk walk(m_repo);
+	walk.add_refs();
+	for (const auto &tip : walk.tips())
+	{
+		auto pos = m_index->position(tip);
+		if (pos == ObjectIndex::npos)
+			throw GitException("Object not found: " + tip);
+		root(pos);
+	}
+	for (const auto &tree : m_repo.checkout_trees())
+	{
+		auto pos = m_index->position(tree);
+		if (pos != ObjectIndex::npos)
+			root(pos);
+	}
+	for (const auto &dir : recent)
+	{
+		for (auto pos : dir)
+			root(pos);
+	}
+
+	while (!level.empty())
+	{
+		size_t tasks = (level.size() + objects_per_task - 1) / objects_per_task;
+		std::vector<std::vector<size_t> > next(tasks);
+		pool.parallel_for(tasks, [&](size_t t) {
+			size_t end = std::min(level.size(), (t + 1) * objects_per_task);
+			for (size_t k = t * objects_per_task; k < end; k++)
+			{
+				follow(level[k], next[t]);
+			}
+		});
+		level.clear();
+		for (const auto &n : next)
+		{
+			level.insert(level.end(), n.begin(), n.end());
+		}
+	}
+}
+
+size_t
+GarbageCollector::reachable() const
+{
+	return m_marked ? m_marked->count() : 0;
+}
+
+std::vector<size_t>
+GarbageCollector::scan(size_t i, time_t expire)
+{
+	std::vector<size_t> recent;
+	char prefix[3] = {digits[i >> 4], digits[i & 15], '\0'};
+	int fd = openat(m_dir_fd, prefix, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		return recent;
+	DIR *dir = fdopendir(fd);
+	if (dir == nullptr)
+	{
+		close(fd);
+		return recent;
+	}
+
+	unsigned char id[20];
+	while (struct dirent *d = readdir(dir))
+	{
+		if (std::strlen(d->d_name) != 38 || !is_hex(d->d_name, 38))
+			continue;
+		struct stat st;
+		PERF_COUNT(syscalls, 1);
+		if (fstatat(fd, d->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+			continue;
+		GitPack::from_hex(std::string(prefix) + d->d_name, id);
+		auto pos = m_index->position(id);
+		if (pos == ObjectIndex::npos)
+			continue;
+		if (st.st_mtime > expire)
+			recent.push_back(pos);
+		else
+			m_expired[i].push_back(Loose{d->d_name, pos});
+	}
+	closedir(dir);
+	return recent;
+}
+
+void
+GarbageCollector::follow(size_t pos, std::vector<size_t> &next)
+{
+	auto sha = m_index->id(pos);
+	std::string fmt;
+	std::vector<unsigned char> data;
+	if (!m_repo.object_data(sha, fmt, data))
+		throw GitException("Cannot read object " + sha);
+
+	if (fmt == "tree")
+	{
+		// Blobs refer to nothing, so they are only marked
+		size_t p = 0;
+		while (p < data.size())
+		{
+			auto space = std::find(data.begin() + p, data.end(), ' ');
+			auto nul = std::find(space, data.end(), '\0');
+			if (nul == data.end() || data.end() - nul < 21)
+				throw GitException("Corrupt tree " + sha);
+			std::string mode(data.begin() + p, space);
+			p = nul - data.begin() + 21;
+			if (mode == "160000")
+				continue;
+			auto to_pos = m_index->position(&*(nul + 1));
+			if (to_pos == ObjectIndex::npos)
+				throw GitException("Object not found: " + GitPack::to_hex(&*(nul + 1)) + ", referenced by " + sha);
+			if (m_marked->set(to_pos) && mode == "40000")
+				next.push_back(to_pos);
+		}
+	}
+	else if (fmt == "commit" || fmt == "tag")
+	{
+		// Headers up to the first empty line
+		size_t p = 0;
+		while (p < data.size() && data[p] != '\n')
+		{
+			auto nl = std::find(data.begin() + p, data.end(), '\n');
+			std::string line(data.begin() + p, nl);
+			p = nl - data.begin() + 1;
+			auto space = line.find(' ');
+			auto key = line.substr(0, space);
+			if (key != "tree" && key != "parent" && key != "object")
+				continue;
+			auto to = line.substr(space + 1);
+			auto to_pos = m_index->position(to);
+			if (to_pos == ObjectIndex::npos)
+				throw GitException("Object not found: " + to + ", referenced by " + sha);
+			if (m_marked->set(to_pos))
+				next.push_back(to_pos);
+		}
+	}
+}
+
+size_t
+GarbageCollector::prune(std::ostream *out, bool dry_run)
+{
+	PERF_SCOPE("gc_prune");
+	ThreadPool pool(m_threads);
+	std::vector<std::vector<std::string> > pruned(256);
+	pool.parallel_for(256, [&](size_t i) {
+		if (m_expired[i].empty())
+			return;
+		char prefix[3] = {digits[i >> 4], digits[i & 15], '\0'};
+		int fd = openat(m_dir_fd, prefix, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (fd < 0)
+			return;
+		for (const auto &loose : m_expired[i])
+		{
+			if (m_marked->test(loose.pos))
+				continue;
+			auto sha = prefix + loose.name;
+			std::string fmt;
+			size_t size;
+			if (out && !m_repo.object_info(sha, fmt, size))
+				fmt = "unknown";
+			PERF_COUNT(syscalls, 1);
+			if (dry_run || unlinkat(fd, loose.name.c_str(), 0) == 0)
+				pruned[i].push_back(sha + " " + fmt);
+		}
+		close(fd);
+
+		// Fails unless the directory is now empty
+		if (!dry_run)
+			unlinkat(m_dir_fd, prefix, AT_REMOVEDIR);
+	});
+
+	size_t count = 0;
+	for (const auto &dir : pruned)
+	{
+		for (const auto &line : dir)
+		{
+			if (out)
+				*out << line << std::endl;
+		}
+		count += dir.size();
+	}
+	return count;
+}
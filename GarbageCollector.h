@@ -0,0 +1,68 @@
+#ifndef GARBAGE_COLLECTOR_H
+#define GARBAGE_COLLECTOR_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <ostream>
+#include <ctime>
+
+#include "GitRepository.h"
+#include "ObjectIndex.h"
+#include "AtomicBitset.h"
+
+/**
+ * \brief Deletes loose objects no reference can reach.
+ *
+ * All objects are numbered by their position in an ObjectIndex and
+ * marked in a bitset, one level of the object graph at a time with the
+ * objects of each level split between the threads.  Loose objects
+ * written after the grace period are marked too, with everything they
+ * refer to, so that objects of a commit still being written survive.
+ * The 256 fan-out directories are then pruned in parallel, with file
+ * names relative to an open directory.
+ */
+class GarbageCollector
+{
+public:
+	GarbageCollector(GitRepository &repo, size_t threads = 0);
+
+	~GarbageCollector();
+
+	//! Mark objects reachable from HEAD, the references, checked out
+	//! trees and loose objects modified after expire.
+	void mark(time_t expire);
+
+	//! Number of objects marked.
+	size_t reachable() const;
+
+	//! Delete loose objects not marked, writing "<sha> <type>" of each
+	//! to out if not null.  With dry_run nothing is deleted.  Returns
+	//! the number of objects.
+	size_t prune(std::ostream *out, bool dry_run);
+
+private:
+	struct Loose
+	{
+		std::string name;
+		size_t pos;
+	};
+
+	GitRepository &m_repo;
+	size_t m_threads;
+	int m_dir_fd;
+	std::unique_ptr<ObjectIndex> m_index;
+	std::unique_ptr<AtomicBitset> m_marked;
+	//! Loose objects older than the grace period, by fan-out directory.
+	std::vector<std::vector<Loose> > m_expired;
+
+	//! List the loose objects of fan-out directory i, returns those
+	//! modified after expire.
+	std::vector<size_t> scan(size_t i, time_t expire);
+
+	//! Mark the objects the object at pos refers to, appending those
+	//! which must be read in turn to next.
+	void follow(size_t pos, std::vector<size_t> &next);
+};
+
+#endif
@@ -11,6 +11,12 @@ GitBlob::serialize()
 	return m_blobdata;
 }
 
+const std::vector<unsigned char> &
+GitBlob::get_data() const
+{
+	return m_blobdata;
+}
+
 void
 GitBlob::deserialize(const std::vector<unsigned char> &data)
 {
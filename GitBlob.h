@@ -15,6 +15,9 @@ public:
 
 	void deserialize(const std::vector<unsigned char> &data);
 
+	//! Blob contents, without copying.
+	const std::vector<unsigned char> &get_data() const;
+
 private:
 	std::vector<unsigned char> m_blobdata;
 };
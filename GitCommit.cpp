@@ -1,6 +1,7 @@
 #include <algorithm>
 
 #include "GitCommit.h"
+#include "PerfTrace.h"
 
 GitCommit::GitCommit(GitRepository *repo) :
 	GitObject(repo, "commit")
@@ -21,6 +22,7 @@ GitCommit::serialize()
 void
 GitCommit::deserialize(const std::vector<unsigned char> &data)
 {
+	PERF_SCOPE("commit_parse");
 	m_dct.clear();
 	kvlm_parse(data, 0, m_dct);
 }
@@ -0,0 +1,898 @@
+#include <algorithm>
+#include <cstring>
+#include <climits>
+#include <fstream>
+#include <cstdio>
+
+#include "GitPack.h"
+#include "GitException.h"
+#include "PerfTrace.h"
+
+#include "zlib.h"
+#include <sha1.hpp>
+
+//! Longest delta chain followed, git itself writes at most 4095.
+static const size_t max_chain_length = 10000;
+
+//! Bytes hashed to find matching blocks when creating deltas.
+static const size_t delta_block_size = 16;
+
+//! Candidate blocks compared for each hash when creating deltas.
+static const size_t max_delta_candidates = 64;
+
+//! Multiplier of the rolling block hash.
+static const uint32_t delta_hash_base = 0x9e3779b1u;
+
+static uint32_t
+get32(const unsigned char *p)
+{
+	return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) |
+		(uint32_t(p[2]) << 8) | uint32_t(p[3]);
+}
+
+static void
+put32(std::vector<unsigned char> &out, uint32_t v)
+{
+	out.push_back(v >> 24);
+	out.push_back(v >> 16);
+	out.push_back(v >> 8);
+	out.push_back(v);
+}
+
+//! Inflate zlib data at p, writing size bytes to out, or nowhere if
+//! out is null.  Fails unless the stream ends after exactly size bytes.
+static bool
+inflate_stream(const unsigned char *p, size_t avail, size_t size,
+	unsigned char *out, size_t *consumed)
+{
+	z_stream zs = {};
+	if (inflateInit(&zs) != Z_OK)
+		return false;
+
+	// zlib counts in 32 bits, so feed large buffers in pieces
+	const size_t chunk = 1u << 30;
+	unsigned char scratch[16384];
+	size_t in_left = avail;
+	size_t out_left = size;
+	zs.next_in = const_cast<unsigned char *>(p);
+	int status = Z_OK;
+	while (status == Z_OK)
+	{
+		if (zs.avail_in == 0 && in_left > 0)
+		{
+			zs.avail_in = std::min(in_left, chunk);
+			in_left -= zs.avail_in;
+		}
+		if (zs.avail_out == 0)
+		{
+			if (out == nullptr || out_left == 0)
+			{
+				// Discarded output, or overflow detected below
+				zs.next_out = scratch;
+				zs.avail_out = out == nullptr ? sizeof(scratch) : 1;
+			}
+			else
+			{
+				zs.next_out = out + (size - out_left);
+				zs.avail_out = std::min(out_left, chunk);
+				out_left -= zs.avail_out;
+			}
+		}
+		status = inflate(&zs, Z_NO_FLUSH);
+		if (status == Z_BUF_ERROR && zs.avail_in == 0 && in_left > 0)
+			status = Z_OK;
+	}
+	bool ok = status == Z_STREAM_END && zs.total_out == size;
+	if (consumed)
+		*consumed = zs.total_in;
+	inflateEnd(&zs);
+	return ok;
+}
+
+GitPack::GitPack(const std::string &idx_path)
+{
+	m_idx.reset(new MappedFile(idx_path));
+	std::string pack_path = idx_path;
+	if (pack_path.size() > 4 && pack_path.compare(pack_path.size() - 4, 4, ".idx") == 0)
+		pack_path = pack_path.substr(0, pack_path.size() - 4);
+	m_pack.reset(new MappedFile(pack_path + ".pack"));
+
+	const unsigned char *p = m_idx->data();
+	size_t len = m_idx->size();
+	if (len < 8 + 256 * 4 + 40 || std::memcmp(p, "\377tOc", 4) != 0 || get32(p + 4) != 2)
+		throw GitException("Unsupported pack index: " + idx_path);
+
+	m_fanout = p + 8;
+	m_count = get32(m_fanout + 255 * 4);
+	if (len < 8 + 256 * 4 + m_count * 28 + 40)
+		throw GitException("Pack index truncated: " + idx_path);
+	m_shas = m_fanout + 256 * 4;
+	m_offsets = m_shas + m_count * 24;
+	m_large_offsets = m_offsets + m_count * 4;
+
+	const unsigned char *pack = m_pack->data();
+	if (m_pack->size() < 32 || std::memcmp(pack, "PACK", 4) != 0 ||
+		(get32(pack + 4) != 2 && get32(pack + 4) != 3))
+	{
+		throw GitException("Not a pack file: " + m_pack->path());
+	}
+	if (std::memcmp(pack + m_pack->size() - 20, p + len - 40, 20) != 0)
+		throw GitException("Pack index does not match pack: " + idx_path);
+}
+
+size_t
+GitPack::object_count() const
+{
+	return m_count;
+}
+
+std::string
+GitPack::object_id(size_t i) const
+{
+	return to_hex(m_shas + 20 * i);
+}
+
+const unsigned char *
+GitPack::id_bytes(size_t i) const
+{
+	return m_shas + 20 * i;
+}
+
+uint64_t
+GitPack::object_offset(size_t i) const
+{
+	uint32_t v = get32(m_offsets + 4 * i);
+	if ((v & 0x80000000u) == 0)
+		return v;
+
+	// Offsets past 2 GiB are in a table of 64 bit values
+	const unsigned char *p = m_large_offsets + 8 * size_t(v & 0x7fffffffu);
+	if (p + 8 > m_idx->data() + m_idx->size() - 40)
+		throw GitException("Bad offset in pack index: " + m_idx->path());
+	return (uint64_t(get32(p)) << 32) | get32(p + 4);
+}
+
+bool
+GitPack::find(const std::string &sha, uint64_t &offset) const
+{
+	if (sha.size() != 40)
+		return false;
+	unsigned char key[20];
+	from_hex(sha, key);
+	size_t i;
+	if (!find_index(key, i))
+		return false;
+	offset = object_offset(i);
+	return true;
+}
+
+bool
+GitPack::find_index(const unsigned char *sha, size_t &i) const
+{
+	// The fan-out table gives the range of ids with this first byte
+	size_t lo = sha[0] == 0 ? 0 : get32(m_fanout + 4 * (sha[0] - 1));
+	size_t hi = get32(m_fanout + 4 * sha[0]);
+	while (lo < hi)
+	{
+		size_t mid = lo + (hi - lo) / 2;
+		int cmp = std::memcmp(m_shas + 20 * mid, sha, 20);
+		if (cmp == 0)
+		{
+			i = mid;
+			return true;
+		}
+		if (cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return false;
+}
+
+std::vector<uint32_t>
+GitPack::pack_order() const
+{
+	std::vector<uint32_t> order(m_count);
+	std::vector<uint64_t> offsets(m_count);
+	for (size_t i = 0; i < m_count; i++)
+	{
+		order[i] = i;
+		offsets[i] = object_offset(i);
+	}
+	std::sort(order.begin(), order.end(), [&offsets](uint32_t a, uint32_t b) {
+		return offsets[a] < offsets[b];
+	});
+	return order;
+}
+
+std::string
+GitPack::pack_checksum() const
+{
+	return to_hex(m_pack->data() + m_pack->size() - 20);
+}
+
+void
+GitPack::find_prefix(const std::string &prefix, std::vector<std::string> &found) const
+{
+	if (prefix.size() < 2)
+		return;
+	unsigned char first;
+	from_hex(prefix.substr(0, 2), &first);
+
+	size_t lo = first == 0 ? 0 : get32(m_fanout + 4 * (first - 1));
+	size_t hi = get32(m_fanout + 4 * first);
+	while (lo < hi)
+	{
+		size_t mid = lo + (hi - lo) / 2;
+		if (object_id(mid) < prefix)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	for (size_t i = lo; i < m_count; i++)
+	{
+		auto sha = object_id(i);
+		if (sha.compare(0, prefix.size(), prefix) != 0)
+			break;
+		found.push_back(sha);
+	}
+}
+
+const std::string &
+GitPack::pack_path() const
+{
+	return m_pack->path();
+}
+
+bool
+GitPack::verify() const
+{
+	unsigned char sha[20];
+	size_t pack_len = m_pack->size() - 20;
+	from_hex(checksum(m_pack->data(), pack_len), sha);
+	if (std::memcmp(sha, m_pack->data() + pack_len, 20) != 0)
+		return false;
+	size_t idx_len = m_idx->size() - 20;
+	from_hex(checksum(m_idx->data(), idx_len), sha);
+	return std::memcmp(sha, m_idx->data() + idx_len, 20) == 0;
+}
+
+bool
+GitPack::parse_entry(const unsigned char *pack, size_t len,
+	uint64_t offset, Entry &entry)
+{
+	if (offset >= len)
+		return false;
+	const unsigned char *p = pack + offset;
+	const unsigned char *end = pack + len;
+
+	// Type and size, continued in 7 bit groups
+	unsigned c = *p++;
+	entry.type = static_cast<Type>((c >> 4) & 7);
+	uint64_t size = c & 15;
+	int shift = 4;
+	while (c & 0x80)
+	{
+		if (p >= end || shift > 57)
+			return false;
+		c = *p++;
+		size |= uint64_t(c & 0x7f) << shift;
+		shift += 7;
+	}
+	entry.size = size;
+
+	switch (entry.type)
+	{
+	case Type::commit:
+	case Type::tree:
+	case Type::blob:
+	case Type::tag:
+		break;
+	case Type::ofs_delta:
+	{
+		// Distance back to the base, with an offset added to
+		// each 7 bit group so that every value has one encoding
+		if (p >= end)
+			return false;
+		c = *p++;
+		uint64_t distance = c & 0x7f;
+		while (c & 0x80)
+		{
+			if (p >= end || distance > (UINT64_MAX >> 8))
+				return false;
+			c = *p++;
+			distance = ((distance + 1) << 7) | (c & 0x7f);
+		}
+		if (distance == 0 || distance > offset)
+			return false;
+		entry.base_offset = offset - distance;
+		break;
+	}
+	case Type::ref_delta:
+		if (end - p < 20)
+			return false;
+		entry.base_sha = to_hex(p);
+		p += 20;
+		break;
+	default:
+		return false;
+	}
+	entry.data_offset = p - pack;
+	return true;
+}
+
+bool
+GitPack::inflate_data(const unsigned char *p, size_t avail, size_t size,
+	std::vector<unsigned char> &out, size_t *consumed)
+{
+	PERF_COUNT(objects_inflated, 1);
+	PERF_COUNT(bytes_inflated, size);
+	out.resize(size);
+	return inflate_stream(p, avail, size, out.data(), consumed);
+}
+
+bool
+GitPack::skip_data(const unsigned char *p, size_t avail, size_t size,
+	size_t &consumed)
+{
+	return inflate_stream(p, avail, size, nullptr, &consumed);
+}
+
+bool
+GitPack::apply_delta(const std::vector<unsigned char> &base,
+	const std::vector<unsigned char> &delta,
+	std::vector<unsigned char> &out)
+{
+	size_t pos = 0;
+	auto varint = [&delta, &pos](uint64_t &v) -> bool
+	{
+		v = 0;
+		int shift = 0;
+		while (pos < delta.size() && shift < 64)
+		{
+			unsigned char c = delta[pos++];
+			v |= uint64_t(c & 0x7f) << shift;
+			shift += 7;
+			if ((c & 0x80) == 0)
+				return true;
+		}
+		return false;
+	};
+
+	uint64_t base_size, result_size;
+	if (!varint(base_size) || !varint(result_size) || base_size != base.size())
+		return false;
+
+	out.resize(result_size);
+	size_t o = 0;
+	while (pos < delta.size())
+	{
+		unsigned char c = delta[pos++];
+		if (c & 0x80)
+		{
+			// Copy from base, offset and size bytes present
+			// according to the bits of c
+			uint64_t offset = 0;
+			uint64_t size = 0;
+			for (int i = 0; i < 4; i++)
+			{
+				if (c & (1 << i))
+				{
+					if (pos >= delta.size())
+						return false;
+					offset |= uint64_t(delta[pos++]) << (8 * i);
+				}
+			}
+			for (int i = 0; i < 3; i++)
+			{
+				if (c & (0x10 << i))
+				{
+					if (pos >= delta.size())
+						return false;
+					size |= uint64_t(delta[pos++]) << (8 * i);
+				}
+			}
+			if (size == 0)
+				size = 0x10000;
+			if (offset + size > base.size() || o + size > out.size())
+				return false;
+			std::memcpy(out.data() + o, base.data() + offset, size);
+			o += size;
+		}
+		else if (c != 0)
+		{
+			// Insert the next c bytes of the delta
+			if (pos + c > delta.size() || o + c > out.size())
+				return false;
+			std::memcpy(out.data() + o, delta.data() + pos, c);
+			pos += c;
+			o += c;
+		}
+		else
+		{
+			return false;
+		}
+	}
+	return o == out.size();
+}
+
+bool
+GitPack::create_delta(const std::vector<unsigned char> &base,
+	const std::vector<unsigned char> &target, size_t max_size,
+	std::vector<unsigned char> &delta)
+{
+	const size_t w = delta_block_size;
+	size_t bn = base.size();
+	size_t tn = target.size();
+	if (bn < w || bn > UINT32_MAX)
+		return false;
+
+	// Hash every block of the base into a chained table
+	size_t blocks = bn / w;
+	size_t buckets = 16;
+	while (buckets < blocks)
+		buckets <<= 1;
+	std::vector<uint32_t> head(buckets, 0);
+	std::vector<uint32_t> next(blocks + 1, 0);
+
+	uint32_t top = 1;
+	for (size_t i = 1; i < w; i++)
+		top *= delta_hash_base;
+	auto hash_at = [w](const unsigned char *p) {
+		uint32_t h = 0;
+		for (size_t i = 0; i < w; i++)
+			h = h * delta_hash_base + p[i];
+		return h;
+	};
+	auto bucket = [buckets](uint32_t h) {
+		return (h ^ (h >> 15)) & (buckets - 1);
+	};
+	// Insert backwards, so that chains list earlier blocks first
+	for (size_t b = blocks; b-- > 0; )
+	{
+		auto k = bucket(hash_at(base.data() + b * w));
+		next[b + 1] = head[k];
+		head[k] = b + 1;
+	}
+
+	delta.clear();
+	auto varint = [&delta](uint64_t v) {
+		while (v >= 0x80)
+		{
+			delta.push_back((v & 0x7f) | 0x80);
+			v >>= 7;
+		}
+		delta.push_back(v);
+	};
+	varint(bn);
+	varint(tn);
+
+	size_t literal = 0;
+	auto flush_literals = [&](size_t end) {
+		while (literal < end)
+		{
+			size_t n = std::min<size_t>(127, end - literal);
+			delta.push_back(n);
+			delta.insert(delta.end(), target.begin() + literal, target.begin() + literal + n);
+			literal += n;
+		}
+	};
+	auto copy = [&delta](size_t offset, size_t len) {
+		while (len > 0)
+		{
+			size_t n = std::min<size_t>(len, 0x10000);
+			size_t pos = delta.size();
+			unsigned char cmd = 0x80;
+			delta.push_back(0);
+			for (int i = 0; i < 4; i++)
+			{
+				unsigned char byte = (offset >> (8 * i)) & 0xff;
+				if (byte)
+				{
+					cmd |= 1 << i;
+					delta.push_back(byte);
+				}
+			}
+			// A size of 0x10000 is written as no size bytes
+			for (int i = 0; i < 3 && n != 0x10000; i++)
+			{
+				unsigned char byte = (n >> (8 * i)) & 0xff;
+				if (byte)
+				{
+					cmd |= 0x10 << i;
+					delta.push_back(byte);
+				}
+			}
+			delta[pos] = cmd;
+			offset += n;
+			len -= n;
+		}
+	};
+
+	size_t t = 0;
+	uint32_t h = tn >= w ? hash_at(target.data()) : 0;
+	while (t + w <= tn)
+	{
+		size_t best_len = 0;
+		size_t best_pos = 0;
+		size_t tried = 0;
+		for (uint32_t b = head[bucket(h)]; b != 0 && tried < max_delta_candidates; b = next[b])
+		{
+			tried++;
+			size_t pos = (b - 1) * w;
+			if (std::memcmp(base.data() + pos, target.data() + t, w) != 0)
+				continue;
+			size_t len = w;
+			while (pos + len < bn && t + len < tn && base[pos + len] == target[t + len])
+				len++;
+			if (len > best_len)
+			{
+				best_len = len;
+				best_pos = pos;
+			}
+		}
+
+		if (best_len == 0)
+		{
+			if (t + w < tn)
+				h = (h - target[t] * top) * delta_hash_base + target[t + w];
+			t++;
+			if (delta.size() + (t - literal) > max_size)
+				return false;
+			continue;
+		}
+
+		// Grow the match backwards over pending literals
+		while (t > literal && best_pos > 0 && base[best_pos - 1] == target[t - 1])
+		{
+			t--;
+			best_pos--;
+			best_len++;
+		}
+		flush_literals(t);
+		copy(best_pos, best_len);
+		t += best_len;
+		literal = t;
+		if (delta.size() > max_size)
+			return false;
+		if (t + w <= tn)
+			h = hash_at(target.data() + t);
+	}
+	flush_literals(tn);
+	return delta.size() <= max_size;
+}
+
+std::string
+GitPack::type_name(Type type)
+{
+	switch (type)
+	{
+	case Type::commit:
+		return "commit";
+	case Type::tree:
+		return "tree";
+	case Type::blob:
+		return "blob";
+	case Type::tag:
+		return "tag";
+	default:
+		return std::string();
+	}
+}
+
+bool
+GitPack::delta_chain(uint64_t offset, std::vector<Entry> &chain,
+	std::vector<uint64_t> &offsets) const
+{
+	while (chain.size() < max_chain_length)
+	{
+		Entry entry;
+		if (!parse_entry(m_pack->data(), m_pack->size() - 20, offset, entry))
+			return false;
+		chain.push_back(entry);
+		offsets.push_back(offset);
+
+		if (entry.type == Type::ofs_delta)
+			offset = entry.base_offset;
+		else if (entry.type == Type::ref_delta)
+		{
+			if (!find(entry.base_sha, offset))
+				return false;
+		}
+		else
+			return true;
+	}
+	return false;
+}
+
+bool
+GitPack::read(uint64_t offset, std::string &fmt, std::vector<unsigned char> &data)
+{
+	PERF_SCOPE("pack_read");
+	std::vector<Entry> chain;
+	std::vector<uint64_t> offsets;
+	if (!delta_chain(offset, chain, offsets))
+		return false;
+
+	fmt = type_name(chain.back().type);
+	const unsigned char *pack = m_pack->data();
+	size_t len = m_pack->size() - 20;
+	auto inflate_entry = [pack, len](const Entry &e, std::vector<unsigned char> &out)
+	{
+		return inflate_data(pack + e.data_offset, len - e.data_offset, e.size, out);
+	};
+
+	if (chain.size() == 1)
+		return inflate_entry(chain.at(0), data);
+
+	// Start from the nearest base still cached, else from the object
+	// at the end of the chain
+	size_t start = chain.size() - 1;
+	DeltaBaseCache::Data base;
+	for (size_t i = 1; i < chain.size(); i++)
+	{
+		base = m_cache.get(offsets.at(i));
+		if (base)
+		{
+			PERF_COUNT(cache_hits, 1);
+			start = i;
+			break;
+		}
+	}
+	if (base == nullptr)
+	{
+		auto bytes = std::make_shared<std::vector<unsigned char> >();
+		if (!inflate_entry(chain.back(), *bytes))
+			return false;
+		base = bytes;
+		m_cache.put(offsets.back(), base);
+	}
+
+	std::vector<unsigned char> delta;
+	for (size_t i = start; i-- > 0; )
+	{
+		if (!inflate_entry(chain.at(i), delta))
+			return false;
+		auto result = std::make_shared<std::vector<unsigned char> >();
+		if (!apply_delta(*base, delta, *result))
+			return false;
+		if (i == 0)
+		{
+			data.swap(*result);
+			break;
+		}
+		base = result;
+		m_cache.put(offsets.at(i), base);
+	}
+	return true;
+}
+
+bool
+GitPack::info(uint64_t offset, std::string &fmt, size_t &size,
+	std::vector<unsigned char> *head, size_t head_size)
+{
+	std::vector<Entry> chain;
+	std::vector<uint64_t> offsets;
+	if (!delta_chain(offset, chain, offsets))
+		return false;
+
+	fmt = type_name(chain.back().type);
+	const auto &first = chain.at(0);
+	if (chain.size() == 1)
+	{
+		size = first.size;
+		if (head == nullptr)
+			return true;
+
+		// Inflate only as far as the head
+		head->resize(std::min<size_t>(size, head_size));
+		z_stream zs = {};
+		if (inflateInit(&zs) != Z_OK)
+			return false;
+		zs.next_in = const_cast<unsigned char *>(m_pack->data() + first.data_offset);
+		zs.avail_in = std::min<size_t>(m_pack->size() - 20 - first.data_offset, UINT_MAX);
+		zs.next_out = head->data();
+		zs.avail_out = head->size();
+		int status = head->empty() ? Z_OK : inflate(&zs, Z_SYNC_FLUSH);
+		head->resize(head->size() - zs.avail_out);
+		inflateEnd(&zs);
+		PERF_COUNT(bytes_inflated, head->size());
+		return status == Z_OK || status == Z_STREAM_END;
+	}
+	if (head)
+	{
+		// Deltas need their whole base anyway
+		std::vector<unsigned char> data;
+		if (!read(offset, fmt, data))
+			return false;
+		size = data.size();
+		head->assign(data.begin(), data.begin() + std::min(data.size(), head_size));
+		return true;
+	}
+
+	// A delta starts with the sizes of its base and its result,
+	// so only inflate those.
+	unsigned char sizes[20];
+	z_stream zs = {};
+	if (inflateInit(&zs) != Z_OK)
+		return false;
+	zs.next_in = const_cast<unsigned char *>(m_pack->data() + first.data_offset);
+	zs.avail_in = std::min<size_t>(m_pack->size() - 20 - first.data_offset, UINT_MAX);
+	zs.next_out = sizes;
+	zs.avail_out = sizeof(sizes);
+	int status = inflate(&zs, Z_SYNC_FLUSH);
+	size_t len = sizeof(sizes) - zs.avail_out;
+	inflateEnd(&zs);
+	if (status != Z_OK && status != Z_STREAM_END)
+		return false;
+
+	size_t pos = 0;
+	uint64_t values[2] = {0, 0};
+	for (auto &v : values)
+	{
+		int shift = 0;
+		while (true)
+		{
+			if (pos >= len)
+				return false;
+			unsigned char c = sizes[pos++];
+			v |= uint64_t(c & 0x7f) << shift;
+			shift += 7;
+			if ((c & 0x80) == 0)
+				break;
+		}
+	}
+	size = values[1];
+	return true;
+}
+
+GitPack::Type
+GitPack::type_from_name(const std::string &fmt)
+{
+	if (fmt == "commit")
+		return Type::commit;
+	if (fmt == "tree")
+		return Type::tree;
+	if (fmt == "blob")
+		return Type::blob;
+	if (fmt == "tag")
+		return Type::tag;
+	return Type::none;
+}
+
+void
+GitPack::write_index(const std::string &path,
+	std::vector<IndexEntry> &entries,
+	const std::string &pack_sha)
+{
+	std::sort(entries.begin(), entries.end(),
+		[](const IndexEntry &a, const IndexEntry &b) { return a.sha < b.sha; });
+
+	std::vector<unsigned char> out;
+	out.reserve(8 + 256 * 4 + entries.size() * 32 + 40);
+	out.insert(out.end(), {0xff, 't', 'O', 'c'});
+	put32(out, 2);
+
+	// Fan-out: number of objects with first byte <= i
+	uint32_t fanout[256] = {};
+	for (const auto &e : entries)
+	{
+		unsigned char first;
+		from_hex(e.sha.substr(0, 2), &first);
+		fanout[first]++;
+	}
+	uint32_t total = 0;
+	for (auto n : fanout)
+	{
+		total += n;
+		put32(out, total);
+	}
+
+	unsigned char sha[20];
+	for (const auto &e : entries)
+	{
+		from_hex(e.sha, sha);
+		out.insert(out.end(), sha, sha + 20);
+	}
+	for (const auto &e : entries)
+	{
+		put32(out, e.crc);
+	}
+
+	// Offsets that do not fit in 31 bits go to a second table
+	std::vector<uint64_t> large;
+	for (const auto &e : entries)
+	{
+		if (e.offset < 0x80000000u)
+		{
+			put32(out, e.offset);
+		}
+		else
+		{
+			put32(out, 0x80000000u | large.size());
+			large.push_back(e.offset);
+		}
+	}
+	for (auto offset : large)
+	{
+		put32(out, offset >> 32);
+		put32(out, offset & 0xffffffffu);
+	}
+
+	from_hex(pack_sha, sha);
+	out.insert(out.end(), sha, sha + 20);
+	from_hex(checksum(out.data(), out.size()), sha);
+	out.insert(out.end(), sha, sha + 20);
+
+	// Write to a temporary file first, readers never see half an index
+	auto tmp = path + ".tmp";
+	PERF_COUNT(syscalls, 2);
+	{
+		std::ofstream f(tmp, std::ios::binary);
+		f.write(reinterpret_cast<const char *>(out.data()), out.size());
+		if (!f)
+			throw GitException("Cannot write pack index: " + tmp);
+	}
+	if (std::rename(tmp.c_str(), path.c_str()) != 0)
+		throw GitException("Cannot write pack index: " + path);
+}
+
+std::string
+GitPack::hash_object(const std::string &fmt, const std::vector<unsigned char> &data)
+{
+	PERF_SCOPE("sha1");
+	SHA1 hasher;
+	hasher.update(fmt + " " + std::to_string(data.size()) + std::string(1, '\0'));
+	const size_t chunk = 1024 * 1024;
+	for (size_t i = 0; i < data.size(); i += chunk)
+	{
+		hasher.update(std::string(reinterpret_cast<const char *>(data.data() + i),
+			std::min(chunk, data.size() - i)));
+	}
+	return hasher.final();
+}
+
+std::string
+GitPack::checksum(const unsigned char *p, size_t len)
+{
+	// Feed the data in pieces rather than copying all of it
+	PERF_SCOPE("sha1");
+	const size_t chunk = 1024 * 1024;
+	SHA1 hasher;
+	for (size_t i = 0; i < len; i += chunk)
+	{
+		hasher.update(std::string(reinterpret_cast<const char *>(p + i),
+			std::min(chunk, len - i)));
+	}
+	return hasher.final();
+}
+
+std::string
+GitPack::to_hex(const unsigned char *sha)
+{
+	static const char digits[] = "0123456789abcdef";
+	std::string hex(40, '0');
+	for (size_t i = 0; i < 20; i++)
+	{
+		hex[2 * i] = digits[sha[i] >> 4];
+		hex[2 * i + 1] = digits[sha[i] & 15];
+	}
+	return hex;
+}
+
+void
+GitPack::from_hex(const std::string &hex, unsigned char *sha)
+{
+	auto nibble = [](char c) -> unsigned char
+	{
+		if (c >= 'a' && c <= 'f')
+			return c - 'a' + 10;
+		if (c >= 'A' && c <= 'F')
+			return c - 'A' + 10;
+		return c - '0';
+	};
+	for (size_t i = 0; i + 1 < hex.size(); i += 2)
+	{
+		sha[i / 2] = (nibble(hex[i]) << 4) | nibble(hex[i + 1]);
+	}
+}
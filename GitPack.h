@@ -0,0 +1,163 @@
+#ifndef GIT_PACK_H
+#define GIT_PACK_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
+
+#include "MappedFile.h"
+#include "DeltaBaseCache.h"
+
+/**
+ * \brief A packfile and its version 2 index, as written by git.
+ *
+ * Both files are memory mapped.  Lookups binary search the sorted
+ * object ids of the index within the range given by its fan-out table,
+ * and reading an object applies its chain of deltas, keeping inflated
+ * bases in a bounded cache.  All methods may be called concurrently.
+ */
+class GitPack
+{
+public:
+	//! Object types as stored in the headers of pack entries.
+	enum class Type
+	{
+		none = 0,
+		commit = 1,
+		tree = 2,
+		blob = 3,
+		tag = 4,
+		ofs_delta = 6,
+		ref_delta = 7
+	};
+
+	//! Header of one pack entry.
+	struct Entry
+	{
+		Type type;
+		//! Inflated size of the data, or of the delta
+		uint64_t size;
+		//! Offset of the compressed data
+		uint64_t data_offset;
+		//! Base of an ofs_delta
+		uint64_t base_offset;
+		//! Base of a ref_delta, as hex
+		std::string base_sha;
+	};
+
+	//! One object for write_index().
+	struct IndexEntry
+	{
+		std::string sha;
+		uint32_t crc;
+		uint64_t offset;
+	};
+
+	//! Open the pack belonging to index file idx_path.
+	GitPack(const std::string &idx_path);
+
+	size_t object_count() const;
+
+	//! Id of the i-th object in sorted order.
+	std::string object_id(size_t i) const;
+
+	//! Id of the i-th object as 20 raw bytes.
+	const unsigned char *id_bytes(size_t i) const;
+
+	//! Pack offset of the i-th object in sorted order.
+	uint64_t object_offset(size_t i) const;
+
+	//! Find offset of object sha, returns false if not in this pack.
+	bool find(const std::string &sha, uint64_t &offset) const;
+
+	//! Find sorted position i of object sha given as 20 raw bytes.
+	bool find_index(const unsigned char *sha, size_t &i) const;
+
+	//! Sorted positions of all objects in the order of their offsets.
+	std::vector<uint32_t> pack_order() const;
+
+	//! Checksum at the end of the pack, as hex.
+	std::string pack_checksum() const;
+
+	//! Append ids of all objects starting with hex prefix to found.
+	void find_prefix(const std::string &prefix, std::vector<std::string> &found) const;
+
+	//! Read type and data of object at offset, applying deltas.
+	bool read(uint64_t offset, std::string &fmt, std::vector<unsigned char> &data);
+
+	//! Read type and size of object at offset without its data, and
+	//! optionally also the first head_size bytes of data into head.
+	//! Only deltas are inflated completely for that.
+	bool info(uint64_t offset, std::string &fmt, size_t &size,
+		std::vector<unsigned char> *head = nullptr, size_t head_size = 0);
+
+	const std::string &pack_path() const;
+
+	//! Verify the checksums of the pack and the index.
+	bool verify() const;
+
+	//! Parse entry header at offset of a pack of len bytes.
+	static bool parse_entry(const unsigned char *pack, size_t len,
+		uint64_t offset, Entry &entry);
+
+	//! Inflate size bytes of zlib data at p into out.  If consumed is
+	//! given, return the compressed length in it.
+	static bool inflate_data(const unsigned char *p, size_t avail, size_t size,
+		std::vector<unsigned char> &out, size_t *consumed = nullptr);
+
+	//! Inflate size bytes of zlib data at p without keeping them,
+	//! only to find the compressed length.
+	static bool skip_data(const unsigned char *p, size_t avail, size_t size,
+		size_t &consumed);
+
+	//! Apply git delta to base, writing the result to out.
+	static bool apply_delta(const std::vector<unsigned char> &base,
+		const std::vector<unsigned char> &delta,
+		std::vector<unsigned char> &out);
+
+	//! Encode target as a git delta against base.  Fails if the delta
+	//! would be bigger than max_size.
+	static bool create_delta(const std::vector<unsigned char> &base,
+		const std::vector<unsigned char> &target, size_t max_size,
+		std::vector<unsigned char> &delta);
+
+	//! "commit", "tree", "blob" or "tag", empty for deltas.
+	static std::string type_name(Type type);
+
+	//! Type for fmt, or Type::none.
+	static Type type_from_name(const std::string &fmt);
+
+	//! Write a version 2 index of entries to path, for the pack with
+	//! checksum pack_sha.  Entries are sorted by this function.
+	static void write_index(const std::string &path,
+		std::vector<IndexEntry> &entries,
+		const std::string &pack_sha);
+
+	//! Object id of data with type fmt.
+	static std::string hash_object(const std::string &fmt,
+		const std::vector<unsigned char> &data);
+
+	//! SHA-1 of len bytes at p, as hex.
+	static std::string checksum(const unsigned char *p, size_t len);
+
+	static std::string to_hex(const unsigned char *sha);
+
+	static void from_hex(const std::string &hex, unsigned char *sha);
+
+private:
+	std::unique_ptr<MappedFile> m_idx;
+	std::unique_ptr<MappedFile> m_pack;
+	size_t m_count;
+	const unsigned char *m_fanout;
+	const unsigned char *m_shas;
+	const unsigned char *m_offsets;
+	const unsigned char *m_large_offsets;
+	DeltaBaseCache m_cache;
+
+	//! Offsets of the entries from offset down to its base object.
+	bool delta_chain(uint64_t offset, std::vector<Entry> &chain,
+		std::vector<uint64_t> &offsets) const;
+};
+
+#endif
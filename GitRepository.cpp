@@ -1,49 +1,113 @@
 #include <fstream>
 #include <vector>
 #include <algorithm>
+#include <set>
 #include <iostream>
 #include <iomanip>
+#include <cstring>
+#include <cerrno>
+#include <atomic>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "GitRepository.h"
 #include "GitObject.h"
 #include "GitBlob.h"
 #include "GitCommit.h"
 #include "GitTree.h"
+#include "GitTag.h"
+#include "GitPack.h"
+#include "CommitGraph.h"
+#include "ReftableStack.h"
+#include "DiffTree.h"
+#include "SparseMatcher.h"
+#include "TreeWalker.h"
+#include "AsyncIO.h"
 #include "ConfigParser.h"
+#include "ObjectCache.h"
+#include "TreePathCache.h"
+#include "LooseObjectFilter.h"
+#include "SharedObjectCache.h"
+#include "ParallelDeflater.h"
 #include "GitException.h"
+#include "PerfTrace.h"
 
 #include "zlib.h"
 #include <sha1.hpp>
 
-GitRepository::GitRepository(const std::string &path, bool force)
+//! Blobs read and then written together while checking out.
+static const size_t checkout_batch = 256;
+
+//! Does file in a checkout still hold blob sha, or is it missing?
+static bool
+worktree_unchanged(const fs::path &file, const std::string &sha)
+{
+	std::error_code ec;
+	auto st = fs::symlink_status(file, ec);
+	if (ec || !fs::exists(st))
+		return true;
+
+	std::vector<unsigned char> data;
+	if (fs::is_symlink(st))
+	{
+		auto target = fs::read_symlink(file, ec).string();
+		data.assign(target.begin(), target.end());
+	}
+	else if (fs::is_regular_file(st))
+	{
+		std::ifstream f(file, std::ios::binary);
+		data.assign(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+		if (!f.eof() && f.fail())
+			return false;
+	}
+	else
+	{
+		return false;
+	}
+	return GitPack::hash_object("blob", data) == sha;
+}
+
+GitRepository::GitRepository(const std::string &path, bool force) :
+	m_cache(new ObjectCache()),
+	m_tree_paths(new TreePathCache())
 {
+	PERF_SCOPE("repo_open");
 	m_worktree = path;
 	m_gitdir = fs::path(path) / ".git";
+	m_loose.reset(new LooseObjectFilter((m_gitdir / "objects").string()));
 
 	if (!(force || fs::is_directory(m_gitdir)))
 	{
 		throw GitException("Not a git repository: " + m_gitdir.string());
 	}
 
-	// Read configuration file in .git/config
-	ConfigParser conf;
-	auto confpath = repo_file("config");
-	if (fs::exists(confpath))
-	{
-		conf.read(confpath.string());
-	}
-	else if (!force)
+	// Read configuration file in .git/config, after the system and
+	// global ones
+	if (!force && !fs::exists(repo_file("config")))
 	{
 		throw GitException("Configuration file missing");
 	}
+	m_config.read_layers(m_gitdir.string());
 
 	if (!force)
 	{
-		std::string vers = conf.get("core", "repositoryformatversion");
-		if (vers != "0")
+		// Version 1 allows the extensions, of which only the
+		// reference storage is known
+		std::string vers = m_config.get("core.repositoryformatversion");
+		if (vers != "0" && vers != "1")
 		{
 			throw GitException("Unsupported repositoryformatversion: " + vers);
 		}
+		std::string refs = m_config.get("extensions.refstorage");
+		if (vers == "1" && refs == "reftable")
+		{
+			m_reftable.reset(new ReftableStack(repo_path("reftable").string()));
+		}
+		else if (!refs.empty() && refs != "files")
+		{
+			throw GitException("Unsupported extensions.refStorage: " + refs);
+		}
 	}
 
 	auto packed_refs_path = repo_file("packed-refs");
@@ -51,11 +115,21 @@ GitRepository::GitRepository(const std::string &path, bool force)
 	{
 		read_packed_refs(packed_refs_path.string());
 	}
+	read_packs();
+	read_commit_graph();
+	if (!force && m_config.get_bool("wyag.sharedcache", false))
+		open_shared_cache();
 }
 
+GitRepository::GitRepository(GitRepository &&other) = default;
+
+GitRepository::~GitRepository() = default;
+
 void
 GitRepository::read_packed_refs(const std::string &path)
 {
+	PERF_SCOPE("read_packed_refs");
+	PERF_COUNT(syscalls, 1);
 	std::ifstream f(path);
 	if (f.is_open())
 	{
@@ -80,6 +154,213 @@ GitRepository::read_packed_refs(const std::string &path)
 	}
 }
 
+void
+GitRepository::read_packs()
+{
+	auto dir = repo_path("objects/pack");
+	if (!fs::is_directory(dir))
+		return;
+
+	PERF_SCOPE("read_packs");
+	std::vector<std::pair<fs::file_time_type, std::string> > idx_files;
+	for (auto &f : fs::directory_iterator(dir))
+	{
+		auto path = f.path();
+		if (path.extension() == ".idx" &&
+			fs::exists(fs::path(path).replace_extension(".pack")))
+		{
+			idx_files.push_back({fs::last_write_time(path), path.string()});
+		}
+	}
+
+	// Recently written packs are the most likely to be used
+	std::sort(idx_files.rbegin(), idx_files.rend());
+	for (const auto &idx : idx_files)
+	{
+		try
+		{
+			m_packs.emplace_back(new GitPack(idx.second));
+		}
+		catch (const GitException &e)
+		{
+			std::cerr << "warning: " << e.what() << std::endl;
+		}
+	}
+}
+
+void
+GitRepository::read_commit_graph()
+{
+	auto path = commit_graph_path();
+	if (!fs::exists(path))
+		return;
+	try
+	{
+		m_commit_graph.reset(new CommitGraph(path.string()));
+	}
+	catch (const GitException &e)
+	{
+		std::cerr << "warning: " << e.what() << std::endl;
+	}
+}
+
+void
+GitRepository::open_shared_cache()
+{
+	try
+	{
+		m_shared_cache.reset(new SharedObjectCache(repo_path("wyag-object-cache").string(),
+			m_config.get_int("wyag.sharedcachesize", 64 << 20)));
+	}
+	catch (const GitException &e)
+	{
+		std::cerr << "warning: " << e.what() << std::endl;
+	}
+}
+
+const ConfigParser &
+GitRepository::config() const
+{
+	return m_config;
+}
+
+const CommitGraph *
+GitRepository::commit_graph() const
+{
+	return m_commit_graph.get();
+}
+
+fs::path
+GitRepository::commit_graph_path() const
+{
+	return repo_path("objects/info/commit-graph");
+}
+
+std::vector<std::string>
+GitRepository::loose_objects() const
+{
+	PERF_SCOPE("loose_objects");
+	std::vector<std::string> objects;
+	static const char digits[] = "0123456789abcdef";
+	for (int i = 0; i < 256; i++)
+	{
+		std::string prefix{digits[i >> 4], digits[i & 15]};
+		auto objdir = repo_path("objects/" + prefix);
+		if (!fs::is_directory(objdir))
+			continue;
+		for (auto &f : fs::directory_iterator(objdir))
+		{
+			// Skip temporary files left by interrupted writes
+			auto name = f.path().filename().string();
+			if (name.size() == 38 && std::all_of(name.begin(), name.end(), [](char c) {
+				return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f');
+			}))
+			{
+				objects.push_back(prefix + name);
+			}
+		}
+	}
+	return objects;
+}
+
+const std::vector<std::unique_ptr<GitPack> > &
+GitRepository::packs() const
+{
+	return m_packs;
+}
+
+fs::path
+GitRepository::object_dir() const
+{
+	return repo_path("objects");
+}
+
+fs::path
+GitRepository::pack_dir() const
+{
+	return repo_dir("objects/pack", true);
+}
+
+size_t
+GitRepository::prune_packed(const std::string &pack_sha, size_t &unpacked)
+{
+	PERF_SCOPE("prune_packed");
+	auto dir = pack_dir();
+	auto keep = "pack-" + pack_sha;
+	GitPack pack((dir / (keep + ".idx")).string());
+
+	// Remove the index first, so that no reader finds an index
+	// without its pack
+	std::vector<fs::path> old_packs;
+	for (auto &f : fs::directory_iterator(dir))
+	{
+		auto path = f.path();
+		if (path.stem().string().compare(0, 5, "pack-") == 0 && path.stem() != keep)
+			old_packs.push_back(path);
+	}
+	std::sort(old_packs.begin(), old_packs.end(), [](const fs::path &a, const fs::path &b) {
+		return (a.extension() == ".idx") > (b.extension() == ".idx");
+	});
+
+	// Objects only in the old packs were not reachable, or were added
+	// after the walk.  They become loose again, as old as their pack,
+	// so that prune keeps them for the grace period like git does.
+	unpacked = 0;
+	for (const auto &path : old_packs)
+	{
+		if (path.extension() != ".idx")
+			continue;
+		GitPack old(path.string());
+		struct stat st;
+		time_t mtime = stat(old.pack_path().c_str(), &st) == 0 ? st.st_mtime : 0;
+		for (size_t i = 0; i < old.object_count(); i++)
+		{
+			auto sha = old.object_id(i);
+			uint64_t offset;
+			std::string fmt;
+			std::vector<unsigned char> data;
+			if (pack.find(sha, offset) || fs::exists(loose_object_path(sha)))
+				continue;
+			if (!old.read(old.object_offset(i), fmt, data))
+				throw GitException("Cannot read object " + sha + " from " + old.pack_path());
+			std::string header = fmt + " " + std::to_string(data.size());
+			data.insert(data.begin(), '\0');
+			data.insert(data.begin(), header.begin(), header.end());
+			if (!loose_object_write(sha, data, mtime))
+				throw GitException("Cannot write object " + sha);
+			unpacked++;
+		}
+	}
+	for (const auto &path : old_packs)
+	{
+		PERF_COUNT(syscalls, 1);
+		fs::remove(path);
+	}
+
+	size_t removed = 0;
+	static const char digits[] = "0123456789abcdef";
+	for (int i = 0; i < 256; i++)
+	{
+		std::string prefix{digits[i >> 4], digits[i & 15]};
+		auto objdir = repo_path("objects/" + prefix);
+		if (!fs::is_directory(objdir))
+			continue;
+		for (auto &f : fs::directory_iterator(objdir))
+		{
+			uint64_t offset;
+			if (pack.find(prefix + f.path().filename().string(), offset))
+			{
+				PERF_COUNT(syscalls, 1);
+				fs::remove(f.path());
+				removed++;
+			}
+		}
+		if (fs::is_empty(objdir))
+			fs::remove(objdir);
+	}
+	return removed;
+}
+
 fs::path
 GitRepository::repo_path(const std::string &path) const
 {
@@ -100,6 +381,7 @@ fs::path
 GitRepository::repo_dir(const std::string &path, bool mkdir) const
 {
 	auto fullpath = repo_path(path);
+	PERF_COUNT(syscalls, 1);
 	if (fs::exists(fullpath))
 	{
 		if (fs::is_directory(fullpath))
@@ -121,7 +403,7 @@ GitRepository::repo_dir(const std::string &path, bool mkdir) const
 }
 
 GitRepository
-GitRepository::repo_create(const std::string path)
+GitRepository::repo_create(const std::string path, bool reftable)
 {
 	auto repo = GitRepository(path, true);
 
@@ -143,7 +425,9 @@ GitRepository::repo_create(const std::string path)
 		fs::create_directories(repo.m_worktree);
 	}
 
-	const std::vector<std::string> dirs = {"branches", "objects", "refs/tags", "refs/heads"};
+	std::vector<std::string> dirs = {"branches", "objects", "refs/tags", "refs/heads"};
+	if (reftable)
+		dirs = {"branches", "objects", "refs", "reftable"};
 	for (const auto &dir : dirs)
 	{
 		if (repo.repo_dir(dir, true).empty())
@@ -159,26 +443,43 @@ GitRepository::repo_create(const std::string path)
 		fd.close();
 	}
 
+	// With reftables HEAD and refs/heads are only there for older
+	// versions of git to fail on, like git does
 	std::ofstream fh(repo.repo_file("HEAD").string());
 	if (fh.is_open())
 	{
-		fh << "ref: refs/heads/master" << std::endl;
+		fh << "ref: refs/heads/" << (reftable ? ".invalid" : "master") << std::endl;
 		fh.close();
 	}
+	if (reftable)
+	{
+		std::ofstream heads(repo.repo_file("refs/heads").string());
+		heads << "this repository uses the reftable format" << std::endl;
+
+		ReftableStack::create(repo.repo_path("reftable").string());
+		ReftableStack stack(repo.repo_path("reftable").string());
+		Reftable::Record head;
+		head.name = "HEAD";
+		head.type = Reftable::Record::symref;
+		head.target = "refs/heads/master";
+		stack.add({head});
+	}
 
-	ConfigParser config = repo.repo_default_config();
+	ConfigParser config = repo.repo_default_config(reftable);
 	config.write(repo.repo_file("config").string());
 
 	return repo;
 }
 
 ConfigParser
-GitRepository::repo_default_config()
+GitRepository::repo_default_config(bool reftable)
 {
 	ConfigParser ret;
-	ret.set("core", "repositoryformatversion", "0");
-	ret.set("core", "filemode", "false");
-	ret.set("core", "bare", "false");
+	ret.set("core.repositoryformatversion", reftable ? "1" : "0");
+	ret.set("core.filemode", "false");
+	ret.set("core.bare", "false");
+	if (reftable)
+		ret.set("extensions.refstorage", "reftable");
 	return ret;
 }
 
@@ -212,6 +513,16 @@ GitRepository::repo_find(const std::string &path, bool required)
 std::vector<unsigned char>
 GitRepository::compress_bytes(const std::vector<unsigned char> &bytes)
 {
+	PERF_SCOPE("deflate");
+	// Large blobs are compressed in blocks on all CPUs
+	auto threshold = m_config.get_int("wyag.paralleldeflatethreshold", 16 << 20);
+	if (threshold > 0 && bytes.size() >= static_cast<uint64_t>(threshold))
+	{
+		auto compressed = ParallelDeflater().compress(bytes);
+		if (!compressed.empty())
+			return compressed;
+	}
+
 	std::vector<unsigned char> compressed;
 	compressed.resize(bytes.size() * 2);
 
@@ -220,6 +531,7 @@ GitRepository::compress_bytes(const std::vector<unsigned char> &bytes)
 		bytes.data(), bytes.size()) == Z_OK)
 	{
 		compressed.resize(compressed_size);
+		PERF_COUNT(bytes_deflated, bytes.size());
 	}
 	else
 	{
@@ -232,98 +544,269 @@ GitRepository::compress_bytes(const std::vector<unsigned char> &bytes)
 std::vector<unsigned char>
 GitRepository::uncompress_bytes(const std::vector<unsigned char> &bytes)
 {
+	PERF_SCOPE("inflate");
+	PERF_COUNT(objects_inflated, 1);
 	std::vector<unsigned char> uncompressed;
-	uncompressed.resize(bytes.size() * 10);
+	uncompressed.resize(bytes.size() * 10 + 64);
 
+	// Highly repetitive objects compress far better than 10:1, so
+	// keep growing the buffer while inflate fills it completely;
+	// a truncated object stops short of that and fails
 	uLong uncompressed_size = uncompressed.size();
 	int status = uncompress(uncompressed.data(), &uncompressed_size,
 		bytes.data(), bytes.size());
-	if (status == Z_OK)
-	{
-		uncompressed.resize(uncompressed_size);
-	}
-	else if (status == Z_BUF_ERROR)
+	while (status == Z_BUF_ERROR && uncompressed_size == uncompressed.size())
 	{
-		// Try uncompressing again with a bigger buffer
-		uncompressed.resize(bytes.size() * 100);
+		uncompressed.resize(uncompressed.size() * 4);
+		uncompressed_size = uncompressed.size();
 		status = uncompress(uncompressed.data(), &uncompressed_size,
 			bytes.data(), bytes.size());
-		if (status == Z_OK)
-		{
-			uncompressed.resize(uncompressed_size);
-		}
-		else
-		{
-			uncompressed.clear();
-		}
 	}
+	if (status == Z_OK)
+		uncompressed.resize(uncompressed_size);
 	else
-	{
 		uncompressed.clear();
-	}
 
+	PERF_COUNT(bytes_inflated, uncompressed.size());
 	return uncompressed;
 }
 
-std::shared_ptr<GitObject>
-GitRepository::object_read(const std::string &sha)
+std::vector<unsigned char>
+GitRepository::read_loose_object(const std::string &sha) const
 {
 	std::vector<unsigned char> bytes;
 	if (sha.size() >= 2)
 	{
-		std::string objpath = "objects/" +
-			sha.substr(0, 2) + "/" + sha.substr(2);
-
-		auto path = repo_file(objpath);
-		std::ifstream f(path.string(), std::ios::binary);
+		PERF_COUNT(syscalls, 1);
+		std::ifstream f(loose_object_path(sha).string(), std::ios::binary);
 		if (f.is_open())
 		{
-			unsigned char ch = f.get();
-			while (f.good())
+			f.seekg(0, std::ios::end);
+			auto len = f.tellg();
+			f.seekg(0, std::ios::beg);
+			if (len > 0)
 			{
-				bytes.push_back(ch);
-				ch = f.get();
+				bytes.resize(len);
+				f.read(reinterpret_cast<char *>(bytes.data()), len);
+				bytes.resize(f.gcount());
 			}
-			f.close();
+		}
+	}
+	return bytes;
+}
 
-			bytes = uncompress_bytes(bytes);
-			auto it1 = std::find(bytes.begin(), bytes.end(), ' ');
-			if (it1 != bytes.end())
-			{
-				std::string fmt(bytes.begin(), it1);
-				auto it2 = std::find(it1, bytes.end(), '\0');
-				std::string size;
-				std::vector<unsigned char> data;
-				if (it2 != bytes.end())
-				{
-					size = std::string(it1 + 1, it2);
-					data = std::vector<unsigned char>(it2 + 1, bytes.end());
-				}
+bool
+GitRepository::has_object(const std::string &sha, bool quick)
+{
+	for (auto &pack : m_packs)
+	{
+		uint64_t offset;
+		if (pack->find(sha, offset))
+			return true;
+	}
+	if (!m_loose->maybe_contains(sha, !quick))
+		return false;
 
-				if (fmt == "blob")
-				{
-					std::shared_ptr<GitObject> obj(new GitBlob(this));
-					obj->deserialize(data);
-					return obj;
-				}
-				else if (fmt == "commit")
-				{
-					std::shared_ptr<GitObject> obj(new GitCommit(this));
-					obj->deserialize(data);
-					return obj;
-				}
-				else if (fmt == "tree")
-				{
-					std::shared_ptr<GitObject> obj(new GitTree(this));
-					obj->deserialize(data);
-					return obj;
-				}
-				else
-				{
-					std::cerr << "fmt: " << fmt << std::endl;
-				}
-			}
+	PERF_COUNT(syscalls, 1);
+	struct stat st;
+	if (stat(loose_object_path(sha).c_str(), &st) == 0)
+		return true;
+	m_loose->add_missing(sha);
+	return false;
+}
+
+bool
+GitRepository::object_info(const std::string &sha, std::string &fmt, size_t &size,
+	std::vector<unsigned char> *head, size_t head_size)
+{
+	PERF_SCOPE("object_info");
+	auto compressed = read_loose_object(sha);
+	if (compressed.empty())
+	{
+		for (auto &pack : m_packs)
+		{
+			uint64_t offset;
+			if (pack->find(sha, offset))
+				return pack->info(offset, fmt, size, head, head_size);
 		}
+		return false;
+	}
+
+	// Only inflate as far as the end of the header, and
+	// the requested number of bytes after it
+	std::vector<unsigned char> header(64 + (head ? head_size : 0));
+	z_stream zs = {};
+	if (inflateInit(&zs) != Z_OK)
+		return false;
+	zs.next_in = compressed.data();
+	zs.avail_in = compressed.size();
+	zs.next_out = header.data();
+	zs.avail_out = header.size();
+	int status = inflate(&zs, Z_SYNC_FLUSH);
+	size_t len = header.size() - zs.avail_out;
+	inflateEnd(&zs);
+	if (status != Z_OK && status != Z_STREAM_END)
+		return false;
+
+	auto end = std::find(header.begin(), header.begin() + len, '\0');
+	auto space = std::find(header.begin(), end, ' ');
+	if (end == header.begin() + len || space == end)
+		return false;
+
+	fmt = std::string(header.begin(), space);
+	size = std::stoul(std::string(space + 1, end));
+	if (head)
+	{
+		size_t avail = header.begin() + len - (end + 1);
+		head->assign(end + 1, end + 1 + std::min(avail, head_size));
+	}
+	return true;
+}
+
+bool
+GitRepository::object_data(const std::string &sha, std::string &fmt,
+	std::vector<unsigned char> &data)
+{
+	if (sha.size() < 2)
+		return false;
+
+	auto bytes = read_loose_object(sha);
+	if (bytes.empty())
+		return packed_object_data(sha, fmt, data);
+	return loose_object_data(bytes, fmt, data);
+}
+
+bool
+GitRepository::loose_object_write(const std::string &sha, const std::vector<unsigned char> &raw,
+	time_t mtime)
+{
+	auto bytes = compress_bytes(raw);
+	if (bytes.empty())
+		return false;
+	auto path = repo_file("objects/" + sha.substr(0, 2) + "/" + sha.substr(2), true);
+	// Unique among processes and among threads writing the same object
+	static std::atomic<unsigned> tmp_count(0);
+	auto tmp = path.parent_path() / ("tmp_obj_" + std::to_string(getpid()) + "_" +
+		std::to_string(tmp_count++));
+
+	PERF_COUNT(syscalls, 3);
+	int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0444);
+	if (fd < 0)
+		return false;
+	size_t done = 0;
+	while (done < bytes.size())
+	{
+		ssize_t n = write(fd, bytes.data() + done, bytes.size() - done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		done += n;
+	}
+	bool ok = close(fd) == 0 && done == bytes.size();
+	if (ok && mtime != 0)
+	{
+		struct timespec times[2] = {{mtime, 0}, {mtime, 0}};
+		ok = utimensat(AT_FDCWD, tmp.c_str(), times, 0) == 0;
+	}
+	if (!ok || rename(tmp.c_str(), path.c_str()) != 0)
+	{
+		unlink(tmp.c_str());
+		return false;
+	}
+	m_loose->add(sha);
+	return true;
+}
+
+fs::path
+GitRepository::loose_object_path(const std::string &sha) const
+{
+	return repo_path("objects/" + sha.substr(0, 2) + "/" + sha.substr(2));
+}
+
+bool
+GitRepository::loose_object_data(const std::vector<unsigned char> &bytes, std::string &fmt,
+	std::vector<unsigned char> &data)
+{
+	auto raw = uncompress_bytes(bytes);
+	auto it1 = std::find(raw.begin(), raw.end(), ' ');
+	if (it1 == raw.end())
+		return false;
+	fmt = std::string(raw.begin(), it1);
+	auto it2 = std::find(it1, raw.end(), '\0');
+	if (it2 != raw.end())
+		data = std::vector<unsigned char>(it2 + 1, raw.end());
+	return true;
+}
+
+bool
+GitRepository::packed_object_data(const std::string &sha, std::string &fmt,
+	std::vector<unsigned char> &data)
+{
+	for (auto &pack : m_packs)
+	{
+		uint64_t offset;
+		if (pack->find(sha, offset))
+			return pack->read(offset, fmt, data);
+	}
+	return false;
+}
+
+std::shared_ptr<GitObject>
+GitRepository::object_read(const std::string &sha)
+{
+	PERF_SCOPE("object_read");
+	PERF_COUNT(objects_read, 1);
+
+	auto cached = m_cache->get(sha);
+	if (cached)
+	{
+		PERF_COUNT(cache_hits, 1);
+		return cached;
+	}
+
+	// Other processes may have inflated the object already.  Blobs
+	// are too many and too big to share.
+	std::string fmt;
+	std::vector<unsigned char> data;
+	if (!m_shared_cache || !m_shared_cache->get(sha, fmt, data))
+	{
+		if (!object_data(sha, fmt, data))
+			return nullptr;
+		if (m_shared_cache && fmt != "blob")
+			m_shared_cache->put(sha, fmt, data);
+	}
+
+	if (fmt == "blob")
+	{
+		std::shared_ptr<GitObject> obj(new GitBlob(this));
+		obj->deserialize(data);
+		return obj;
+	}
+	else if (fmt == "commit")
+	{
+		std::shared_ptr<GitObject> obj(new GitCommit(this));
+		obj->deserialize(data);
+		m_cache->put(sha, obj);
+		return obj;
+	}
+	else if (fmt == "tree")
+	{
+		std::shared_ptr<GitObject> obj(new GitTree(this));
+		obj->deserialize(data);
+		m_cache->put(sha, obj);
+		return obj;
+	}
+	else if (fmt == "tag")
+	{
+		std::shared_ptr<GitObject> obj(new GitTag(this));
+		obj->deserialize(data);
+		m_cache->put(sha, obj);
+		return obj;
+	}
+	else
+	{
+		std::cerr << "fmt: " << fmt << std::endl;
 	}
 	return nullptr;
 }
@@ -331,6 +814,7 @@ GitRepository::object_read(const std::string &sha)
 std::string
 GitRepository::object_write(std::shared_ptr<GitObject> obj, bool actually_write)
 {
+	PERF_SCOPE("object_write");
 	// Serialize object data
 	std::vector<unsigned char> data = obj->serialize();
 
@@ -348,26 +832,20 @@ GitRepository::object_write(std::shared_ptr<GitObject> obj, bool actually_write)
 	}
 
 	// Compute hash
-	SHA1 hasher;
-	hasher.update(std::string(reinterpret_cast<char *>(result.data()), result.size()));
-	std::string sha = hasher.final();
-
-	if (actually_write)
+	std::string sha;
 	{
-		// Compute path
-		std::string objpath = "objects/" +
-			sha.substr(0, 2) + "/" + sha.substr(2);
-		auto path = repo_file(objpath, actually_write);
-
-		std::ofstream f(path.string(), std::ios::binary);
-		if (f.is_open())
-		{
-			auto bytes = compress_bytes(result);
-			f.write(reinterpret_cast<char *>(bytes.data()), bytes.size());
-			f.close();
-		}
+		PERF_SCOPE("sha1");
+		SHA1 hasher;
+		hasher.update(std::string(reinterpret_cast<char *>(result.data()), result.size()));
+		sha = hasher.final();
 	}
 
+	// Objects already there are not compressed and written again.
+	// One missed is only written again, identical, so the quick
+	// answer is good enough.
+	if (actually_write && !has_object(sha, true) && !loose_object_write(sha, result))
+		throw GitException("Cannot write object " + sha);
+
 	return sha;
 }
 
@@ -418,40 +896,515 @@ GitRepository::object_find(const std::string &name,
 	const std::string &fmt,
 	bool follow)
 {
-	return name;
+	std::string sha;
+	auto colon = name.find(':');
+	if (colon == std::string::npos)
+		sha = object_resolve(name);
+	else if (!object_resolve(name.substr(0, colon)).empty())
+		sha = tree_lookup(object_find(name.substr(0, colon), "tree"), name.substr(colon + 1));
+	if (sha.empty())
+		return name;
+
+	if (fmt.empty())
+		return sha;
+
+	// Follow tags to the tagged object and commits to their tree,
+	// until we reach an object of the requested type.
+	while (true)
+	{
+		auto obj = object_read(sha);
+		if (obj == nullptr || obj->get_format() == fmt || !follow)
+			return sha;
+
+		std::vector<std::string> next;
+		if (obj->get_format() == "tag")
+		{
+			next = std::dynamic_pointer_cast<GitTag>(obj)->get_value("object");
+		}
+		else if (obj->get_format() == "commit" && fmt == "tree")
+		{
+			next = std::dynamic_pointer_cast<GitCommit>(obj)->get_value("tree");
+		}
+		if (next.empty())
+			return sha;
+		sha = next.at(0);
+	}
+}
+
+std::string
+GitRepository::object_resolve(const std::string &name) const
+{
+	if (name.empty())
+		return std::string();
+
+	bool is_hex = std::all_of(name.begin(), name.end(), [](char c) {
+		return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f');
+	});
+	if (is_hex && name.size() == 40)
+		return name;
+
+	// Abbreviated hash, must be unique among loose and packed objects
+	if (is_hex && name.size() >= 4)
+	{
+		std::string found;
+		auto dir = repo_path("objects/" + name.substr(0, 2));
+		if (fs::is_directory(dir))
+		{
+			auto rest = name.substr(2);
+			for (auto &f : fs::directory_iterator(dir))
+			{
+				auto filename = f.path().filename().string();
+				if (filename.compare(0, rest.size(), rest) == 0)
+				{
+					if (!found.empty())
+						throw GitException("Ambiguous reference: " + name);
+					found = name.substr(0, 2) + filename;
+				}
+			}
+		}
+		std::vector<std::string> packed;
+		for (const auto &pack : m_packs)
+		{
+			pack->find_prefix(name, packed);
+		}
+		for (const auto &sha : packed)
+		{
+			if (!found.empty() && found != sha)
+				throw GitException("Ambiguous reference: " + name);
+			found = sha;
+		}
+		if (!found.empty())
+			return found;
+	}
+
+	for (const auto &prefix : {"", "refs/", "refs/tags/", "refs/heads/"})
+	{
+		// ref_resolve also accepts paths relative to the current
+		// directory, so only pass it names known to be refs.
+		auto ref = prefix + name;
+		if (ref_exists(ref))
+		{
+			return ref_resolve(ref);
+		}
+	}
+	return std::string();
 }
 
-void
-GitRepository::tree_checkout(std::shared_ptr<GitObject> obj, const std::string &path)
+std::string
+GitRepository::tree_lookup(const std::string &tree, const std::string &path)
 {
-	if (obj->get_format() != "tree")
-		return;
+	PERF_SCOPE("tree_lookup");
+	std::vector<std::string> names;
+	size_t start = 0;
+	while (start <= path.size())
+	{
+		auto slash = std::min(path.find('/', start), path.size());
+		if (slash > start)
+			names.push_back(path.substr(start, slash - start));
+		start = slash + 1;
+	}
+	if (names.empty())
+		return tree;
 
-	auto tree = std::dynamic_pointer_cast<GitTree>(obj);
-	for (const auto &item : tree->get_items())
+	// Start below the deepest directory looked up before
+	std::vector<std::string> dirs(names.size() - 1);
+	for (size_t i = 0; i < dirs.size(); i++)
+		dirs[i] = (i > 0 ? dirs[i - 1] + "/" : std::string()) + names[i];
+	std::string sha = tree;
+	size_t level = dirs.size();
+	while (level > 0)
 	{
-		auto obj2 = object_read(item.sha);
-		auto dest = fs::path(path) / item.path;
+		auto cached = m_tree_paths->get(tree, dirs[level - 1]);
+		if (!cached.empty())
+		{
+			PERF_COUNT(cache_hits, 1);
+			sha = cached;
+			break;
+		}
+		level--;
+	}
+
+	for (; level < names.size(); level++)
+	{
+		auto obj = object_read(sha);
+		if (obj == nullptr || obj->get_format() != "tree")
+			return std::string();
+
+		// Entries are sorted with subtree names as if ending in '/',
+		// so a name can be in one of two places
+		const auto &items = std::dynamic_pointer_cast<GitTree>(obj)->get_items();
+		const GitTreeLeaf *found = nullptr;
+		for (const char *mode : {"100644", "40000"})
+		{
+			GitTreeLeaf key(mode, names[level], std::string());
+			auto it = std::lower_bound(items.begin(), items.end(), key,
+				[](const GitTreeLeaf &a, const GitTreeLeaf &b) {
+					return DiffTree::compare(a, b) < 0;
+				});
+			if (it != items.end() && it->path == names[level] && it->is_tree() == key.is_tree())
+			{
+				found = &*it;
+				break;
+			}
+		}
+		if (found == nullptr)
+			return std::string();
+
+		sha = found->sha;
+		if (level < dirs.size())
+		{
+			if (!found->is_tree())
+				return std::string();
+			m_tree_paths->put(tree, dirs[level], sha);
+		}
+	}
+	return sha;
+}
 
-		if (obj2 == nullptr)
+void
+GitRepository::tree_checkout(const std::string &sha, const std::string &path,
+	const SparseMatcher *sparse, const std::string &prefix)
+{
+	PERF_SCOPE("tree_checkout");
+	// Excluded subtrees are not even read, and below an included one
+	// there is nothing left to match.  Directories only partially
+	// included are removed again if nothing in them was.
+	std::string included;
+	std::vector<fs::path> partial;
+	std::vector<BlobCheckout> blobs;
+	TreeWalker walker(*this);
+	if (!sparse)
+		walker.read_ahead();
+	walker.walk({sha}, [&](const std::string &name, const TreeWalker::Entries &entries) {
+		const auto *item = entries[0];
+		auto dest = fs::path(path) / name.substr(prefix.size());
+		if (sparse && (included.empty() || name.compare(0, included.size(), included) != 0))
 		{
-			std::cerr << "Object not found: " << item.sha << std::endl;
+			if (!item->is_tree() && !sparse->includes(name))
+				return false;
+			auto match = item->is_tree() ? sparse->match_dir(name) : SparseMatcher::Match::included;
+			if (match == SparseMatcher::Match::excluded)
+				return false;
+			if (match == SparseMatcher::Match::partial)
+				partial.push_back(dest);
+			else if (item->is_tree())
+				included = name + "/";
 		}
-		else if (obj2->get_format() == "tree")
+
+		if (item->is_tree() || item->mode == "160000")
 		{
+			// Submodules are checked out as empty directories
 			fs::create_directories(dest);
-			tree_checkout(obj2, dest.string());
 		}
-		else if (obj2->get_format() == "blob")
+		else
 		{
-			std::ofstream f(dest.string(), std::ios::binary);
-			if (f.is_open())
+			blobs.push_back({item->sha, item->mode, dest});
+		}
+		return true;
+	}, prefix);
+	blobs_checkout(blobs);
+
+	for (auto it = partial.rbegin(); it != partial.rend(); ++it)
+	{
+		if (fs::is_empty(*it))
+			fs::remove(*it);
+	}
+}
+
+void
+GitRepository::blobs_checkout(const std::vector<BlobCheckout> &blobs)
+{
+	PERF_SCOPE("blobs_checkout");
+	AsyncIO io;
+	std::string failed;
+	for (size_t start = 0; start < blobs.size(); start += checkout_batch)
+	{
+		size_t end = std::min(blobs.size(), start + checkout_batch);
+		std::vector<std::string> fmts(end - start);
+		std::vector<std::vector<unsigned char> > datas(end - start);
+
+		// Looking in the pack indexes is cheaper than failing to open
+		// a loose object, so only read the others from files
+		std::vector<AsyncIO::Request> reads;
+		std::vector<size_t> read_blob;
+		for (size_t i = start; i < end; i++)
+		{
+			PERF_COUNT(objects_read, 1);
+			if (packed_object_data(blobs[i].sha, fmts[i - start], datas[i - start]))
+				continue;
+			AsyncIO::Request read;
+			read.path = loose_object_path(blobs[i].sha).string();
+			read.write = false;
+			reads.push_back(std::move(read));
+			read_blob.push_back(i - start);
+		}
+		io.run(reads);
+		for (size_t r = 0; r < reads.size(); r++)
+		{
+			if (reads[r].error == 0 && !reads[r].data.empty())
+				loose_object_data(reads[r].data, fmts[read_blob[r]], datas[read_blob[r]]);
+		}
+
+		std::vector<AsyncIO::Request> writes;
+		for (size_t i = start; i < end; i++)
+		{
+			const auto &blob = blobs[i];
+			if (fmts[i - start] != "blob")
+			{
+				failed += "\n\t" + blob.dest.string() + ": object not found: " + blob.sha;
+				continue;
+			}
+
+			auto &data = datas[i - start];
+			if (blob.mode == "120000")
 			{
-				auto blobdata = obj2->serialize();
-				f.write(reinterpret_cast<char *>(blobdata.data()), blobdata.size());
+				PERF_COUNT(syscalls, 1);
+				std::error_code ec;
+				fs::create_symlink(std::string(data.begin(), data.end()), blob.dest, ec);
+				if (ec)
+					failed += "\n\t" + blob.dest.string() + ": " + ec.message();
+				continue;
 			}
+			AsyncIO::Request write;
+			write.path = blob.dest.string();
+			write.write = true;
+			write.mode = blob.mode == "100755" ? 0777 : 0666;
+			write.data = std::move(data);
+			writes.push_back(std::move(write));
+		}
+		io.run(writes);
+
+		for (const auto &write : writes)
+		{
+			if (write.error != 0)
+				failed += "\n\t" + write.path + ": " + std::strerror(write.error);
+		}
+	}
+
+	// All blobs are tried, so that one failure does not leave the
+	// rest of the checkout missing too
+	if (!failed.empty())
+		throw GitException("Cannot check out these files:" + failed);
+}
+
+void
+GitRepository::tree_switch(const std::string &old_tree, const std::string &new_tree,
+	const std::string &path, const SparseMatcher *sparse)
+{
+	PERF_SCOPE("tree_switch");
+	DiffTree differ(*this, true);
+	if (sparse)
+	{
+		differ.set_filter([sparse](const std::string &name, bool is_dir) {
+			if (is_dir)
+				return sparse->match_dir(name) != SparseMatcher::Match::excluded;
+			return sparse->includes(name);
+		});
+	}
+	auto changes = differ.diff(old_tree, new_tree);
+	auto root = fs::canonical(path);
+
+	auto is_file = [](const std::string &mode) {
+		return mode == "100644" || mode == "100755";
+	};
+
+	std::set<std::string> deleted;
+	for (const auto &c : changes)
+	{
+		if (c.status == 'D')
+			deleted.insert(c.path);
+	}
+
+	// A directory where a file is added is only replaced if the
+	// deletions leave nothing but empty directories in it
+	auto emptied = [&root, &deleted](const fs::path &dir) {
+		for (const auto &entry : fs::recursive_directory_iterator(dir))
+		{
+			if (!fs::is_directory(entry.symlink_status()) &&
+				deleted.count(entry.path().lexically_relative(root).generic_string()) == 0)
+			{
+				return false;
+			}
+		}
+		return true;
+	};
+
+	// Refuse before touching anything if files to be replaced or
+	// deleted were changed since the old tree was checked out, or an
+	// added file would replace one that was not checked out at all
+	std::vector<std::string> modified;
+	for (const auto &c : changes)
+	{
+		bool chmod_only = c.status == 'M' && c.old_sha == c.new_sha &&
+			is_file(c.old_mode) && is_file(c.new_mode);
+		auto dest = root / c.path;
+		bool unchanged = true;
+		if (c.status == 'A' && fs::is_directory(fs::symlink_status(dest)))
+		{
+			unchanged = c.new_mode == "160000" || emptied(dest);
+		}
+		else if (c.status == 'A')
+		{
+			unchanged = worktree_unchanged(dest, c.new_sha);
+		}
+		else if (!chmod_only && c.old_mode != "160000")
+		{
+			unchanged = worktree_unchanged(dest, c.old_sha);
+		}
+		if (!unchanged)
+			modified.push_back(c.path);
+	}
+	if (!modified.empty())
+	{
+		std::string files;
+		for (const auto &name : modified)
+			files += "\n\t" + name;
+		throw GitException("Local changes to these files would be overwritten:" + files);
+	}
+
+	// Remove old files first, so that directories can replace them
+	for (const auto &c : changes)
+	{
+		bool chmod_only = c.status == 'M' && c.old_sha == c.new_sha &&
+			is_file(c.old_mode) && is_file(c.new_mode);
+		if (c.status == 'A' || chmod_only)
+			continue;
+
+		auto dest = root / c.path;
+		PERF_COUNT(syscalls, 1);
+		fs::remove(dest);
+		if (c.status != 'D')
+			continue;
+
+		// Directories left empty went away with their last file
+		auto dir = dest.parent_path();
+		while (dir != root && fs::is_directory(dir) && fs::is_empty(dir))
+		{
+			fs::remove(dir);
+			dir = dir.parent_path();
+		}
+	}
+
+	// Then write new and changed files, leaving all others untouched
+	std::vector<BlobCheckout> blobs;
+	for (const auto &c : changes)
+	{
+		auto dest = root / c.path;
+		if (c.status == 'D')
+			continue;
+
+		if (c.status == 'M' && c.old_sha == c.new_sha &&
+			is_file(c.old_mode) && is_file(c.new_mode))
+		{
+			auto perms = fs::status(dest).permissions();
+			auto exec = fs::perms::owner_exec | fs::perms::group_exec | fs::perms::others_exec;
+			fs::permissions(dest, c.new_mode == "100755" ? (perms | exec) : (perms & ~exec));
+			continue;
 		}
+
+		// Only empty directories can be left where a file goes
+		if (c.status == 'A' && c.new_mode != "160000" &&
+			fs::is_directory(fs::symlink_status(dest)))
+		{
+			fs::remove_all(dest);
+		}
+
+		fs::create_directories(dest.parent_path());
+		if (c.new_mode == "160000")
+			fs::create_directories(dest);
+		else
+			blobs.push_back({c.new_sha, c.new_mode, dest});
+	}
+	blobs_checkout(blobs);
+}
+
+fs::path
+GitRepository::checkout_record_file(const std::string &path) const
+{
+	SHA1 hasher;
+	hasher.update(fs::canonical(path).string());
+	return repo_path("checkouts") / hasher.final();
+}
+
+SparseMatcher
+GitRepository::sparse_checkout(bool cone) const
+{
+	auto file = repo_path("info/sparse-checkout");
+	if (!fs::is_regular_file(file))
+		throw GitException("No sparse checkout patterns in " + file.string());
+	return SparseMatcher::read(file.string(), cone);
+}
+
+std::string
+GitRepository::sparse_id(const SparseMatcher *sparse)
+{
+	if (sparse == nullptr)
+		return std::string();
+	SHA1 hasher;
+	hasher.update(sparse->describe());
+	return hasher.final();
+}
+
+std::string
+GitRepository::checkout_recorded(const std::string &path) const
+{
+	std::string tree;
+	std::ifstream f(checkout_record_file(path).string());
+	if (f.is_open())
+	{
+		std::getline(f, tree);
+	}
+	return tree;
+}
+
+bool
+GitRepository::checkout_recorded_sparse(const std::string &path,
+	const SparseMatcher *sparse) const
+{
+	// Third line of the record, after the tree and the path
+	std::string line;
+	std::string patterns;
+	std::ifstream f(checkout_record_file(path).string());
+	if (f.is_open())
+	{
+		std::getline(f, line);
+		std::getline(f, line);
+		std::getline(f, patterns);
+	}
+	return patterns == sparse_id(sparse);
+}
+
+void
+GitRepository::checkout_record(const std::string &path, const std::string &tree,
+	const SparseMatcher *sparse)
+{
+	auto record = checkout_record_file(path);
+	repo_dir("checkouts", true);
+	std::ofstream f(record.string());
+	if (f.is_open())
+	{
+		f << tree << std::endl <<
+			fs::canonical(path).string() << std::endl;
+		if (sparse)
+			f << sparse_id(sparse) << std::endl;
+	}
+}
+
+std::vector<std::string>
+GitRepository::checkout_trees() const
+{
+	std::vector<std::string> trees;
+	auto dir = repo_path("checkouts");
+	if (!fs::is_directory(dir))
+		return trees;
+	for (auto &f : fs::directory_iterator(dir))
+	{
+		std::string tree;
+		std::ifstream in(f.path().string());
+		if (std::getline(in, tree) && !tree.empty())
+			trees.push_back(tree);
 	}
+	return trees;
 }
 
 std::string
@@ -459,20 +1412,33 @@ GitRepository::ref_resolve(const std::string &ref) const
 {
 	std::string line;
 
-	// Is it a packed ref?
-	auto it = m_packed_refs.find(ref);
-	if (it != m_packed_refs.end())
+	if (m_reftable)
 	{
-		return it->second;
+		Reftable::Record rec;
+		if (!m_reftable->find(ref, rec))
+			return line;
+		return rec.type == Reftable::Record::symref ? ref_resolve(rec.target) : rec.sha;
 	}
 
-	// Accept ref with or without directory path
-	std::ifstream f(ref);
-	if (!f.is_open())
+	// Accept ref with or without directory path, preferring
+	// the ref in the repository.  A loose ref overrides a packed
+	// one, it was written after the refs were packed.
+	PERF_COUNT(syscalls, 1);
+	std::ifstream f;
+	auto refpath = repo_file(ref);
+	if (!refpath.empty() && fs::is_regular_file(refpath))
 	{
-		auto refpath = repo_file(ref);
 		f.open(refpath.string());
 	}
+	if (!f.is_open())
+	{
+		auto it = m_packed_refs.find(ref);
+		if (it != m_packed_refs.end())
+		{
+			return it->second;
+		}
+		f.open(ref);
+	}
 	if (f.is_open())
 	{
 		std::getline(f, line);
@@ -491,44 +1457,202 @@ GitRepository::ref_resolve(const std::string &ref) const
 	return line;
 }
 
-std::map<std::string, std::string>
+const std::map<std::string, std::string> &
 GitRepository::packed_ref_list() const
 {
 	return m_packed_refs;
 }
 
-std::map<std::string, GitRef>
-GitRepository::ref_list(const std::string &path) const
+fs::path
+GitRepository::gitdir() const
 {
-	std::map<std::string, GitRef> ret;
+	return m_gitdir;
+}
 
-	std::string path2;
-	if (path.empty())
+const ReftableStack *
+GitRepository::reftable() const
+{
+	return m_reftable.get();
+}
+
+bool
+GitRepository::ref_exists(const std::string &ref) const
+{
+	if (m_reftable)
 	{
-		path2 = repo_dir("refs").string();
+		Reftable::Record rec;
+		return m_reftable->find(ref, rec);
 	}
-	else
+	return m_packed_refs.find(ref) != m_packed_refs.end() ||
+		fs::is_regular_file(repo_path(ref));
+}
+
+std::string
+GitRepository::ref_target(const std::string &ref) const
+{
+	std::string name = ref;
+	// Give up on loops like git does
+	for (int depth = 0; depth < 5; depth++)
 	{
-		path2 = path;
+		std::string target;
+		if (m_reftable)
+		{
+			Reftable::Record rec;
+			if (m_reftable->find(name, rec) && rec.type == Reftable::Record::symref)
+				target = rec.target;
+		}
+		else
+		{
+			std::ifstream f(repo_path(name).string());
+			std::string line;
+			if (std::getline(f, line) && line.find("ref: ") == 0)
+				target = line.substr(5);
+		}
+		if (target.empty())
+			return name;
+		name = target;
 	}
+	throw GitException("Symbolic reference loop at " + ref);
+}
+
+std::string
+GitRepository::ref_lock(const std::string &ref)
+{
+	// The lock file keeps out other writers until it is renamed over
+	// the reference or removed
+	auto lock = repo_file(ref + ".lock", true).string();
+	int fd = open(lock.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+	if (fd < 0)
+		throw GitException("Unable to lock " + ref);
+	close(fd);
+	return lock;
+}
 
-	for(auto &f : fs::directory_iterator(path2))
+void
+GitRepository::ref_write_file(const std::string &ref, const std::string &sha,
+	const std::string &lock)
+{
+	auto path = repo_path(ref);
+	if (!sha.empty())
 	{
-		GitRef entry;
-		auto can = f.path();
-		if (fs::is_directory(can))
+		int fd = open(lock.c_str(), O_WRONLY | O_TRUNC | O_CLOEXEC);
+		std::string line = sha + "\n";
+		bool ok = fd >= 0 && write(fd, line.data(), line.size()) == static_cast<ssize_t>(line.size());
+		ok = fd >= 0 && close(fd) == 0 && ok;
+		if (!ok || std::rename(lock.c_str(), path.string().c_str()) != 0)
 		{
-			if (!fs::is_empty(can))
+			unlink(lock.c_str());
+			throw GitException("Cannot write reference " + ref);
+		}
+		return;
+	}
+
+	unlink(path.string().c_str());
+	if (m_packed_refs.erase(ref) == 0)
+	{
+		unlink(lock.c_str());
+		return;
+	}
+
+	auto packed = repo_path("packed-refs").string();
+	auto packed_lock = packed + ".lock";
+	int fd = open(packed_lock.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+	if (fd < 0)
+	{
+		unlink(lock.c_str());
+		throw GitException("Unable to lock " + packed);
+	}
+	close(fd);
+
+	// Other refs may have been packed since this repository was opened
+	m_packed_refs.clear();
+	read_packed_refs(packed);
+	m_packed_refs.erase(ref);
+	std::ofstream f(packed_lock);
+	f << "# pack-refs with: sorted " << std::endl;
+	for (const auto &r : m_packed_refs)
+		f << r.second << " " << r.first << std::endl;
+	f.close();
+	bool ok = f && std::rename(packed_lock.c_str(), packed.c_str()) == 0;
+	if (!ok)
+		unlink(packed_lock.c_str());
+	unlink(lock.c_str());
+	if (!ok)
+		throw GitException("Cannot write " + packed);
+}
+
+void
+GitRepository::ref_update(const std::vector<RefUpdate> &updates)
+{
+	PERF_SCOPE("ref_update");
+	static const std::string zero_id(40, '0');
+
+	// Updating a symbolic reference updates the one it points to
+	std::vector<RefUpdate> resolved(updates);
+	std::set<std::string> names;
+	for (auto &update : resolved)
+	{
+		update.name = ref_target(update.name);
+		if (!names.insert(update.name).second)
+			throw GitException("Multiple updates for reference " + update.name);
+	}
+	auto check = [&resolved](const GitRepository &repo) {
+		for (const auto &update : resolved)
+		{
+			if (update.old_sha.empty())
+				continue;
+			auto current = repo.ref_exists(update.name) ? repo.ref_resolve(update.name) : std::string();
+			if (update.old_sha == zero_id ? !current.empty() : current != update.old_sha)
 			{
-				entry.subref = ref_list(can.string());
-				ret[f.path().filename().string()] = entry;
+				throw GitException("Cannot update " + update.name + ": it is at " +
+					(current.empty() ? "nothing" : current) + " but expected " + update.old_sha);
 			}
 		}
-		else
+	};
+
+	if (!m_reftable)
+	{
+		// Lock all references before checking their old values, so
+		// that no other writer can change them in between
+		std::vector<std::string> locks;
+		size_t written = 0;
+		bool writing = false;
+		try
 		{
-			entry.ref = ref_resolve(can.string());
-			ret[f.path().filename().string()] = entry;
+			for (const auto &update : resolved)
+				locks.push_back(ref_lock(update.name));
+			auto packed = repo_file("packed-refs");
+			m_packed_refs.clear();
+			if (fs::exists(packed))
+				read_packed_refs(packed.string());
+			check(*this);
+			writing = true;
+			for (; written < resolved.size(); written++)
+				ref_write_file(resolved[written].name, resolved[written].new_sha, locks[written]);
 		}
+		catch (...)
+		{
+			// ref_write_file removes its own lock, also on failure
+			for (size_t i = writing ? written + 1 : 0; i < locks.size(); i++)
+			{
+				unlink(locks[i].c_str());
+			}
+			throw;
+		}
+		return;
 	}
-	return ret;
+
+	std::vector<Reftable::Record> records;
+	for (const auto &update : resolved)
+	{
+		Reftable::Record rec;
+		rec.name = update.name;
+		rec.type = update.new_sha.empty() ? Reftable::Record::deletion : Reftable::Record::value;
+		rec.sha = update.new_sha;
+		records.push_back(rec);
+	}
+	// The check runs with the stack reread under its lock
+	m_reftable->add(records, [this, &check](const ReftableStack &) {
+		check(*this);
+	});
 }
@@ -17,20 +17,53 @@ namespace fs = std::experimental::filesystem;
 #endif
 
 #include "ConfigParser.h"
-#include "GitRef.h"
 
 class GitObject;
+class ObjectCache;
+class TreePathCache;
+class LooseObjectFilter;
+class SharedObjectCache;
+class SparseMatcher;
+class GitPack;
+class CommitGraph;
+class ReftableStack;
 
 /**
  * \brief A git repository
+ *
+ * Concurrency: once constructed, one instance may be shared by many
+ * threads calling object_read(), object_info(), ref_resolve(),
+ * packed_ref_list(), tree_checkout() and the other read-only
+ * operations.  Configuration and packed-refs are read once by the
+ * constructor and never modified afterwards; parsed objects are
+ * shared through a sharded cache.  Objects returned by object_read()
+ * may be shared with other threads and must not be modified.
+ * Writers (object_write(), object_hash() with actually_write) may run
+ * concurrently with readers, as each object is written to a temporary
+ * file and renamed into place, so it appears complete or not at all.
+ * ref_update() must not run concurrently with other threads.
  */
 class GitRepository
 {
 public:
+	//! Change of a reference, its deletion if new_sha is empty.
+	struct RefUpdate
+	{
+		std::string name;
+		std::string new_sha;
+		//! Expected current value: empty for any, all zeros for none.
+		std::string old_sha;
+	};
+
 	GitRepository(const std::string &path, bool force = false);
 
-	//! Create a new repository at path.
-	static GitRepository repo_create(const std::string path);
+	GitRepository(GitRepository &&other);
+
+	~GitRepository();
+
+	//! Create a new repository at path, storing references in
+	//! reftables instead of files if reftable is set.
+	static GitRepository repo_create(const std::string path, bool reftable = false);
 
 	//! Search up through directory tree for repo's gitdir
 	static GitRepository repo_find(const std::string &path = ".",
@@ -39,34 +72,150 @@ public:
 	//! Read object object_id from Git repository repo.
 	std::shared_ptr<GitObject> object_read(const std::string &sha);
 
+	//! Is there an object sha, loose or packed?  Most missing objects
+	//! cost one stat of their directory.  With quick they cost no
+	//! system call, but objects other processes wrote since the
+	//! directory was read may be missed.
+	bool has_object(const std::string &sha, bool quick = false);
+
+	//! Read type and size of object without reading all its data,
+	//! optionally also the first head_size bytes of data into head.
+	bool object_info(const std::string &sha, std::string &fmt, size_t &size,
+		std::vector<unsigned char> *head = nullptr, size_t head_size = 0);
+
+	//! Read type and raw data of object sha, loose or packed.
+	bool object_data(const std::string &sha, std::string &fmt,
+		std::vector<unsigned char> &data);
+
 	//! Write object to Git repository repo.
 	std::string object_write(std::shared_ptr<GitObject> obj, bool actually_write = true);
 
 	//! Generate hash for file and optionally write file to repo.
 	std::string object_hash(std::ifstream &f, const std::string &fmt, bool actually_write = false);
 
+	//! Resolve name to an object id, optionally following tags and
+	//! commits until reaching an object of type fmt.  A name
+	//! rev:path is the object at path in the tree of rev.
 	std::string object_find(const std::string &name,
 		const std::string &fmt = "",
 		bool follow = true);
 
-	//! Write tree object to empty directory.
-	void tree_checkout(std::shared_ptr<GitObject> obj, const std::string &path);
+	//! Id of the object at path below tree, or empty string if there
+	//! is none.  The subtrees passed on the way are cached.
+	std::string tree_lookup(const std::string &tree, const std::string &path);
+
+	//! Write tree sha to empty directory, only the paths included
+	//! by sparse if given.  prefix is the path of the tree within the
+	//! checkout, for matching against sparse.
+	void tree_checkout(const std::string &sha, const std::string &path,
+		const SparseMatcher *sparse = nullptr,
+		const std::string &prefix = std::string());
+
+	//! Change files in path from tree old_tree to new_tree, only
+	//! writing, deleting or changing the mode of the paths that differ.
+	//! Both trees must have been checked out with the same sparse.
+	//! Throws GitException, changing nothing, if a file that differs
+	//! was modified in path or an added one exists there already.
+	void tree_switch(const std::string &old_tree, const std::string &new_tree,
+		const std::string &path, const SparseMatcher *sparse = nullptr);
+
+	//! Read the sparse checkout patterns in info/sparse-checkout.
+	SparseMatcher sparse_checkout(bool cone) const;
+
+	//! Tree last checked out to directory path, or empty string.
+	std::string checkout_recorded(const std::string &path) const;
+
+	//! Was directory path checked out with the same sparse patterns,
+	//! or without any if sparse is null?
+	bool checkout_recorded_sparse(const std::string &path,
+		const SparseMatcher *sparse) const;
+
+	//! Remember tree checked out to directory path, and an id of the
+	//! sparse patterns used, if any.
+	void checkout_record(const std::string &path, const std::string &tree,
+		const SparseMatcher *sparse = nullptr);
+
+	//! Trees recorded by checkout_record() for all directories.
+	std::vector<std::string> checkout_trees() const;
+
+	//! Directory holding loose objects and packs.
+	fs::path object_dir() const;
+
+	//! Ids of all loose objects.
+	std::vector<std::string> loose_objects() const;
+
+	//! Packfiles of the repository, newest first.
+	const std::vector<std::unique_ptr<GitPack> > &packs() const;
+
+	//! System, global and repository configuration, read once by the
+	//! constructor.
+	const ConfigParser &config() const;
+
+	//! The commit-graph file, or null if there is none.
+	const CommitGraph *commit_graph() const;
+
+	//! Path of the commit-graph file.
+	fs::path commit_graph_path() const;
+
+	//! Directory holding packfiles, created if missing.
+	fs::path pack_dir() const;
+
+	//! Delete all packs but pack-<pack_sha>, and the loose objects
+	//! it contains.  Objects only in the deleted packs are written as
+	//! loose objects with the time of their pack, counted in unpacked.
+	//! Returns the number of loose objects deleted.
+	size_t prune_packed(const std::string &pack_sha, size_t &unpacked);
 
-	//! Read packed references.
-	std::map<std::string, std::string> packed_ref_list() const;
+	//! Packed references, sorted by name.
+	const std::map<std::string, std::string> &packed_ref_list() const;
 
-	//! Read references.
-	std::map<std::string, GitRef> ref_list(const std::string &path = std::string()) const;
+	//! Read reference from file, following symbolic references.
+	std::string ref_resolve(const std::string &ref) const;
+
+	//! Apply updates to references, throws GitException if one does
+	//! not have its expected old value.  With reftables all are
+	//! applied or none, with files each is applied separately.
+	void ref_update(const std::vector<RefUpdate> &updates);
+
+	//! The reftable stack holding the references, or null if they are
+	//! stored in files.
+	const ReftableStack *reftable() const;
+
+	//! The .git directory.
+	fs::path gitdir() const;
 
 private:
 	std::string m_worktree;
 	fs::path m_gitdir;
+	ConfigParser m_config;
 	//! ref to sha lookup table.
 	std::map<std::string, std::string> m_packed_refs;
+	//! Parsed trees and commits, shared between threads.
+	std::unique_ptr<ObjectCache> m_cache;
+	//! Subtrees found by tree_lookup().
+	std::unique_ptr<TreePathCache> m_tree_paths;
+	//! Loose objects that certainly do not exist.
+	std::unique_ptr<LooseObjectFilter> m_loose;
+	//! Inflated objects shared with other processes, if enabled by
+	//! wyag.sharedCache.
+	std::unique_ptr<SharedObjectCache> m_shared_cache;
+	//! Packfiles in objects/pack, newest first.
+	std::vector<std::unique_ptr<GitPack> > m_packs;
+	std::unique_ptr<CommitGraph> m_commit_graph;
+	std::unique_ptr<ReftableStack> m_reftable;
 
 	//! Read all packed-refs into lookup table.
 	void read_packed_refs(const std::string &path);
 
+	//! Open all packfiles having an index.
+	void read_packs();
+
+	//! Map the cache of objects shared between processes.
+	void open_shared_cache();
+
+	//! Open objects/info/commit-graph if it exists.
+	void read_commit_graph();
+
 	//! Compute path under repo's gitdir.
 	fs::path repo_path(const std::string &path) const;
 
@@ -79,7 +228,22 @@ private:
 		bool mkdir = false) const;
 
 	//! Get default configuration for new repository.
-	ConfigParser repo_default_config();
+	ConfigParser repo_default_config(bool reftable);
+
+	//! Does reference ref exist?
+	bool ref_exists(const std::string &ref) const;
+
+	//! Name of the reference ref finally points to, following
+	//! symbolic references.
+	std::string ref_target(const std::string &ref) const;
+
+	//! Create the lock file of loose reference ref, returning its path.
+	std::string ref_lock(const std::string &ref);
+
+	//! Write value sha to the loose reference ref, or delete it and
+	//! its packed copy if sha is empty, and release lock.
+	void ref_write_file(const std::string &ref, const std::string &sha,
+		const std::string &lock);
 
 	//! Compress bytes using zlib
 	std::vector<unsigned char> compress_bytes(const std::vector<unsigned char> &bytes);
@@ -87,8 +251,48 @@ private:
 	//! Decompress zlib compressed bytes
 	std::vector<unsigned char> uncompress_bytes(const std::vector<unsigned char> &bytes);
 
-	//! Read reference from file.
-	std::string ref_resolve(const std::string &ref) const;
+	//! A blob to write to the worktree.
+	struct BlobCheckout
+	{
+		std::string sha;
+		std::string mode;
+		fs::path dest;
+	};
+
+	//! Write blobs to their files, as symbolic links or executables
+	//! depending on mode.  Loose objects are read and the files are
+	//! written many at a time with AsyncIO.  Throws GitException
+	//! listing the files that could not be read or written.
+	void blobs_checkout(const std::vector<BlobCheckout> &blobs);
+
+	//! File under gitdir recording what was checked out to path.
+	fs::path checkout_record_file(const std::string &path) const;
+
+	//! Hash of sparse patterns for the checkout record, or empty.
+	static std::string sparse_id(const SparseMatcher *sparse);
+
+	//! Read whole file containing loose object.
+	std::vector<unsigned char> read_loose_object(const std::string &sha) const;
+
+	//! Write loose object sha with header and data raw through a
+	//! temporary file, so that readers never see part of it.  A
+	//! nonzero mtime becomes its modification time.
+	bool loose_object_write(const std::string &sha, const std::vector<unsigned char> &raw,
+		time_t mtime = 0);
+
+	//! Path of the file for loose object sha.
+	fs::path loose_object_path(const std::string &sha) const;
+
+	//! Inflate loose object file contents into type and data.
+	bool loose_object_data(const std::vector<unsigned char> &bytes, std::string &fmt,
+		std::vector<unsigned char> &data);
+
+	//! Read type and data of object sha from the packs.
+	bool packed_object_data(const std::string &sha, std::string &fmt,
+		std::vector<unsigned char> &data);
+
+	//! Resolve hash, abbreviated hash or reference name to object id.
+	std::string object_resolve(const std::string &name) const;
 };
 
 #endif
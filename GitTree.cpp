@@ -5,6 +5,7 @@
 
 #include "GitTree.h"
 #include "GitException.h"
+#include "PerfTrace.h"
 
 GitTree::GitTree(GitRepository *repo) :
 	GitObject(repo, "tree")
@@ -33,6 +34,7 @@ GitTree::serialize()
 void
 GitTree::deserialize(const std::vector<unsigned char> &data)
 {
+	PERF_SCOPE("tree_parse");
 	m_items = tree_parse(data);
 }
 
@@ -91,7 +93,7 @@ GitTree::tree_parse(const std::vector<unsigned char> &raw)
 	return ret;
 }
 
-std::vector<GitTreeLeaf>
+const std::vector<GitTreeLeaf> &
 GitTree::get_items() const
 {
 	return m_items;
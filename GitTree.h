@@ -16,7 +16,7 @@ public:
 
 	void deserialize(const std::vector<unsigned char> &data);
 
-	std::vector<GitTreeLeaf> get_items() const;
+	const std::vector<GitTreeLeaf> &get_items() const;
 private:
 
 	std::tuple<size_t, GitTreeLeaf>
@@ -18,6 +18,12 @@ public:
 	{
 	};
 
+	//! Does this leaf point to a subtree?
+	bool is_tree() const
+	{
+		return mode == "40000" || mode == "040000";
+	};
+
 	std::string mode;
 	std::string path;
 	std::string sha;
@@ -0,0 +1,254 @@
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+
+#include "GrepMatcher.h"
+#include "GitException.h"
+
+//! Characters with a special meaning in basic regular expressions.
+static const std::string regex_special(".[]*^$\\");
+
+GrepMatcher::GrepMatcher(const std::vector<std::string> &patterns,
+	bool ignore_case)
+{
+	auto flags = std::regex::ECMAScript | std::regex::optimize;
+	if (ignore_case)
+		flags |= std::regex::icase;
+
+	for (const auto &p : patterns)
+	{
+		Pattern pattern;
+		pattern.literal = required_literal(p, pattern.is_literal);
+		if (ignore_case)
+		{
+			// memmem cannot ignore case
+			pattern.literal.clear();
+			pattern.is_literal = false;
+		}
+		try
+		{
+			if (!pattern.is_literal)
+				pattern.regex = std::regex(to_ecmascript(p), flags);
+		}
+		catch (const std::regex_error &e)
+		{
+			throw GitException("Invalid pattern: " + p + ": " + e.what());
+		}
+		m_patterns.push_back(pattern);
+	}
+}
+
+std::string
+GrepMatcher::to_ecmascript(const std::string &pattern)
+{
+	std::string out;
+	// '^' is an anchor and '*' an ordinary character at the start
+	// of the pattern, of a group and of an alternative
+	bool at_start = true;
+	size_t n = pattern.size();
+	for (size_t i = 0; i < n; i++)
+	{
+		char c = pattern.at(i);
+		bool start = at_start;
+		at_start = false;
+		if (c == '\\' && i + 1 < n)
+		{
+			char d = pattern.at(++i);
+			if (d == '(' || d == '|')
+			{
+				out += d;
+				at_start = true;
+			}
+			else if (std::strchr(")+?{}", d))
+				out += d;
+			else if (d == '<' || d == '>')
+				out += "\\b";
+			else if (std::isalnum(static_cast<unsigned char>(d)) &&
+				!std::strchr("wWsSbB123456789", d))
+			{
+				// Not special in grep either
+				out += d;
+			}
+			else
+			{
+				out += '\\';
+				out += d;
+			}
+		}
+		else if (c == '[')
+		{
+			// Backslashes are ordinary in brackets, and ']' is too
+			// right after the '[' or '[^'
+			size_t j = i + 1;
+			out += '[';
+			if (j < n && pattern.at(j) == '^')
+				out += pattern.at(j++);
+			if (j < n && pattern.at(j) == ']')
+			{
+				out += "\\]";
+				j++;
+			}
+			while (j < n && pattern.at(j) != ']')
+			{
+				char e = pattern.at(j);
+				if (e == '[' && j + 1 < n && std::strchr(":.=", pattern.at(j + 1)))
+				{
+					// Classes like [:alpha:] are the same in both
+					auto close = pattern.find(std::string(1, pattern.at(j + 1)) + "]", j + 2);
+					if (close == std::string::npos)
+						break;
+					out += pattern.substr(j, close + 2 - j);
+					j = close + 2;
+					continue;
+				}
+				if (e == '\\' || e == '[')
+					out += '\\';
+				out += e;
+				j++;
+			}
+			if (j >= n)
+				throw std::regex_error(std::regex_constants::error_brack);
+			out += ']';
+			i = j;
+		}
+		else if (c == '^' && start)
+		{
+			out += c;
+			at_start = true;
+		}
+		else if (c == '$')
+		{
+			bool end = i + 1 == n || (pattern.at(i + 1) == '\\' && i + 2 < n &&
+				(pattern.at(i + 2) == ')' || pattern.at(i + 2) == '|'));
+			out += end ? "$" : "\\$";
+		}
+		else if ((c == '*' && start) || c == '^' ||
+			(c != '\0' && std::strchr("+?|(){}]/", c)))
+		{
+			out += '\\';
+			out += c;
+		}
+		else
+		{
+			out += c;
+		}
+	}
+	return out;
+}
+
+std::string
+GrepMatcher::required_literal(const std::string &pattern, bool &is_literal)
+{
+	is_literal = pattern.find_first_of(regex_special) == std::string::npos;
+	if (is_literal)
+		return pattern;
+
+	// Escapes may start groups or alternatives, don't guess
+	if (pattern.find('\\') != std::string::npos)
+		return std::string();
+
+	// Find the longest run of ordinary characters outside brackets.
+	// A character followed by '*' is optional, so it ends the run.
+	std::string best;
+	std::string run;
+	bool in_bracket = false;
+	for (size_t i = 0; i < pattern.size(); i++)
+	{
+		char c = pattern.at(i);
+		if (in_bracket)
+		{
+			if (c == ']')
+				in_bracket = false;
+			continue;
+		}
+		bool optional = i + 1 < pattern.size() && pattern.at(i + 1) == '*';
+		if (regex_special.find(c) != std::string::npos || optional)
+		{
+			if (run.size() > best.size())
+				best = run;
+			run.clear();
+			if (c == '[')
+			{
+				in_bracket = true;
+				// ']' right after '[' or '[^' is part of the set
+				if (i + 1 < pattern.size() && pattern.at(i + 1) == '^')
+					i++;
+				if (i + 1 < pattern.size() && pattern.at(i + 1) == ']')
+					i++;
+			}
+		}
+		else
+		{
+			run.push_back(c);
+		}
+	}
+	if (run.size() > best.size())
+		best = run;
+	return best;
+}
+
+void
+GrepMatcher::match_pattern(const Pattern &pattern,
+	const char *data, size_t len,
+	std::vector<size_t> &starts) const
+{
+	const char *end = data + len;
+	const char *pos = data;
+	while (pos < end)
+	{
+		const char *line;
+		if (!pattern.literal.empty())
+		{
+			// Jump straight to the next line containing the literal
+			auto hit = static_cast<const char *>(memmem(pos, end - pos,
+				pattern.literal.data(), pattern.literal.size()));
+			if (hit == nullptr)
+				return;
+			line = hit;
+			while (line > pos && line[-1] != '\n')
+				line--;
+		}
+		else
+		{
+			line = pos;
+		}
+		auto nl = static_cast<const char *>(std::memchr(line, '\n', end - line));
+		const char *line_end = nl ? nl : end;
+
+		if (pattern.is_literal ||
+			std::regex_search(line, line_end, pattern.regex))
+		{
+			starts.push_back(line - data);
+		}
+		pos = line_end + 1;
+	}
+}
+
+void
+GrepMatcher::match(const unsigned char *data, size_t len,
+	const std::function<void(size_t, std::string_view)> &found) const
+{
+	auto text = reinterpret_cast<const char *>(data);
+	std::vector<size_t> starts;
+	for (const auto &p : m_patterns)
+	{
+		match_pattern(p, text, len, starts);
+	}
+	if (m_patterns.size() > 1)
+	{
+		std::sort(starts.begin(), starts.end());
+		starts.erase(std::unique(starts.begin(), starts.end()), starts.end());
+	}
+
+	// Count lines only between matches
+	size_t line_number = 1;
+	size_t counted = 0;
+	for (auto start : starts)
+	{
+		line_number += std::count(text + counted, text + start, '\n');
+		counted = start;
+		auto nl = static_cast<const char *>(std::memchr(text + start, '\n', len - start));
+		size_t line_len = (nl ? nl - text : len) - start;
+		found(line_number, std::string_view(text + start, line_len));
+	}
+}
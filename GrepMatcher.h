@@ -0,0 +1,57 @@
+#ifndef GREP_MATCHER_H
+#define GREP_MATCHER_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <regex>
+#include <functional>
+
+/**
+ * \brief Finds lines matching any of a set of basic regular expressions.
+ *
+ * Like GNU grep, \| separates alternatives, \+ and \? repeat, and
+ * \< and \> match at word boundaries.  The patterns are translated to
+ * ECMAScript syntax, as std::regex::basic knows none of these.
+ * Patterns without regex metacharacters are searched for with
+ * memmem().  For the others, the longest literal every match must
+ * contain is searched for first and only the lines containing it are
+ * run through std::regex.
+ */
+class GrepMatcher
+{
+public:
+	//! Throws GitException for an invalid pattern.
+	GrepMatcher(const std::vector<std::string> &patterns,
+		bool ignore_case = false);
+
+	//! Call found(line_number, line) for each matching line, in order.
+	//! Line numbers start at 1, lines exclude their '\n'.
+	void match(const unsigned char *data, size_t len,
+		const std::function<void(size_t, std::string_view)> &found) const;
+
+private:
+	struct Pattern
+	{
+		//! Text every match contains, empty if none known.
+		std::string literal;
+		//! Is the literal the whole pattern?
+		bool is_literal;
+		std::regex regex;
+	};
+
+	std::vector<Pattern> m_patterns;
+
+	//! The basic regular expression pattern in ECMAScript syntax.
+	static std::string to_ecmascript(const std::string &pattern);
+
+	static std::string required_literal(const std::string &pattern,
+		bool &is_literal);
+
+	//! Append offsets of the starts of lines matching pattern.
+	void match_pattern(const Pattern &pattern,
+		const char *data, size_t len,
+		std::vector<size_t> &starts) const;
+};
+
+#endif
@@ -0,0 +1,391 @@
+#include <algorithm>
+#include <cstring>
+#include <unordered_map>
+
+#include "LineDiff.h"
+#include "PerfTrace.h"
+
+//! Lines occurring more often than this are not used as anchors
+//! by the histogram algorithm.
+static const size_t max_chain_length = 64;
+
+//! Only the start of a file is searched for NUL bytes, like git.
+static const size_t binary_check_size = 8000;
+
+//! Same as git's default core.bigFileThreshold.
+static const size_t big_file_threshold = 512 * 1024 * 1024;
+
+LineDiff::LineDiff(Algorithm algorithm, size_t context) :
+	m_algorithm(algorithm),
+	m_context(context)
+{
+}
+
+bool
+LineDiff::is_binary(const unsigned char *data, size_t len)
+{
+	if (len > big_file_threshold)
+		return true;
+	return std::memchr(data, '\0', std::min(len, binary_check_size)) != nullptr;
+}
+
+void
+LineDiff::split_lines(const unsigned char *data, size_t len,
+	std::vector<std::string_view> &lines)
+{
+	// Each line keeps its '\n', so that a missing newline at
+	// the end of a file counts as a change.
+	lines.clear();
+	const char *p = reinterpret_cast<const char *>(data);
+	const char *end = p + len;
+	while (p < end)
+	{
+		auto nl = static_cast<const char *>(std::memchr(p, '\n', end - p));
+		const char *next = nl ? nl + 1 : end;
+		lines.emplace_back(p, next - p);
+		p = next;
+	}
+}
+
+void
+LineDiff::tokenize()
+{
+	std::unordered_map<std::string_view, int> ids;
+	ids.reserve(m_lines_a.size() + m_lines_b.size());
+
+	auto intern = [&ids](const std::vector<std::string_view> &lines,
+		std::vector<int> &tokens)
+	{
+		tokens.resize(lines.size());
+		for (size_t i = 0; i < lines.size(); i++)
+		{
+			auto it = ids.emplace(lines[i], ids.size());
+			tokens[i] = it.first->second;
+		}
+	};
+	intern(m_lines_a, m_a);
+	intern(m_lines_b, m_b);
+}
+
+bool
+LineDiff::unified(const unsigned char *a, size_t alen,
+	const unsigned char *b, size_t blen,
+	std::ostream &out)
+{
+	PERF_SCOPE("line_diff");
+	split_lines(a, alen, m_lines_a);
+	split_lines(b, blen, m_lines_b);
+	tokenize();
+
+	m_changed_a.assign(m_a.size(), false);
+	m_changed_b.assign(m_b.size(), false);
+	if (m_algorithm == Algorithm::histogram)
+		histogram(0, m_a.size(), 0, m_b.size());
+	else
+		myers(0, m_a.size(), 0, m_b.size());
+
+	bool changed = std::find(m_changed_a.begin(), m_changed_a.end(), true) != m_changed_a.end() ||
+		std::find(m_changed_b.begin(), m_changed_b.end(), true) != m_changed_b.end();
+	if (changed)
+	{
+		write_hunks(out);
+	}
+	return changed;
+}
+
+void
+LineDiff::myers(int a0, int a1, int b0, int b1)
+{
+	// Skip common prefix and suffix
+	while (a0 < a1 && b0 < b1 && m_a[a0] == m_b[b0])
+	{
+		a0++;
+		b0++;
+	}
+	while (a0 < a1 && b0 < b1 && m_a[a1 - 1] == m_b[b1 - 1])
+	{
+		a1--;
+		b1--;
+	}
+	if (a0 == a1 || b0 == b1)
+	{
+		std::fill(m_changed_a.begin() + a0, m_changed_a.begin() + a1, true);
+		std::fill(m_changed_b.begin() + b0, m_changed_b.begin() + b1, true);
+		return;
+	}
+
+	// Find the middle snake by searching forwards from the start and
+	// backwards from the end at the same time, then recurse on the
+	// parts before and after it.  This needs only linear space.
+	int n = a1 - a0;
+	int m = b1 - b0;
+	int delta = n - m;
+	bool odd = (delta & 1) != 0;
+	int max = (n + m + 1) / 2;
+	int off = max + 1;
+	m_vf.assign(2 * max + 3, -1);
+	m_vb.assign(2 * max + 3, -1);
+	m_vf[off + 1] = 0;
+	m_vb[off + 1] = 0;
+
+	// Furthest reaching x on diagonal k, or -1 if k is unreachable
+	auto extend = [n, m, off](std::vector<int> &v, int k) -> int
+	{
+		int down = v[off + k + 1];
+		int right = v[off + k - 1] >= 0 ? v[off + k - 1] + 1 : -1;
+		if (down >= 0 && down - k > m)
+			down = -1;
+		if (right > n)
+			right = -1;
+		return std::max(down, right);
+	};
+
+	int sx0 = 0, sy0 = 0, sx1 = 0, sy1 = 0;
+	bool found = false;
+	for (int d = 0; d <= max && !found; d++)
+	{
+		for (int k = -d; k <= d && !found; k += 2)
+		{
+			int x = extend(m_vf, k);
+			if (x < 0)
+			{
+				m_vf[off + k] = -1;
+				continue;
+			}
+			int xs = x;
+			while (x < n && x - k < m && m_a[a0 + x] == m_b[b0 + x - k])
+				x++;
+			m_vf[off + k] = x;
+
+			int kb = delta - k;
+			if (odd && kb >= -(d - 1) && kb <= d - 1 &&
+				m_vb[off + kb] >= 0 && x + m_vb[off + kb] >= n)
+			{
+				sx0 = xs;
+				sy0 = xs - k;
+				sx1 = x;
+				sy1 = x - k;
+				found = true;
+			}
+		}
+		for (int k = -d; k <= d && !found; k += 2)
+		{
+			int x = extend(m_vb, k);
+			if (x < 0)
+			{
+				m_vb[off + k] = -1;
+				continue;
+			}
+			int xs = x;
+			while (x < n && x - k < m && m_a[a1 - 1 - x] == m_b[b1 - 1 - (x - k)])
+				x++;
+			m_vb[off + k] = x;
+
+			int kf = delta - k;
+			if (!odd && kf >= -d && kf <= d &&
+				m_vf[off + kf] >= 0 && x + m_vf[off + kf] >= n)
+			{
+				sx0 = n - x;
+				sy0 = m - (x - k);
+				sx1 = n - xs;
+				sy1 = m - (xs - k);
+				found = true;
+			}
+		}
+	}
+
+	if (!found || (sx0 == n && sy0 == m) || (sx1 == 0 && sy1 == 0))
+	{
+		// Cannot happen for a correct split, but never loop forever
+		std::fill(m_changed_a.begin() + a0, m_changed_a.begin() + a1, true);
+		std::fill(m_changed_b.begin() + b0, m_changed_b.begin() + b1, true);
+		return;
+	}
+
+	myers(a0, a0 + sx0, b0, b0 + sy0);
+	myers(a0 + sx1, a1, b0 + sy1, b1);
+}
+
+void
+LineDiff::histogram(int a0, int a1, int b0, int b1)
+{
+	// The part after each common region is handled by looping,
+	// only the part before it by recursion.
+	while (true)
+	{
+		while (a0 < a1 && b0 < b1 && m_a[a0] == m_b[b0])
+		{
+			a0++;
+			b0++;
+		}
+		while (a0 < a1 && b0 < b1 && m_a[a1 - 1] == m_b[b1 - 1])
+		{
+			a1--;
+			b1--;
+		}
+		if (a0 == a1 || b0 == b1)
+		{
+			std::fill(m_changed_a.begin() + a0, m_changed_a.begin() + a1, true);
+			std::fill(m_changed_b.begin() + b0, m_changed_b.begin() + b1, true);
+			return;
+		}
+
+		// Where each line of a occurs in this region
+		std::unordered_map<int, std::vector<int> > occurrences;
+		for (int i = a0; i < a1; i++)
+		{
+			occurrences[m_a[i]].push_back(i);
+		}
+
+		// Find the longest common region anchored on the lines
+		// that occur least often.
+		size_t best_count = max_chain_length + 1;
+		int best_a0 = 0, best_a1 = 0, best_b0 = 0, best_b1 = 0;
+		for (int j = b0; j < b1; )
+		{
+			auto it = occurrences.find(m_b[j]);
+			if (it == occurrences.end() || it->second.size() > max_chain_length)
+			{
+				j++;
+				continue;
+			}
+
+			int next_j = j + 1;
+			for (int i : it->second)
+			{
+				int as = i, bs = j;
+				while (as > a0 && bs > b0 && m_a[as - 1] == m_b[bs - 1])
+				{
+					as--;
+					bs--;
+				}
+				int ae = i + 1, be = j + 1;
+				while (ae < a1 && be < b1 && m_a[ae] == m_b[be])
+				{
+					ae++;
+					be++;
+				}
+
+				size_t count = best_count;
+				for (int k = as; k < ae; k++)
+				{
+					count = std::min(count, occurrences[m_a[k]].size());
+				}
+				if (count < best_count ||
+					(count == best_count && ae - as > best_a1 - best_a0))
+				{
+					best_count = count;
+					best_a0 = as;
+					best_a1 = ae;
+					best_b0 = bs;
+					best_b1 = be;
+				}
+				next_j = std::max(next_j, be);
+			}
+			j = next_j;
+		}
+
+		if (best_a1 == best_a0)
+		{
+			// Only frequent or no common lines, let Myers decide
+			myers(a0, a1, b0, b1);
+			return;
+		}
+
+		histogram(a0, best_a0, b0, best_b0);
+		a0 = best_a1;
+		b0 = best_b1;
+	}
+}
+
+void
+LineDiff::write_line(std::ostream &out, char prefix,
+	const std::string_view &line)
+{
+	out << prefix << line;
+	if (line.empty() || line.back() != '\n')
+	{
+		out << std::endl << "\\ No newline at end of file" << std::endl;
+	}
+}
+
+void
+LineDiff::write_hunks(std::ostream &out)
+{
+	struct Block
+	{
+		int a0, a1, b0, b1;
+	};
+
+	// Collect runs of changed lines, unchanged lines pair up in order
+	std::vector<Block> blocks;
+	int n = m_a.size();
+	int m = m_b.size();
+	int i = 0, j = 0;
+	while (i < n || j < m)
+	{
+		if (i < n && j < m && !m_changed_a[i] && !m_changed_b[j])
+		{
+			i++;
+			j++;
+			continue;
+		}
+		Block block{i, i, j, j};
+		while (i < n && m_changed_a[i])
+			i++;
+		while (j < m && m_changed_b[j])
+			j++;
+		block.a1 = i;
+		block.b1 = j;
+		if (block.a0 == block.a1 && block.b0 == block.b1)
+			break;
+		blocks.push_back(block);
+	}
+
+	auto range = [](int start, int count)
+	{
+		if (count == 1)
+			return std::to_string(start + 1);
+		if (count == 0)
+			return std::to_string(start) + ",0";
+		return std::to_string(start + 1) + "," + std::to_string(count);
+	};
+
+	int context = m_context;
+	size_t first = 0;
+	while (first < blocks.size())
+	{
+		// Merge blocks whose context would overlap into one hunk
+		size_t last = first;
+		while (last + 1 < blocks.size() &&
+			blocks[last + 1].a0 - blocks[last].a1 <= 2 * context)
+		{
+			last++;
+		}
+
+		int ha0 = std::max(0, blocks[first].a0 - context);
+		int ha1 = std::min(n, blocks[last].a1 + context);
+		int hb0 = blocks[first].b0 - (blocks[first].a0 - ha0);
+		int hb1 = blocks[last].b1 + (ha1 - blocks[last].a1);
+
+		out << "@@ -" << range(ha0, ha1 - ha0) <<
+			" +" << range(hb0, hb1 - hb0) << " @@" << std::endl;
+
+		int pos = ha0;
+		for (size_t k = first; k <= last; k++)
+		{
+			const auto &b = blocks[k];
+			for (; pos < b.a0; pos++)
+				write_line(out, ' ', m_lines_a[pos]);
+			for (int x = b.a0; x < b.a1; x++)
+				write_line(out, '-', m_lines_a[x]);
+			for (int y = b.b0; y < b.b1; y++)
+				write_line(out, '+', m_lines_b[y]);
+			pos = b.a1;
+		}
+		for (; pos < ha1; pos++)
+			write_line(out, ' ', m_lines_a[pos]);
+
+		first = last + 1;
+	}
+}
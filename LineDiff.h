@@ -0,0 +1,68 @@
+#ifndef LINE_DIFF_H
+#define LINE_DIFF_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <ostream>
+
+/**
+ * \brief Computes line differences between two buffers and writes
+ * them as unified diff hunks.
+ *
+ * Lines are split with memchr() and interned into integer tokens, so
+ * the diff algorithms only ever compare integers.  Lines refer
+ * directly into the caller's buffers, which must outlive the call.
+ */
+class LineDiff
+{
+public:
+	enum class Algorithm
+	{
+		myers,
+		histogram
+	};
+
+	LineDiff(Algorithm algorithm = Algorithm::myers, size_t context = 3);
+
+	//! Write hunks of differences between a and b to out.
+	//! Returns false if there were no differences.
+	bool unified(const unsigned char *a, size_t alen,
+		const unsigned char *b, size_t blen,
+		std::ostream &out);
+
+	//! Guess whether data is binary by searching for a NUL byte.
+	//! Data too big to diff line by line is treated as binary too.
+	static bool is_binary(const unsigned char *data, size_t len);
+
+private:
+	Algorithm m_algorithm;
+	size_t m_context;
+
+	std::vector<std::string_view> m_lines_a;
+	std::vector<std::string_view> m_lines_b;
+	std::vector<int> m_a;
+	std::vector<int> m_b;
+	std::vector<bool> m_changed_a;
+	std::vector<bool> m_changed_b;
+
+	//! Forward and backward furthest reaching paths for Myers.
+	std::vector<int> m_vf;
+	std::vector<int> m_vb;
+
+	static void split_lines(const unsigned char *data, size_t len,
+		std::vector<std::string_view> &lines);
+
+	void tokenize();
+
+	void myers(int a0, int a1, int b0, int b1);
+
+	void histogram(int a0, int a1, int b0, int b1);
+
+	void write_hunks(std::ostream &out);
+
+	void write_line(std::ostream &out, char prefix,
+		const std::string_view &line);
+};
+
+#endif
@@ -0,0 +1,206 @@
+#include <algorithm>
+#include <dirent.h>
+#include <time.h>
+
+#include "LooseObjectFilter.h"
+#include "PerfTrace.h"
+
+static int
+hex_value(char c)
+{
+	return c >= 'a' ? c - 'a' + 10 : c - '0';
+}
+
+//! 32 bits of the id from hex digit pos on.
+static uint32_t
+id_bits(const std::string &sha, size_t pos)
+{
+	uint32_t v = 0;
+	for (size_t i = pos; i < pos + 8; i++)
+		v = (v << 4) | hex_value(sha[i]);
+	return v;
+}
+
+static bool
+is_hex_id(const std::string &s)
+{
+	return s.size() == 40 && std::all_of(s.begin(), s.end(), [](char c) {
+		return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f');
+	});
+}
+
+LooseObjectFilter::LooseObjectFilter(const std::string &objects_dir, size_t max_missing) :
+	m_objects_dir(objects_dir),
+	m_max_missing(max_missing)
+{
+}
+
+//! The file system may not give a new modification time to changes
+//! this close to the last one.
+static bool
+too_recent(const struct timespec &mtime, const struct timespec &now)
+{
+	return now.tv_sec < mtime.tv_sec + 1 ||
+		(now.tv_sec == mtime.tv_sec + 1 && now.tv_nsec < mtime.tv_nsec);
+}
+
+static struct timespec
+dir_mtime(const std::string &path)
+{
+	PERF_COUNT(syscalls, 1);
+	struct stat st;
+	if (stat(path.c_str(), &st) != 0)
+		return {0, 0};
+	return st.st_mtim;
+}
+
+bool
+LooseObjectFilter::maybe_contains(const std::string &sha, bool revalidate)
+{
+	if (!is_hex_id(sha))
+		return false;
+
+	// The first two digits name the directory and are the same for
+	// all its objects, the bits come from the digits after them
+	size_t index = hex_value(sha[0]) << 4 | hex_value(sha[1]);
+	auto &f = m_fanouts[index];
+	std::lock_guard<std::mutex> lock(f.mutex);
+	if (!f.scanned)
+		scan(index);
+	if (!test_bits(f, sha) || f.missing.count(sha) != 0)
+	{
+		if (!revalidate)
+		{
+			PERF_COUNT(bloom_skips, 1);
+			return false;
+		}
+		// Another process may have written it since
+		if (changed(index))
+			scan(index);
+		if (!f.racy && (!test_bits(f, sha) || f.missing.count(sha) != 0))
+		{
+			PERF_COUNT(bloom_skips, 1);
+			return false;
+		}
+	}
+	return true;
+}
+
+void
+LooseObjectFilter::add(const std::string &sha)
+{
+	if (!is_hex_id(sha))
+		return;
+	size_t index = hex_value(sha[0]) << 4 | hex_value(sha[1]);
+	auto &f = m_fanouts[index];
+	std::lock_guard<std::mutex> lock(f.mutex);
+	f.missing.erase(sha);
+	if (!f.scanned)
+		return;
+	if (++f.entries > f.capacity)
+	{
+		// Too many false positives, read the directory again
+		f.scanned = false;
+		return;
+	}
+	set_bits(f, sha);
+}
+
+void
+LooseObjectFilter::add_missing(const std::string &sha)
+{
+	if (!is_hex_id(sha))
+		return;
+	size_t index = hex_value(sha[0]) << 4 | hex_value(sha[1]);
+	auto &f = m_fanouts[index];
+	std::lock_guard<std::mutex> lock(f.mutex);
+	if (f.missing.size() >= std::max<size_t>(16, m_max_missing / 256))
+		f.missing.clear();
+	f.missing.insert(sha);
+}
+
+std::string
+LooseObjectFilter::fanout_dir(size_t index) const
+{
+	static const char digits[] = "0123456789abcdef";
+	return m_objects_dir + "/" + digits[index >> 4] + digits[index & 15];
+}
+
+bool
+LooseObjectFilter::changed(size_t index)
+{
+	auto &f = m_fanouts[index];
+	auto mtime = dir_mtime(fanout_dir(index));
+	if (mtime.tv_sec != f.mtime.tv_sec || mtime.tv_nsec != f.mtime.tv_nsec)
+		return true;
+
+	// Reading a racy directory again is only worth it once its time
+	// is old enough to be trusted
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	return f.racy && !too_recent(mtime, now);
+}
+
+void
+LooseObjectFilter::scan(size_t index)
+{
+	// The time is taken first, a change while reading gives a new one
+	auto &f = m_fanouts[index];
+	auto path = fanout_dir(index);
+	f.mtime = dir_mtime(path);
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	f.racy = f.mtime.tv_sec != 0 && too_recent(f.mtime, now);
+
+	std::string prefix = path.substr(path.size() - 2);
+	std::vector<std::string> names;
+	PERF_COUNT(syscalls, 1);
+	DIR *dir = opendir(path.c_str());
+	if (dir)
+	{
+		while (struct dirent *e = readdir(dir))
+		{
+			std::string sha = prefix + e->d_name;
+			if (is_hex_id(sha))
+				names.push_back(sha);
+		}
+		closedir(dir);
+	}
+
+	// Room for twice the objects found before reading again
+	f.scanned = true;
+	f.missing.clear();
+	f.entries = names.size();
+	f.capacity = std::max<size_t>(64, names.size() * 2);
+	f.bits.assign((f.capacity * bits_per_entry + 63) / 64, 0);
+	for (const auto &sha : names)
+		set_bits(f, sha);
+}
+
+void
+LooseObjectFilter::set_bits(Fanout &f, const std::string &sha)
+{
+	uint64_t nbits = f.bits.size() * 64;
+	uint32_t h1 = id_bits(sha, 2);
+	uint32_t h2 = id_bits(sha, 10) | 1;
+	for (uint32_t i = 0; i < num_hashes; i++)
+	{
+		uint64_t bit = (h1 + static_cast<uint64_t>(i) * h2) % nbits;
+		f.bits[bit / 64] |= uint64_t(1) << (bit % 64);
+	}
+}
+
+bool
+LooseObjectFilter::test_bits(const Fanout &f, const std::string &sha)
+{
+	uint64_t nbits = f.bits.size() * 64;
+	uint32_t h1 = id_bits(sha, 2);
+	uint32_t h2 = id_bits(sha, 10) | 1;
+	for (uint32_t i = 0; i < num_hashes; i++)
+	{
+		uint64_t bit = (h1 + static_cast<uint64_t>(i) * h2) % nbits;
+		if (!(f.bits[bit / 64] & (uint64_t(1) << (bit % 64))))
+			return false;
+	}
+	return true;
+}
@@ -0,0 +1,85 @@
+#ifndef LOOSE_OBJECT_FILTER_H
+#define LOOSE_OBJECT_FILTER_H
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <cstdint>
+#include <unordered_set>
+#include <sys/stat.h>
+
+/**
+ * \brief Answers "is there no loose object with this id?" mostly
+ * without system calls.
+ *
+ * Each of the 256 fan-out directories in objects gets a Bloom filter
+ * of the names in it, built by reading the directory the first time
+ * an id in it is asked for.  Object ids are uniformly distributed, so
+ * the bits are taken from the id itself instead of hashing it.  Ids
+ * looked for and not found are remembered too, for the lookups the
+ * filter cannot rule out.
+ *
+ * Other processes may add objects at any time, so a negative answer
+ * is only trusted while the directory still has the modification time
+ * it had when it was read.  A directory modified within a second of
+ * being read may have changed again without a new time, so its
+ * listing only rules out objects after a later read.  Each directory
+ * has its own lock, threads looking up different directories do not
+ * wait for each other.
+ */
+class LooseObjectFilter
+{
+public:
+	static const uint32_t num_hashes = 7;
+	static const uint32_t bits_per_entry = 10;
+
+	LooseObjectFilter(const std::string &objects_dir, size_t max_missing = 65536);
+
+	//! False if there is certainly no loose object sha.  Without
+	//! revalidate the answer may miss objects other processes wrote
+	//! since the directory was read, but costs no system call.
+	bool maybe_contains(const std::string &sha, bool revalidate = true);
+
+	//! Record loose object sha written by this process.
+	void add(const std::string &sha);
+
+	//! Record that loose object sha was looked for and not found.
+	void add_missing(const std::string &sha);
+
+private:
+	struct Fanout
+	{
+		std::mutex mutex;
+		bool scanned = false;
+		//! Directory modification time when read, zero if missing.
+		struct timespec mtime = {0, 0};
+		//! Modified too shortly before it was read to trust the time.
+		bool racy = false;
+		//! Objects added since scanning, the filter is rebuilt
+		//! when it gets too full.
+		size_t entries = 0;
+		size_t capacity = 0;
+		std::vector<uint64_t> bits;
+		//! Ids looked for and not found since the directory was read.
+		std::unordered_set<std::string> missing;
+	};
+
+	std::string m_objects_dir;
+	size_t m_max_missing;
+	Fanout m_fanouts[256];
+
+	std::string fanout_dir(size_t index) const;
+
+	//! Has the directory of fanout index changed since it was read?
+	bool changed(size_t index);
+
+	//! Read directory of fanout index and fill its filter, with the
+	//! fanout mutex held.
+	void scan(size_t index);
+
+	static void set_bits(Fanout &f, const std::string &sha);
+
+	static bool test_bits(const Fanout &f, const std::string &sha);
+};
+
+#endif
@@ -0,0 +1,62 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "MappedFile.h"
+#include "GitException.h"
+#include "PerfTrace.h"
+
+MappedFile::MappedFile(const std::string &path) :
+	m_path(path),
+	m_data(nullptr),
+	m_size(0)
+{
+	PERF_COUNT(syscalls, 3);
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0)
+		throw GitException("Cannot open file: " + path);
+
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+	{
+		close(fd);
+		throw GitException("Cannot read file: " + path);
+	}
+	m_size = st.st_size;
+	if (m_size > 0)
+	{
+		void *p = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (p == MAP_FAILED)
+		{
+			close(fd);
+			throw GitException("Cannot map file: " + path);
+		}
+		m_data = static_cast<const unsigned char *>(p);
+	}
+	close(fd);
+}
+
+MappedFile::~MappedFile()
+{
+	if (m_data)
+		munmap(const_cast<unsigned char *>(m_data), m_size);
+}
+
+const unsigned char *
+MappedFile::data() const
+{
+	return m_data;
+}
+
+size_t
+MappedFile::size() const
+{
+	return m_size;
+}
+
+const std::string &
+MappedFile::path() const
+{
+	return m_path;
+}
@@ -0,0 +1,36 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <string>
+#include <cstddef>
+
+/**
+ * \brief Read-only memory mapping of a whole file.
+ *
+ * Pages are only read from disk when first touched, so mapping a
+ * large packfile is cheap and concurrent readers need no locking.
+ */
+class MappedFile
+{
+public:
+	//! Map file path, throws GitException if it cannot be read.
+	MappedFile(const std::string &path);
+
+	~MappedFile();
+
+	MappedFile(const MappedFile &) = delete;
+	MappedFile &operator=(const MappedFile &) = delete;
+
+	const unsigned char *data() const;
+
+	size_t size() const;
+
+	const std::string &path() const;
+
+private:
+	std::string m_path;
+	const unsigned char *m_data;
+	size_t m_size;
+};
+
+#endif
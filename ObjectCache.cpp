@@ -0,0 +1,51 @@
+#include <algorithm>
+
+#include "ObjectCache.h"
+#include "GitObject.h"
+
+ObjectCache::ObjectCache(size_t max_entries)
+{
+	m_shard_size = std::max<size_t>(1, max_entries / shard_count);
+}
+
+ObjectCache::Shard &
+ObjectCache::shard_for(const std::string &sha)
+{
+	// Object ids are uniformly distributed, so the leading hex
+	// digits are as good as any hash.
+	size_t h = 0;
+	for (size_t i = 0; i < 2 && i < sha.size(); i++)
+	{
+		char c = sha.at(i);
+		h = (h << 4) | (c >= 'a' ? c - 'a' + 10 : c - '0');
+	}
+	return m_shards[h % shard_count];
+}
+
+std::shared_ptr<GitObject>
+ObjectCache::get(const std::string &sha)
+{
+	auto &shard = shard_for(sha);
+	std::lock_guard<std::mutex> lock(shard.mutex);
+	auto it = shard.objects.find(sha);
+	if (it == shard.objects.end())
+		return nullptr;
+	return it->second;
+}
+
+void
+ObjectCache::put(const std::string &sha, std::shared_ptr<GitObject> obj)
+{
+	auto &shard = shard_for(sha);
+	std::lock_guard<std::mutex> lock(shard.mutex);
+	if (shard.objects.find(sha) != shard.objects.end())
+		return;
+
+	while (shard.order.size() >= m_shard_size)
+	{
+		shard.objects.erase(shard.order.front());
+		shard.order.pop_front();
+	}
+	shard.objects.insert({sha, obj});
+	shard.order.push_back(sha);
+}
@@ -0,0 +1,46 @@
+#ifndef OBJECT_CACHE_H
+#define OBJECT_CACHE_H
+
+#include <string>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <deque>
+
+class GitObject;
+
+/**
+ * \brief Cache of parsed objects, safe for concurrent readers.
+ *
+ * Entries are spread over independently locked shards chosen by
+ * object id, so threads reading different objects rarely contend.
+ * Each shard holds at most a fixed number of objects and evicts the
+ * oldest insertion first.
+ */
+class ObjectCache
+{
+public:
+	ObjectCache(size_t max_entries = 16384);
+
+	//! Return cached object, or nullptr if not cached.
+	std::shared_ptr<GitObject> get(const std::string &sha);
+
+	void put(const std::string &sha, std::shared_ptr<GitObject> obj);
+
+private:
+	static const size_t shard_count = 64;
+
+	struct Shard
+	{
+		std::mutex mutex;
+		std::unordered_map<std::string, std::shared_ptr<GitObject> > objects;
+		std::deque<std::string> order;
+	};
+
+	size_t m_shard_size;
+	Shard m_shards[shard_count];
+
+	Shard &shard_for(const std::string &sha);
+};
+
+#endif
@@ -0,0 +1,292 @@
+#include <algorithm>
+#include <cstring>
+#include <future>
+
+#include "ObjectChecker.h"
+#include "ObjectWalk.h"
+#include "GitPack.h"
+#include "ThreadPool.h"
+#include "PerfTrace.h"
+
+//! Objects checked by one task, their errors are kept together.
+static const size_t objects_per_task = 256;
+
+static bool
+is_hex_id(const std::string &s)
+{
+	return s.size() == 40 && std::all_of(s.begin(), s.end(), [](char c) {
+		return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f');
+	});
+}
+
+//! Read line "key value" at pos, returns false if it has another key.
+static bool
+header(const std::vector<unsigned char> &data, size_t &pos,
+	const std::string &key, std::string &value)
+{
+	if (data.size() - pos < key.size() + 1 ||
+		std::memcmp(data.data() + pos, key.data(), key.size()) != 0 ||
+		data[pos + key.size()] != ' ')
+	{
+		return false;
+	}
+	auto start = data.begin() + pos + key.size() + 1;
+	auto nl = std::find(start, data.end(), '\n');
+	if (nl == data.end())
+		return false;
+	value.assign(start, nl);
+	pos = nl - data.begin() + 1;
+	return true;
+}
+
+//! Check "Name <email> 1234567890 +0100"
+static bool
+is_ident(const std::string &s)
+{
+	auto lt = s.find('<');
+	auto gt = s.find("> ");
+	if (lt == std::string::npos || gt == std::string::npos || gt < lt)
+		return false;
+	auto time = s.substr(gt + 2);
+	auto space = time.find(' ');
+	if (space == 0 || space == std::string::npos || time.size() != space + 6)
+		return false;
+	return std::all_of(time.begin(), time.begin() + space, ::isdigit) &&
+		(time[space + 1] == '+' || time[space + 1] == '-') &&
+		std::all_of(time.begin() + space + 2, time.end(), ::isdigit);
+}
+
+//! Git tree order, subtrees sort as if their name ended in '/'.
+static int
+tree_compare(const std::string &a, bool a_tree, const std::string &b, bool b_tree)
+{
+	size_t len = std::min(a.size(), b.size());
+	int cmp = a.compare(0, len, b, 0, len);
+	if (cmp != 0)
+		return cmp;
+	unsigned char c1 = len < a.size() ? a[len] : (a_tree ? '/' : '\0');
+	unsigned char c2 = len < b.size() ? b[len] : (b_tree ? '/' : '\0');
+	return c1 < c2 ? -1 : (c1 > c2 ? 1 : 0);
+}
+
+ObjectChecker::ObjectChecker(GitRepository &repo, size_t threads) :
+	m_repo(repo),
+	m_threads(threads)
+{
+}
+
+size_t
+ObjectChecker::run(std::ostream &out, bool dangling)
+{
+	PERF_SCOPE("fsck");
+	m_index.reset(new ObjectIndex(m_repo));
+	size_t n = m_index->size();
+	m_referenced.reset(new AtomicBitset(n));
+	m_types.assign(n, 0);
+
+	ThreadPool pool(m_threads);
+	std::vector<std::future<bool> > packs_ok;
+	for (const auto &pack : m_repo.packs())
+	{
+		const GitPack *p = pack.get();
+		packs_ok.push_back(pool.submit([p]() { return p->verify(); }));
+	}
+
+	size_t tasks = (n + objects_per_task - 1) / objects_per_task;
+	std::vector<std::vector<std::string> > errors(tasks);
+	pool.parallel_for(tasks, [&](size_t t) {
+		size_t end = std::min(n, (t + 1) * objects_per_task);
+		for (size_t pos = t * objects_per_task; pos < end; pos++)
+		{
+			check(pos, errors[t]);
+		}
+	});
+
+	size_t count = 0;
+	for (size_t i = 0; i < packs_ok.size(); i++)
+	{
+		if (!packs_ok[i].get())
+		{
+			out << "error: checksum mismatch in " << m_repo.packs().at(i)->pack_path() << std::endl;
+			count++;
+		}
+	}
+	for (const auto &e : errors)
+	{
+		for (const auto &line : e)
+		{
+			out << line << std::endl;
+		}
+		count += e.size();
+	}
+
+	ObjectWalk walk(m_repo);
+	walk.add_refs();
+	for (const auto &tip : walk.tips())
+	{
+		auto pos = m_index->position(tip);
+		if (pos == ObjectIndex::npos)
+		{
+			out << "error: reference to missing object " << tip << std::endl;
+			count++;
+		}
+		else
+		{
+			m_referenced->set(pos);
+		}
+	}
+
+	if (dangling)
+	{
+		for (size_t pos = 0; pos < n; pos++)
+		{
+			if (m_types[pos] != 0 && !m_referenced->test(pos))
+			{
+				out << "dangling " << GitPack::type_name(static_cast<GitPack::Type>(m_types[pos])) <<
+					" " << m_index->id(pos) << std::endl;
+			}
+		}
+	}
+	return count;
+}
+
+void
+ObjectChecker::check(size_t pos, std::vector<std::string> &errors)
+{
+	auto sha = m_index->id(pos);
+	std::string fmt;
+	std::vector<unsigned char> data;
+	if (!m_repo.object_data(sha, fmt, data))
+	{
+		errors.push_back("error: " + sha + ": object corrupt or missing");
+		return;
+	}
+	if (GitPack::hash_object(fmt, data) != sha)
+	{
+		errors.push_back("error: " + sha + ": hash mismatch");
+		return;
+	}
+
+	m_types[pos] = static_cast<unsigned char>(GitPack::type_from_name(fmt));
+	if (fmt == "commit")
+		check_commit(sha, data, errors);
+	else if (fmt == "tree")
+		check_tree(sha, data, errors);
+	else if (fmt == "tag")
+		check_tag(sha, data, errors);
+	else if (fmt != "blob")
+		errors.push_back("error: " + sha + ": unknown object type " + fmt);
+}
+
+void
+ObjectChecker::check_commit(const std::string &sha, const std::vector<unsigned char> &data,
+	std::vector<std::string> &errors)
+{
+	size_t pos = 0;
+	std::string value;
+	if (!header(data, pos, "tree", value) || !is_hex_id(value))
+	{
+		errors.push_back("error in commit " + sha + ": invalid or missing tree");
+		return;
+	}
+	link("commit", sha, "tree", value, errors);
+
+	while (header(data, pos, "parent", value))
+	{
+		if (is_hex_id(value))
+			link("commit", sha, "commit", value, errors);
+		else
+			errors.push_back("error in commit " + sha + ": invalid parent " + value);
+	}
+
+	if (!header(data, pos, "author", value) || !is_ident(value))
+		errors.push_back("error in commit " + sha + ": invalid or missing author");
+	else if (!header(data, pos, "committer", value) || !is_ident(value))
+		errors.push_back("error in commit " + sha + ": invalid or missing committer");
+}
+
+void
+ObjectChecker::check_tag(const std::string &sha, const std::vector<unsigned char> &data,
+	std::vector<std::string> &errors)
+{
+	size_t pos = 0;
+	std::string object;
+	std::string type;
+	std::string name;
+	if (!header(data, pos, "object", object) || !is_hex_id(object))
+	{
+		errors.push_back("error in tag " + sha + ": invalid or missing object");
+		return;
+	}
+	if (!header(data, pos, "type", type) || GitPack::type_from_name(type) == GitPack::Type::none)
+	{
+		errors.push_back("error in tag " + sha + ": invalid or missing type");
+		return;
+	}
+	link("tag", sha, type, object, errors);
+	if (!header(data, pos, "tag", name) || name.empty())
+		errors.push_back("error in tag " + sha + ": invalid or missing tag name");
+}
+
+void
+ObjectChecker::check_tree(const std::string &sha, const std::vector<unsigned char> &data,
+	std::vector<std::string> &errors)
+{
+	std::string prev;
+	bool prev_tree = false;
+	size_t pos = 0;
+	while (pos < data.size())
+	{
+		auto begin = data.begin() + pos;
+		auto space = std::find(begin, data.end(), ' ');
+		auto nul = std::find(space, data.end(), '\0');
+		if (space == data.end() || nul == data.end() || data.end() - nul < 21)
+		{
+			errors.push_back("error in tree " + sha + ": truncated entry");
+			return;
+		}
+		std::string mode(begin, space);
+		std::string name(space + 1, nul);
+		const unsigned char *id = &*(nul + 1);
+		pos = nul - data.begin() + 21;
+
+		bool is_tree = mode == "40000";
+		if (!is_tree && mode != "100644" && mode != "100755" && mode != "120000" && mode != "160000")
+			errors.push_back("error in tree " + sha + ": bad mode " + mode + " of " + name);
+		if (name.empty() || name == "." || name == ".." || name == ".git" ||
+			name.find('/') != std::string::npos)
+		{
+			errors.push_back("error in tree " + sha + ": bad entry name '" + name + "'");
+		}
+		if (!prev.empty())
+		{
+			if (prev == name)
+				errors.push_back("error in tree " + sha + ": duplicate entry " + name);
+			else if (tree_compare(prev, prev_tree, name, is_tree) > 0)
+				errors.push_back("error in tree " + sha + ": not properly sorted at " + name);
+		}
+		prev = name;
+		prev_tree = is_tree;
+
+		// Submodule commits live in another repository
+		if (mode == "160000")
+			continue;
+		auto to = m_index->position(id);
+		if (to == ObjectIndex::npos)
+			link("tree", sha, is_tree ? "tree" : "blob", GitPack::to_hex(id), errors);
+		else
+			m_referenced->set(to);
+	}
+}
+
+void
+ObjectChecker::link(const std::string &from_fmt, const std::string &from,
+	const std::string &to_fmt, const std::string &to,
+	std::vector<std::string> &errors)
+{
+	auto pos = m_index->position(to);
+	if (pos == ObjectIndex::npos)
+		errors.push_back("broken link from " + from_fmt + " " + from + " to " + to_fmt + " " + to);
+	else
+		m_referenced->set(pos);
+}
@@ -0,0 +1,57 @@
+#ifndef OBJECT_CHECKER_H
+#define OBJECT_CHECKER_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <ostream>
+
+#include "GitRepository.h"
+#include "ObjectIndex.h"
+#include "AtomicBitset.h"
+
+/**
+ * \brief Checks the integrity and connectivity of all objects.
+ *
+ * Every loose and packed object is inflated and hashed again on a
+ * thread pool, and commits, trees and tags are parsed from their raw
+ * data, stricter than GitCommit and GitTree do.  Each object they
+ * refer to is looked up by binary search in an ObjectIndex and marked
+ * in a bitset, which then also gives the dangling objects.
+ */
+class ObjectChecker
+{
+public:
+	ObjectChecker(GitRepository &repo, size_t threads = 0);
+
+	//! Check all objects, writing problems to out in object id order.
+	//! Returns the number of errors found.
+	size_t run(std::ostream &out, bool dangling = true);
+
+private:
+	GitRepository &m_repo;
+	size_t m_threads;
+	std::unique_ptr<ObjectIndex> m_index;
+	std::unique_ptr<AtomicBitset> m_referenced;
+	//! GitPack::Type of each object, by position.
+	std::vector<unsigned char> m_types;
+
+	//! Check object at pos, appending problems to errors.
+	void check(size_t pos, std::vector<std::string> &errors);
+
+	void check_commit(const std::string &sha, const std::vector<unsigned char> &data,
+		std::vector<std::string> &errors);
+
+	void check_tree(const std::string &sha, const std::vector<unsigned char> &data,
+		std::vector<std::string> &errors);
+
+	void check_tag(const std::string &sha, const std::vector<unsigned char> &data,
+		std::vector<std::string> &errors);
+
+	//! Mark object to as referenced, or report it missing.
+	void link(const std::string &from_fmt, const std::string &from,
+		const std::string &to_fmt, const std::string &to,
+		std::vector<std::string> &errors);
+};
+
+#endif
@@ -0,0 +1,79 @@
+#include <algorithm>
+#include <array>
+#include <cstring>
+
+#include "ObjectIndex.h"
+#include "GitRepository.h"
+#include "GitPack.h"
+#include "PerfTrace.h"
+
+ObjectIndex::ObjectIndex(const GitRepository &repo)
+{
+	PERF_SCOPE("object_index");
+	std::vector<std::array<unsigned char, 20> > ids;
+	std::array<unsigned char, 20> id;
+	for (const auto &sha : repo.loose_objects())
+	{
+		GitPack::from_hex(sha, id.data());
+		ids.push_back(id);
+	}
+	for (const auto &pack : repo.packs())
+	{
+		for (size_t i = 0; i < pack->object_count(); i++)
+		{
+			std::memcpy(id.data(), pack->id_bytes(i), 20);
+			ids.push_back(id);
+		}
+	}
+
+	// Objects may be both loose and packed, or in several packs
+	std::sort(ids.begin(), ids.end());
+	ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+	m_count = ids.size();
+	m_ids.resize(m_count * 20);
+	for (size_t i = 0; i < m_count; i++)
+	{
+		std::memcpy(m_ids.data() + 20 * i, ids[i].data(), 20);
+	}
+}
+
+size_t
+ObjectIndex::size() const
+{
+	return m_count;
+}
+
+size_t
+ObjectIndex::position(const std::string &sha) const
+{
+	if (sha.size() != 40)
+		return npos;
+	unsigned char id[20];
+	GitPack::from_hex(sha, id);
+	return position(id);
+}
+
+size_t
+ObjectIndex::position(const unsigned char *sha) const
+{
+	size_t lo = 0;
+	size_t hi = m_count;
+	while (lo < hi)
+	{
+		size_t mid = lo + (hi - lo) / 2;
+		int cmp = std::memcmp(m_ids.data() + 20 * mid, sha, 20);
+		if (cmp == 0)
+			return mid;
+		if (cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return npos;
+}
+
+std::string
+ObjectIndex::id(size_t pos) const
+{
+	return GitPack::to_hex(m_ids.data() + 20 * pos);
+}
@@ -0,0 +1,38 @@
+#ifndef OBJECT_INDEX_H
+#define OBJECT_INDEX_H
+
+#include <string>
+#include <vector>
+
+class GitRepository;
+
+/**
+ * \brief Sorted list of all object ids of a repository.
+ *
+ * Ids are kept as 20 raw bytes each, so that an object can be
+ * identified by its position, for example in an AtomicBitset.
+ */
+class ObjectIndex
+{
+public:
+	static const size_t npos = static_cast<size_t>(-1);
+
+	//! Collect all loose and packed objects of repo.
+	ObjectIndex(const GitRepository &repo);
+
+	size_t size() const;
+
+	//! Position of object sha, or npos if it does not exist.
+	size_t position(const std::string &sha) const;
+
+	//! Same as position(), for 20 raw bytes.
+	size_t position(const unsigned char *sha) const;
+
+	std::string id(size_t pos) const;
+
+private:
+	std::vector<unsigned char> m_ids;
+	size_t m_count;
+};
+
+#endif
@@ -0,0 +1,126 @@
+#include <deque>
+
+#include "ObjectWalk.h"
+#include "RefIterator.h"
+#include "GitCommit.h"
+#include "TreeWalker.h"
+#include "GitTag.h"
+#include "GitException.h"
+#include "PerfTrace.h"
+
+ObjectWalk::ObjectWalk(GitRepository &repo) :
+	m_repo(repo)
+{
+}
+
+void
+ObjectWalk::add_tip(const std::string &sha)
+{
+	if (!sha.empty())
+		m_tips.push_back(sha);
+}
+
+void
+ObjectWalk::add_refs()
+{
+	// object_find() returns names it cannot resolve unchanged
+	auto head = m_repo.object_find("HEAD");
+	if (head != "HEAD")
+		add_tip(head);
+	for (RefIterator it(m_repo); it.next(); )
+	{
+		add_tip(it.sha());
+	}
+}
+
+const std::vector<std::string> &
+ObjectWalk::tips() const
+{
+	return m_tips;
+}
+
+void
+ObjectWalk::walk(const Visitor &visit)
+{
+	PERF_SCOPE("object_walk");
+	std::deque<std::string> todo(m_tips.begin(), m_tips.end());
+	std::vector<std::pair<std::string, std::string> > trees;
+	std::vector<std::string> blobs;
+
+	while (!todo.empty())
+	{
+		auto sha = todo.front();
+		todo.pop_front();
+		if (!m_seen.insert(sha).second)
+			continue;
+
+		auto obj = m_repo.object_read(sha);
+		if (obj == nullptr)
+			throw GitException("Object not found: " + sha);
+		auto fmt = obj->get_format();
+		if (fmt == "tree")
+		{
+			// Trees are walked after all commits
+			m_seen.erase(sha);
+			trees.push_back({sha, std::string()});
+			continue;
+		}
+		if (fmt == "blob")
+		{
+			m_seen.erase(sha);
+			blobs.push_back(sha);
+			continue;
+		}
+
+		visit(sha, fmt, std::string());
+		auto commit = std::dynamic_pointer_cast<GitCommit>(obj);
+		if (fmt == "commit")
+		{
+			for (const auto &tree : commit->get_value("tree"))
+				trees.push_back({tree, std::string()});
+			for (const auto &parent : commit->get_value("parent"))
+				todo.push_back(parent);
+		}
+		else if (fmt == "tag")
+		{
+			for (const auto &object : commit->get_value("object"))
+				todo.push_front(object);
+		}
+	}
+
+	for (const auto &tree : trees)
+	{
+		walk_tree(tree.first, tree.second, visit);
+	}
+	for (const auto &blob : blobs)
+	{
+		if (m_seen.insert(blob).second)
+			visit(blob, "blob", std::string());
+	}
+}
+
+void
+ObjectWalk::walk_tree(const std::string &sha, const std::string &path,
+	const Visitor &visit)
+{
+	if (!m_seen.insert(sha).second)
+		return;
+	visit(sha, "tree", path);
+
+	TreeWalker walker(m_repo);
+	walker.walk({sha}, [this, &visit](const std::string &item_path, const TreeWalker::Entries &entries) {
+		const auto *item = entries[0];
+		if (item->is_tree())
+		{
+			// Subtrees seen before are not entered again
+			if (!m_seen.insert(item->sha).second)
+				return false;
+			visit(item->sha, "tree", item_path);
+			return true;
+		}
+		// Submodule commits live in another repository
+		if (item->mode != "160000" && m_seen.insert(item->sha).second)
+			visit(item->sha, "blob", item_path);
+		return false;
+	}, path.empty() ? path : path + "/");
+}
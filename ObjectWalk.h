@@ -0,0 +1,46 @@
+#ifndef OBJECT_WALK_H
+#define OBJECT_WALK_H
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <unordered_set>
+
+#include "GitRepository.h"
+
+/**
+ * \brief Enumerates the objects reachable from a set of tips.
+ *
+ * Commits and tags are visited first, in the order they are found
+ * from the tips, then the trees and blobs of those commits.  Blobs are
+ * never read, their type is known from the tree listing them.
+ */
+class ObjectWalk
+{
+public:
+	//! Called once for each object with its type and, for trees and
+	//! blobs, the path it was first found at.
+	using Visitor = std::function<void(const std::string &sha,
+		const std::string &fmt, const std::string &path)>;
+
+	ObjectWalk(GitRepository &repo);
+
+	void add_tip(const std::string &sha);
+
+	//! Add HEAD and all loose and packed references as tips.
+	void add_refs();
+
+	const std::vector<std::string> &tips() const;
+
+	void walk(const Visitor &visit);
+
+private:
+	GitRepository &m_repo;
+	std::vector<std::string> m_tips;
+	std::unordered_set<std::string> m_seen;
+
+	void walk_tree(const std::string &sha, const std::string &path,
+		const Visitor &visit);
+};
+
+#endif
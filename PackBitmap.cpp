@@ -0,0 +1,207 @@
+#include <algorithm>
+#include <cstring>
+
+#include "PackBitmap.h"
+#include "GitException.h"
+#include "PerfTrace.h"
+
+//! The bitmaps cover all objects reachable from their commits.
+static const uint16_t option_full_dag = 1;
+
+//! Git reads no further back for the base of a stored bitmap.
+static const size_t max_xor_offset = 160;
+
+static const GitPack::Type types[4] = {GitPack::Type::commit,
+	GitPack::Type::tree, GitPack::Type::blob, GitPack::Type::tag};
+
+static uint32_t
+get32(const unsigned char *p)
+{
+	return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) |
+		(uint32_t(p[2]) << 8) | uint32_t(p[3]);
+}
+
+PackBitmap::PackBitmap(GitPack &pack) :
+	m_pack(pack),
+	m_file(new MappedFile(bitmap_path(pack.pack_path())))
+{
+	PERF_SCOPE("bitmap_read");
+	const unsigned char *p = m_file->data();
+	size_t len = m_file->size();
+	auto bad = [this](const std::string &why) {
+		return GitException("Invalid bitmap " + m_file->path() + ": " + why);
+	};
+
+	// Header, then the file ends with its own checksum
+	if (len < 32 + 20 || std::memcmp(p, "BITM", 4) != 0)
+		throw bad("no bitmap header");
+	if (((p[4] << 8) | p[5]) != 1)
+		throw bad("unsupported version");
+	if ((((p[6] << 8) | p[7]) & option_full_dag) == 0)
+		throw bad("bitmaps do not cover all reachable objects");
+	size_t entries = get32(p + 8);
+	if (GitPack::to_hex(p + 12) != m_pack.pack_checksum())
+		throw bad("written for another pack");
+	size_t pos = 32;
+	size_t end = len - 20;
+
+	m_order = m_pack.pack_order();
+	m_bit.resize(m_order.size());
+	for (size_t bit = 0; bit < m_order.size(); bit++)
+	{
+		m_bit[m_order[bit]] = bit;
+	}
+
+	size_t consumed;
+	for (auto &t : m_types)
+	{
+		if (!EwahBitmap::read(p + pos, end - pos, t, consumed))
+			throw bad("corrupt type bitmap");
+		pos += consumed;
+	}
+
+	// Each entry may be stored as xor with one up to 160 entries back
+	std::vector<const EwahBitmap *> read;
+	for (size_t i = 0; i < entries; i++)
+	{
+		if (end - pos < 6)
+			throw bad("truncated");
+		uint32_t commit = get32(p + pos);
+		size_t xor_offset = p[pos + 4];
+		pos += 6;
+		EwahBitmap bits;
+		if (commit >= m_order.size() || xor_offset > max_xor_offset || xor_offset > i ||
+			!EwahBitmap::read(p + pos, end - pos, bits, consumed))
+		{
+			throw bad("corrupt entry " + std::to_string(i));
+		}
+		pos += consumed;
+		if (xor_offset > 0)
+			bits ^= *read[i - xor_offset];
+		auto &stored = m_commits[commit];
+		stored = std::move(bits);
+		read.push_back(&stored);
+	}
+}
+
+std::string
+PackBitmap::bitmap_path(const std::string &pack_path)
+{
+	auto path = pack_path;
+	if (path.size() > 5 && path.compare(path.size() - 5, 5, ".pack") == 0)
+		path.erase(path.size() - 5);
+	return path + ".bitmap";
+}
+
+size_t
+PackBitmap::object_count() const
+{
+	return m_order.size();
+}
+
+size_t
+PackBitmap::bitmap_count() const
+{
+	return m_commits.size();
+}
+
+GitPack::Type
+PackBitmap::type(size_t bit) const
+{
+	for (size_t t = 0; t < 4; t++)
+	{
+		if (m_types[t].test(bit))
+			return types[t];
+	}
+	return GitPack::Type::none;
+}
+
+bool
+PackBitmap::reachable(const std::string &sha, EwahBitmap &bits)
+{
+	PERF_SCOPE("bitmap_reachable");
+	std::vector<size_t> todo;
+	auto add = [&](const unsigned char *id) {
+		size_t i;
+		if (!m_pack.find_index(id, i))
+			return false;
+		size_t bit = m_bit[i];
+		if (bits.test(bit))
+			return true;
+		auto it = m_commits.find(i);
+		if (it != m_commits.end())
+		{
+			PERF_COUNT(bitmap_hits, 1);
+			bits |= it->second;
+			return true;
+		}
+		// Blobs refer to nothing, no need to read them
+		bits.set(bit);
+		if (type(bit) != GitPack::Type::blob)
+			todo.push_back(i);
+		return true;
+	};
+
+	unsigned char id[20];
+	if (sha.size() != 40)
+		return false;
+	GitPack::from_hex(sha, id);
+	if (!add(id))
+		return false;
+
+	std::string fmt;
+	std::vector<unsigned char> data;
+	while (!todo.empty())
+	{
+		size_t i = todo.back();
+		todo.pop_back();
+		if (!m_pack.read(m_pack.object_offset(i), fmt, data))
+			return false;
+		if (fmt == "tree")
+		{
+			for (size_t p = 0; p < data.size(); )
+			{
+				auto nul = std::find(data.begin() + p, data.end(), '\0');
+				if (data.end() - nul < 21)
+					throw GitException("Corrupt tree " + m_pack.object_id(i));
+				bool gitlink = std::memcmp(&data[p], "160000 ", 7) == 0;
+				p = nul - data.begin() + 21;
+				if (!gitlink && !add(&*(nul + 1)))
+					return false;
+			}
+			continue;
+		}
+
+		// Commit and tag headers up to the first empty line
+		for (size_t p = 0; p < data.size() && data[p] != '\n'; )
+		{
+			auto nl = std::find(data.begin() + p, data.end(), '\n');
+			std::string line(data.begin() + p, nl);
+			p = nl - data.begin() + 1;
+			if (line.compare(0, 5, "tree ") == 0 || line.compare(0, 7, "parent ") == 0 ||
+				line.compare(0, 7, "object ") == 0)
+			{
+				auto hex = line.substr(line.find(' ') + 1);
+				if (hex.size() != 40)
+					return false;
+				GitPack::from_hex(hex, id);
+				if (!add(id))
+					return false;
+			}
+		}
+	}
+	return true;
+}
+
+void
+PackBitmap::list(const EwahBitmap &bits,
+	const std::function<void(const std::string &, GitPack::Type)> &f) const
+{
+	for (size_t t = 0; t < 4; t++)
+	{
+		bits.for_each([&](size_t bit) {
+			if (m_types[t].test(bit))
+				f(m_pack.object_id(m_order[bit]), types[t]);
+		});
+	}
+}
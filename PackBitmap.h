@@ -0,0 +1,65 @@
+#ifndef PACK_BITMAP_H
+#define PACK_BITMAP_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <unordered_map>
+#include <cstdint>
+
+#include "GitPack.h"
+#include "MappedFile.h"
+#include "EwahBitmap.h"
+
+/**
+ * \brief Reachability bitmaps of a pack, read from its .bitmap file.
+ *
+ * Bit i stands for the i-th object of the pack in offset order.  The
+ * file has a bitmap of the objects of each type and, for some commits,
+ * a bitmap of all objects reachable from the commit, possibly stored
+ * as the difference to an earlier one.  Objects reachable from other
+ * commits are found by walking the graph until a commit with a bitmap
+ * is reached.
+ */
+class PackBitmap
+{
+public:
+	//! Read the bitmap belonging to pack, throws GitException if it
+	//! is missing or does not match the pack.
+	PackBitmap(GitPack &pack);
+
+	//! Path of the bitmap of the pack at pack_path.
+	static std::string bitmap_path(const std::string &pack_path);
+
+	//! Number of objects in the pack, and bits in each bitmap.
+	size_t object_count() const;
+
+	//! Number of commits with a stored bitmap.
+	size_t bitmap_count() const;
+
+	//! Set the bits of all objects reachable from object sha.  Returns
+	//! false if some of them are not in the pack.
+	bool reachable(const std::string &sha, EwahBitmap &bits);
+
+	//! Call f with the id and type of each object in bits, commits
+	//! first, then trees, blobs and tags, each in pack order.
+	void list(const EwahBitmap &bits,
+		const std::function<void(const std::string &, GitPack::Type)> &f) const;
+
+private:
+	GitPack &m_pack;
+	std::unique_ptr<MappedFile> m_file;
+	//! Sorted position of the object of each bit.
+	std::vector<uint32_t> m_order;
+	//! Bit of the object at each sorted position.
+	std::vector<uint32_t> m_bit;
+	//! Objects of type commit, tree, blob and tag.
+	EwahBitmap m_types[4];
+	//! Stored bitmaps by the sorted position of their commit.
+	std::unordered_map<uint32_t, EwahBitmap> m_commits;
+
+	GitPack::Type type(size_t bit) const;
+};
+
+#endif
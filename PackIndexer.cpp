@@ -0,0 +1,318 @@
+#include <algorithm>
+#include <cstring>
+#include <future>
+#include <thread>
+
+#include "PackIndexer.h"
+#include "GitException.h"
+#include "PerfTrace.h"
+
+#include "zlib.h"
+
+static const size_t no_base = static_cast<size_t>(-1);
+
+static uint32_t
+get32(const unsigned char *p)
+{
+	return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) |
+		(uint32_t(p[2]) << 8) | uint32_t(p[3]);
+}
+
+static bool
+is_delta(GitPack::Type type)
+{
+	return type == GitPack::Type::ofs_delta || type == GitPack::Type::ref_delta;
+}
+
+PackIndexer::PackIndexer(const std::string &pack_path, size_t threads) :
+	m_pack(new MappedFile(pack_path)),
+	m_threads(threads),
+	m_pending(0),
+	m_queued(0),
+	m_failed(false)
+{
+	if (m_threads == 0)
+	{
+		m_threads = std::max(1u, std::thread::hardware_concurrency());
+	}
+}
+
+std::string
+PackIndexer::run()
+{
+	PERF_SCOPE("index_pack");
+	const unsigned char *pack = m_pack->data();
+	size_t len = m_pack->size();
+	if (len < 32 || std::memcmp(pack, "PACK", 4) != 0 ||
+		(get32(pack + 4) != 2 && get32(pack + 4) != 3))
+	{
+		throw GitException("Not a pack file: " + m_pack->path());
+	}
+
+	// Verify the checksum at the end while scanning the entries
+	auto checksum = std::async(std::launch::async, [pack, len]() {
+		return GitPack::checksum(pack, len - 20);
+	});
+	scan();
+	auto pack_sha = GitPack::to_hex(pack + len - 20);
+	if (checksum.get() != pack_sha)
+		throw GitException("Pack checksum mismatch: " + m_pack->path());
+
+	// Every object which is not a delta starts a chain of tasks
+	for (size_t i = 0; i < m_threads; i++)
+	{
+		m_queues.emplace_back(new WorkQueue());
+	}
+	size_t next = 0;
+	for (size_t i = 0; i < m_entries.size(); i++)
+	{
+		if (!is_delta(m_entries[i].header.type))
+			push(next++ % m_threads, i);
+	}
+
+	{
+		PERF_SCOPE("resolve_deltas");
+		std::vector<std::thread> threads;
+		for (size_t i = 0; i < m_threads; i++)
+		{
+			threads.emplace_back(&PackIndexer::worker, this, i);
+		}
+		for (auto &t : threads)
+		{
+			t.join();
+		}
+	}
+	if (m_failed)
+		throw GitException(m_error);
+
+	std::vector<GitPack::IndexEntry> index;
+	size_t unresolved = 0;
+	for (const auto &e : m_entries)
+	{
+		if (e.sha.empty())
+			unresolved++;
+		else
+			index.push_back(GitPack::IndexEntry{e.sha, e.crc, e.offset});
+	}
+	if (unresolved > 0)
+	{
+		throw GitException("Pack has " + std::to_string(unresolved) +
+			" unresolved deltas, thin packs are not supported");
+	}
+
+	auto idx_path = m_pack->path();
+	if (idx_path.size() > 5 && idx_path.compare(idx_path.size() - 5, 5, ".pack") == 0)
+		idx_path = idx_path.substr(0, idx_path.size() - 5);
+	GitPack::write_index(idx_path + ".idx", index, pack_sha);
+	return pack_sha;
+}
+
+void
+PackIndexer::scan()
+{
+	PERF_SCOPE("scan_pack");
+	const unsigned char *pack = m_pack->data();
+	size_t end = m_pack->size() - 20;
+	uint32_t count = get32(pack + 8);
+
+	// Each entry takes at least two bytes, do not trust count further
+	m_entries.reserve(std::min<size_t>(count, end / 2));
+	uint64_t offset = 12;
+	for (uint32_t i = 0; i < count; i++)
+	{
+		Entry e;
+		e.offset = offset;
+		e.base = no_base;
+		if (!GitPack::parse_entry(pack, end, offset, e.header))
+			throw GitException("Bad pack entry at offset " + std::to_string(offset));
+
+		size_t consumed = 0;
+		auto data_offset = e.header.data_offset;
+		if (!GitPack::skip_data(pack + data_offset, end - data_offset, e.header.size, consumed))
+			throw GitException("Corrupt pack entry at offset " + std::to_string(offset));
+		uint64_t next = data_offset + consumed;
+
+		// The index stores the CRC32 of the packed entry, zlib
+		// counts in 32 bits so large entries go in pieces.
+		uLong crc = crc32(0, Z_NULL, 0);
+		for (uint64_t pos = offset; pos < next; )
+		{
+			uInt n = std::min<uint64_t>(next - pos, 1u << 30);
+			crc = crc32(crc, pack + pos, n);
+			pos += n;
+		}
+		e.crc = crc;
+		e.type = is_delta(e.header.type) ? GitPack::Type::none : e.header.type;
+		m_entries.push_back(e);
+		offset = next;
+	}
+	if (offset != end)
+		throw GitException("Pack has " + std::to_string(end - offset) + " bytes of garbage");
+
+	// Link deltas to their bases, entries are in offset order
+	m_ofs_children.resize(m_entries.size());
+	for (size_t i = 0; i < m_entries.size(); i++)
+	{
+		const auto &h = m_entries[i].header;
+		if (h.type == GitPack::Type::ofs_delta)
+		{
+			auto it = std::lower_bound(m_entries.begin(), m_entries.begin() + i, h.base_offset,
+				[](const Entry &e, uint64_t offset) { return e.offset < offset; });
+			if (it == m_entries.begin() + i || it->offset != h.base_offset)
+				throw GitException("Bad delta base at offset " + std::to_string(m_entries[i].offset));
+			m_ofs_children[it - m_entries.begin()].push_back(i);
+		}
+		else if (h.type == GitPack::Type::ref_delta)
+		{
+			m_ref_children[h.base_sha].push_back(i);
+		}
+	}
+}
+
+void
+PackIndexer::push(size_t queue, size_t i)
+{
+	m_pending++;
+	{
+		auto &q = *m_queues[queue];
+		std::lock_guard<std::mutex> lock(q.mutex);
+		q.tasks.push_back(i);
+	}
+	m_queued++;
+	{
+		// So an idle worker cannot miss the notification between
+		// checking m_queued and starting to wait
+		std::lock_guard<std::mutex> lock(m_idle_mutex);
+	}
+	m_idle.notify_one();
+}
+
+void
+PackIndexer::wake_all()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_idle_mutex);
+	}
+	m_idle.notify_all();
+}
+
+void
+PackIndexer::worker(size_t id)
+{
+	while (!m_failed)
+	{
+		// Newest task of our own first, else the oldest of another
+		size_t task = no_base;
+		{
+			auto &q = *m_queues[id];
+			std::lock_guard<std::mutex> lock(q.mutex);
+			if (!q.tasks.empty())
+			{
+				task = q.tasks.back();
+				q.tasks.pop_back();
+				m_queued--;
+			}
+		}
+		for (size_t k = 1; task == no_base && k < m_queues.size(); k++)
+		{
+			auto &q = *m_queues[(id + k) % m_queues.size()];
+			std::lock_guard<std::mutex> lock(q.mutex);
+			if (!q.tasks.empty())
+			{
+				task = q.tasks.front();
+				q.tasks.pop_front();
+				m_queued--;
+			}
+		}
+
+		if (task == no_base)
+		{
+			// Running tasks may still queue more
+			std::unique_lock<std::mutex> lock(m_idle_mutex);
+			m_idle.wait(lock, [this]() {
+				return m_queued > 0 || m_pending == 0 || m_failed;
+			});
+			if (m_queued == 0)
+				break;
+			continue;
+		}
+
+		try
+		{
+			resolve(task, id);
+		}
+		catch (const std::exception &e)
+		{
+			fail(e.what());
+		}
+		if (--m_pending == 0)
+			wake_all();
+	}
+}
+
+void
+PackIndexer::resolve(size_t i, size_t id)
+{
+	auto data = object_data(i);
+	auto &e = m_entries[i];
+	e.sha = GitPack::hash_object(GitPack::type_name(e.type), *data);
+
+	std::vector<size_t> children = m_ofs_children[i];
+	auto it = m_ref_children.find(e.sha);
+	if (it != m_ref_children.end())
+		children.insert(children.end(), it->second.begin(), it->second.end());
+	if (children.empty())
+		return;
+
+	// Keep the base around for its deltas, which go to our own queue
+	m_cache.put(e.offset, data);
+	for (auto c : children)
+	{
+		m_entries[c].base = i;
+		m_entries[c].type = e.type;
+		push(id, c);
+	}
+}
+
+DeltaBaseCache::Data
+PackIndexer::object_data(size_t i)
+{
+	const auto &e = m_entries[i];
+	auto cached = m_cache.get(e.offset);
+	if (cached)
+	{
+		PERF_COUNT(cache_hits, 1);
+		return cached;
+	}
+
+	const unsigned char *pack = m_pack->data();
+	size_t end = m_pack->size() - 20;
+	auto data_offset = e.header.data_offset;
+	auto out = std::make_shared<std::vector<unsigned char> >();
+	if (!is_delta(e.header.type))
+	{
+		if (!GitPack::inflate_data(pack + data_offset, end - data_offset, e.header.size, *out))
+			throw GitException("Corrupt pack entry at offset " + std::to_string(e.offset));
+		return out;
+	}
+
+	// The base was evicted or never cached, resolve it again
+	auto base = object_data(e.base);
+	std::vector<unsigned char> delta;
+	if (!GitPack::inflate_data(pack + data_offset, end - data_offset, e.header.size, delta) ||
+		!GitPack::apply_delta(*base, delta, *out))
+	{
+		throw GitException("Corrupt delta at offset " + std::to_string(e.offset));
+	}
+	return out;
+}
+
+void
+PackIndexer::fail(const std::string &error)
+{
+	std::lock_guard<std::mutex> lock(m_error_mutex);
+	if (!m_failed)
+		m_error = error;
+	m_failed = true;
+	wake_all();
+}
@@ -0,0 +1,97 @@
+#ifndef PACK_INDEXER_H
+#define PACK_INDEXER_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <memory>
+#include <unordered_map>
+
+#include "GitPack.h"
+#include "MappedFile.h"
+#include "DeltaBaseCache.h"
+
+/**
+ * \brief Builds the .idx file for a .pack file.
+ *
+ * Entry boundaries are only known after inflating each entry, so the
+ * pack is first scanned sequentially, while its checksum is verified
+ * on another thread.  Objects are then hashed in parallel: every
+ * non-delta object starts a task, and resolving an object queues the
+ * deltas based on it.  Each worker takes tasks from the back of its
+ * own queue, keeping a delta chain on one thread while its base is
+ * hot, and steals from the front of other queues when idle.  Inflated
+ * bases are kept in a bounded cache and resolved again if evicted.
+ */
+class PackIndexer
+{
+public:
+	//! Index pack_path using threads workers, or one per CPU if 0.
+	PackIndexer(const std::string &pack_path, size_t threads = 0);
+
+	//! Verify the pack, write the index next to it and return the
+	//! pack checksum.  Throws GitException on a corrupt pack.
+	std::string run();
+
+private:
+	struct Entry
+	{
+		GitPack::Entry header;
+		uint64_t offset;
+		uint32_t crc;
+		//! Type of the object after applying deltas
+		GitPack::Type type;
+		//! Index of the base entry of a delta, once known
+		size_t base;
+		std::string sha;
+	};
+
+	struct WorkQueue
+	{
+		std::mutex mutex;
+		std::deque<size_t> tasks;
+	};
+
+	std::unique_ptr<MappedFile> m_pack;
+	size_t m_threads;
+	std::vector<Entry> m_entries;
+	//! Entries which are ofs_deltas against each entry.
+	std::vector<std::vector<size_t> > m_ofs_children;
+	//! Entries which are ref_deltas against each object id.
+	std::unordered_map<std::string, std::vector<size_t> > m_ref_children;
+	std::vector<std::unique_ptr<WorkQueue> > m_queues;
+	//! Tasks queued or running, workers stop when it drops to 0.
+	std::atomic<size_t> m_pending;
+	//! Tasks waiting in the queues.
+	std::atomic<size_t> m_queued;
+	//! Idle workers wait here for a task, the end or a failure.
+	std::mutex m_idle_mutex;
+	std::condition_variable m_idle;
+	std::atomic<bool> m_failed;
+	std::mutex m_error_mutex;
+	std::string m_error;
+	DeltaBaseCache m_cache;
+
+	//! Find entry boundaries and compute their CRC32.
+	void scan();
+
+	void worker(size_t id);
+
+	//! Wake the idle workers.
+	void wake_all();
+
+	//! Hash entry i and queue the deltas based on it on queue id.
+	void resolve(size_t i, size_t id);
+
+	//! Data of entry i, from the cache or by resolving its chain.
+	DeltaBaseCache::Data object_data(size_t i);
+
+	void push(size_t queue, size_t i);
+
+	void fail(const std::string &error);
+};
+
+#endif
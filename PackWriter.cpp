@@ -0,0 +1,329 @@
+#include <algorithm>
+#include <cstdio>
+#include <deque>
+#include <fstream>
+#include <unistd.h>
+
+#include "PackWriter.h"
+#include "ThreadPool.h"
+#include "GitException.h"
+#include "PerfTrace.h"
+
+#include "zlib.h"
+#include <sha1.hpp>
+
+static const size_t no_base = static_cast<size_t>(-1);
+
+//! Objects smaller than this are not worth a delta.
+static const size_t min_delta_size = 50;
+
+//! Same as git's default core.bigFileThreshold.
+static const size_t big_file_threshold = 512 * 1024 * 1024;
+
+//! Limits of one batch of objects compressed in parallel.
+static const size_t batch_objects = 256;
+static const size_t batch_bytes = 32 * 1024 * 1024;
+
+PackWriter::PackWriter(GitRepository &repo, size_t window, size_t depth,
+	size_t threads) :
+	m_repo(repo),
+	m_window(window),
+	m_depth(depth),
+	m_threads(threads),
+	m_deltas(0)
+{
+}
+
+void
+PackWriter::add(const std::string &sha, const std::string &fmt,
+	const std::string &path)
+{
+	Object o;
+	o.sha = sha;
+	o.type = GitPack::type_from_name(fmt);
+	if (o.type == GitPack::Type::none)
+		throw GitException("Unknown object type " + fmt + ": " + sha);
+	o.name_hash = name_hash(path);
+	o.size = 0;
+	o.base = no_base;
+	o.depth = 0;
+	o.offset = 0;
+	o.crc = 0;
+	m_objects.push_back(o);
+}
+
+size_t
+PackWriter::object_count() const
+{
+	return m_objects.size();
+}
+
+size_t
+PackWriter::delta_count() const
+{
+	return m_deltas;
+}
+
+uint32_t
+PackWriter::name_hash(const std::string &path)
+{
+	// The last characters count most, so files with the same
+	// name or extension sort together.
+	uint32_t hash = 0;
+	for (unsigned char c : path)
+	{
+		if (isspace(c))
+			continue;
+		hash = (hash >> 2) + (uint32_t(c) << 24);
+	}
+	return hash;
+}
+
+void
+PackWriter::find_deltas(const std::vector<size_t> &order, size_t begin, size_t end)
+{
+	struct Slot
+	{
+		size_t index;
+		std::vector<unsigned char> data;
+	};
+	std::deque<Slot> window;
+	std::vector<unsigned char> best;
+	std::vector<unsigned char> delta;
+
+	for (size_t pos = begin; pos < end; pos++)
+	{
+		size_t i = order[pos];
+		auto &o = m_objects[i];
+		if (o.size < min_delta_size || o.size > big_file_threshold)
+			continue;
+
+		Slot slot{i, std::vector<unsigned char>()};
+		std::string fmt;
+		if (!m_repo.object_data(o.sha, fmt, slot.data))
+			throw GitException("Object not found: " + o.sha);
+
+		// Try the most similar, most recently sorted objects first
+		size_t best_base = no_base;
+		for (auto it = window.rbegin(); it != window.rend(); ++it)
+		{
+			const auto &b = m_objects[it->index];
+			if (b.type != o.type)
+				break;
+			if (b.depth >= m_depth || it->data.size() < o.size / 32)
+				continue;
+			size_t max_size = best_base == no_base ? o.size / 2 - 20 : best.size() - 1;
+			if (GitPack::create_delta(it->data, slot.data, max_size, delta))
+			{
+				best.swap(delta);
+				best_base = it->index;
+			}
+		}
+		if (best_base != no_base)
+		{
+			o.base = best_base;
+			o.depth = m_objects[best_base].depth + 1;
+			o.delta = best;
+		}
+
+		window.push_back(std::move(slot));
+		if (window.size() > m_window)
+			window.pop_front();
+	}
+}
+
+std::vector<size_t>
+PackWriter::write_order() const
+{
+	std::vector<size_t> order;
+	std::vector<bool> placed(m_objects.size(), false);
+	std::vector<size_t> chain;
+	for (size_t i = 0; i < m_objects.size(); i++)
+	{
+		for (size_t j = i; j != no_base && !placed[j]; j = m_objects[j].base)
+		{
+			chain.push_back(j);
+		}
+		while (!chain.empty())
+		{
+			placed[chain.back()] = true;
+			order.push_back(chain.back());
+			chain.pop_back();
+		}
+	}
+	return order;
+}
+
+std::string
+PackWriter::write(const std::string &dir)
+{
+	PERF_SCOPE("pack_write");
+	ThreadPool pool(m_threads);
+
+	{
+		PERF_SCOPE("object_sizes");
+		pool.parallel_for(m_objects.size(), [this](size_t i) {
+			std::string fmt;
+			if (!m_repo.object_info(m_objects[i].sha, fmt, m_objects[i].size))
+				throw GitException("Object not found: " + m_objects[i].sha);
+		});
+	}
+
+	if (m_window > 0 && m_depth > 0)
+	{
+		PERF_SCOPE("find_deltas");
+		std::vector<size_t> order(m_objects.size());
+		for (size_t i = 0; i < order.size(); i++)
+			order[i] = i;
+		std::sort(order.begin(), order.end(), [this](size_t a, size_t b) {
+			const auto &x = m_objects[a];
+			const auto &y = m_objects[b];
+			if (x.type != y.type)
+				return x.type < y.type;
+			if (x.name_hash != y.name_hash)
+				return x.name_hash < y.name_hash;
+			if (x.size != y.size)
+				return x.size > y.size;
+			return a < b;
+		});
+
+		size_t slices = std::max<size_t>(1, std::min(pool.size(), order.size() / (4 * m_window + 1)));
+		pool.parallel_for(slices, [&](size_t s) {
+			find_deltas(order, order.size() * s / slices, order.size() * (s + 1) / slices);
+		});
+		m_deltas = std::count_if(m_objects.begin(), m_objects.end(),
+			[](const Object &o) { return o.base != no_base; });
+	}
+
+	auto tmp = dir + "/tmp_pack_" + std::to_string(getpid());
+	std::ofstream f(tmp, std::ios::binary);
+	if (!f.is_open())
+		throw GitException("Cannot create pack: " + tmp);
+
+	// Each batch is collected in out, then hashed and written at once
+	SHA1 hasher;
+	uint64_t offset = 0;
+	std::string out;
+	auto emit = [&](const unsigned char *p, size_t len) {
+		out.append(reinterpret_cast<const char *>(p), len);
+		offset += len;
+	};
+	auto flush = [&]() {
+		{
+			PERF_SCOPE("sha1");
+			hasher.update(out);
+		}
+		f.write(out.data(), out.size());
+		out.clear();
+	};
+
+	size_t count = m_objects.size();
+	const unsigned char header[12] = {'P', 'A', 'C', 'K', 0, 0, 0, 2,
+		static_cast<unsigned char>(count >> 24), static_cast<unsigned char>(count >> 16),
+		static_cast<unsigned char>(count >> 8), static_cast<unsigned char>(count)};
+	emit(header, sizeof(header));
+
+	auto order = write_order();
+	std::vector<std::vector<unsigned char> > compressed;
+	std::vector<size_t> sizes;
+	for (size_t pos = 0; pos < order.size(); )
+	{
+		size_t end = pos;
+		size_t bytes = 0;
+		while (end < order.size() && end - pos < batch_objects && bytes < batch_bytes)
+		{
+			const auto &o = m_objects[order[end++]];
+			bytes += o.base == no_base ? o.size : o.delta.size();
+		}
+
+		compressed.assign(end - pos, std::vector<unsigned char>());
+		sizes.assign(end - pos, 0);
+		{
+			PERF_SCOPE("deflate");
+			pool.parallel_for(end - pos, [&](size_t k) {
+				const auto &o = m_objects[order[pos + k]];
+				std::vector<unsigned char> data;
+				if (o.base == no_base)
+				{
+					std::string fmt;
+					if (!m_repo.object_data(o.sha, fmt, data))
+						throw GitException("Object not found: " + o.sha);
+				}
+				const auto &payload = o.base == no_base ? data : o.delta;
+				uLong len = compressBound(payload.size());
+				compressed[k].resize(len);
+				if (compress2(compressed[k].data(), &len, payload.data(), payload.size(),
+					Z_DEFAULT_COMPRESSION) != Z_OK)
+				{
+					throw GitException("Cannot compress object: " + o.sha);
+				}
+				compressed[k].resize(len);
+				sizes[k] = payload.size();
+				PERF_COUNT(bytes_deflated, payload.size());
+			});
+		}
+
+		for (size_t k = 0; k < end - pos; k++)
+		{
+			auto &o = m_objects[order[pos + k]];
+			o.offset = offset;
+
+			// Type and size, then the distance back to a delta base
+			unsigned char head[32];
+			size_t n = 0;
+			auto type = o.base == no_base ? o.type : GitPack::Type::ofs_delta;
+			uint64_t size = sizes[k];
+			unsigned char c = (static_cast<unsigned>(type) << 4) | (size & 15);
+			for (size >>= 4; size > 0; size >>= 7)
+			{
+				head[n++] = c | 0x80;
+				c = size & 0x7f;
+			}
+			head[n++] = c;
+			if (o.base != no_base)
+			{
+				uint64_t distance = o.offset - m_objects[o.base].offset;
+				unsigned char buf[10];
+				size_t i = sizeof(buf) - 1;
+				buf[i] = distance & 0x7f;
+				while (distance >>= 7)
+				{
+					buf[--i] = 0x80 | (--distance & 0x7f);
+				}
+				std::copy(buf + i, buf + sizeof(buf), head + n);
+				n += sizeof(buf) - i;
+			}
+
+			uLong crc = crc32(0, Z_NULL, 0);
+			crc = crc32(crc, head, n);
+			crc = crc32(crc, compressed[k].data(), compressed[k].size());
+			o.crc = crc;
+			emit(head, n);
+			emit(compressed[k].data(), compressed[k].size());
+			std::vector<unsigned char>().swap(o.delta);
+		}
+		flush();
+		pos = end;
+	}
+	flush();
+
+	auto pack_sha = hasher.final();
+	unsigned char trailer[20];
+	GitPack::from_hex(pack_sha, trailer);
+	f.write(reinterpret_cast<const char *>(trailer), sizeof(trailer));
+	f.close();
+	if (!f)
+		throw GitException("Cannot write pack: " + tmp);
+
+	auto name = dir + "/pack-" + pack_sha;
+	if (std::rename(tmp.c_str(), (name + ".pack").c_str()) != 0)
+		throw GitException("Cannot write pack: " + name + ".pack");
+
+	std::vector<GitPack::IndexEntry> index;
+	for (const auto &o : m_objects)
+	{
+		index.push_back(GitPack::IndexEntry{o.sha, o.crc, o.offset});
+	}
+	GitPack::write_index(name + ".idx", index, pack_sha);
+	return pack_sha;
+}
@@ -0,0 +1,73 @@
+#ifndef PACK_WRITER_H
+#define PACK_WRITER_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include "GitRepository.h"
+#include "GitPack.h"
+
+/**
+ * \brief Writes objects of a repository into a new packfile and index.
+ *
+ * Like git, objects are sorted by type, by a hash of the path they
+ * were found at and by decreasing size, so that likely delta bases end
+ * up next to each other.  Each object is then compared with the
+ * objects in a sliding window before it.  The sorted list is split
+ * into one slice per thread, each searched with its own window.
+ * Objects are written in the order they were added, a delta base
+ * always before its deltas, and compressed in parallel batches.
+ */
+class PackWriter
+{
+public:
+	//! Compare each object with the window objects before it, and
+	//! build delta chains of at most depth objects.
+	PackWriter(GitRepository &repo, size_t window = 10, size_t depth = 50,
+		size_t threads = 0);
+
+	//! Add object sha of type fmt, found at path if a tree or blob.
+	void add(const std::string &sha, const std::string &fmt,
+		const std::string &path);
+
+	//! Write pack-<checksum>.pack and .idx to dir, returns the checksum.
+	std::string write(const std::string &dir);
+
+	size_t object_count() const;
+
+	size_t delta_count() const;
+
+private:
+	struct Object
+	{
+		std::string sha;
+		GitPack::Type type;
+		uint32_t name_hash;
+		size_t size;
+		//! Index of the delta base, or none
+		size_t base;
+		size_t depth;
+		std::vector<unsigned char> delta;
+		uint64_t offset;
+		uint32_t crc;
+	};
+
+	GitRepository &m_repo;
+	size_t m_window;
+	size_t m_depth;
+	size_t m_threads;
+	std::vector<Object> m_objects;
+	size_t m_deltas;
+
+	//! Git's pack name hash, sorting similar paths together.
+	static uint32_t name_hash(const std::string &path);
+
+	//! Search deltas for the objects order[begin] to order[end - 1].
+	void find_deltas(const std::vector<size_t> &order, size_t begin, size_t end);
+
+	//! Objects in write order, each delta base before its deltas.
+	std::vector<size_t> write_order() const;
+};
+
+#endif
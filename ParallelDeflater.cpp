@@ -0,0 +1,85 @@
+#include <algorithm>
+
+#include "ParallelDeflater.h"
+#include "ThreadPool.h"
+#include "PerfTrace.h"
+
+#include "zlib.h"
+
+//! Size of the deflate window, and so of the useful dictionary.
+static const size_t window_size = 32 * 1024;
+
+ParallelDeflater::ParallelDeflater(size_t threads, size_t block_size) :
+	m_threads(threads),
+	m_block_size(std::max(block_size, window_size))
+{
+}
+
+std::vector<unsigned char>
+ParallelDeflater::compress(const std::vector<unsigned char> &data) const
+{
+	PERF_SCOPE("parallel_deflate");
+	size_t blocks = std::max<size_t>(1, (data.size() + m_block_size - 1) / m_block_size);
+	std::vector<std::vector<unsigned char> > out(blocks);
+	std::vector<uLong> checks(blocks);
+	std::vector<char> ok(blocks, 0);
+
+	ThreadPool pool(m_threads);
+	pool.parallel_for(blocks, [&](size_t i) {
+		size_t start = i * m_block_size;
+		size_t len = std::min(m_block_size, data.size() - start);
+		bool last = i + 1 == blocks;
+		const Bytef *in = data.data() + start;
+
+		// Raw deflate, the zlib header and trailer are added below
+		z_stream zs = {};
+		if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8,
+			Z_DEFAULT_STRATEGY) != Z_OK)
+		{
+			return;
+		}
+		if (i > 0)
+			deflateSetDictionary(&zs, in - window_size, window_size);
+
+		// A sync flush adds an empty stored block of 5 bytes
+		auto &block = out[i];
+		block.resize(deflateBound(&zs, len) + 16);
+		zs.next_in = const_cast<Bytef *>(in);
+		zs.avail_in = len;
+		zs.next_out = block.data();
+		zs.avail_out = block.size();
+		int status = deflate(&zs, last ? Z_FINISH : Z_SYNC_FLUSH);
+		if ((last && status == Z_STREAM_END) || (!last && status == Z_OK && zs.avail_in == 0))
+		{
+			block.resize(zs.total_out);
+			checks[i] = adler32(adler32(0, nullptr, 0), in, len);
+			ok[i] = 1;
+		}
+		deflateEnd(&zs);
+		PERF_COUNT(bytes_deflated, len);
+	});
+
+	std::vector<unsigned char> ret;
+	if (std::find(ok.begin(), ok.end(), 0) != ok.end())
+		return ret;
+
+	size_t total = 6;
+	for (const auto &block : out)
+		total += block.size();
+	ret.reserve(total);
+
+	// Deflate with a 32 KiB window at the default level, as compress()
+	// would write it
+	ret.push_back(0x78);
+	ret.push_back(0x9c);
+	uLong check = adler32(0, nullptr, 0);
+	for (size_t i = 0; i < blocks; i++)
+	{
+		ret.insert(ret.end(), out[i].begin(), out[i].end());
+		size_t len = std::min(m_block_size, data.size() - i * m_block_size);
+		check = adler32_combine(check, checks[i], len);
+	}
+	for (int shift = 24; shift >= 0; shift -= 8)
+		ret.push_back((check >> shift) & 0xff);
+	return ret;
+}
@@ -0,0 +1,36 @@
+#ifndef PARALLEL_DEFLATER_H
+#define PARALLEL_DEFLATER_H
+
+#include <vector>
+#include <cstddef>
+
+/**
+ * \brief Compresses large data into one zlib stream on many threads,
+ * the way pigz does.
+ *
+ * The data is split into blocks which are deflated independently,
+ * each primed with the last 32 KiB of the block before it as
+ * dictionary so that matches can reach back across the boundary.
+ * Every block but the last ends with a sync flush, which finishes it
+ * on a byte boundary without ending the stream, so the blocks can
+ * simply be concatenated between a zlib header and the Adler-32 of
+ * all data, combined from the checksums of the blocks.  The result
+ * only depends on the block size, not on the number of threads.
+ */
+class ParallelDeflater
+{
+public:
+	//! Compress on threads workers, or one per CPU if 0, in blocks
+	//! of block_size bytes.
+	ParallelDeflater(size_t threads = 0, size_t block_size = 128 * 1024);
+
+	//! zlib stream of data at the default compression level, or an
+	//! empty vector on failure.
+	std::vector<unsigned char> compress(const std::vector<unsigned char> &data) const;
+
+private:
+	size_t m_threads;
+	size_t m_block_size;
+};
+
+#endif
@@ -0,0 +1,199 @@
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <map>
+#include <thread>
+#include <unistd.h>
+
+#include "PerfTrace.h"
+
+static const char *counter_names[] = {
+	"objects_read",
+	"objects_inflated",
+	"bytes_inflated",
+	"bytes_deflated",
+	"cache_hits",
+	"syscalls",
+	"bitmap_hits",
+	"bloom_skips"
+};
+
+PerfTrace &
+PerfTrace::instance()
+{
+	static PerfTrace trace;
+	return trace;
+}
+
+PerfTrace::PerfTrace() :
+	m_epoch(clock::now())
+{
+	const char *filename = std::getenv("WYAG_TRACE_PERF");
+	if (filename)
+	{
+		m_filename = filename;
+		auto n = m_filename.size();
+		m_chrome = n > 5 && m_filename.compare(n - 5, 5, ".json") == 0;
+	}
+	for (auto &c : m_counters)
+	{
+		c = 0;
+	}
+}
+
+PerfTrace::~PerfTrace()
+{
+	flush();
+}
+
+bool
+PerfTrace::enabled() const
+{
+	return !m_filename.empty();
+}
+
+void
+PerfTrace::add(PerfCounter counter, uint64_t n)
+{
+	m_counters[static_cast<size_t>(counter)].fetch_add(n,
+		std::memory_order_relaxed);
+}
+
+void
+PerfTrace::record(const char *name, clock::time_point start,
+	clock::time_point end)
+{
+	if (!enabled())
+		return;
+
+	using std::chrono::duration_cast;
+	using std::chrono::microseconds;
+	uint64_t dur_us = duration_cast<microseconds>(end - start).count();
+	if (!m_chrome)
+	{
+		auto &t = thread_totals();
+		std::lock_guard<std::mutex> lock(t.mutex);
+		// Phase names are literals, a thread only uses a few of them
+		for (auto &total : t.totals)
+		{
+			if (total.first == name)
+			{
+				total.second.calls++;
+				total.second.us += dur_us;
+				return;
+			}
+		}
+		Total total;
+		total.calls = 1;
+		total.us = dur_us;
+		t.totals.emplace_back(name, total);
+		return;
+	}
+
+	Event e;
+	e.name = name;
+	e.start_us = duration_cast<microseconds>(start - m_epoch).count();
+	e.dur_us = dur_us;
+	e.tid = std::hash<std::thread::id>()(std::this_thread::get_id()) & 0xffffff;
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_events.push_back(e);
+}
+
+PerfTrace::ThreadTotals &
+PerfTrace::thread_totals()
+{
+	// Owned by m_threads, so the totals outlive the thread
+	thread_local ThreadTotals *totals = nullptr;
+	if (!totals)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_threads.emplace_back(new ThreadTotals);
+		totals = m_threads.back().get();
+	}
+	return *totals;
+}
+
+void
+PerfTrace::flush()
+{
+	if (!enabled())
+		return;
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	std::ofstream f(m_filename);
+	if (!f.is_open())
+	{
+		std::cerr << "Cannot write performance trace: " << m_filename << std::endl;
+		return;
+	}
+
+	if (m_chrome)
+		write_chrome_trace(f);
+	else
+		write_summary(f);
+
+	// Only write once, even if flushed explicitly before exit
+	m_events.clear();
+	m_filename.clear();
+}
+
+void
+PerfTrace::write_summary(std::ostream &out)
+{
+	std::map<std::string, Total> totals;
+	for (const auto &thread : m_threads)
+	{
+		std::lock_guard<std::mutex> lock(thread->mutex);
+		for (const auto &total : thread->totals)
+		{
+			auto &t = totals[total.first];
+			t.calls += total.second.calls;
+			t.us += total.second.us;
+		}
+	}
+
+	out << std::left << std::setw(24) << "phase" <<
+		std::right << std::setw(10) << "calls" <<
+		std::setw(14) << "total_us" << std::endl;
+	for (const auto &t : totals)
+	{
+		out << std::left << std::setw(24) << t.first <<
+			std::right << std::setw(10) << t.second.calls <<
+			std::setw(14) << t.second.us << std::endl;
+	}
+	out << std::endl;
+	for (size_t i = 0; i < static_cast<size_t>(PerfCounter::count); i++)
+	{
+		out << std::left << std::setw(24) << counter_names[i] <<
+			std::right << std::setw(24) << m_counters[i].load() << std::endl;
+	}
+}
+
+void
+PerfTrace::write_chrome_trace(std::ostream &out)
+{
+	auto pid = getpid();
+	uint64_t end_us = 0;
+
+	out << "{\"traceEvents\":[" << std::endl;
+	for (const auto &e : m_events)
+	{
+		out << "{\"name\":\"" << e.name << "\",\"ph\":\"X\"," <<
+			"\"ts\":" << e.start_us << ",\"dur\":" << e.dur_us <<
+			",\"pid\":" << pid << ",\"tid\":" << e.tid << "}," << std::endl;
+		end_us = std::max(end_us, e.start_us + e.dur_us);
+	}
+
+	// Counters are reported once, with their final values
+	out << "{\"name\":\"counters\",\"ph\":\"C\",\"ts\":" << end_us <<
+		",\"pid\":" << pid << ",\"args\":{";
+	for (size_t i = 0; i < static_cast<size_t>(PerfCounter::count); i++)
+	{
+		if (i > 0)
+			out << ",";
+		out << "\"" << counter_names[i] << "\":" << m_counters[i].load();
+	}
+	out << "}}" << std::endl << "]}" << std::endl;
+}
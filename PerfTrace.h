@@ -0,0 +1,135 @@
+#ifndef PERF_TRACE_H
+#define PERF_TRACE_H
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+
+/**
+ * \brief Counters collected while tracing is enabled.
+ */
+enum class PerfCounter
+{
+	objects_read,
+	objects_inflated,
+	bytes_inflated,
+	bytes_deflated,
+	cache_hits,
+	syscalls,
+	bitmap_hits,
+	bloom_skips,
+	count
+};
+
+/**
+ * \brief Process wide collector of scoped timers and counters.
+ *
+ * Only compiled into wyag when built with WYAG_TRACE_PERF defined
+ * (make TRACE_PERF=1).  At exit the collected data is written to the
+ * file named in the WYAG_TRACE_PERF environment variable: Chrome
+ * trace-event JSON if the name ends in ".json", otherwise a plain
+ * text summary.  Only the JSON trace keeps every phase; for the
+ * summary each thread just adds up calls and time per phase name.
+ */
+class PerfTrace
+{
+public:
+	using clock = std::chrono::steady_clock;
+
+	static PerfTrace &instance();
+
+	~PerfTrace();
+
+	//! Is a trace output file configured?
+	bool enabled() const;
+
+	void add(PerfCounter counter, uint64_t n);
+
+	//! Record a completed phase.
+	void record(const char *name, clock::time_point start,
+		clock::time_point end);
+
+	//! Write the collected data to the configured file.
+	void flush();
+
+private:
+	PerfTrace();
+
+	struct Event
+	{
+		const char *name;
+		uint64_t start_us;
+		uint64_t dur_us;
+		uint64_t tid;
+	};
+
+	struct Total
+	{
+		uint64_t calls = 0;
+		uint64_t us = 0;
+	};
+
+	//! Phase totals of one thread, only locked by it and by flush().
+	struct ThreadTotals
+	{
+		std::mutex mutex;
+		std::vector<std::pair<const char *, Total> > totals;
+	};
+
+	std::string m_filename;
+	bool m_chrome = false;
+	clock::time_point m_epoch;
+	std::atomic<uint64_t> m_counters[static_cast<size_t>(PerfCounter::count)];
+	std::mutex m_mutex;
+	std::vector<Event> m_events;
+	std::vector<std::unique_ptr<ThreadTotals> > m_threads;
+
+	//! The totals of the calling thread, created on first use.
+	ThreadTotals &thread_totals();
+
+	void write_summary(std::ostream &out);
+
+	void write_chrome_trace(std::ostream &out);
+};
+
+/**
+ * \brief Times the enclosing scope as one phase.
+ */
+class PerfScope
+{
+public:
+	PerfScope(const char *name) :
+		m_name(name)
+	{
+		// Make sure the trace epoch is set before our start time
+		PerfTrace::instance();
+		m_start = PerfTrace::clock::now();
+	};
+
+	~PerfScope()
+	{
+		PerfTrace::instance().record(m_name, m_start,
+			PerfTrace::clock::now());
+	};
+
+private:
+	const char *m_name;
+	PerfTrace::clock::time_point m_start;
+};
+
+#define PERF_CONCAT2(a, b) a##b
+#define PERF_CONCAT(a, b) PERF_CONCAT2(a, b)
+
+#ifdef WYAG_TRACE_PERF
+#define PERF_SCOPE(name) PerfScope PERF_CONCAT(perf_scope_, __LINE__)(name)
+#define PERF_COUNT(counter, n) PerfTrace::instance().add(PerfCounter::counter, (n))
+#else
+#define PERF_SCOPE(name) do {} while (0)
+#define PERF_COUNT(counter, n) do {} while (0)
+#endif
+
+#endif
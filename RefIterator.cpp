@@ -0,0 +1,169 @@
+#include <algorithm>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "RefIterator.h"
+#include "PerfTrace.h"
+
+RefIterator::RefIterator(const GitRepository &repo, const std::string &prefix) :
+	m_repo(repo),
+	m_prefix(prefix),
+	m_gitdir(repo.gitdir().string() + "/"),
+	m_has_loose(false)
+{
+	const auto &packed = m_repo.packed_ref_list();
+	m_packed = packed.lower_bound(m_prefix);
+	m_packed_end = packed.end();
+	if (m_repo.reftable())
+	{
+		m_reftable.reset(new ReftableStack::Iterator(*m_repo.reftable(), m_prefix));
+		return;
+	}
+	open_dir("refs/");
+	next_loose();
+}
+
+bool
+RefIterator::dir_matches(const std::string &name) const
+{
+	size_t len = std::min(name.size(), m_prefix.size());
+	return name.compare(0, len, m_prefix, 0, len) == 0;
+}
+
+void
+RefIterator::open_dir(const std::string &name)
+{
+	if (!dir_matches(name))
+		return;
+
+	PERF_COUNT(syscalls, 1);
+	DIR *dir = opendir((m_gitdir + name).c_str());
+	if (dir == nullptr)
+		return;
+
+	Dir d;
+	d.name = name;
+	d.pos = 0;
+	while (struct dirent *e = readdir(dir))
+	{
+		if (std::strcmp(e->d_name, ".") == 0 || std::strcmp(e->d_name, "..") == 0)
+			continue;
+		std::string entry = e->d_name;
+		if (entry.size() > 5 && entry.compare(entry.size() - 5, 5, ".lock") == 0)
+			continue;
+
+		bool is_dir = e->d_type == DT_DIR;
+		if (e->d_type == DT_UNKNOWN)
+		{
+			struct stat st;
+			PERF_COUNT(syscalls, 1);
+			is_dir = fstatat(dirfd(dir), e->d_name, &st, 0) == 0 && S_ISDIR(st.st_mode);
+		}
+		// With the '/' directories sort where their references do
+		if (is_dir)
+			entry += '/';
+		d.entries.push_back(entry);
+	}
+	closedir(dir);
+	std::sort(d.entries.begin(), d.entries.end());
+	m_dirs.push_back(std::move(d));
+}
+
+void
+RefIterator::next_loose()
+{
+	m_has_loose = false;
+	while (!m_dirs.empty())
+	{
+		auto &d = m_dirs.back();
+		if (d.pos == d.entries.size())
+		{
+			m_dirs.pop_back();
+			continue;
+		}
+		std::string name = d.name + d.entries[d.pos++];
+		if (name.back() == '/')
+		{
+			// May invalidate d
+			open_dir(name);
+			continue;
+		}
+		if (name.compare(0, m_prefix.size(), m_prefix) != 0)
+			continue;
+
+		PERF_COUNT(syscalls, 1);
+		int fd = open((m_gitdir + name).c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+			continue;
+		char buf[256];
+		ssize_t n = read(fd, buf, sizeof(buf));
+		close(fd);
+		if (n <= 0)
+			continue;
+		std::string line(buf, std::find(buf, buf + n, '\n'));
+		if (line.compare(0, 5, "ref: ") == 0)
+			line = m_repo.ref_resolve(line.substr(5));
+		if (line.empty())
+			continue;
+
+		m_has_loose = true;
+		m_loose_name = std::move(name);
+		m_loose_sha = std::move(line);
+		return;
+	}
+}
+
+bool
+RefIterator::next()
+{
+	if (m_reftable)
+	{
+		Reftable::Record rec;
+		while (m_reftable->next(rec))
+		{
+			m_name = rec.name;
+			m_sha = rec.type == Reftable::Record::symref ? m_repo.ref_resolve(rec.target) : rec.sha;
+			if (!m_sha.empty())
+				return true;
+		}
+		return false;
+	}
+
+	bool packed = m_packed != m_packed_end &&
+		m_packed->first.compare(0, m_prefix.size(), m_prefix) == 0;
+	if (!packed && !m_has_loose)
+		return false;
+
+	int cmp = !packed ? -1 : (!m_has_loose ? 1 : m_loose_name.compare(m_packed->first));
+	if (cmp <= 0)
+	{
+		m_name.swap(m_loose_name);
+		m_sha.swap(m_loose_sha);
+		next_loose();
+		// The loose reference replaces the packed one
+		if (cmp == 0)
+			++m_packed;
+	}
+	else
+	{
+		m_name = m_packed->first;
+		m_sha = m_packed->second;
+		++m_packed;
+	}
+	return true;
+}
+
+const std::string &
+RefIterator::name() const
+{
+	return m_name;
+}
+
+const std::string &
+RefIterator::sha() const
+{
+	return m_sha;
+}
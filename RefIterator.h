@@ -0,0 +1,74 @@
+#ifndef REF_ITERATOR_H
+#define REF_ITERATOR_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+
+#include "GitRepository.h"
+#include "ReftableStack.h"
+
+/**
+ * \brief Iterates over the references starting with a prefix, sorted
+ * by name.
+ *
+ * Loose references are read one directory at a time while iterating,
+ * and only directories which can hold names with the prefix are read,
+ * so that listing "refs/tags/" never opens "refs/heads".  They are
+ * merged with the packed references on the fly, a loose reference
+ * hiding a packed one of the same name, like git does.  In a
+ * repository using reftables, the tables are merged instead.
+ */
+class RefIterator
+{
+public:
+	RefIterator(const GitRepository &repo, const std::string &prefix = "refs/");
+
+	//! Move to the next reference, returns false after the last one.
+	bool next();
+
+	//! Full name of the reference, such as "refs/heads/master".
+	const std::string &name() const;
+
+	//! Object id the reference points to, following symbolic refs.
+	const std::string &sha() const;
+
+private:
+	//! A directory of loose references being read.
+	struct Dir
+	{
+		//! Name relative to the gitdir, ending in '/'.
+		std::string name;
+		//! Sorted entries, directories have a trailing '/'.
+		std::vector<std::string> entries;
+		size_t pos;
+	};
+
+	const GitRepository &m_repo;
+	std::string m_prefix;
+	std::string m_gitdir;
+	std::vector<Dir> m_dirs;
+	std::map<std::string, std::string>::const_iterator m_packed;
+	std::map<std::string, std::string>::const_iterator m_packed_end;
+	std::unique_ptr<ReftableStack::Iterator> m_reftable;
+
+	//! Next loose reference, read ahead for merging.
+	bool m_has_loose;
+	std::string m_loose_name;
+	std::string m_loose_sha;
+
+	std::string m_name;
+	std::string m_sha;
+
+	//! Push directory name if it may hold references with the prefix.
+	void open_dir(const std::string &name);
+
+	//! Read ahead the next loose reference.
+	void next_loose();
+
+	//! Can references below directory name start with the prefix?
+	bool dir_matches(const std::string &name) const;
+};
+
+#endif
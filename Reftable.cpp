@@ -0,0 +1,348 @@
+#include <cstring>
+#include <zlib.h>
+
+#include "Reftable.h"
+#include "GitPack.h"
+#include "GitException.h"
+#include "PerfTrace.h"
+
+//! Header of version 1, with only SHA-1 object ids, and the footer
+//! repeating it.
+static const size_t header_size = 24;
+static const size_t footer_size = header_size + 5 * 8 + 4;
+
+static uint32_t
+get16(const unsigned char *p)
+{
+	return (uint32_t(p[0]) << 8) | uint32_t(p[1]);
+}
+
+static uint32_t
+get24(const unsigned char *p)
+{
+	return (uint32_t(p[0]) << 16) | (uint32_t(p[1]) << 8) | uint32_t(p[2]);
+}
+
+static uint32_t
+get32(const unsigned char *p)
+{
+	return (uint32_t(p[0]) << 24) | get24(p + 1);
+}
+
+static uint64_t
+get64(const unsigned char *p)
+{
+	return (uint64_t(get32(p)) << 32) | get32(p + 4);
+}
+
+static GitException
+corrupt(const std::string &path)
+{
+	return GitException("Corrupt reftable " + path);
+}
+
+Reftable::Reftable(const std::string &path) :
+	m_file(new MappedFile(path)),
+	m_header_size(header_size),
+	m_ref_end(0),
+	m_ref_index(0)
+{
+	PERF_SCOPE("reftable_read");
+	const unsigned char *p = m_file->data();
+	size_t len = m_file->size();
+	if (len < header_size + footer_size || std::memcmp(p, "REFT", 4) != 0)
+		throw GitException("Not a reftable: " + path);
+	if (p[4] != 1)
+		throw GitException("Unsupported reftable version in " + path);
+	m_block_size = get24(p + 5);
+	m_min_update_index = get64(p + 8);
+	m_max_update_index = get64(p + 16);
+
+	const unsigned char *footer = p + len - footer_size;
+	if (m_block_size == 0 || std::memcmp(footer, p, header_size) != 0 ||
+		crc32(0, footer, footer_size - 4) != get32(footer + footer_size - 4))
+	{
+		throw corrupt(path);
+	}
+
+	// The ref blocks end where the first other section starts, the
+	// sections are in this order
+	m_ref_index = get64(footer + header_size);
+	uint64_t obj = get64(footer + header_size + 8) >> 5;
+	uint64_t log = get64(footer + header_size + 24);
+	m_ref_end = len - footer_size;
+	for (uint64_t offset : {log, obj, static_cast<uint64_t>(m_ref_index)})
+	{
+		if (offset > m_ref_end)
+			throw corrupt(path);
+		if (offset != 0)
+			m_ref_end = offset;
+	}
+}
+
+const std::string &
+Reftable::path() const
+{
+	return m_file->path();
+}
+
+size_t
+Reftable::size() const
+{
+	return m_file->size();
+}
+
+uint64_t
+Reftable::min_update_index() const
+{
+	return m_min_update_index;
+}
+
+uint64_t
+Reftable::max_update_index() const
+{
+	return m_max_update_index;
+}
+
+bool
+Reftable::find(const std::string &name, Record &rec) const
+{
+	Iterator it(*this);
+	it.seek(name);
+	return it.next(rec) && rec.name == name;
+}
+
+Reftable::Iterator::Iterator(const Reftable &table) :
+	m_table(table),
+	m_block(0),
+	m_type(0),
+	m_len(0),
+	m_pos(0),
+	m_end(0),
+	m_done(true)
+{
+}
+
+bool
+Reftable::Iterator::load(size_t offset, unsigned char type)
+{
+	const unsigned char *data = m_table.m_file->data();
+	size_t limit = type == 'r' ? m_table.m_ref_end : m_table.size() - footer_size;
+	size_t header = offset == 0 ? m_table.m_header_size : 0;
+	if (offset + header + 4 > limit || data[offset + header] != type)
+		return false;
+
+	size_t len = get24(data + offset + header + 1);
+	if (len < header + 4 + 2 || len > limit - offset)
+		throw corrupt(m_table.path());
+	size_t restarts = get16(data + offset + len - 2);
+	if (restarts == 0 || header + 4 + 3 * restarts + 2 > len)
+		throw corrupt(m_table.path());
+	m_block = offset;
+	m_type = type;
+	m_len = len;
+	m_pos = offset + header + 4;
+	m_end = offset + len - 2 - 3 * restarts;
+	m_key.clear();
+	m_done = false;
+	return true;
+}
+
+size_t
+Reftable::Iterator::next_block() const
+{
+	// Blocks are padded with zeros to the block size, unless the table
+	// was written unaligned
+	const unsigned char *data = m_table.m_file->data();
+	size_t end = m_block + m_len;
+	if (m_len < m_table.m_block_size && end < m_table.size() && data[end] != 0)
+		return end;
+	return m_block + m_table.m_block_size;
+}
+
+uint64_t
+Reftable::Iterator::read_varint()
+{
+	// Same encoding as the offsets of packfile deltas
+	const unsigned char *data = m_table.m_file->data();
+	if (m_pos >= m_end)
+		throw corrupt(m_table.path());
+	unsigned char c = data[m_pos++];
+	uint64_t v = c & 0x7f;
+	while (c & 0x80)
+	{
+		if (m_pos >= m_end || v >> 56)
+			throw corrupt(m_table.path());
+		c = data[m_pos++];
+		v = ((v + 1) << 7) | (c & 0x7f);
+	}
+	return v;
+}
+
+uint8_t
+Reftable::Iterator::read_key()
+{
+	uint64_t prefix = read_varint();
+	uint64_t suffix = read_varint();
+	uint8_t type = suffix & 7;
+	suffix >>= 3;
+	if (prefix > m_key.size() || suffix > m_end - m_pos)
+		throw corrupt(m_table.path());
+	m_key.resize(prefix);
+	m_key.append(reinterpret_cast<const char *>(m_table.m_file->data() + m_pos), suffix);
+	m_pos += suffix;
+	return type;
+}
+
+void
+Reftable::Iterator::read_value(uint8_t type, Record &rec)
+{
+	const unsigned char *data = m_table.m_file->data();
+	rec.update_index = m_table.m_min_update_index + read_varint();
+	rec.type = static_cast<Record::Type>(type);
+	rec.sha.clear();
+	rec.peeled.clear();
+	rec.target.clear();
+	switch (type)
+	{
+	case Record::deletion:
+		break;
+	case Record::value:
+	case Record::peeled_value:
+		if (m_end - m_pos < (type == Record::value ? 20u : 40u))
+			throw corrupt(m_table.path());
+		rec.sha = GitPack::to_hex(data + m_pos);
+		m_pos += 20;
+		if (type == Record::peeled_value)
+		{
+			rec.peeled = GitPack::to_hex(data + m_pos);
+			m_pos += 20;
+		}
+		break;
+	case Record::symref:
+	{
+		uint64_t len = read_varint();
+		if (len > m_end - m_pos)
+			throw corrupt(m_table.path());
+		rec.target.assign(reinterpret_cast<const char *>(data + m_pos), len);
+		m_pos += len;
+		break;
+	}
+	default:
+		throw corrupt(m_table.path());
+	}
+}
+
+void
+Reftable::Iterator::seek_block(const std::string &name)
+{
+	// Restart points hold full keys, find the last one not after name
+	const unsigned char *data = m_table.m_file->data();
+	size_t restarts = (m_block + m_len - 2 - m_end) / 3;
+	size_t lo = 0;
+	size_t hi = restarts;
+	size_t start = m_pos;
+	while (hi - lo > 1)
+	{
+		size_t mid = (lo + hi) / 2;
+		m_pos = m_block + get24(data + m_end + 3 * mid);
+		m_key.clear();
+		read_key();
+		if (m_key <= name)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	m_pos = lo == 0 ? start : m_block + get24(data + m_end + 3 * lo);
+	m_key.clear();
+
+	// Then skip the records before name
+	Record rec;
+	while (m_pos < m_end)
+	{
+		size_t pos = m_pos;
+		std::string key = m_key;
+		uint8_t type = read_key();
+		if (m_key >= name)
+		{
+			m_pos = pos;
+			m_key.swap(key);
+			return;
+		}
+		if (m_type == 'r')
+			read_value(type, rec);
+		else
+			read_varint();
+	}
+}
+
+void
+Reftable::Iterator::seek(const std::string &name)
+{
+	m_done = false;
+	if (m_table.m_ref_index != 0)
+	{
+		// Each index record holds the last key of a block of the level
+		// below and its offset.  The root level may span several blocks.
+		size_t offset = m_table.m_ref_index;
+		if (!load(offset, 'i'))
+			throw corrupt(m_table.path());
+		while (true)
+		{
+			seek_block(name);
+			if (m_pos == m_end)
+			{
+				if (!load(next_block(), 'i'))
+				{
+					m_done = true;
+					return;
+				}
+				continue;
+			}
+			read_key();
+			offset = read_varint();
+			if (load(offset, 'r'))
+				break;
+			if (!load(offset, 'i'))
+				throw corrupt(m_table.path());
+		}
+	}
+	else
+	{
+		// Without an index, skip the blocks starting before name
+		if (!load(0, 'r'))
+		{
+			m_done = true;
+			return;
+		}
+		while (true)
+		{
+			size_t offset = next_block();
+			Iterator following(m_table);
+			Record rec;
+			if (!following.load(offset, 'r') || !following.next(rec) || rec.name > name)
+				break;
+			load(offset, 'r');
+		}
+	}
+	seek_block(name);
+}
+
+bool
+Reftable::Iterator::next(Record &rec)
+{
+	while (!m_done)
+	{
+		if (m_pos == m_end)
+		{
+			if (!load(next_block(), 'r'))
+				m_done = true;
+			continue;
+		}
+		uint8_t type = read_key();
+		rec.name = m_key;
+		read_value(type, rec);
+		return true;
+	}
+	return false;
+}
@@ -0,0 +1,113 @@
+#ifndef REFTABLE_H
+#define REFTABLE_H
+
+#include <string>
+#include <memory>
+#include <cstdint>
+
+#include "MappedFile.h"
+
+/**
+ * \brief One table of references in the reftable format.
+ *
+ * A table is a sorted sequence of blocks, each holding prefix
+ * compressed records with a full name every few records, the restart
+ * points.  Lookups binary search the restart points of a block, and
+ * the index blocks lead from a name to its block, so finding a name
+ * reads a few blocks of the mapped file whatever the size of the
+ * table.  Reference logs and the object index are not read.
+ */
+class Reftable
+{
+public:
+	//! A reference, or the deletion of one.
+	struct Record
+	{
+		enum Type : uint8_t { deletion = 0, value = 1, peeled_value = 2, symref = 3 };
+
+		std::string name;
+		uint64_t update_index;
+		Type type;
+		//! Object id for value and peeled_value.
+		std::string sha;
+		//! Object a tag points to, for peeled_value.
+		std::string peeled;
+		//! Name of the reference a symref points to.
+		std::string target;
+	};
+
+	/**
+	 * \brief Reads the references of a table in name order.
+	 */
+	class Iterator
+	{
+	public:
+		Iterator(const Reftable &table);
+
+		//! Move before the first reference not sorting before name.
+		void seek(const std::string &name);
+
+		//! Read the next reference, returns false after the last.
+		bool next(Record &rec);
+
+	private:
+		const Reftable &m_table;
+		//! Offset and length of the block, of the next record in it
+		//! and of the restart table ending the records.
+		size_t m_block;
+		unsigned char m_type;
+		size_t m_len;
+		size_t m_pos;
+		size_t m_end;
+		bool m_done;
+		//! Key of the last record read, for prefix compression.
+		std::string m_key;
+
+		//! Start reading the records of the block of type at offset,
+		//! returns false if there is no such block.
+		bool load(size_t offset, unsigned char type);
+
+		//! Offset of the block following the current one.
+		size_t next_block() const;
+
+		//! Move within the block before the first key >= name.
+		void seek_block(const std::string &name);
+
+		//! Read the key of the next record into m_key, returns the
+		//! type of its value.
+		uint8_t read_key();
+
+		uint64_t read_varint();
+
+		//! Read the value of a ref record into rec.
+		void read_value(uint8_t type, Record &rec);
+	};
+
+	//! Open the table at path, throws GitException if invalid.
+	Reftable(const std::string &path);
+
+	const std::string &path() const;
+
+	//! Size of the file in bytes.
+	size_t size() const;
+
+	uint64_t min_update_index() const;
+
+	uint64_t max_update_index() const;
+
+	//! Find reference name, returns false if the table has no record
+	//! of it.  A deletion record is returned like any other.
+	bool find(const std::string &name, Record &rec) const;
+
+private:
+	std::unique_ptr<MappedFile> m_file;
+	size_t m_header_size;
+	size_t m_block_size;
+	uint64_t m_min_update_index;
+	uint64_t m_max_update_index;
+	//! End of the ref blocks, and the root of their index or 0.
+	size_t m_ref_end;
+	size_t m_ref_index;
+};
+
+#endif
@@ -0,0 +1,268 @@
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <fstream>
+#include <random>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "ReftableStack.h"
+#include "ReftableWriter.h"
+#include "GitException.h"
+#include "PerfTrace.h"
+
+//! Times to reread tables.list when a table it names was just
+//! compacted away by another process.
+static const int reload_attempts = 5;
+
+//! Newer tables are merged while their total size reaches half of
+//! the size of the table before them.
+static const size_t compaction_factor = 2;
+
+static const int lock_timeout_ms = 100;
+
+ReftableStack::Iterator::Iterator(const std::vector<const Reftable *> &tables,
+	const std::string &prefix, bool deletions) :
+	m_prefix(prefix),
+	m_deletions(deletions),
+	m_records(tables.size()),
+	m_valid(tables.size(), false)
+{
+	for (size_t i = 0; i < tables.size(); i++)
+	{
+		m_iterators.emplace_back(*tables[i]);
+		m_iterators.back().seek(prefix);
+		advance(i);
+	}
+}
+
+ReftableStack::Iterator::Iterator(const ReftableStack &stack, const std::string &prefix) :
+	Iterator(stack.tables(0, stack.m_tables.size()), prefix)
+{
+}
+
+void
+ReftableStack::Iterator::advance(size_t i)
+{
+	m_valid[i] = m_iterators[i].next(m_records[i]) &&
+		m_records[i].name.compare(0, m_prefix.size(), m_prefix) == 0;
+}
+
+bool
+ReftableStack::Iterator::next(Reftable::Record &rec)
+{
+	while (true)
+	{
+		// The smallest name, from the newest table having it
+		size_t best = m_records.size();
+		for (size_t i = 0; i < m_records.size(); i++)
+		{
+			if (m_valid[i] && (best == m_records.size() || m_records[i].name <= m_records[best].name))
+				best = i;
+		}
+		if (best == m_records.size())
+			return false;
+
+		rec = m_records[best];
+		for (size_t i = 0; i < m_records.size(); i++)
+		{
+			if (m_valid[i] && m_records[i].name == rec.name)
+				advance(i);
+		}
+		if (m_deletions || rec.type != Reftable::Record::deletion)
+			return true;
+	}
+}
+
+ReftableStack::ReftableStack(const std::string &dir) :
+	m_dir(dir)
+{
+	reload();
+}
+
+void
+ReftableStack::create(const std::string &dir)
+{
+	if (mkdir(dir.c_str(), 0777) != 0 && errno != EEXIST)
+		throw GitException("Cannot create directory " + dir);
+	std::ofstream f(dir + "/tables.list");
+	if (!f)
+		throw GitException("Cannot create " + dir + "/tables.list");
+}
+
+void
+ReftableStack::reload()
+{
+	PERF_SCOPE("reftable_reload");
+	for (int attempt = 1; ; attempt++)
+	{
+		m_names.clear();
+		m_tables.clear();
+		PERF_COUNT(syscalls, 1);
+		std::ifstream f(m_dir + "/tables.list");
+		if (!f.is_open())
+			throw GitException("Missing " + m_dir + "/tables.list");
+		std::string name;
+		while (std::getline(f, name))
+		{
+			if (!name.empty())
+				m_names.push_back(name);
+		}
+
+		try
+		{
+			for (const auto &table : m_names)
+				m_tables.emplace_back(new Reftable(m_dir + "/" + table));
+			return;
+		}
+		catch (const GitException &)
+		{
+			// A compaction may have replaced the table
+			if (attempt == reload_attempts)
+				throw;
+		}
+	}
+}
+
+std::vector<const Reftable *>
+ReftableStack::tables(size_t begin, size_t end) const
+{
+	std::vector<const Reftable *> ret;
+	for (size_t i = begin; i < end; i++)
+		ret.push_back(m_tables[i].get());
+	return ret;
+}
+
+bool
+ReftableStack::find(const std::string &name, Reftable::Record &rec) const
+{
+	for (auto it = m_tables.rbegin(); it != m_tables.rend(); ++it)
+	{
+		if ((*it)->find(name, rec))
+			return rec.type != Reftable::Record::deletion;
+	}
+	return false;
+}
+
+size_t
+ReftableStack::table_count() const
+{
+	return m_tables.size();
+}
+
+std::string
+ReftableStack::write_table(uint64_t min_update_index, uint64_t max_update_index,
+	const std::function<void(ReftableWriter &)> &fill) const
+{
+	ReftableWriter writer(min_update_index, max_update_index);
+	fill(writer);
+
+	static std::mt19937 random(std::random_device{}());
+	char name[64];
+	std::snprintf(name, sizeof(name), "0x%012" PRIx64 "-0x%012" PRIx64 "-%08x.ref",
+		min_update_index, max_update_index, static_cast<unsigned int>(random()));
+	auto tmp = m_dir + "/tmp_table_" + std::to_string(getpid());
+	writer.write(tmp);
+	if (std::rename(tmp.c_str(), (m_dir + "/" + name).c_str()) != 0)
+	{
+		unlink(tmp.c_str());
+		throw GitException("Cannot write reftable " + m_dir + "/" + name);
+	}
+	return name;
+}
+
+std::vector<std::string>
+ReftableStack::compact()
+{
+	// Merge the newest tables while the next older one is not much
+	// larger than all of them together
+	size_t begin = m_tables.size();
+	size_t size = 0;
+	while (begin > 0 && (begin == m_tables.size() ||
+		m_tables[begin - 1]->size() <= compaction_factor * size))
+	{
+		size += m_tables[--begin]->size();
+	}
+	if (m_tables.size() - begin < 2)
+		return std::vector<std::string>();
+
+	PERF_SCOPE("reftable_compact");
+	// Deletions must hide references in older tables, unless there
+	// are none
+	Iterator it(tables(begin, m_tables.size()), std::string(), begin > 0);
+	auto name = write_table(m_tables[begin]->min_update_index(),
+		m_tables.back()->max_update_index(), [&it](ReftableWriter &writer) {
+			Reftable::Record rec;
+			while (it.next(rec))
+				writer.add(rec);
+		});
+
+	std::vector<std::string> replaced(m_names.begin() + begin, m_names.end());
+	m_names.erase(m_names.begin() + begin, m_names.end());
+	m_tables.erase(m_tables.begin() + begin, m_tables.end());
+	m_names.push_back(name);
+	m_tables.emplace_back(new Reftable(m_dir + "/" + name));
+	return replaced;
+}
+
+void
+ReftableStack::add(std::vector<Reftable::Record> records,
+	const std::function<void(const ReftableStack &)> &check)
+{
+	PERF_SCOPE("reftable_add");
+	auto list = m_dir + "/tables.list";
+	auto lock = list + ".lock";
+	// Wait a little for other writers, like git does
+	int fd = -1;
+	for (int waited = 0; fd < 0 && waited <= lock_timeout_ms; waited++)
+	{
+		fd = open(lock.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+		if (fd < 0 && errno == EEXIST)
+			usleep(1000);
+		else
+			break;
+	}
+	if (fd < 0)
+		throw GitException("Unable to lock " + list + ", another process may be updating references");
+	close(fd);
+
+	std::vector<std::string> replaced;
+	try
+	{
+		reload();
+		if (check)
+			check(*this);
+
+		std::sort(records.begin(), records.end(),
+			[](const Reftable::Record &a, const Reftable::Record &b) {
+				return a.name < b.name;
+			});
+		uint64_t update_index = m_tables.empty() ? 1 : m_tables.back()->max_update_index() + 1;
+		for (auto &rec : records)
+			rec.update_index = update_index;
+		auto name = write_table(update_index, update_index, [&records](ReftableWriter &writer) {
+			for (const auto &rec : records)
+				writer.add(rec);
+		});
+		m_names.push_back(name);
+		m_tables.emplace_back(new Reftable(m_dir + "/" + name));
+		replaced = compact();
+
+		std::ofstream f(lock);
+		for (const auto &table : m_names)
+			f << table << "\n";
+		f.close();
+		if (!f || std::rename(lock.c_str(), list.c_str()) != 0)
+			throw GitException("Cannot write " + list);
+	}
+	catch (...)
+	{
+		unlink(lock.c_str());
+		throw;
+	}
+
+	for (const auto &table : replaced)
+		unlink((m_dir + "/" + table).c_str());
+}
@@ -0,0 +1,91 @@
+#ifndef REFTABLE_STACK_H
+#define REFTABLE_STACK_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <functional>
+
+#include "Reftable.h"
+
+class ReftableWriter;
+
+/**
+ * \brief The references of a repository using the reftable backend.
+ *
+ * The tables listed in reftable/tables.list are read from the oldest
+ * to the newest, a newer table overriding the records of older ones.
+ * An update writes one small table with all its changes and renames a
+ * new list into place, so that readers see all or none of them.  When
+ * the newest tables grow about as large as the ones before them, they
+ * are merged into one, keeping the number of tables logarithmic.
+ */
+class ReftableStack
+{
+public:
+	/**
+	 * \brief Reads the references of several tables in name order,
+	 * with the newest record of each name.
+	 */
+	class Iterator
+	{
+	public:
+		//! References starting with prefix in tables, oldest first.
+		Iterator(const std::vector<const Reftable *> &tables,
+			const std::string &prefix, bool deletions = false);
+
+		Iterator(const ReftableStack &stack, const std::string &prefix);
+
+		//! Read the next reference, returns false after the last.
+		bool next(Reftable::Record &rec);
+
+	private:
+		std::string m_prefix;
+		bool m_deletions;
+		std::vector<Reftable::Iterator> m_iterators;
+		//! Next record of each table, if it has one.
+		std::vector<Reftable::Record> m_records;
+		std::vector<bool> m_valid;
+
+		void advance(size_t i);
+	};
+
+	//! Open the stack in directory dir, throws GitException if a
+	//! table is invalid.
+	ReftableStack(const std::string &dir);
+
+	//! Create an empty stack in directory dir.
+	static void create(const std::string &dir);
+
+	//! Find reference name, returns false if it does not exist.
+	bool find(const std::string &name, Reftable::Record &rec) const;
+
+	size_t table_count() const;
+
+	//! Write records as a new table, after calling check with the
+	//! stack reread while it is locked.  Check throws GitException to
+	//! cancel the update.  The update index of the records is set.
+	void add(std::vector<Reftable::Record> records,
+		const std::function<void(const ReftableStack &)> &check = nullptr);
+
+private:
+	std::string m_dir;
+	//! File names and tables of tables.list, oldest first.
+	std::vector<std::string> m_names;
+	std::vector<std::unique_ptr<Reftable> > m_tables;
+
+	//! Read tables.list and open its tables.
+	void reload();
+
+	std::vector<const Reftable *> tables(size_t begin, size_t end) const;
+
+	//! Write records to a new table file, returns its name.
+	std::string write_table(uint64_t min_update_index, uint64_t max_update_index,
+		const std::function<void(ReftableWriter &)> &fill) const;
+
+	//! Merge the newest tables if they are about as large as the one
+	//! before them.  Returns the names of the tables replaced.
+	std::vector<std::string> compact();
+};
+
+#endif
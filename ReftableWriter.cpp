@@ -0,0 +1,221 @@
+#include <fstream>
+#include <zlib.h>
+
+#include "ReftableWriter.h"
+#include "GitPack.h"
+#include "GitException.h"
+#include "PerfTrace.h"
+
+static const size_t header_size = 24;
+static const size_t restart_interval = 16;
+
+//! Write an index when there are more blocks than this.
+static const size_t index_threshold = 3;
+
+static void
+put24(std::vector<unsigned char> &out, uint32_t v)
+{
+	for (int shift = 16; shift >= 0; shift -= 8)
+		out.push_back(static_cast<unsigned char>(v >> shift));
+}
+
+static void
+put32(std::vector<unsigned char> &out, uint32_t v)
+{
+	out.push_back(static_cast<unsigned char>(v >> 24));
+	put24(out, v);
+}
+
+static void
+put64(std::vector<unsigned char> &out, uint64_t v)
+{
+	put32(out, static_cast<uint32_t>(v >> 32));
+	put32(out, static_cast<uint32_t>(v));
+}
+
+static void
+put_varint(std::vector<unsigned char> &out, uint64_t v)
+{
+	unsigned char buf[10];
+	size_t i = sizeof(buf) - 1;
+	buf[i] = v & 0x7f;
+	while (v >>= 7)
+		buf[--i] = 0x80 | (--v & 0x7f);
+	out.insert(out.end(), buf + i, buf + sizeof(buf));
+}
+
+static void
+put_id(std::vector<unsigned char> &out, const std::string &sha)
+{
+	unsigned char id[20];
+	GitPack::from_hex(sha, id);
+	out.insert(out.end(), id, id + 20);
+}
+
+ReftableWriter::ReftableWriter(uint64_t min_update_index, uint64_t max_update_index,
+	size_t block_size) :
+	m_min_update_index(min_update_index),
+	m_max_update_index(max_update_index),
+	m_block_size(block_size),
+	m_count(0),
+	m_type(0),
+	m_block_records(0)
+{
+}
+
+void
+ReftableWriter::header(std::vector<unsigned char> &out) const
+{
+	out.insert(out.end(), {'R', 'E', 'F', 'T', 1});
+	put24(out, m_block_size);
+	put64(out, m_min_update_index);
+	put64(out, m_max_update_index);
+}
+
+void
+ReftableWriter::add(const Reftable::Record &rec)
+{
+	if (m_count > 0 && rec.name <= m_last)
+		throw GitException("Reftable records out of order at " + rec.name);
+	if (rec.update_index < m_min_update_index || rec.update_index > m_max_update_index)
+		throw GitException("Update index of " + rec.name + " outside the table");
+
+	std::vector<unsigned char> value;
+	put_varint(value, rec.update_index - m_min_update_index);
+	switch (rec.type)
+	{
+	case Reftable::Record::deletion:
+		break;
+	case Reftable::Record::value:
+		put_id(value, rec.sha);
+		break;
+	case Reftable::Record::peeled_value:
+		put_id(value, rec.sha);
+		put_id(value, rec.peeled);
+		break;
+	case Reftable::Record::symref:
+		put_varint(value, rec.target.size());
+		value.insert(value.end(), rec.target.begin(), rec.target.end());
+		break;
+	}
+	add_record('r', rec.name, rec.type, value);
+	m_count++;
+}
+
+size_t
+ReftableWriter::size() const
+{
+	return m_count;
+}
+
+void
+ReftableWriter::add_record(unsigned char type, const std::string &key, uint8_t value_type,
+	const std::vector<unsigned char> &value)
+{
+	for (int attempt = 0; attempt < 2; attempt++)
+	{
+		if (m_block.empty())
+		{
+			// The first block also holds the file header
+			if (m_out.empty())
+				header(m_block);
+			m_type = type;
+			m_block.push_back(type);
+			put24(m_block, 0);
+			m_restarts.clear();
+			m_last.clear();
+			m_block_records = 0;
+		}
+
+		bool restart = m_block_records % restart_interval == 0;
+		size_t prefix = 0;
+		if (!restart)
+		{
+			while (prefix < key.size() && prefix < m_last.size() && key[prefix] == m_last[prefix])
+				prefix++;
+		}
+		std::vector<unsigned char> rec;
+		put_varint(rec, prefix);
+		put_varint(rec, ((key.size() - prefix) << 3) | value_type);
+		rec.insert(rec.end(), key.begin() + prefix, key.end());
+		rec.insert(rec.end(), value.begin(), value.end());
+
+		size_t restarts = m_restarts.size() + (restart ? 1 : 0);
+		if (m_block.size() + rec.size() + 3 * restarts + 2 > m_block_size)
+		{
+			if (m_restarts.empty())
+				throw GitException("Reftable record too large: " + key);
+			flush_block();
+			continue;
+		}
+		if (restart)
+			m_restarts.push_back(m_block.size());
+		m_block.insert(m_block.end(), rec.begin(), rec.end());
+		m_last = key;
+		m_block_records++;
+		return;
+	}
+}
+
+void
+ReftableWriter::flush_block()
+{
+	size_t header = m_out.empty() ? header_size : 0;
+	for (auto offset : m_restarts)
+		put24(m_block, offset);
+	m_block.push_back(static_cast<unsigned char>(m_restarts.size() >> 8));
+	m_block.push_back(static_cast<unsigned char>(m_restarts.size()));
+
+	// The length counts the file header in the first block
+	size_t len = m_block.size();
+	m_block[header + 1] = static_cast<unsigned char>(len >> 16);
+	m_block[header + 2] = static_cast<unsigned char>(len >> 8);
+	m_block[header + 3] = static_cast<unsigned char>(len);
+
+	m_blocks.push_back(std::make_pair(m_last, m_out.size()));
+	m_block.resize(m_block_size, 0);
+	m_out.insert(m_out.end(), m_block.begin(), m_block.end());
+	m_block.clear();
+}
+
+void
+ReftableWriter::write(const std::string &path)
+{
+	PERF_SCOPE("reftable_write");
+	if (!m_block.empty())
+		flush_block();
+
+	// Each level indexes the blocks of the one below, the reader starts
+	// from the last
+	uint64_t ref_index = 0;
+	while (m_blocks.size() > index_threshold)
+	{
+		auto blocks = std::move(m_blocks);
+		m_blocks.clear();
+		ref_index = m_out.size();
+		for (const auto &block : blocks)
+		{
+			std::vector<unsigned char> value;
+			put_varint(value, block.second);
+			add_record('i', block.first, 0, value);
+		}
+		flush_block();
+	}
+
+	if (m_out.empty())
+		header(m_out);
+	std::vector<unsigned char> footer;
+	header(footer);
+	put64(footer, ref_index);
+	// No object index and no reference logs
+	for (int i = 0; i < 4; i++)
+		put64(footer, 0);
+	put32(footer, crc32(0, footer.data(), footer.size()));
+	m_out.insert(m_out.end(), footer.begin(), footer.end());
+
+	std::ofstream f(path, std::ios::binary);
+	f.write(reinterpret_cast<const char *>(m_out.data()), m_out.size());
+	f.close();
+	if (!f)
+		throw GitException("Cannot write reftable: " + path);
+}
@@ -0,0 +1,62 @@
+#ifndef REFTABLE_WRITER_H
+#define REFTABLE_WRITER_H
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <cstdint>
+
+#include "Reftable.h"
+
+/**
+ * \brief Writes a table of references in the reftable format.
+ *
+ * Records are added sorted by name and packed into blocks of a fixed
+ * size with a restart point every 16 records.  Tables with more than
+ * a few ref blocks get index blocks, in as many levels as needed for
+ * the top level to fit in a few blocks.
+ */
+class ReftableWriter
+{
+public:
+	ReftableWriter(uint64_t min_update_index, uint64_t max_update_index,
+		size_t block_size = 4096);
+
+	//! Add a record, throws GitException unless its name sorts after
+	//! the previous one.
+	void add(const Reftable::Record &rec);
+
+	//! Number of records added.
+	size_t size() const;
+
+	//! Finish the table and write it to path.
+	void write(const std::string &path);
+
+private:
+	uint64_t m_min_update_index;
+	uint64_t m_max_update_index;
+	size_t m_block_size;
+	size_t m_count;
+	std::vector<unsigned char> m_out;
+
+	//! The block being filled, its type, restart points and last key.
+	std::vector<unsigned char> m_block;
+	unsigned char m_type;
+	std::vector<uint32_t> m_restarts;
+	size_t m_block_records;
+	std::string m_last;
+	//! Last key and offset of each block written of the current type.
+	std::vector<std::pair<std::string, uint64_t> > m_blocks;
+
+	void header(std::vector<unsigned char> &out) const;
+
+	//! Add a record with key and encoded value to the current block
+	//! of type, starting a new block if it is full.
+	void add_record(unsigned char type, const std::string &key, uint8_t value_type,
+		const std::vector<unsigned char> &value);
+
+	//! Append the current block to the table.
+	void flush_block();
+};
+
+#endif
@@ -0,0 +1,270 @@
+#include <algorithm>
+#include <iostream>
+#include <unordered_map>
+
+#include "RenameDetector.h"
+#include "GitBlob.h"
+#include "ThreadPool.h"
+#include "PerfTrace.h"
+
+//! Chunk hashes shared by more sources than this are too common to
+//! find useful candidates with.  They still count towards the score.
+static const size_t max_sources_per_chunk = 64;
+
+//! Maximum length of a chunk without a newline.
+static const size_t max_chunk_size = 64;
+
+RenameDetector::RenameDetector(GitRepository &repo, bool copies,
+	int min_score, size_t rename_limit) :
+	m_repo(repo),
+	m_copies(copies),
+	m_min_score(min_score),
+	m_rename_limit(rename_limit)
+{
+}
+
+RenameDetector::Signature
+RenameDetector::signature(const std::string &sha)
+{
+	Signature sig;
+	auto obj = m_repo.object_read(sha);
+	if (obj == nullptr || obj->get_format() != "blob")
+		return sig;
+
+	const auto &data = std::dynamic_pointer_cast<GitBlob>(obj)->get_data();
+	sig.size = data.size();
+
+	// FNV-1a hash of each line, or of each 64 bytes of long lines
+	uint32_t hash = 2166136261u;
+	uint32_t len = 0;
+	for (size_t i = 0; i < data.size(); i++)
+	{
+		hash = (hash ^ data[i]) * 16777619u;
+		len++;
+		if (data[i] == '\n' || len == max_chunk_size || i + 1 == data.size())
+		{
+			sig.chunks.push_back({hash, len});
+			hash = 2166136261u;
+			len = 0;
+		}
+	}
+
+	// Sort by hash and merge repeated chunks
+	std::sort(sig.chunks.begin(), sig.chunks.end(),
+		[](const Chunk &a, const Chunk &b) { return a.hash < b.hash; });
+	size_t out = 0;
+	for (size_t i = 0; i < sig.chunks.size(); i++)
+	{
+		if (out > 0 && sig.chunks[out - 1].hash == sig.chunks[i].hash)
+			sig.chunks[out - 1].bytes += sig.chunks[i].bytes;
+		else
+			sig.chunks[out++] = sig.chunks[i];
+	}
+	sig.chunks.resize(out);
+	return sig;
+}
+
+void
+RenameDetector::detect(std::vector<DiffEntry> &entries)
+{
+	PERF_SCOPE("rename_detect");
+	auto is_file = [](const std::string &mode) {
+		return mode == "100644" || mode == "100755" || mode == "120000";
+	};
+
+	// Deleted files are rename sources, modified files copy sources
+	std::vector<size_t> sources;
+	std::vector<size_t> dests;
+	for (size_t i = 0; i < entries.size(); i++)
+	{
+		const auto &e = entries.at(i);
+		if (e.status == 'D' && is_file(e.old_mode))
+			sources.push_back(i);
+		else if (e.status == 'M' && m_copies && is_file(e.old_mode))
+			sources.push_back(i);
+		else if (e.status == 'A' && is_file(e.new_mode))
+			dests.push_back(i);
+	}
+	if (sources.empty() || dests.empty())
+		return;
+
+	struct Match
+	{
+		size_t src;
+		int score;
+		bool rename;
+	};
+	const size_t none = static_cast<size_t>(-1);
+	std::vector<Match> matches(dests.size(), Match{none, 0, false});
+	std::vector<bool> source_used(sources.size(), false);
+
+	// Try to give a destination source s, returns true if accepted
+	auto assign = [&](size_t d, size_t s, int score) -> bool
+	{
+		if (entries.at(sources.at(s)).status == 'D' && !source_used.at(s))
+		{
+			source_used.at(s) = true;
+			matches.at(d) = Match{s, score, true};
+			return true;
+		}
+		if (m_copies)
+		{
+			matches.at(d) = Match{s, score, false};
+			return true;
+		}
+		return false;
+	};
+
+	// Exact renames need no file contents
+	std::unordered_multimap<std::string, size_t> by_sha;
+	for (size_t s = 0; s < sources.size(); s++)
+	{
+		by_sha.emplace(entries.at(sources.at(s)).old_sha, s);
+	}
+	for (size_t d = 0; d < dests.size(); d++)
+	{
+		auto range = by_sha.equal_range(entries.at(dests.at(d)).new_sha);
+		for (auto it = range.first; it != range.second; ++it)
+		{
+			if (assign(d, it->second, 100))
+				break;
+		}
+	}
+
+	// Remaining destinations and the sources they may still use
+	std::vector<size_t> todo_dests;
+	for (size_t d = 0; d < dests.size(); d++)
+	{
+		if (matches.at(d).src == none)
+			todo_dests.push_back(d);
+	}
+	std::vector<size_t> todo_sources;
+	for (size_t s = 0; s < sources.size(); s++)
+	{
+		if (m_copies || !source_used.at(s))
+			todo_sources.push_back(s);
+	}
+
+	if (!todo_dests.empty() && !todo_sources.empty())
+	{
+		if (todo_dests.size() * todo_sources.size() > m_rename_limit * m_rename_limit)
+		{
+			std::cerr << "warning: inexact rename detection was skipped due to too many files." <<
+				std::endl << "warning: you may want to set the rename limit to at least " <<
+				std::max(todo_dests.size(), todo_sources.size()) << " using -l" << std::endl;
+		}
+		else
+		{
+			// Read and summarize all blobs in parallel
+			std::vector<Signature> src_sigs(todo_sources.size());
+			std::vector<Signature> dst_sigs(todo_dests.size());
+			ThreadPool pool;
+			pool.parallel_for(src_sigs.size() + dst_sigs.size(), [&](size_t i) {
+				if (i < src_sigs.size())
+					src_sigs[i] = signature(entries.at(sources.at(todo_sources[i])).old_sha);
+				else
+					dst_sigs[i - src_sigs.size()] = signature(entries.at(dests.at(todo_dests[i - src_sigs.size()])).new_sha);
+			});
+
+			// Index sources by their chunk hashes
+			std::unordered_map<uint32_t, std::vector<uint32_t> > index;
+			for (size_t s = 0; s < src_sigs.size(); s++)
+			{
+				for (const auto &c : src_sigs[s].chunks)
+					index[c.hash].push_back(s);
+			}
+
+			struct Candidate
+			{
+				int score;
+				size_t d;
+				size_t s;
+			};
+			std::vector<std::vector<Candidate> > found(todo_dests.size());
+			pool.parallel_for(todo_dests.size(), [&](size_t d) {
+				const auto &dst = dst_sigs[d];
+				const auto &dst_entry = entries.at(dests.at(todo_dests[d]));
+				std::vector<uint32_t> cands;
+				for (const auto &c : dst.chunks)
+				{
+					auto it = index.find(c.hash);
+					if (it != index.end() && it->second.size() <= max_sources_per_chunk)
+						cands.insert(cands.end(), it->second.begin(), it->second.end());
+				}
+				std::sort(cands.begin(), cands.end());
+				cands.erase(std::unique(cands.begin(), cands.end()), cands.end());
+
+				for (auto s : cands)
+				{
+					const auto &src = src_sigs[s];
+					const auto &src_entry = entries.at(sources.at(todo_sources[s]));
+					if ((src_entry.old_mode == "120000") != (dst_entry.new_mode == "120000"))
+						continue;
+
+					// Skip pairs whose sizes alone rule out a match
+					size_t max_size = std::max(src.size, dst.size);
+					size_t min_size = std::min(src.size, dst.size);
+					if (max_size == 0 || min_size * 100 < max_size * m_min_score)
+						continue;
+
+					size_t shared = 0;
+					auto i = src.chunks.begin();
+					auto j = dst.chunks.begin();
+					while (i != src.chunks.end() && j != dst.chunks.end())
+					{
+						if (i->hash < j->hash)
+							++i;
+						else if (j->hash < i->hash)
+							++j;
+						else
+						{
+							shared += std::min(i->bytes, j->bytes);
+							++i;
+							++j;
+						}
+					}
+					int score = shared * 100 / max_size;
+					if (score >= m_min_score)
+						found[d].push_back(Candidate{score, todo_dests[d], todo_sources[s]});
+				}
+			});
+
+			std::vector<Candidate> all;
+			for (const auto &f : found)
+				all.insert(all.end(), f.begin(), f.end());
+			std::stable_sort(all.begin(), all.end(),
+				[](const Candidate &a, const Candidate &b) { return a.score > b.score; });
+			for (const auto &c : all)
+			{
+				if (matches.at(c.d).src == none)
+					assign(c.d, c.s, c.score);
+			}
+		}
+	}
+
+	// Turn matched additions into renames and copies
+	std::vector<bool> remove(entries.size(), false);
+	for (size_t d = 0; d < dests.size(); d++)
+	{
+		const auto &match = matches.at(d);
+		if (match.src == none)
+			continue;
+		const auto &src = entries.at(sources.at(match.src));
+		auto &dst = entries.at(dests.at(d));
+		dst.status = match.rename ? 'R' : 'C';
+		dst.old_path = src.path;
+		dst.old_mode = src.old_mode;
+		dst.old_sha = src.old_sha;
+		dst.score = match.score;
+		if (match.rename)
+			remove.at(sources.at(match.src)) = true;
+	}
+
+	std::vector<DiffEntry> result;
+	for (size_t i = 0; i < entries.size(); i++)
+	{
+		if (!remove.at(i))
+			result.push_back(entries.at(i));
+	}
+	entries.swap(result);
+}
@@ -0,0 +1,52 @@
+#ifndef RENAME_DETECTOR_H
+#define RENAME_DETECTOR_H
+
+#include <vector>
+#include <cstdint>
+
+#include "GitRepository.h"
+#include "DiffTree.h"
+
+/**
+ * \brief Pairs deleted and added files of a tree diff into renames,
+ * and optionally added files with existing files into copies.
+ *
+ * Files with identical ids are paired first.  For the rest, each blob
+ * is summarized by the set of hashes of its lines (split at most every
+ * 64 bytes) with their byte counts.  Candidate sources for a
+ * destination are found through an index from chunk hash to the
+ * sources containing it, so unrelated files are never compared.
+ */
+class RenameDetector
+{
+public:
+	RenameDetector(GitRepository &repo, bool copies = false,
+		int min_score = 50, size_t rename_limit = 1000);
+
+	//! Replace matching deletions and additions in entries with
+	//! renames and copies.
+	void detect(std::vector<DiffEntry> &entries);
+
+private:
+	struct Chunk
+	{
+		uint32_t hash;
+		uint32_t bytes;
+	};
+
+	//! Sorted chunk hashes of one blob.
+	struct Signature
+	{
+		size_t size = 0;
+		std::vector<Chunk> chunks;
+	};
+
+	GitRepository &m_repo;
+	bool m_copies;
+	int m_min_score;
+	size_t m_rename_limit;
+
+	Signature signature(const std::string &sha);
+};
+
+#endif
@@ -0,0 +1,351 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "SharedObjectCache.h"
+#include "GitPack.h"
+#include "GitException.h"
+#include "PerfTrace.h"
+
+#include "zlib.h"
+
+static const char cache_magic[8] = {'W', 'Y', 'A', 'G', 'O', 'B', 'J', '2'};
+static const size_t page_size = 4096;
+
+//! Expected average size of a cached tree or commit, for the number
+//! of slots.
+static const size_t bytes_per_slot = 1024;
+
+//! Seconds a slot may be claimed before its writer is taken to have
+//! died.  Writing a slot takes microseconds.
+static const uint64_t abandoned_after = 10;
+
+struct SharedObjectCache::Header
+{
+	char magic[8];
+	uint32_t slot_count;
+	uint32_t unused;
+	uint64_t data_size;
+	//! Ring position after the last object written, never wraps.
+	std::atomic<uint64_t> head;
+};
+
+struct SharedObjectCache::Slot
+{
+	//! Sequence number in the low 32 bits, odd while the slot is being
+	//! written, and the time it was claimed in the high 32 bits.
+	std::atomic<uint64_t> state;
+	std::atomic<uint8_t> referenced;
+	//! GitPack::Type, none in an empty slot.
+	uint8_t type;
+	uint16_t unused;
+	uint32_t size;
+	//! CRC-32 of id, type and data, as a last check against torn
+	//! copies and slots written by two processes at once.
+	uint32_t crc;
+	uint32_t unused2;
+	uint64_t pos;
+	unsigned char id[20];
+	uint32_t unused3;
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free &&
+	std::atomic<uint8_t>::is_always_lock_free,
+	"shared memory needs address-free atomics");
+
+static size_t
+round_up(size_t n, size_t to)
+{
+	return (n + to - 1) / to * to;
+}
+
+static uint32_t
+slot_crc(const unsigned char *id, uint8_t type, const unsigned char *data, size_t size)
+{
+	uint32_t crc = crc32(0, id, 20);
+	crc = crc32(crc, &type, 1);
+	return crc32(crc, data, size);
+}
+
+SharedObjectCache::SharedObjectCache(const std::string &path, size_t size) :
+	m_map(nullptr),
+	m_map_size(0)
+{
+	PERF_SCOPE("shared_cache_open");
+
+	// A file only ever appears complete: it is filled under another
+	// name first.  An unusable one, left by an older wyag or damaged,
+	// is replaced; processes still using it just stop sharing.
+	for (int attempt = 0; attempt < 2; attempt++)
+	{
+		PERF_COUNT(syscalls, 1);
+		int fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+		if (fd >= 0)
+		{
+			bool ok = map_file(fd);
+			close(fd);
+			if (ok)
+				return;
+		}
+		else if (errno != ENOENT)
+		{
+			throw GitException("Cannot open shared object cache: " + path);
+		}
+		if (create_file(path, size, fd >= 0))
+			return;
+	}
+	throw GitException("Cannot create shared object cache: " + path);
+}
+
+bool
+SharedObjectCache::map_file(int fd)
+{
+	PERF_COUNT(syscalls, 2);
+	struct stat st;
+	if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < page_size)
+		return false;
+	void *p = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED)
+		return false;
+	m_map = static_cast<unsigned char *>(p);
+	m_map_size = st.st_size;
+	m_header = reinterpret_cast<Header *>(m_map);
+
+	uint32_t slot_count = m_header->slot_count;
+	uint64_t data_size = m_header->data_size;
+	size_t slots_size = round_up(static_cast<size_t>(slot_count) * sizeof(Slot), page_size);
+	if (std::memcmp(m_header->magic, cache_magic, sizeof(cache_magic)) != 0 ||
+		slot_count == 0 || (slot_count & (slot_count - 1)) != 0 || data_size == 0 ||
+		page_size + slots_size + data_size > m_map_size)
+	{
+		munmap(m_map, m_map_size);
+		m_map = nullptr;
+		return false;
+	}
+	m_slots = reinterpret_cast<Slot *>(m_map + page_size);
+	m_slot_mask = slot_count - 1;
+	m_data = m_map + page_size + slots_size;
+	m_data_size = data_size;
+	return true;
+}
+
+bool
+SharedObjectCache::create_file(const std::string &path, size_t size, bool replace)
+{
+	uint32_t slot_count = 1024;
+	uint64_t data_size = round_up(std::max<size_t>(size, page_size), page_size);
+	while (slot_count < data_size / bytes_per_slot)
+		slot_count *= 2;
+	size_t file_size = page_size + round_up(slot_count * sizeof(Slot), page_size) + data_size;
+
+	PERF_COUNT(syscalls, 4);
+	static std::atomic<unsigned> tmp_count(0);
+	std::string tmp = path + ".tmp" + std::to_string(getpid()) + "_" +
+		std::to_string(tmp_count++);
+	int fd = open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (fd < 0)
+		return false;
+	bool ok = ftruncate(fd, file_size) == 0;
+	void *p = ok ? mmap(nullptr, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+	if (p != MAP_FAILED)
+	{
+		// The file is all zeros, so the slots are empty
+		auto header = static_cast<Header *>(p);
+		header->slot_count = slot_count;
+		header->data_size = data_size;
+		std::memcpy(header->magic, cache_magic, sizeof(cache_magic));
+		munmap(p, file_size);
+	}
+	ok = p != MAP_FAILED;
+
+	// link() fails if another process got there first, its file is
+	// then used instead
+	if (ok && replace)
+		ok = rename(tmp.c_str(), path.c_str()) == 0;
+	else if (ok)
+		ok = link(tmp.c_str(), path.c_str()) == 0;
+	unlink(tmp.c_str());
+	ok = ok && map_file(fd);
+	close(fd);
+	return ok;
+}
+
+SharedObjectCache::~SharedObjectCache()
+{
+	munmap(m_map, m_map_size);
+}
+
+bool
+SharedObjectCache::read_slot(Slot &slot, Slot &copy, uint64_t &state) const
+{
+	state = slot.state.load(std::memory_order_acquire);
+	if (state & 1)
+		return false;
+	copy.type = slot.type;
+	copy.size = slot.size;
+	copy.crc = slot.crc;
+	copy.pos = slot.pos;
+	std::memcpy(copy.id, slot.id, sizeof(copy.id));
+	std::atomic_thread_fence(std::memory_order_acquire);
+	return slot.state.load(std::memory_order_relaxed) == state;
+}
+
+bool
+SharedObjectCache::get(const std::string &sha, std::string &fmt, std::vector<unsigned char> &data)
+{
+	if (sha.size() != 40)
+		return false;
+	unsigned char id[20];
+	GitPack::from_hex(sha, id);
+	uint64_t hash;
+	std::memcpy(&hash, id, sizeof(hash));
+
+	for (size_t k = 0; k < probe_slots; k++)
+	{
+		Slot &slot = m_slots[(hash + k) & m_slot_mask];
+		Slot copy;
+		uint64_t state;
+		if (!read_slot(slot, copy, state))
+			continue;
+		if (copy.type == 0 || std::memcmp(copy.id, id, sizeof(id)) != 0)
+			continue;
+
+		// Writers advance the head before overwriting old data, so
+		// data copied before the head passed it is intact
+		if (m_header->head.load(std::memory_order_acquire) > copy.pos + m_data_size ||
+			copy.size > m_data_size)
+		{
+			return false;
+		}
+		data.resize(copy.size);
+		ring_read(copy.pos, data.data(), copy.size);
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (m_header->head.load(std::memory_order_relaxed) > copy.pos + m_data_size ||
+			slot_crc(id, copy.type, data.data(), data.size()) != copy.crc)
+		{
+			return false;
+		}
+
+		slot.referenced.store(1, std::memory_order_relaxed);
+		fmt = GitPack::type_name(static_cast<GitPack::Type>(copy.type));
+		PERF_COUNT(cache_hits, 1);
+		return true;
+	}
+	return false;
+}
+
+static uint64_t
+now_seconds()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	return static_cast<uint32_t>(now.tv_sec);
+}
+
+//! Claimed by a writer that died?
+static bool
+abandoned(uint64_t state)
+{
+	return (state & 1) && now_seconds() >= (state >> 32) + abandoned_after;
+}
+
+bool
+SharedObjectCache::claim_slot(Slot &slot, uint64_t &state)
+{
+	uint64_t old = slot.state.load(std::memory_order_relaxed);
+	if ((old & 1) && !abandoned(old))
+		return false;
+	state = (((old + 1) | 1) & 0xffffffff) | (now_seconds() << 32);
+	return slot.state.compare_exchange_strong(old, state, std::memory_order_acq_rel);
+}
+
+void
+SharedObjectCache::put(const std::string &sha, const std::string &fmt,
+	const std::vector<unsigned char> &data)
+{
+	auto type = GitPack::type_from_name(fmt);
+	if (sha.size() != 40 || type == GitPack::Type::none || data.size() > m_data_size / 16)
+		return;
+	unsigned char id[20];
+	GitPack::from_hex(sha, id);
+	uint64_t hash;
+	std::memcpy(&hash, id, sizeof(hash));
+
+	// An empty or abandoned slot, else the first one not referenced
+	// since the clock hand last passed it
+	Slot *victim = nullptr;
+	for (size_t k = 0; k < probe_slots && !victim; k++)
+	{
+		Slot &slot = m_slots[(hash + k) & m_slot_mask];
+		Slot copy;
+		uint64_t state;
+		if (!read_slot(slot, copy, state))
+		{
+			if (abandoned(state))
+				victim = &slot;
+			continue;
+		}
+		if (copy.type == 0)
+			victim = &slot;
+		else if (std::memcmp(copy.id, id, sizeof(id)) == 0)
+			return;
+	}
+	for (size_t k = 0; k < probe_slots && !victim; k++)
+	{
+		Slot &slot = m_slots[(hash + k) & m_slot_mask];
+		if (slot.referenced.exchange(0, std::memory_order_relaxed) == 0)
+			victim = &slot;
+	}
+	if (!victim)
+		victim = &m_slots[hash & m_slot_mask];
+
+	// Another process writing the slot wins
+	uint64_t state;
+	if (!claim_slot(*victim, state))
+		return;
+
+	uint64_t pos = m_header->head.fetch_add(data.size(), std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	ring_write(pos, data.data(), data.size());
+
+	victim->type = static_cast<uint8_t>(type);
+	victim->size = data.size();
+	victim->crc = slot_crc(id, victim->type, data.data(), data.size());
+	victim->pos = pos;
+	std::memcpy(victim->id, id, sizeof(id));
+	victim->referenced.store(0, std::memory_order_relaxed);
+
+	// Fails only if the slot was taken over meanwhile, the CRC then
+	// rejects whatever mix of the two writes it holds
+	uint64_t claimed = state;
+	victim->state.compare_exchange_strong(claimed, (state + 1) & 0xffffffff,
+		std::memory_order_acq_rel);
+}
+
+void
+SharedObjectCache::ring_read(uint64_t pos, unsigned char *out, size_t len) const
+{
+	if (len == 0)
+		return;
+	size_t offset = pos % m_data_size;
+	size_t first = std::min<size_t>(len, m_data_size - offset);
+	std::memcpy(out, m_data + offset, first);
+	std::memcpy(out + first, m_data, len - first);
+}
+
+void
+SharedObjectCache::ring_write(uint64_t pos, const unsigned char *in, size_t len)
+{
+	if (len == 0)
+		return;
+	size_t offset = pos % m_data_size;
+	size_t first = std::min<size_t>(len, m_data_size - offset);
+	std::memcpy(m_data + offset, in, first);
+	std::memcpy(m_data, in + first, len - first);
+}
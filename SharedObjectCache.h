@@ -0,0 +1,84 @@
+#ifndef SHARED_OBJECT_CACHE_H
+#define SHARED_OBJECT_CACHE_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+/**
+ * \brief Inflated objects shared by all wyag processes on a machine,
+ * in a memory-mapped file.
+ *
+ * The file holds a hash table of fixed size slots and a ring of object
+ * data.  Nothing is locked: a slot is claimed by making its sequence
+ * number odd with a compare-and-swap, and readers retry or give up if
+ * the number changed while they copied the slot.  A slot claimed for
+ * longer than any write takes belongs to a writer that died and may
+ * be claimed again.  Data is appended to
+ * the ring by advancing its head atomically, overwriting the oldest
+ * objects, and readers check that the head did not pass their object
+ * while copying it.  An id may be stored in the few slots after the
+ * one its hash selects, and the one replaced is chosen by the clock
+ * algorithm: a hit sets a slot's referenced bit and inserting skips,
+ * clearing it, any slot with the bit set.
+ *
+ * A new file is filled under another name and then moved into place,
+ * so no process ever sees one half made.  Objects never change, so
+ * entries cannot become stale.  A damaged or unusable file only means
+ * that objects are read from the repository.
+ */
+class SharedObjectCache
+{
+public:
+	//! Open or create the cache file at path.  A new file gets room
+	//! for size bytes of objects, an existing one keeps its size.
+	SharedObjectCache(const std::string &path, size_t size);
+
+	~SharedObjectCache();
+
+	SharedObjectCache(const SharedObjectCache &) = delete;
+	SharedObjectCache &operator=(const SharedObjectCache &) = delete;
+
+	//! Copy type and data of object sha, false if not cached.
+	bool get(const std::string &sha, std::string &fmt, std::vector<unsigned char> &data);
+
+	//! Store object sha, unless it is too big or its slots are busy.
+	void put(const std::string &sha, const std::string &fmt,
+		const std::vector<unsigned char> &data);
+
+private:
+	struct Header;
+	struct Slot;
+
+	//! Slots searched for an id, starting at the one its hash selects.
+	static const size_t probe_slots = 8;
+
+	unsigned char *m_map;
+	size_t m_map_size;
+	Header *m_header;
+	Slot *m_slots;
+	unsigned char *m_data;
+	uint64_t m_data_size;
+	uint64_t m_slot_mask;
+
+	//! Create the file at path under another name and move it into
+	//! place, over an unusable file if replace.  False if another
+	//! process created it first or it cannot be created.
+	bool create_file(const std::string &path, size_t size, bool replace);
+
+	//! Map the cache file open on fd, false if it is not usable.
+	bool map_file(int fd);
+
+	//! Copy the fields of slot, false if it is being written.
+	bool read_slot(Slot &slot, Slot &copy, uint64_t &state) const;
+
+	//! Make slot odd for writing it, false if another process is.
+	bool claim_slot(Slot &slot, uint64_t &state);
+
+	//! Copy len bytes of the ring from position pos to out.
+	void ring_read(uint64_t pos, unsigned char *out, size_t len) const;
+
+	void ring_write(uint64_t pos, const unsigned char *in, size_t len);
+};
+
+#endif
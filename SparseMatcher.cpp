@@ -0,0 +1,252 @@
+#include <fstream>
+#include <fnmatch.h>
+
+#include "SparseMatcher.h"
+
+SparseMatcher::SparseMatcher(const std::vector<std::string> &patterns, bool cone) :
+	m_cone(cone)
+{
+	std::set<std::string> parent_only;
+	std::vector<std::string> dirs;
+	for (auto line : patterns)
+	{
+		while (!line.empty() && (line.back() == ' ' || line.back() == '\r'))
+			line.pop_back();
+		if (line.empty() || line.at(0) == '#')
+			continue;
+		m_lines.push_back(line);
+
+		if (cone)
+		{
+			// Accept plain directory names as well as the patterns
+			// git writes for them: "/dir/" includes dir recursively,
+			// "!/dir/*/" then restricts it to its own files.
+			if (line == "/*" || line == "!/*/")
+				continue;
+			bool negated = line.at(0) == '!';
+			if (negated)
+			{
+				line = line.substr(1);
+				if (line.size() > 3 && line.compare(line.size() - 3, 3, "/*/") == 0)
+					line = line.substr(0, line.size() - 2);
+			}
+			while (!line.empty() && line.front() == '/')
+				line.erase(0, 1);
+			while (!line.empty() && line.back() == '/')
+				line.pop_back();
+			if (line.empty())
+				continue;
+			if (negated)
+				parent_only.insert(line);
+			else
+				dirs.push_back(line);
+			continue;
+		}
+
+		Pattern p;
+		p.negated = line.at(0) == '!';
+		if (p.negated)
+			line = line.substr(1);
+		p.dir_only = !line.empty() && line.back() == '/';
+		while (!line.empty() && line.back() == '/')
+			line.pop_back();
+		// Patterns without a slash match at any depth
+		p.anchored = line.find('/') != std::string::npos;
+		p.segments = split(line);
+		if (!p.anchored)
+			p.segments.insert(p.segments.begin(), "**");
+		if (!p.segments.empty())
+			m_patterns.push_back(p);
+	}
+
+	for (const auto &dir : dirs)
+	{
+		if (parent_only.find(dir) != parent_only.end())
+		{
+			m_parents.insert(dir);
+			add_cone_dir(dir);
+			m_recursive.erase(dir);
+		}
+		else
+		{
+			add_cone_dir(dir);
+		}
+	}
+}
+
+SparseMatcher
+SparseMatcher::read(const std::string &filename, bool cone)
+{
+	std::vector<std::string> lines;
+	std::ifstream f(filename);
+	std::string line;
+	while (std::getline(f, line))
+	{
+		lines.push_back(line);
+	}
+	return SparseMatcher(lines, cone);
+}
+
+void
+SparseMatcher::add_cone_dir(const std::string &dir)
+{
+	m_recursive.insert(dir);
+	for (auto idx = dir.rfind('/'); idx != std::string::npos && idx > 0;
+		idx = dir.rfind('/', idx - 1))
+	{
+		m_parents.insert(dir.substr(0, idx));
+	}
+}
+
+std::vector<std::string>
+SparseMatcher::split(const std::string &path)
+{
+	std::vector<std::string> segments;
+	size_t start = 0;
+	while (start < path.size())
+	{
+		auto idx = path.find('/', start);
+		if (idx == std::string::npos)
+			idx = path.size();
+		if (idx > start)
+			segments.push_back(path.substr(start, idx - start));
+		start = idx + 1;
+	}
+	return segments;
+}
+
+bool
+SparseMatcher::match_segments(const std::vector<std::string> &pattern, size_t i,
+	const std::vector<std::string> &path, size_t j)
+{
+	if (i == pattern.size())
+		return j == path.size();
+
+	if (pattern.at(i) == "**")
+	{
+		for (size_t k = j; k <= path.size(); k++)
+		{
+			if (match_segments(pattern, i + 1, path, k))
+				return true;
+		}
+		return false;
+	}
+
+	return j < path.size() &&
+		fnmatch(pattern.at(i).c_str(), path.at(j).c_str(), 0) == 0 &&
+		match_segments(pattern, i + 1, path, j + 1);
+}
+
+bool
+SparseMatcher::matches(const Pattern &pattern, const std::vector<std::string> &path,
+	bool is_dir)
+{
+	if (pattern.dir_only && !is_dir)
+		return false;
+	return match_segments(pattern.segments, 0, path, 0);
+}
+
+bool
+SparseMatcher::may_match_below(const Pattern &pattern,
+	const std::vector<std::string> &dir)
+{
+	// Walk the pattern along dir.  Running out of either means the
+	// pattern matches dir, one of its parents, or something below.
+	for (size_t i = 0; i < dir.size(); i++)
+	{
+		if (i == pattern.segments.size() || pattern.segments.at(i) == "**")
+			return true;
+		if (fnmatch(pattern.segments.at(i).c_str(), dir.at(i).c_str(), 0) != 0)
+			return false;
+	}
+	return true;
+}
+
+SparseMatcher::Match
+SparseMatcher::match_dir(const std::string &dir) const
+{
+	if (m_cone)
+	{
+		for (auto idx = dir.size(); idx != std::string::npos && idx > 0;
+			idx = dir.rfind('/', idx - 1))
+		{
+			if (m_recursive.find(dir.substr(0, idx)) != m_recursive.end())
+				return Match::included;
+		}
+		if (m_parents.find(dir) != m_parents.end())
+			return Match::partial;
+		return Match::excluded;
+	}
+
+	// Is the directory itself, or one of its parents, matched?
+	auto segments = split(dir);
+	bool included = false;
+	bool negated_below = false;
+	bool positive_below = false;
+	for (const auto &p : m_patterns)
+	{
+		for (size_t len = 1; len <= segments.size(); len++)
+		{
+			std::vector<std::string> prefix(segments.begin(), segments.begin() + len);
+			if (matches(p, prefix, true))
+			{
+				included = !p.negated;
+				break;
+			}
+		}
+		if (may_match_below(p, segments))
+		{
+			if (p.negated)
+				negated_below = true;
+			else
+				positive_below = true;
+		}
+	}
+
+	if (included && !negated_below)
+		return Match::included;
+	if (!included && !positive_below)
+		return Match::excluded;
+	return Match::partial;
+}
+
+bool
+SparseMatcher::includes(const std::string &path) const
+{
+	if (m_cone)
+	{
+		auto idx = path.rfind('/');
+		if (idx == std::string::npos)
+			return true;
+		auto parent = path.substr(0, idx);
+		return m_parents.find(parent) != m_parents.end() ||
+			match_dir(parent) == Match::included;
+	}
+
+	// The last pattern matching the file or a parent directory wins
+	auto segments = split(path);
+	bool included = false;
+	for (const auto &p : m_patterns)
+	{
+		bool hit = matches(p, segments, false);
+		for (size_t len = 1; len < segments.size() && !hit; len++)
+		{
+			std::vector<std::string> prefix(segments.begin(), segments.begin() + len);
+			hit = matches(p, prefix, true);
+		}
+		if (hit)
+			included = !p.negated;
+	}
+	return included;
+}
+
+std::string
+SparseMatcher::describe() const
+{
+	std::string text = m_cone ? "cone\n" : "full\n";
+	for (const auto &line : m_lines)
+	{
+		text += line + "\n";
+	}
+	return text;
+}
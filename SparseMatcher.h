@@ -0,0 +1,79 @@
+#ifndef SPARSE_MATCHER_H
+#define SPARSE_MATCHER_H
+
+#include <string>
+#include <vector>
+#include <set>
+
+/**
+ * \brief Decides which paths of a tree a sparse checkout includes.
+ *
+ * In cone mode the patterns are directories: everything below them is
+ * included, as are the files directly in the top level directory and
+ * in each of their parent directories.  Otherwise the patterns use
+ * .gitignore syntax, the last pattern matching a path or one of its
+ * directories decides, and '!' excludes again.
+ *
+ * match_dir() lets tree walks skip whole subtrees before reading them.
+ */
+class SparseMatcher
+{
+public:
+	enum class Match
+	{
+		//! Nothing below the directory is included
+		excluded,
+		//! Some paths below may be included, ask for each
+		partial,
+		//! Everything below the directory is included
+		included
+	};
+
+	SparseMatcher(const std::vector<std::string> &patterns, bool cone);
+
+	//! Read patterns in git's .git/info/sparse-checkout format.
+	static SparseMatcher read(const std::string &filename, bool cone);
+
+	Match match_dir(const std::string &dir) const;
+
+	bool includes(const std::string &path) const;
+
+	//! Text identifying the patterns, to notice when they change.
+	std::string describe() const;
+
+private:
+	struct Pattern
+	{
+		std::vector<std::string> segments;
+		bool negated;
+		bool anchored;
+		bool dir_only;
+	};
+
+	bool m_cone;
+	std::vector<std::string> m_lines;
+
+	//! Cone mode: directories included with everything below them.
+	std::set<std::string> m_recursive;
+	//! Cone mode: parents of those, including only their own files.
+	std::set<std::string> m_parents;
+
+	std::vector<Pattern> m_patterns;
+
+	void add_cone_dir(const std::string &dir);
+
+	static std::vector<std::string> split(const std::string &path);
+
+	static bool match_segments(const std::vector<std::string> &pattern, size_t i,
+		const std::vector<std::string> &path, size_t j);
+
+	//! Does pattern match path, a directory if is_dir is set?
+	static bool matches(const Pattern &pattern, const std::vector<std::string> &path,
+		bool is_dir);
+
+	//! Could pattern match dir or anything below it?
+	static bool may_match_below(const Pattern &pattern,
+		const std::vector<std::string> &dir);
+};
+
+#endif
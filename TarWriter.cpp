@@ -0,0 +1,191 @@
+#include <cstring>
+#include <cstdio>
+#include <algorithm>
+
+#include "TarWriter.h"
+
+static const size_t block_size = 512;
+
+//! Archives are padded to a multiple of this, like git and tar do.
+static const size_t record_size = 10240;
+
+//! Largest size that fits in the 11 octal digits of the size field.
+static const uint64_t max_ustar_size = 077777777777ULL;
+
+struct UstarHeader
+{
+	char name[100];
+	char mode[8];
+	char uid[8];
+	char gid[8];
+	char size[12];
+	char mtime[12];
+	char chksum[8];
+	char typeflag;
+	char linkname[100];
+	char magic[6];
+	char version[2];
+	char uname[32];
+	char gname[32];
+	char devmajor[8];
+	char devminor[8];
+	char prefix[155];
+	char padding[12];
+};
+
+TarWriter::TarWriter(std::ostream &out, time_t mtime) :
+	m_out(out),
+	m_mtime(mtime),
+	m_written(0)
+{
+}
+
+void
+TarWriter::write(const char *data, size_t size)
+{
+	m_out.write(data, size);
+	m_written += size;
+}
+
+void
+TarWriter::pad()
+{
+	static const char zeros[block_size] = {};
+	size_t tail = m_written % block_size;
+	if (tail != 0)
+	{
+		write(zeros, block_size - tail);
+	}
+}
+
+std::string
+TarWriter::pax_record(const std::string &key, const std::string &value)
+{
+	// "<length> <key>=<value>\n", where length counts its own digits
+	size_t len = key.size() + value.size() + 3;
+	size_t total = len + std::to_string(len).size();
+	if (std::to_string(total).size() != std::to_string(len).size())
+		total++;
+	return std::to_string(total) + " " + key + "=" + value + "\n";
+}
+
+void
+TarWriter::write_header(const std::string &path, unsigned int mode,
+	uint64_t size, char type, const std::string &linkname)
+{
+	// Long paths are split over the prefix and name fields if
+	// possible, otherwise they go into a pax header.
+	std::string name = path;
+	std::string prefix;
+	std::string records;
+	if (path.size() > sizeof(UstarHeader::name))
+	{
+		// A directory's own trailing '/' stays in the name
+		size_t i = path.size();
+		if (path.back() == '/')
+			i--;
+		i = std::min(i, sizeof(UstarHeader::prefix));
+		do
+		{
+			i--;
+		} while (i > 0 && path.at(i) != '/');
+		if (i > 0 && path.size() - i - 1 <= sizeof(UstarHeader::name))
+		{
+			prefix = path.substr(0, i);
+			name = path.substr(i + 1);
+		}
+		else
+		{
+			records += pax_record("path", path);
+		}
+	}
+	if (linkname.size() > sizeof(UstarHeader::linkname))
+		records += pax_record("linkpath", linkname);
+	if (size > max_ustar_size)
+		records += pax_record("size", std::to_string(size));
+	if (!records.empty())
+		write_pax_header('x', records);
+
+	UstarHeader h;
+	std::memset(&h, 0, sizeof(h));
+	std::strncpy(h.name, name.c_str(), sizeof(h.name));
+	std::strncpy(h.prefix, prefix.c_str(), sizeof(h.prefix));
+	std::snprintf(h.mode, sizeof(h.mode), "%07o", mode & 07777);
+	std::snprintf(h.uid, sizeof(h.uid), "%07o", 0);
+	std::snprintf(h.gid, sizeof(h.gid), "%07o", 0);
+	std::snprintf(h.size, sizeof(h.size), "%011llo",
+		static_cast<unsigned long long>(size > max_ustar_size ? 0 : size));
+	std::snprintf(h.mtime, sizeof(h.mtime), "%011llo",
+		static_cast<unsigned long long>(m_mtime));
+	h.typeflag = type;
+	std::strncpy(h.linkname, linkname.c_str(), sizeof(h.linkname));
+	std::memcpy(h.magic, "ustar", 6);
+	std::memcpy(h.version, "00", 2);
+	std::strncpy(h.uname, "root", sizeof(h.uname));
+	std::strncpy(h.gname, "root", sizeof(h.gname));
+	std::snprintf(h.devmajor, sizeof(h.devmajor), "%07o", 0);
+	std::snprintf(h.devminor, sizeof(h.devminor), "%07o", 0);
+
+	// Checksum is computed with the checksum field set to spaces
+	std::memset(h.chksum, ' ', sizeof(h.chksum));
+	unsigned int sum = 0;
+	auto bytes = reinterpret_cast<const unsigned char *>(&h);
+	for (size_t i = 0; i < sizeof(h); i++)
+		sum += bytes[i];
+	std::snprintf(h.chksum, sizeof(h.chksum), "%07o", sum);
+
+	write(reinterpret_cast<const char *>(&h), sizeof(h));
+}
+
+void
+TarWriter::write_pax_header(char type, const std::string &records)
+{
+	std::string name = type == 'g' ? "pax_global_header" : "pax_extended_header";
+	write_header(name, 0666, records.size(), type, std::string());
+	write(records.data(), records.size());
+	pad();
+}
+
+void
+TarWriter::add_comment(const std::string &comment)
+{
+	write_pax_header('g', pax_record("comment", comment));
+}
+
+void
+TarWriter::add_directory(const std::string &path, unsigned int mode)
+{
+	write_header(path + "/", mode, 0, '5', std::string());
+}
+
+void
+TarWriter::add_file(const std::string &path, unsigned int mode,
+	const std::vector<unsigned char> &data)
+{
+	write_header(path, mode, data.size(), '0', std::string());
+	write(reinterpret_cast<const char *>(data.data()), data.size());
+	pad();
+}
+
+void
+TarWriter::add_symlink(const std::string &path, const std::string &target)
+{
+	write_header(path, 0777, 0, '2', target);
+}
+
+void
+TarWriter::finish()
+{
+	// Two empty blocks end the archive
+	static const char zeros[block_size] = {};
+	write(zeros, block_size);
+	write(zeros, block_size);
+
+	size_t tail = m_written % record_size;
+	if (tail != 0)
+	{
+		std::vector<char> padding(record_size - tail, 0);
+		write(padding.data(), padding.size());
+	}
+	m_out.flush();
+}
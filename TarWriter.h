@@ -0,0 +1,54 @@
+#ifndef TAR_WRITER_H
+#define TAR_WRITER_H
+
+#include <string>
+#include <vector>
+#include <ostream>
+#include <ctime>
+#include <cstdint>
+
+/**
+ * \brief Writes a POSIX tar archive to a stream, one entry at a time.
+ *
+ * Paths and link targets too long for the ustar header, and files
+ * too big for its size field, get a pax extended header like
+ * git archive writes.
+ */
+class TarWriter
+{
+public:
+	TarWriter(std::ostream &out, time_t mtime);
+
+	//! Add a global header with a comment, git stores the commit id.
+	void add_comment(const std::string &comment);
+
+	void add_directory(const std::string &path, unsigned int mode);
+
+	void add_file(const std::string &path, unsigned int mode,
+		const std::vector<unsigned char> &data);
+
+	void add_symlink(const std::string &path, const std::string &target);
+
+	//! Write end of archive marker and pad the last record.
+	void finish();
+
+private:
+	std::ostream &m_out;
+	time_t m_mtime;
+	uint64_t m_written;
+
+	void write_header(const std::string &path, unsigned int mode,
+		uint64_t size, char type, const std::string &linkname);
+
+	void write_pax_header(char type, const std::string &records);
+
+	void write(const char *data, size_t size);
+
+	//! Fill up the last 512 byte block.
+	void pad();
+
+	static std::string pax_record(const std::string &key,
+		const std::string &value);
+};
+
+#endif
@@ -0,0 +1,82 @@
+#include <atomic>
+
+#include "ThreadPool.h"
+
+ThreadPool::ThreadPool(size_t threads) :
+	m_stop(false)
+{
+	if (threads == 0)
+	{
+		threads = std::max(1u, std::thread::hardware_concurrency());
+	}
+	for (size_t i = 0; i < threads; i++)
+	{
+		m_threads.emplace_back(&ThreadPool::worker, this);
+	}
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stop = true;
+	}
+	m_cond.notify_all();
+	for (auto &t : m_threads)
+	{
+		t.join();
+	}
+}
+
+size_t
+ThreadPool::size() const
+{
+	return m_threads.size();
+}
+
+void
+ThreadPool::worker()
+{
+	while (true)
+	{
+		std::function<void()> task;
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_cond.wait(lock, [this] { return m_stop || !m_tasks.empty(); });
+			if (m_tasks.empty())
+				return;
+			task = std::move(m_tasks.front());
+			m_tasks.pop_front();
+		}
+		task();
+	}
+}
+
+void
+ThreadPool::parallel_for(size_t n, const std::function<void(size_t)> &f)
+{
+	// Each worker claims the next index until all are taken,
+	// so uneven work balances itself.
+	std::atomic<size_t> next(0);
+	std::vector<std::future<void> > done;
+	size_t workers = std::min(n, size());
+	for (size_t w = 0; w < workers; w++)
+	{
+		done.push_back(submit([&next, n, &f]() {
+			for (size_t i = next++; i < n; i = next++)
+			{
+				f(i);
+			}
+		}));
+	}
+	// Wait for all workers before passing on the first exception,
+	// they still use next and f.
+	for (auto &d : done)
+	{
+		d.wait();
+	}
+	for (auto &d : done)
+	{
+		d.get();
+	}
+}
@@ -0,0 +1,56 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <memory>
+
+/**
+ * \brief Fixed set of worker threads running queued tasks in order.
+ */
+class ThreadPool
+{
+public:
+	//! Start threads workers, or one per CPU if threads is 0.
+	ThreadPool(size_t threads = 0);
+
+	//! Finish queued tasks, then stop the workers.
+	~ThreadPool();
+
+	size_t size() const;
+
+	//! Queue f to run on a worker, the future receives its result.
+	template<class F>
+	auto submit(F f) -> std::future<decltype(f())>
+	{
+		using R = decltype(f());
+		auto task = std::make_shared<std::packaged_task<R()> >(std::move(f));
+		auto result = task->get_future();
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_tasks.push_back([task]() { (*task)(); });
+		}
+		m_cond.notify_one();
+		return result;
+	}
+
+	//! Call f(i) for i in [0, n) on all workers and wait until done.
+	//! Must not be called from one of this pool's own tasks.
+	void parallel_for(size_t n, const std::function<void(size_t)> &f);
+
+private:
+	std::vector<std::thread> m_threads;
+	std::deque<std::function<void()> > m_tasks;
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+	bool m_stop;
+
+	void worker();
+};
+
+#endif
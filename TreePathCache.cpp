@@ -0,0 +1,35 @@
+#include <algorithm>
+
+#include "TreePathCache.h"
+
+TreePathCache::TreePathCache(size_t max_entries) :
+	m_max_entries(std::max<size_t>(1, max_entries))
+{
+}
+
+std::string
+TreePathCache::get(const std::string &tree, const std::string &dir)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	auto it = m_subtrees.find(tree + ":" + dir);
+	if (it == m_subtrees.end())
+		return std::string();
+	return it->second;
+}
+
+void
+TreePathCache::put(const std::string &tree, const std::string &dir, const std::string &sha)
+{
+	auto key = tree + ":" + dir;
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (m_subtrees.find(key) != m_subtrees.end())
+		return;
+
+	while (m_order.size() >= m_max_entries)
+	{
+		m_subtrees.erase(m_order.front());
+		m_order.pop_front();
+	}
+	m_subtrees.insert({key, sha});
+	m_order.push_back(key);
+}
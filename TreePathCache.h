@@ -0,0 +1,36 @@
+#ifndef TREE_PATH_CACHE_H
+#define TREE_PATH_CACHE_H
+
+#include <string>
+#include <mutex>
+#include <unordered_map>
+#include <deque>
+
+/**
+ * \brief Cache of the subtrees found while looking up paths in trees.
+ *
+ * Maps a tree id and the path of a directory below it to the id of
+ * the directory's tree, so that looking up more paths below the same
+ * directories only searches the levels not seen before.  Holds at
+ * most a fixed number of entries and evicts the oldest insertion
+ * first.
+ */
+class TreePathCache
+{
+public:
+	TreePathCache(size_t max_entries = 4096);
+
+	//! Tree id of directory dir below tree, or empty if not cached.
+	std::string get(const std::string &tree, const std::string &dir);
+
+	void put(const std::string &tree, const std::string &dir, const std::string &sha);
+
+private:
+	size_t m_max_entries;
+	std::mutex m_mutex;
+	//! Subtree ids by tree id, a colon and the directory.
+	std::unordered_map<std::string, std::string> m_subtrees;
+	std::deque<std::string> m_order;
+};
+
+#endif
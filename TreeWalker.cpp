@@ -0,0 +1,139 @@
+#include <future>
+#include <unordered_map>
+
+#include "TreeWalker.h"
+#include "GitTree.h"
+#include "DiffTree.h"
+#include "ThreadPool.h"
+#include "GitException.h"
+#include "PerfTrace.h"
+
+TreeWalker::TreeWalker(GitRepository &repo) :
+	m_repo(repo)
+{
+}
+
+TreeWalker::~TreeWalker() = default;
+
+void
+TreeWalker::set_filter(Filter filter)
+{
+	m_filter = filter;
+}
+
+void
+TreeWalker::read_ahead(size_t threads)
+{
+	m_pool.reset(new ThreadPool(threads));
+}
+
+std::vector<GitTreeLeaf>
+TreeWalker::read_tree(const std::string &sha)
+{
+	if (sha.empty())
+		return std::vector<GitTreeLeaf>();
+
+	auto obj = m_repo.object_read(sha);
+	if (obj == nullptr || obj->get_format() != "tree")
+		throw GitException("Not a tree object: " + sha);
+	return std::dynamic_pointer_cast<GitTree>(obj)->get_items();
+}
+
+void
+TreeWalker::walk(const std::vector<std::string> &trees, const Visitor &visit,
+	const std::string &prefix)
+{
+	PERF_SCOPE("tree_walk");
+	std::vector<std::vector<GitTreeLeaf> > items;
+	for (const auto &sha : trees)
+		items.push_back(read_tree(sha));
+	walk_trees(std::move(items), prefix, visit);
+}
+
+void
+TreeWalker::walk_trees(std::vector<std::vector<GitTreeLeaf> > trees,
+	const std::string &prefix, const Visitor &visit)
+{
+	// Start reading the subtrees which may be entered, each is only
+	// read once even if several trees have it
+	std::unordered_map<std::string, std::future<std::vector<GitTreeLeaf> > > ahead;
+	if (m_pool)
+	{
+		for (const auto &items : trees)
+		{
+			for (const auto &item : items)
+			{
+				if (!item.is_tree() || ahead.count(item.sha) ||
+					(m_filter && !m_filter(prefix + item.path, true)))
+				{
+					continue;
+				}
+				auto sha = item.sha;
+				ahead[sha] = m_pool->submit([this, sha]() { return read_tree(sha); });
+			}
+		}
+	}
+
+	// All lists are sorted, so merge them taking the smallest name
+	std::vector<size_t> pos(trees.size(), 0);
+	Entries entries(trees.size());
+	while (true)
+	{
+		const GitTreeLeaf *first = nullptr;
+		for (size_t i = 0; i < trees.size(); i++)
+		{
+			if (pos[i] < trees[i].size() &&
+				(first == nullptr || DiffTree::compare(trees[i][pos[i]], *first) < 0))
+			{
+				first = &trees[i][pos[i]];
+			}
+		}
+		if (first == nullptr)
+			break;
+
+		bool is_tree = first->is_tree();
+		auto path = prefix + first->path;
+		for (size_t i = 0; i < trees.size(); i++)
+		{
+			entries[i] = nullptr;
+			if (pos[i] < trees[i].size() && DiffTree::compare(trees[i][pos[i]], *first) == 0)
+				entries[i] = &trees[i][pos[i]];
+		}
+		// first points into the lists, advance only after using it
+		bool enter = (!m_filter || m_filter(path, is_tree)) && visit(path, entries) && is_tree;
+		if (enter)
+		{
+			// Entries with the same name are all trees
+			std::vector<std::vector<GitTreeLeaf> > subtrees;
+			std::unordered_map<std::string, size_t> read;
+			for (const auto *entry : entries)
+			{
+				std::string sha = entry ? entry->sha : std::string();
+				auto done = read.find(sha);
+				if (done != read.end())
+				{
+					auto items = subtrees[done->second];
+					subtrees.push_back(std::move(items));
+					continue;
+				}
+				auto it = ahead.find(sha);
+				if (it != ahead.end())
+				{
+					subtrees.push_back(it->second.get());
+					ahead.erase(it);
+				}
+				else
+				{
+					subtrees.push_back(read_tree(sha));
+				}
+				read[sha] = subtrees.size() - 1;
+			}
+			walk_trees(std::move(subtrees), path + "/", visit);
+		}
+		for (size_t i = 0; i < trees.size(); i++)
+		{
+			if (entries[i])
+				pos[i]++;
+		}
+	}
+}
@@ -0,0 +1,65 @@
+#ifndef TREE_WALKER_H
+#define TREE_WALKER_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <functional>
+
+#include "GitRepository.h"
+#include "GitTreeLeaf.h"
+
+class ThreadPool;
+
+/**
+ * \brief Walks one or more trees in lock-step, in git tree order.
+ *
+ * The visitor sees each path with the entry each tree has for it, so
+ * that comparing trees needs no recursion of its own, and decides
+ * whether to enter subtrees.  A filter rejects paths before any tree
+ * below them is read.  With read-ahead, the subtrees accepted by the
+ * filter are read on worker threads while the visitor runs, though
+ * the visitor is always called on the walking thread, in order.
+ */
+class TreeWalker
+{
+public:
+	//! Entry of each tree at a path, null where a tree has none.
+	using Entries = std::vector<const GitTreeLeaf *>;
+
+	//! Called for each path, returns false to skip the subtrees at it.
+	using Visitor = std::function<bool(const std::string &path, const Entries &entries)>;
+
+	//! Decides whether to walk a path, a subtree if is_dir is set.
+	//! With read-ahead it is called for subtrees before the paths
+	//! sorted before them are visited, so it must not depend on them.
+	using Filter = std::function<bool(const std::string &path, bool is_dir)>;
+
+	TreeWalker(GitRepository &repo);
+
+	~TreeWalker();
+
+	//! Only walk paths accepted by filter.
+	void set_filter(Filter filter);
+
+	//! Read subtrees ahead on threads workers, or one per CPU if 0.
+	void read_ahead(size_t threads = 0);
+
+	//! Walk trees with ids trees in lock-step, an empty id is an empty
+	//! tree.  Paths below a subtree start with prefix.
+	void walk(const std::vector<std::string> &trees, const Visitor &visit,
+		const std::string &prefix = std::string());
+
+	//! Read the entries of tree sha, none if sha is empty.
+	std::vector<GitTreeLeaf> read_tree(const std::string &sha);
+
+private:
+	GitRepository &m_repo;
+	Filter m_filter;
+	std::unique_ptr<ThreadPool> m_pool;
+
+	void walk_trees(std::vector<std::vector<GitTreeLeaf> > trees,
+		const std::string &prefix, const Visitor &visit);
+};
+
+#endif
@@ -6,37 +6,79 @@
 #include <vector>
 #include <exception>
 #include <memory>
+#include <deque>
+#include <sstream>
+#include <algorithm>
+#include <ctime>
 
 #include "GitRepository.h"
 #include "GitObject.h"
 #include "GitCommit.h"
 #include "GitTree.h"
+#include "GitException.h"
+#include "DiffTree.h"
+#include "GitBlob.h"
+#include "LineDiff.h"
+#include "RenameDetector.h"
+#include "SparseMatcher.h"
+#include "GrepMatcher.h"
+#include "ThreadPool.h"
+#include "TarWriter.h"
+#include "PackIndexer.h"
+#include "PackWriter.h"
+#include "ObjectWalk.h"
+#include "ObjectChecker.h"
+#include "GarbageCollector.h"
+#include "PackBitmap.h"
+#include "BitmapWriter.h"
+#include "CommitGraph.h"
+#include "CommitGraphWriter.h"
+#include "CommitWalk.h"
+#include "TreeWalker.h"
+#include "BufferedWriter.h"
+#include "RefIterator.h"
+#include "PerfTrace.h"
 
 int
 cmd_init(const std::vector<std::string> &args)
 {
+	PERF_SCOPE("cmd_init");
 	std::string path(".");
-	if (args.size() > 2)
-		path = args.at(2);
+	bool reftable = false;
+	for (size_t i = 2; i < args.size(); i++)
+	{
+		if (args.at(i) == "--ref-format=reftable")
+			reftable = true;
+		else if (args.at(i) == "--ref-format=files")
+			reftable = false;
+		else
+			path = args.at(i);
+	}
 
-	GitRepository::repo_create(path);
+	GitRepository::repo_create(path, reftable);
 	return(0);
 }
 
 int
 cmd_cat_file(const std::vector<std::string> &args)
 {
+	PERF_SCOPE("cmd_cat_file");
 	int status = 0;
 	std::string type;
 	std::string sha;
 	if (args.size() > 3)
 	{
 		type = args.at(2);
-		sha = args.at(3);
 
 		GitRepository repo = GitRepository::repo_find();
+		sha = repo.object_find(args.at(3), type);
 		auto obj = repo.object_read(sha);
-		if (obj)
+		if (obj && obj->get_format() != type)
+		{
+			std::cerr << "Not a " << type << ": " << args.at(3) << std::endl;
+			status = 1;
+		}
+		else if (obj)
 		{
 			auto bytes = obj->serialize();
 			for (const auto &ch : bytes)
@@ -63,6 +105,7 @@ cmd_cat_file(const std::vector<std::string> &args)
 int
 cmd_hash_object(const std::vector<std::string> &args)
 {
+	PERF_SCOPE("cmd_hash_object");
 	int status = 0;
 	std::string type("blob");
 	bool write = false;
@@ -147,11 +190,57 @@ log_graphviz(GitRepository &repo, const std::string &sha,
 	return 0;
 }
 
+//! Print id and subject of the commits from tip changing paths.
+int
+log_paths(GitRepository &repo, const std::string &tip,
+	const std::vector<std::string> &paths)
+{
+	CommitWalk walk(repo);
+	walk.log(tip, paths, [&repo](const CommitWalk::Commit &c) {
+		auto commit = std::dynamic_pointer_cast<GitCommit>(repo.object_read(c.sha));
+		std::string subject;
+		if (commit)
+		{
+			auto message = commit->get_value(std::string());
+			if (!message.empty())
+				subject = message.front().substr(0, message.front().find('\n'));
+		}
+		std::cout << c.sha << " " << subject << std::endl;
+	});
+	return 0;
+}
+
 int
 cmd_log(const std::vector<std::string> &args)
 {
+	PERF_SCOPE("cmd_log");
 	int status = 0;
-	if (args.size() > 2)
+	auto dashes = std::find(args.begin() + 2, args.end(), "--");
+	if (dashes != args.end())
+	{
+		// Only commits changing the paths after "--"
+		std::string commit = dashes - args.begin() > 2 ? args.at(2) : "HEAD";
+		std::vector<std::string> paths;
+		for (auto it = dashes + 1; it != args.end(); ++it)
+		{
+			auto path = *it;
+			while (path.size() > 1 && path.back() == '/')
+				path.pop_back();
+			paths.push_back(path);
+		}
+
+		GitRepository repo = GitRepository::repo_find();
+		try
+		{
+			status = log_paths(repo, repo.object_find(commit), paths);
+		}
+		catch (const GitException &e)
+		{
+			std::cerr << e.what() << std::endl;
+			status = 1;
+		}
+	}
+	else if (args.size() > 2)
 	{
 		std::string commit = args.at(2);
 
@@ -168,6 +257,8 @@ cmd_log(const std::vector<std::string> &args)
 	{
 		std::cerr << "Usage: " << args.at(0) << " " << args.at(1) <<
 			" commit" << std::endl;
+		std::cerr << "       " << args.at(0) << " " << args.at(1) <<
+			" [commit] -- path..." << std::endl;
 		status = 1;
 	}
 	return status;
@@ -176,81 +267,116 @@ cmd_log(const std::vector<std::string> &args)
 int
 cmd_ls_tree(const std::vector<std::string> &args)
 {
-	int status = 0;
-	if (args.size() > 2)
+	PERF_SCOPE("cmd_ls_tree");
+	bool recursive = false;
+	bool show_trees = false;
+	std::vector<std::string> names;
+	for (size_t i = 2; i < args.size(); i++)
+	{
+		if (args.at(i) == "-r")
+			recursive = true;
+		else if (args.at(i) == "-t")
+			show_trees = true;
+		else
+			names.push_back(args.at(i));
+	}
+	if (names.size() != 1)
 	{
-		std::string name = args.at(2);
+		std::cerr << "Usage: " << args.at(0) << " " << args.at(1) <<
+			" [-r] [-t] object" << std::endl;
+		return 1;
+	}
 
-		GitRepository repo = GitRepository::repo_find();
-		auto obj = repo.object_read(repo.object_find(name, "tree"));
-		if (obj == nullptr)
-		{
-			std::cerr << "Object not found: " << name << std::endl;
-			return 1;
-		}
-		if (obj->get_format() != "tree")
+	const auto &name = names.at(0);
+	GitRepository repo = GitRepository::repo_find();
+	auto sha = repo.object_find(name, "tree");
+	std::string fmt;
+	size_t size;
+	if (!repo.object_info(sha, fmt, size))
+	{
+		std::cerr << "Object not found: " << name << std::endl;
+		return 1;
+	}
+	if (fmt != "tree")
+	{
+		std::cerr << "Not a tree object: " << name << std::endl;
+		return 1;
+	}
+
+	// Like git, the type of each entry follows from its mode, so
+	// only trees are read
+	BufferedWriter out;
+	TreeWalker walker(repo);
+	if (recursive)
+		walker.read_ahead();
+	walker.walk({sha}, [&](const std::string &path, const TreeWalker::Entries &entries) {
+		const auto *item = entries[0];
+		bool is_tree = item->is_tree();
+		if (!is_tree || show_trees || !recursive)
 		{
-			std::cerr << "Not a tree object: " << name << std::endl;
-			return 1;
+			out << std::string(item->mode.size() < 6 ? 6 - item->mode.size() : 0, '0') <<
+				item->mode << ' ' <<
+				(is_tree ? "tree" : (item->mode == "160000" ? "commit" : "blob")) << ' ' <<
+				item->sha << '\t' << path << '\n';
 		}
-		auto items = std::dynamic_pointer_cast<GitTree>(obj)->get_items();
-		for (const auto &item : items)
-		{
-			std::cout << std::setw(6) << std::setfill('0') <<
-				item.mode;
+		return recursive;
+	});
+	out.flush();
+	return 0;
+}
 
-			// Git's ls-tree displays the type
-			// of the object pointed to.  We can do that too :)
-			obj = repo.object_read(item.sha);
-			if (obj == nullptr)
-			{
-				std::cerr << "Object not found: " << item.sha << std::endl;
-				return 1;
-			}
-			std::cout << " " << obj->get_format() <<
-				" " << item.sha << "\t" <<
-				item.path << std::endl;
-		}
-	}
-	else
+//! Find tree for a tree or commit, or return empty string.
+std::string
+find_tree(GitRepository &repo, const std::string &name)
+{
+	auto sha = repo.object_find(name, "tree");
+	std::string fmt;
+	size_t size;
+	if (!repo.object_info(sha, fmt, size) || fmt != "tree")
 	{
-		std::cerr << "Usage: " << args.at(0) << " " << args.at(1) <<
-			" object" << std::endl;
-		status = 1;
+		return std::string();
 	}
-	return status;
+	return sha;
 }
 
 int
 cmd_checkout(const std::vector<std::string> &args)
 {
+	PERF_SCOPE("cmd_checkout");
+	bool sparse_checkout = false;
+	bool cone = false;
+	std::vector<std::string> names;
+	for (size_t i = 2; i < args.size(); i++)
+	{
+		if (args.at(i) == "--sparse")
+			sparse_checkout = true;
+		else if (args.at(i) == "--cone")
+			sparse_checkout = cone = true;
+		else
+			names.push_back(args.at(i));
+	}
+
 	int status = 0;
-	if (args.size() > 3)
+	if (names.size() == 2)
 	{
-		std::string commit = args.at(2);
-		std::string path = args.at(3);
+		std::string commit = names.at(0);
+		std::string path = names.at(1);
 
 		GitRepository repo = GitRepository::repo_find();
-		auto obj = repo.object_read(repo.object_find(commit, "tree"));
-		if (obj == nullptr)
+		// Commits are followed to their tree
+		std::string tree_sha = find_tree(repo, commit);
+		if (tree_sha.empty())
 		{
 			std::cerr << "Object not found: " << commit << std::endl;
 			return 1;
 		}
-		// If the object is a commit, we grab its tree
-		if (obj->get_format() == "commit")
-		{
-			auto tree = std::dynamic_pointer_cast<GitCommit>(obj)->get_value("tree");
-			if (tree.empty())
-			{
-				std::cerr << "Tree object is empty: " << commit << std::endl;
-				return 1;
-			}
-			std::string sha = tree.at(0);
-			obj = repo.object_read(sha);
-		}
 
-		// Verify that path is an empty directory
+		std::unique_ptr<SparseMatcher> sparse;
+		if (sparse_checkout)
+			sparse.reset(new SparseMatcher(repo.sparse_checkout(cone)));
+
+		// Verify that path is an empty directory, or one we
+		// checked out before and can switch incrementally.
 		auto dir = fs::path(path);
 		if (fs::exists(dir))
 		{
@@ -261,8 +387,29 @@ cmd_checkout(const std::vector<std::string> &args)
 			}
 			if (!fs::is_empty(dir))
 			{
-				std::cerr << "Directory not empty: " << path << std::endl;
-				return 1;
+				auto old_tree = repo.checkout_recorded(path);
+				if (old_tree.empty())
+				{
+					std::cerr << "Directory not empty: " << path << std::endl;
+					return 1;
+				}
+				if (!repo.checkout_recorded_sparse(path, sparse.get()))
+				{
+					std::cerr << "Sparse checkout patterns changed, check out to an empty directory: " <<
+						path << std::endl;
+					return 1;
+				}
+				try
+				{
+					repo.tree_switch(old_tree, tree_sha, path, sparse.get());
+				}
+				catch (const GitException &e)
+				{
+					std::cerr << e.what() << std::endl;
+					return 1;
+				}
+				repo.checkout_record(path, tree_sha, sparse.get());
+				return 0;
 			}
 		}
 		else
@@ -270,45 +417,987 @@ cmd_checkout(const std::vector<std::string> &args)
 			fs::create_directories(dir);
 		}
 
-		repo.tree_checkout(obj, path);
+		// Nothing is recorded for a tree not completely written
+		try
+		{
+			repo.tree_checkout(tree_sha, path, sparse.get());
+		}
+		catch (const GitException &e)
+		{
+			std::cerr << e.what() << std::endl;
+			return 1;
+		}
+		repo.checkout_record(path, tree_sha, sparse.get());
 	}
 	else
 	{
 		std::cerr << "Usage: " << args.at(0) << " " << args.at(1) <<
-			" commit path" << std::endl;
+			" [--sparse | --cone] commit path" << std::endl;
 		status = 1;
 	}
 	return status;
 }
 
-int
-show_ref(const std::map<std::string, GitRef> &refs,
-	bool with_hash,
-	const std::string &prefix)
+//! Read blob contents, an all zero id is an empty blob.
+std::shared_ptr<GitBlob>
+read_blob(GitRepository &repo, const std::string &sha)
+{
+	if (sha.find_first_not_of('0') == std::string::npos)
+		return std::make_shared<GitBlob>(&repo);
+
+	auto obj = repo.object_read(sha);
+	if (obj == nullptr || obj->get_format() != "blob")
+		throw GitException("Not a blob object: " + sha);
+	return std::dynamic_pointer_cast<GitBlob>(obj);
+}
+
+//! Write one changed path in git's patch format.
+void
+write_patch(GitRepository &repo, const DiffEntry &e, LineDiff &differ)
 {
-	for (auto it = refs.begin(); it != refs.end(); ++it)
+	std::string old_path = e.old_path.empty() ? e.path : e.old_path;
+	std::cout << "diff --git a/" << old_path << " b/" << e.path << std::endl;
+	std::string old_name = "a/" + old_path;
+	std::string new_name = "b/" + e.path;
+	if (e.status == 'R' || e.status == 'C')
 	{
-		if (it->second.subref.empty() == false)
+		const char *what = e.status == 'R' ? "rename" : "copy";
+		if (e.old_mode != e.new_mode)
 		{
-			std::string prefix2 = prefix;
-			if (prefix2.size() > 0)
-				prefix2.append("/");
-			prefix2.append(it->first);
+			std::cout << "old mode " << e.old_mode << std::endl <<
+				"new mode " << e.new_mode << std::endl;
+		}
+		std::cout << "similarity index " << e.score << "%" << std::endl <<
+			what << " from " << e.old_path << std::endl <<
+			what << " to " << e.path << std::endl;
+	}
+	else if (e.status == 'A')
+	{
+		std::cout << "new file mode " << e.new_mode << std::endl;
+		old_name = "/dev/null";
+	}
+	else if (e.status == 'D')
+	{
+		std::cout << "deleted file mode " << e.old_mode << std::endl;
+		new_name = "/dev/null";
+	}
+	else if (e.old_mode != e.new_mode)
+	{
+		std::cout << "old mode " << e.old_mode << std::endl <<
+			"new mode " << e.new_mode << std::endl;
+	}
+	if (e.old_sha == e.new_sha)
+		return;
+
+	std::cout << "index " << e.old_sha.substr(0, 7) << ".." <<
+		e.new_sha.substr(0, 7);
+	if (e.status != 'A' && e.status != 'D' && e.old_mode == e.new_mode)
+		std::cout << " " << e.old_mode;
+	std::cout << std::endl;
+
+	// Submodule commits have no contents here
+	if (e.old_mode == "160000" || e.new_mode == "160000")
+		return;
+
+	auto blob1 = read_blob(repo, e.old_sha);
+	auto blob2 = read_blob(repo, e.new_sha);
+	const auto &data1 = blob1->get_data();
+	const auto &data2 = blob2->get_data();
+	if (LineDiff::is_binary(data1.data(), data1.size()) ||
+		LineDiff::is_binary(data2.data(), data2.size()))
+	{
+		std::cout << "Binary files " << old_name << " and " <<
+			new_name << " differ" << std::endl;
+		return;
+	}
+
+	std::cout << "--- " << old_name << std::endl <<
+		"+++ " << new_name << std::endl;
+	differ.unified(data1.data(), data1.size(),
+		data2.data(), data2.size(), std::cout);
+}
 
-			show_ref(it->second.subref, with_hash, prefix2);
+int
+cmd_diff_tree(const std::vector<std::string> &args)
+{
+	PERF_SCOPE("cmd_diff_tree");
+	bool recursive = false;
+	bool patch = false;
+	bool renames = false;
+	bool copies = false;
+	int min_score = 50;
+	size_t rename_limit = 1000;
+	size_t context = 3;
+	auto algorithm = LineDiff::Algorithm::myers;
+	std::vector<std::string> names;
+	for (size_t i = 2; i < args.size(); i++)
+	{
+		if (args.at(i) == "-r")
+			recursive = true;
+		else if (args.at(i) == "-p")
+			patch = true;
+		else if (args.at(i) == "--histogram")
+			algorithm = LineDiff::Algorithm::histogram;
+		else if (args.at(i).find("-U") == 0)
+			context = std::stoul(args.at(i).substr(2));
+		else if (args.at(i).find("-M") == 0 || args.at(i).find("-C") == 0)
+		{
+			renames = true;
+			copies = copies || args.at(i).at(1) == 'C';
+			if (args.at(i).size() > 2)
+				min_score = std::stoi(args.at(i).substr(2));
 		}
+		else if (args.at(i).find("-l") == 0 && args.at(i).size() > 2)
+			rename_limit = std::stoul(args.at(i).substr(2));
 		else
+			names.push_back(args.at(i));
+	}
+	if (names.empty() || names.size() > 2)
+	{
+		std::cerr << "Usage: " << args.at(0) << " " << args.at(1) <<
+			" [-r] [-p] [--histogram] [-U<n>] [-M[<n>]] [-C[<n>]] [-l<n>]" <<
+			" tree-ish [tree-ish]" << std::endl;
+		return 1;
+	}
+
+	GitRepository repo = GitRepository::repo_find();
+	std::string tree1;
+	std::string tree2;
+	if (names.size() == 1)
+	{
+		// Compare a commit with its first parent
+		auto sha = repo.object_find(names.at(0), "commit");
+		auto obj = repo.object_read(sha);
+		if (obj == nullptr || obj->get_format() != "commit")
+		{
+			std::cerr << "Not a commit object: " << names.at(0) << std::endl;
+			return 1;
+		}
+		auto parents = std::dynamic_pointer_cast<GitCommit>(obj)->get_value("parent");
+		if (!parents.empty())
+		{
+			tree1 = find_tree(repo, parents.at(0));
+		}
+		tree2 = find_tree(repo, sha);
+		std::cout << sha << std::endl;
+	}
+	else
+	{
+		tree1 = find_tree(repo, names.at(0));
+		tree2 = find_tree(repo, names.at(1));
+		for (size_t i = 0; i < 2; i++)
 		{
-			if (with_hash)
+			if ((i == 0 ? tree1 : tree2).empty())
 			{
-				std::cout << it->second.ref << " ";
+				std::cerr << "Not a tree object: " << names.at(i) << std::endl;
+				return 1;
 			}
-			if (prefix.size() > 0)
+		}
+	}
+
+	// Patches are always made for files, not subtrees
+	DiffTree differ(repo, recursive || patch);
+	LineDiff line_differ(algorithm, context);
+	auto entries = differ.diff(tree1, tree2);
+	if (renames)
+	{
+		RenameDetector detector(repo, copies, min_score, rename_limit);
+		detector.detect(entries);
+	}
+	for (const auto &e : entries)
+	{
+		if (patch)
+		{
+			write_patch(repo, e, line_differ);
+			continue;
+		}
+		std::cout << ":" << std::setw(6) << std::setfill('0') << e.old_mode <<
+			" " << std::setw(6) << std::setfill('0') << e.new_mode <<
+			" " << e.old_sha << " " << e.new_sha << " " << e.status;
+		if (e.status == 'R' || e.status == 'C')
+		{
+			std::cout << std::setw(3) << std::setfill('0') << e.score <<
+				"\t" << e.old_path;
+		}
+		std::cout << "\t" << e.path << std::endl;
+	}
+	return 0;
+}
+
+//! A file in a tree, with its full path.
+struct TreeFile
+{
+	std::string path;
+	std::string mode;
+	std::string sha;
+};
+
+//! Is path, or anything below directory path, selected by pathspecs?
+bool
+pathspec_match(const std::string &path, bool is_dir,
+	const std::vector<std::string> &pathspecs)
+{
+	if (pathspecs.empty())
+		return true;
+
+	for (auto spec : pathspecs)
+	{
+		while (spec.size() > 1 && spec.back() == '/')
+			spec.pop_back();
+		if (path == spec || path.compare(0, spec.size() + 1, spec + "/") == 0)
+			return true;
+		if (is_dir && spec.compare(0, path.size() + 1, path + "/") == 0)
+			return true;
+	}
+	return false;
+}
+
+//! List files below tree in tree order, skipping subtrees that
+//! cannot contain files selected by pathspecs.  Directories are
+//! listed before their contents if with_dirs is set.
+void
+list_files(GitRepository &repo, const std::string &sha,
+	const std::string &prefix,
+	const std::vector<std::string> &pathspecs,
+	std::vector<TreeFile> &files,
+	bool with_dirs = false)
+{
+	TreeWalker walker(repo);
+	walker.read_ahead();
+	walker.set_filter([&pathspecs](const std::string &path, bool is_dir) {
+		return pathspec_match(path, is_dir, pathspecs);
+	});
+	walker.walk({sha}, [&files, with_dirs](const std::string &path, const TreeWalker::Entries &entries) {
+		const auto *item = entries[0];
+		if (!item->is_tree() || with_dirs)
+			files.push_back(TreeFile{path, item->mode, item->sha});
+		return true;
+	}, prefix);
+}
+
+int
+cmd_grep(const std::vector<std::string> &args)
+{
+	PERF_SCOPE("cmd_grep");
+	std::vector<std::string> patterns;
+	std::vector<std::string> names;
+	std::vector<std::string> pathspecs;
+	bool line_numbers = false;
+	bool ignore_case = false;
+	bool files_only = false;
+	for (size_t i = 2; i < args.size(); i++)
+	{
+		if (args.at(i) == "--")
+		{
+			pathspecs.assign(args.begin() + i + 1, args.end());
+			break;
+		}
+		else if (args.at(i) == "-e" && i + 1 < args.size())
+			patterns.push_back(args.at(++i));
+		else if (args.at(i) == "-n")
+			line_numbers = true;
+		else if (args.at(i) == "-i")
+			ignore_case = true;
+		else if (args.at(i) == "-l")
+			files_only = true;
+		else
+			names.push_back(args.at(i));
+	}
+	if (patterns.empty() && !names.empty())
+	{
+		patterns.push_back(names.front());
+		names.erase(names.begin());
+	}
+	if (patterns.empty() || names.size() != 1)
+	{
+		std::cerr << "Usage: " << args.at(0) << " " << args.at(1) <<
+			" [-n] [-i] [-l] [-e] pattern tree-ish [-- path...]" << std::endl;
+		return 1;
+	}
+
+	// 1 means nothing matched, so a bad pattern needs another status
+	std::unique_ptr<GrepMatcher> matcher;
+	try
+	{
+		matcher.reset(new GrepMatcher(patterns, ignore_case));
+	}
+	catch (const GitException &e)
+	{
+		std::cerr << e.what() << std::endl;
+		return 128;
+	}
+
+	GitRepository repo = GitRepository::repo_find();
+	std::string name = names.at(0);
+	auto tree = find_tree(repo, name);
+	if (tree.empty())
+	{
+		std::cerr << "Not a tree object: " << name << std::endl;
+		return 1;
+	}
+
+	std::vector<TreeFile> files;
+	list_files(repo, tree, std::string(), pathspecs, files);
+
+	auto grep_file = [&repo, &matcher, &name, line_numbers, files_only](const TreeFile &file)
+	{
+		// Only regular files are searched, like git grep does, not
+		// symlink targets or submodules
+		std::ostringstream out;
+		if (file.mode == "120000" || file.mode == "160000")
+			return out.str();
+
+		// Skip binary files after inflating only their start
+		std::string fmt;
+		size_t size;
+		std::vector<unsigned char> head;
+		if (!repo.object_info(file.sha, fmt, size, &head, 8000) ||
+			LineDiff::is_binary(head.data(), head.size()))
+		{
+			return out.str();
+		}
+
+		auto blob = read_blob(repo, file.sha);
+		const auto &data = blob->get_data();
+		matcher->match(data.data(), data.size(),
+			[&](size_t line_number, std::string_view line) {
+				if (files_only)
+				{
+					if (out.tellp() == 0)
+						out << name << ":" << file.path << std::endl;
+					return;
+				}
+				out << name << ":" << file.path << ":";
+				if (line_numbers)
+					out << line_number << ":";
+				out << line << std::endl;
+			});
+		return out.str();
+	};
+
+	// Search files on all workers, but print results in tree order,
+	// keeping a limited number of files in flight.
+	ThreadPool pool;
+	size_t window = 4 * pool.size();
+	std::deque<std::future<std::string> > pending;
+	bool matched = false;
+	auto print_next = [&pending, &matched]()
+	{
+		auto result = pending.front().get();
+		pending.pop_front();
+		if (!result.empty())
+		{
+			std::cout << result;
+			matched = true;
+		}
+	};
+	for (const auto &file : files)
+	{
+		if (pending.size() >= window)
+			print_next();
+		pending.push_back(pool.submit([&grep_file, file]() { return grep_file(file); }));
+	}
+	while (!pending.empty())
+		print_next();
+
+	return matched ? 0 : 1;
+}
+
+int
+cmd_archive(const std::vector<std::string> &args)
+{
+	PERF_SCOPE("cmd_archive");
+	std::string format("tar");
+	std::string prefix;
+	std::vector<std::string> names;
+	std::vector<std::string> pathspecs;
+	for (size_t i = 2; i < args.size(); i++)
+	{
+		if (args.at(i).find("--format=") == 0)
+			format = args.at(i).substr(9);
+		else if (args.at(i).find("--prefix=") == 0)
+			prefix = args.at(i).substr(9);
+		else if (names.empty())
+			names.push_back(args.at(i));
+		else
+			pathspecs.push_back(args.at(i));
+	}
+	if (names.empty())
+	{
+		std::cerr << "Usage: " << args.at(0) << " " << args.at(1) <<
+			" [--format=tar] [--prefix=dir/] tree-ish [path...]" << std::endl;
+		return 1;
+	}
+	if (format != "tar")
+	{
+		std::cerr << "Unknown archive format: " << format << std::endl;
+		return 1;
+	}
+
+	GitRepository repo = GitRepository::repo_find();
+	std::string name = names.at(0);
+	auto tree = find_tree(repo, name);
+	if (tree.empty())
+	{
+		std::cerr << "Not a tree object: " << name << std::endl;
+		return 1;
+	}
+
+	// Like git, use the commit time for all files, or the current
+	// time if archiving a tree.
+	time_t mtime = time(nullptr);
+	auto commit_sha = repo.object_find(name, "commit");
+	auto commit = repo.object_read(commit_sha);
+	if (commit && commit->get_format() == "commit")
+	{
+		auto committer = std::dynamic_pointer_cast<GitCommit>(commit)->get_value("committer");
+		if (!committer.empty())
+		{
+			std::istringstream fields(committer.at(0).substr(committer.at(0).rfind('>') + 1));
+			fields >> mtime;
+		}
+	}
+	else
+	{
+		commit = nullptr;
+	}
+
+	std::vector<TreeFile> entries;
+	list_files(repo, tree, std::string(), pathspecs, entries, true);
+
+	auto has_blob = [](const TreeFile &e) {
+		return e.mode != "40000" && e.mode != "040000" && e.mode != "160000";
+	};
+
+	TarWriter tar(std::cout, mtime);
+	if (commit)
+		tar.add_comment(commit_sha);
+	if (!prefix.empty() && prefix.back() == '/')
+		tar.add_directory(prefix.substr(0, prefix.size() - 1), 0775);
+
+	// Workers inflate blobs ahead of the writer, which takes them in
+	// tree order.  Only a few blobs are held in memory at a time.
+	ThreadPool pool;
+	size_t window = 2 * pool.size();
+	std::deque<std::future<std::shared_ptr<GitBlob> > > pending;
+	size_t next = 0;
+	for (const auto &e : entries)
+	{
+		for (; next < entries.size() && pending.size() < window; next++)
+		{
+			if (has_blob(entries[next]))
 			{
-				std::cout << prefix << "/";
+				auto sha = entries[next].sha;
+				pending.push_back(pool.submit([&repo, sha]() { return read_blob(repo, sha); }));
 			}
-			std::cout << it->first << std::endl;
 		}
+
+		auto path = prefix + e.path;
+		if (!has_blob(e))
+		{
+			// Submodules become empty directories
+			tar.add_directory(path, 0775);
+			continue;
+		}
+
+		auto blob = pending.front().get();
+		pending.pop_front();
+		const auto &data = blob->get_data();
+		if (e.mode == "120000")
+			tar.add_symlink(path, std::string(data.begin(), data.end()));
+		else
+			tar.add_file(path, e.mode == "100755" ? 0775 : 0664, data);
+	}
+	tar.finish();
+	return 0;
+}
+
+int
+cmd_index_pack(const std::vector<std::string> &args)
+{
+	PERF_SCOPE("cmd_index_pack");
+	size_t threads = 0;
+	std::vector<std::string> names;
+	for (size_t i = 2; i < args.size(); i++)
+	{
+		if (args.at(i).find("--threads=") == 0)
+			threads = std::stoul(args.at(i).substr(10));
+		else
+			names.push_back(args.at(i));
+	}
+	if (names.size() != 1)
+	{
+		std::cerr << "Usage: " << args.at(0) << " " << args.at(1) <<
+			" [--threads=n] file.pack" << std::endl;
+		return 1;
+	}
+
+	try
+	{
+		PackIndexer indexer(names.at(0), threads);
+		std::cout << indexer.run() << std::endl;
+	}
+	catch (const GitException &e)
+	{
+		std::cerr << e.what() << std::endl;
+		return 1;
+	}
+	return 0;
+}
+
+//! Pack all objects reachable from the references, with prune delete
+//! the old packs and loose objects now packed, with bitmap write
+//! reachability bitmaps.
+static void
+repack(GitRepository &repo, bool prune, bool bitmap, size_t window, size_t depth,
+	size_t threads)
+{
+	PackWriter writer(repo, window, depth, threads);
+	ObjectWalk walk(repo);
+	walk.add_refs();
+	auto ref_tips = walk.tips();
+	// Checked out trees stay, as prune keeps them
+	for (const auto &tree : repo.checkout_trees())
+	{
+		if (repo.has_object(tree))
+			walk.add_tip(tree);
+	}
+	walk.walk([&writer](const std::string &sha, const std::string &fmt,
+		const std::string &path) {
+		writer.add(sha, fmt, path);
+	});
+	if (writer.object_count() == 0)
+	{
+		std::cerr << "Nothing new to pack." << std::endl;
+		return;
+	}
+
+	auto pack_sha = writer.write(repo.pack_dir().string());
+	std::cerr << "Total " << writer.object_count() << " (delta " <<
+		writer.delta_count() << ")" << std::endl;
+	if (bitmap)
+	{
+		GitPack pack((repo.pack_dir() / ("pack-" + pack_sha + ".idx")).string());
+		BitmapWriter bitmaps(pack);
+		bitmaps.write(ref_tips);
+		std::cerr << "Wrote bitmaps for " << bitmaps.bitmap_count() << " commits" << std::endl;
+	}
+	if (prune)
+	{
+		size_t unpacked;
+		auto removed = repo.prune_packed(pack_sha, unpacked);
+		std::cerr << "Removed " << removed << " loose objects" << std::endl;
+		if (unpacked > 0)
+			std::cerr << "Unpacked " << unpacked << " unreachable objects" << std::endl;
+	}
+}
+
+//! Parse "now", "never" or "<n>.<unit>.ago" into a time.
+static time_t
+parse_expire(const std::string &s)
+{
+	time_t now = time(nullptr);
+	if (s == "now")
+		return now;
+	if (s == "never")
+		return 0;
+
+	static const std::map<std::string, time_t> units = {
+		{"second", 1}, {"minute", 60}, {"hour", 3600},
+		{"day", 86400}, {"week", 7 * 86400}
+	};
+	auto dot = s.find('.');
+	auto ago = s.rfind(".ago");
+	if (dot != std::string::npos && ago != std::string::npos && ago > dot &&
+		ago + 4 == s.size() && dot > 0 &&
+		std::all_of(s.begin(), s.begin() + dot, ::isdigit))
+	{
+		auto unit = s.substr(dot + 1, ago - dot - 1);
+		if (unit.size() > 1 && unit.back() == 's')
+			unit.pop_back();
+		auto it = units.find(unit);
+		if (it != units.end())
+			return now - std::stol(s.substr(0, dot)) * it->second;
+	}
+	throw GitException("Invalid expiry time: " + s);
+}
+
+//! Mark reachable objects and delete the other loose objects older
+//! than expire.
+static void
+prune(GitRepository &repo, time_t expire, bool dry_run, bool verbose,
+	size_t threads)
+{
+	GarbageCollector gc(repo, threads);
+	gc.mark(expire);
+	auto count = gc.prune(dry_run || verbose ? &std::cout : nullptr, dry_run);
+	if (!dry_run)
+		std::cerr << "Removed " << count << " unreachable loose objects" << std::endl;
+}
+
+int
+cmd_repack(const std::vector<std::string> &args)
+{
+	PERF_SCOPE("cmd_repack");
+	GitRepository repo = GitRepository::repo_find();
+	const auto &config = repo.config();
+	bool prune = false;
+	bool bitmap = config.get_bool("repack.writebitmaps", false);
+	size_t window = config.get_int("pack.window", 10);
+	size_t depth = config.get_int("pack.depth", 50);
+	size_t threads = config.get_int("pack.threads", 0);
+	for (size_t i = 2; i < args.size(); i++)
+	{
+		if (args.at(i) == "-d")
+			prune = true;
+		else if (args.at(i) == "-b" || args.at(i) == "--write-bitmap-index")
+			bitmap = true;
+		else if (args.at(i).find("--window=") == 0)
+			window = std::stoul(args.at(i).substr(9));
+		else if (args.at(i).find("--depth=") == 0)
+			depth = std::stoul(args.at(i).substr(8));
+		else if (args.at(i).find("--threads=") == 0)
+			threads = std::stoul(args.at(i).substr(10));
+		else
+		{
+			std::cerr << "Usage: " << args.at(0) << " " << args.at(1) <<
+				" [-d] [-b] [--window=n] [--depth=n] [--threads=n]" << std::endl;
+			return 1;
+		}
+	}
+
+	repack(repo, prune, bitmap, window, depth, threads);
+	return 0;
+}
+
+int
+cmd_fsck(const std::vector<std::string> &args)
+{
+	PERF_SCOPE("cmd_fsck");
+	bool dangling = true;
+	size_t threads = 0;
+	for (size_t i = 2; i < args.size(); i++)
+	{
+		if (args.at(i) == "--no-dangling")
+			dangling = false;
+		else if (args.at(i).find("--threads=") == 0)
+			threads = std::stoul(args.at(i).substr(10));
+		else
+		{
+			std::cerr << "Usage: " << args.at(0) << " " << args.at(1) <<
+				" [--no-dangling] [--threads=n]" << std::endl;
+			return 1;
+		}
+	}
+
+	GitRepository repo = GitRepository::repo_find();
+	ObjectChecker checker(repo, threads);
+	return checker.run(std::cout, dangling) > 0 ? 1 : 0;
+}
+
+int
+cmd_prune(const std::vector<std::string> &args)
+{
+	PERF_SCOPE("cmd_prune");
+	bool dry_run = false;
+	bool verbose = false;
+	std::string expire = "now";
+	size_t threads = 0;
+	for (size_t i = 2; i < args.size(); i++)
+	{
+		if (args.at(i) == "-n")
+			dry_run = true;
+		else if (args.at(i) == "-v")
+			verbose = true;
+		else if (args.at(i).find("--expire=") == 0)
+			expire = args.at(i).substr(9);
+		else if (args.at(i).find("--threads=") == 0)
+			threads = std::stoul(args.at(i).substr(10));
+		else
+		{
+			std::cerr << "Usage: " << args.at(0) << " " << args.at(1) <<
+				" [-n] [-v] [--expire=time] [--threads=n]" << std::endl;
+			return 1;
+		}
+	}
+
+	GitRepository repo = GitRepository::repo_find();
+	try
+	{
+		prune(repo, parse_expire(expire), dry_run, verbose, threads);
+	}
+	catch (const GitException &e)
+	{
+		std::cerr << e.what() << std::endl;
+		return 1;
+	}
+	return 0;
+}
+
+int
+cmd_gc(const std::vector<std::string> &args)
+{
+	PERF_SCOPE("cmd_gc");
+	GitRepository repo = GitRepository::repo_find();
+	const auto &config = repo.config();
+	std::string expire = config.has("gc.pruneexpire") ? config.get("gc.pruneexpire") : "2.weeks.ago";
+	size_t threads = config.get_int("pack.threads", 0);
+	for (size_t i = 2; i < args.size(); i++)
+	{
+		if (args.at(i).find("--prune=") == 0)
+			expire = args.at(i).substr(8);
+		else if (args.at(i).find("--threads=") == 0)
+			threads = std::stoul(args.at(i).substr(10));
+		else
+		{
+			std::cerr << "Usage: " << args.at(0) << " " << args.at(1) <<
+				" [--prune=time] [--threads=n]" << std::endl;
+			return 1;
+		}
+	}
+
+	try
+	{
+		// Check the expiry before packing
+		auto when = parse_expire(expire);
+		repack(repo, true, false, config.get_int("pack.window", 10),
+			config.get_int("pack.depth", 50), threads);
+		GitRepository packed = GitRepository::repo_find();
+		prune(packed, when, false, false, threads);
+	}
+	catch (const GitException &e)
+	{
+		std::cerr << e.what() << std::endl;
+		return 1;
+	}
+	return 0;
+}
+
+//! Objects reachable from include but not from exclude, using the
+//! bitmap of the first pack which has one.  Returns false if there is
+//! none or it does not cover all objects.
+static bool
+rev_list_bitmap(GitRepository &repo, const std::vector<std::string> &include,
+	const std::vector<std::string> &exclude, bool objects,
+	std::vector<std::string> &found)
+{
+	for (const auto &pack : repo.packs())
+	{
+		if (!fs::exists(PackBitmap::bitmap_path(pack->pack_path())))
+			continue;
+		PackBitmap bitmap(*pack);
+		EwahBitmap wanted(bitmap.object_count());
+		EwahBitmap unwanted(bitmap.object_count());
+		for (const auto &sha : include)
+		{
+			if (!bitmap.reachable(sha, wanted))
+				return false;
+		}
+		for (const auto &sha : exclude)
+		{
+			if (!bitmap.reachable(sha, unwanted))
+				return false;
+		}
+		wanted.and_not(unwanted);
+		bitmap.list(wanted, [&](const std::string &sha, GitPack::Type type) {
+			if (objects || type == GitPack::Type::commit)
+				found.push_back(sha);
+		});
+		return true;
+	}
+	return false;
+}
+
+//! Same as rev_list_bitmap(), walking all commits and trees.
+static void
+rev_list_walk(GitRepository &repo, const std::vector<std::string> &include,
+	const std::vector<std::string> &exclude, bool objects,
+	std::vector<std::string> &found)
+{
+	std::set<std::string> excluded;
+	ObjectWalk hidden(repo);
+	for (const auto &sha : exclude)
+		hidden.add_tip(sha);
+	hidden.walk([&excluded](const std::string &sha, const std::string &,
+		const std::string &) {
+		excluded.insert(sha);
+	});
+
+	ObjectWalk walk(repo);
+	for (const auto &sha : include)
+		walk.add_tip(sha);
+	walk.walk([&](const std::string &sha, const std::string &fmt,
+		const std::string &path) {
+		if (excluded.count(sha) || (!objects && fmt != "commit"))
+			return;
+		found.push_back(path.empty() ? sha : sha + " " + path);
+	});
+}
+
+int
+cmd_rev_list(const std::vector<std::string> &args)
+{
+	PERF_SCOPE("cmd_rev_list");
+	bool objects = false;
+	bool count = false;
+	bool use_bitmap = false;
+	bool all = false;
+	std::vector<std::string> names;
+	for (size_t i = 2; i < args.size(); i++)
+	{
+		if (args.at(i) == "--objects")
+			objects = true;
+		else if (args.at(i) == "--count")
+			count = true;
+		else if (args.at(i) == "--use-bitmap-index")
+			use_bitmap = true;
+		else if (args.at(i) == "--all")
+			all = true;
+		else if (args.at(i)[0] != '-')
+			names.push_back(args.at(i));
+		else
+		{
+			// Unknown option, show the usage
+			names.clear();
+			all = false;
+			break;
+		}
+	}
+	if (names.empty() && !all)
+	{
+		std::cerr << "Usage: " << args.at(0) << " " << args.at(1) <<
+			" [--objects] [--count] [--use-bitmap-index] [--all] [^]commit..." << std::endl;
+		return 1;
+	}
+
+	GitRepository repo = GitRepository::repo_find();
+	std::vector<std::string> include;
+	std::vector<std::string> exclude;
+	if (all)
+	{
+		ObjectWalk refs(repo);
+		refs.add_refs();
+		include = refs.tips();
+	}
+	for (const auto &name : names)
+	{
+		bool hide = name[0] == '^';
+		auto sha = repo.object_find(hide ? name.substr(1) : name);
+		if (!repo.has_object(sha))
+		{
+			std::cerr << "Bad revision: " << name << std::endl;
+			return 1;
+		}
+		(hide ? exclude : include).push_back(sha);
+	}
+
+	std::vector<std::string> found;
+	if (!use_bitmap || !rev_list_bitmap(repo, include, exclude, objects, found))
+		rev_list_walk(repo, include, exclude, objects, found);
+	if (count)
+	{
+		std::cout << found.size() << std::endl;
+		return 0;
+	}
+	for (const auto &line : found)
+	{
+		std::cout << line << std::endl;
+	}
+	return 0;
+}
+
+int
+cmd_commit_graph(const std::vector<std::string> &args)
+{
+	PERF_SCOPE("cmd_commit_graph");
+	bool changed_paths = false;
+	size_t threads = 0;
+	bool usage = args.size() < 3 || args.at(2) != "write";
+	for (size_t i = 3; i < args.size() && !usage; i++)
+	{
+		if (args.at(i) == "--changed-paths")
+			changed_paths = true;
+		else if (args.at(i).find("--threads=") == 0)
+			threads = std::stoul(args.at(i).substr(10));
+		else
+			usage = true;
+	}
+	if (usage)
+	{
+		std::cerr << "Usage: " << args.at(0) << " " << args.at(1) <<
+			" write [--changed-paths] [--threads=n]" << std::endl;
+		return 1;
+	}
+
+	GitRepository repo = GitRepository::repo_find();
+	ObjectWalk refs(repo);
+	refs.add_refs();
+	CommitGraphWriter writer(repo, changed_paths, threads);
+	for (const auto &tip : refs.tips())
+		writer.add_tip(tip);
+	auto path = repo.commit_graph_path();
+	fs::create_directories(path.parent_path());
+	writer.write(path.string());
+	std::cerr << "Wrote " << writer.commit_count() << " commits to " <<
+		path.string() << std::endl;
+	return 0;
+}
+
+int
+cmd_merge_base(const std::vector<std::string> &args)
+{
+	PERF_SCOPE("cmd_merge_base");
+	bool is_ancestor = false;
+	bool all = false;
+	std::vector<std::string> names;
+	for (size_t i = 2; i < args.size(); i++)
+	{
+		if (args.at(i) == "--is-ancestor")
+			is_ancestor = true;
+		else if (args.at(i) == "--all" || args.at(i) == "-a")
+			all = true;
+		else
+			names.push_back(args.at(i));
+	}
+	if (names.size() < 2 || (is_ancestor && (names.size() != 2 || all)))
+	{
+		std::cerr << "Usage: " << args.at(0) << " " << args.at(1) <<
+			" [--all] commit commit..." << std::endl;
+		std::cerr << "       " << args.at(0) << " " << args.at(1) <<
+			" --is-ancestor commit commit" << std::endl;
+		return 1;
+	}
+
+	GitRepository repo = GitRepository::repo_find();
+	CommitWalk walk(repo);
+	std::vector<std::string> commits;
+	try
+	{
+		for (const auto &name : names)
+		{
+			// Tags stand for their commits
+			auto sha = repo.object_find(name, "commit");
+			walk.lookup(sha);
+			commits.push_back(sha);
+		}
+		if (is_ancestor)
+			return walk.is_ancestor(commits.at(0), commits.at(1)) ? 0 : 1;
+
+		auto bases = walk.merge_bases(commits.front(),
+			std::vector<std::string>(commits.begin() + 1, commits.end()));
+		if (bases.empty())
+			return 1;
+		for (const auto &base : bases)
+		{
+			std::cout << base << std::endl;
+			if (!all)
+				break;
+		}
+	}
+	catch (const GitException &e)
+	{
+		std::cerr << e.what() << std::endl;
+		return 128;
 	}
 	return 0;
 }
@@ -316,25 +1405,102 @@ show_ref(const std::map<std::string, GitRef> &refs,
 int
 cmd_show_ref(const std::vector<std::string> &args)
 {
-	int status = 0;
+	PERF_SCOPE("cmd_show_ref");
 	GitRepository repo = GitRepository::repo_find();
-	auto refs = repo.ref_list();
-	status = show_ref(refs, true, "refs");
+	std::string prefix = args.size() > 2 ? args.at(2) : "refs/";
+	for (RefIterator it(repo, prefix); it.next(); )
+	{
+		std::cout << it.sha() << " " << it.name() << '\n';
+	}
+	return 0;
+}
+
+//! Object id of value for update-ref, keeping the all zero id.
+static std::string
+update_ref_value(GitRepository &repo, const std::string &value)
+{
+	if (value.empty() || value == std::string(40, '0'))
+		return value;
+	auto sha = repo.object_find(value);
+	if (!repo.has_object(sha))
+		throw GitException("Not a valid object: " + value);
+	return sha;
+}
 
-	// More refs stored in packed-refs file
-	auto packed_refs = repo.packed_ref_list();
-	auto it = packed_refs.begin();
-	while (it != packed_refs.end())
+int
+cmd_update_ref(const std::vector<std::string> &args)
+{
+	PERF_SCOPE("cmd_update_ref");
+	GitRepository repo = GitRepository::repo_find();
+	std::vector<GitRepository::RefUpdate> updates;
+	try
+	{
+		if (args.size() == 3 && args.at(2) == "--stdin")
+		{
+			// Lines "update ref new [old]", "create ref new" and
+			// "delete ref [old]", applied together
+			std::string line;
+			while (std::getline(std::cin, line))
+			{
+				std::istringstream words(line);
+				std::string command;
+				GitRepository::RefUpdate update;
+				std::string new_sha;
+				std::string old_sha;
+				words >> command >> update.name;
+				if (command == "update" || command == "create")
+					words >> new_sha;
+				if (command == "update" || command == "delete")
+					words >> old_sha;
+				if (command == "create")
+					old_sha = std::string(40, '0');
+				if ((command != "update" && command != "create" && command != "delete") ||
+					update.name.empty() || (command != "delete" && new_sha.empty()))
+				{
+					throw GitException("Bad update-ref line: " + line);
+				}
+				update.new_sha = update_ref_value(repo, new_sha);
+				update.old_sha = update_ref_value(repo, old_sha);
+				updates.push_back(update);
+			}
+		}
+		else if (args.size() >= 4 && args.size() <= 5 && args.at(2) == "-d")
+		{
+			GitRepository::RefUpdate update;
+			update.name = args.at(3);
+			if (args.size() == 5)
+				update.old_sha = update_ref_value(repo, args.at(4));
+			updates.push_back(update);
+		}
+		else if (args.size() >= 4 && args.size() <= 5)
+		{
+			GitRepository::RefUpdate update;
+			update.name = args.at(2);
+			update.new_sha = update_ref_value(repo, args.at(3));
+			if (args.size() == 5)
+				update.old_sha = update_ref_value(repo, args.at(4));
+			updates.push_back(update);
+		}
+		else
+		{
+			std::cerr << "Usage: " << args.at(0) << " " << args.at(1) <<
+				" [-d] ref [new] [old] | --stdin" << std::endl;
+			return 1;
+		}
+		repo.ref_update(updates);
+	}
+	catch (const GitException &e)
 	{
-		std::cout << it->second << " " << it->first << std::endl;
-		++it;
+		std::cerr << e.what() << std::endl;
+		return 1;
 	}
-	return status;
+	return 0;
 }
 
 int
 cmd_tag(const std::vector<std::string> &args)
 {
+	PERF_SCOPE("cmd_tag");
 	int status = 0;
 	GitRepository repo = GitRepository::repo_find();
 
@@ -344,24 +1510,9 @@ cmd_tag(const std::vector<std::string> &args)
 	}
 	else
 	{
-		auto refs = repo.ref_list();
-		auto it = refs.find("tags");
-		if (it != refs.end())
+		for (RefIterator it(repo, "refs/tags/"); it.next(); )
 		{
-			show_ref(it->second.subref, false, std::string());
-		}
-
-		// More refs stored in packed-refs file
-		auto packed_refs = repo.packed_ref_list();
-		auto it2 = packed_refs.begin();
-		while (it2 != packed_refs.end())
-		{
-			if (it2->first.find("refs/tags/") == 0)
-			{
-				auto tag = it2->first.substr(10);
-				std::cout << tag << std::endl;
-			}
-			++it2;
+			std::cout << it.name().substr(10) << '\n';
 		}
 	}
 	return status;
@@ -402,6 +1553,50 @@ process(const std::vector<std::string> &args)
 	{
 		status = cmd_checkout(args);
 	}
+	else if (command == "diff-tree")
+	{
+		status = cmd_diff_tree(args);
+	}
+	else if (command == "grep")
+	{
+		status = cmd_grep(args);
+	}
+	else if (command == "archive")
+	{
+		status = cmd_archive(args);
+	}
+	else if (command == "index-pack")
+	{
+		status = cmd_index_pack(args);
+	}
+	else if (command == "repack")
+	{
+		status = cmd_repack(args);
+	}
+	else if (command == "fsck")
+	{
+		status = cmd_fsck(args);
+	}
+	else if (command == "prune")
+	{
+		status = cmd_prune(args);
+	}
+	else if (command == "gc")
+	{
+		status = cmd_gc(args);
+	}
+	else if (command == "rev-list")
+	{
+		status = cmd_rev_list(args);
+	}
+	else if (command == "commit-graph")
+	{
+		status = cmd_commit_graph(args);
+	}
+	else if (command == "merge-base")
+	{
+		status = cmd_merge_base(args);
+	}
 	else if (command == "show-ref")
 	{
 		status = cmd_show_ref(args);
@@ -410,6 +1605,10 @@ process(const std::vector<std::string> &args)
 	{
 		status = cmd_tag(args);
 	}
+	else if (command == "update-ref")
+	{
+		status = cmd_update_ref(args);
+	}
 	else
 	{
 		std::cerr << "Unknown command: " << command << std::endl;
@@ -434,6 +1633,7 @@ main(int argc, char *argv[])
 	catch (const std::exception &e)
 	{
 		std::cerr << e.what() << std::endl;
+		status = 128;
 	}
 	return status;
 }
@@ -0,0 +1,331 @@
+/*
+ * Concurrency stress test: many threads share one GitRepository,
+ * writing loose objects while others read them back.  Any object a
+ * reader sees through has_object() must be complete and intact.
+ * Objects another process writes must be found too.
+ *
+ * Meanwhile more threads read a chain of commits through object_read()
+ * and its shared cache, resolve and list references and walk the
+ * trees, and must see exactly what a single thread saw before.
+ *
+ * Usage: stress_test [threads] [objects per thread]
+ */
+#include <atomic>
+#include <cstdlib>
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "GitRepository.h"
+#include "GitBlob.h"
+#include "GitCommit.h"
+#include "GitTree.h"
+#include "GitPack.h"
+#include "RefIterator.h"
+#include "TreeWalker.h"
+
+namespace fs = std::filesystem;
+
+static std::atomic<unsigned> failures(0);
+
+static void
+fail(const std::string &msg)
+{
+	failures++;
+	std::cerr << "FAIL: " << msg << std::endl;
+}
+
+//! Contents of blob i; large enough that a torn write would be visible.
+static std::vector<unsigned char>
+blob_content(unsigned i)
+{
+	std::string s = "blob " + std::to_string(i) + "\n";
+	std::string content;
+	while (content.size() < 64 * 1024)
+		content += s;
+	return std::vector<unsigned char>(content.begin(), content.end());
+}
+
+static std::string
+write_blob(GitRepository &repo, unsigned i, bool actually_write = true)
+{
+	auto blob = std::make_shared<GitBlob>(&repo);
+	blob->deserialize(blob_content(i));
+	return repo.object_write(blob, actually_write);
+}
+
+static void
+check_blob(GitRepository &repo, const std::string &sha, unsigned i)
+{
+	std::string fmt;
+	std::vector<unsigned char> data;
+	if (!repo.object_data(sha, fmt, data))
+		fail("has_object " + sha + " but object_data failed");
+	else if (fmt != "blob" || data != blob_content(i))
+		fail("object " + sha + " read back with wrong contents");
+
+	size_t size = 0;
+	if (!repo.object_info(sha, fmt, size) || size != data.size())
+		fail("object_info " + sha + " disagrees with object_data");
+}
+
+//! Commits in the history read by the history threads.
+static const unsigned history_length = 50;
+
+/**
+ * \brief Object written exactly as given.  GitCommit::serialize()
+ * does not give back the commit it parsed.
+ */
+class RawObject : public GitObject
+{
+public:
+	RawObject(GitRepository *repo, const std::string &fmt, const std::string &raw) :
+		GitObject(repo, fmt),
+		m_raw(raw.begin(), raw.end())
+	{
+	}
+
+	std::vector<unsigned char> serialize()
+	{
+		return m_raw;
+	}
+
+	void deserialize(const std::vector<unsigned char> &data)
+	{
+		m_raw = data;
+	}
+
+private:
+	std::vector<unsigned char> m_raw;
+};
+
+static std::string
+write_object(GitRepository &repo, const std::string &fmt, const std::string &raw)
+{
+	return repo.object_write(std::make_shared<RawObject>(&repo, fmt, raw));
+}
+
+//! Tree entry for raw tree data.
+static std::string
+tree_entry(const std::string &mode, const std::string &name, const std::string &sha)
+{
+	unsigned char id[20];
+	GitPack::from_hex(sha, id);
+	return mode + " " + name + std::string(1, '\0') +
+		std::string(reinterpret_cast<char *>(id), sizeof(id));
+}
+
+static std::string
+write_small_blob(GitRepository &repo, const std::string &content)
+{
+	return write_object(repo, "blob", content);
+}
+
+//! Write a chain of commits, each changing some files, with a branch
+//! at the last one and a tag at each one.
+static void
+write_history(GitRepository &repo)
+{
+	std::string parent;
+	std::vector<GitRepository::RefUpdate> refs;
+	for (unsigned i = 0; i < history_length; i++)
+	{
+		auto n = std::to_string(i);
+		std::string subtree = write_object(repo, "tree",
+			tree_entry("100644", "deep.txt", write_small_blob(repo, "deep " + n + "\n")) +
+			tree_entry("100644", "same.txt", write_small_blob(repo, "same\n")));
+		std::string tree = write_object(repo, "tree",
+			tree_entry("100644", "a.txt", write_small_blob(repo, "a " + n + "\n")) +
+			tree_entry("100755", "b.sh", write_small_blob(repo, "b " + std::to_string(i / 3) + "\n")) +
+			tree_entry("40000", "sub", subtree));
+		std::string raw = "tree " + tree + "\n";
+		if (!parent.empty())
+			raw += "parent " + parent + "\n";
+		raw += "author a <a@b> " + std::to_string(1000000000 + i) + " +0000\n";
+		raw += "committer a <a@b> " + std::to_string(1000000000 + i) + " +0000\n";
+		raw += "\ncommit " + n + "\n";
+		parent = write_object(repo, "commit", raw);
+		refs.push_back({"refs/tags/v" + n, parent, ""});
+	}
+	refs.push_back({"refs/heads/master", parent, ""});
+	repo.ref_update(refs);
+}
+
+//! Everything reachable from master and the refs, as text.
+static std::string
+describe_history(GitRepository &repo)
+{
+	std::string out;
+	RefIterator refs(repo);
+	while (refs.next())
+	{
+		out += refs.name() + " " + refs.sha() + "\n";
+		if (repo.ref_resolve(refs.name()) != refs.sha())
+			fail("ref_resolve " + refs.name() + " disagrees with RefIterator");
+	}
+
+	TreeWalker walker(repo);
+	std::string sha = repo.ref_resolve("refs/heads/master");
+	while (!sha.empty())
+	{
+		auto commit = std::dynamic_pointer_cast<GitCommit>(repo.object_read(sha));
+		if (!commit)
+		{
+			fail("object_read " + sha + " is not a commit");
+			break;
+		}
+		auto trees = commit->get_value("tree");
+		auto parents = commit->get_value("parent");
+		out += "commit " + sha + "\n";
+		if (trees.empty())
+			break;
+		auto tree = std::dynamic_pointer_cast<GitTree>(repo.object_read(trees.at(0)));
+		if (!tree)
+		{
+			fail("object_read " + trees.at(0) + " is not a tree");
+			break;
+		}
+		for (const auto &item : tree->get_items())
+			out += item.mode + " " + item.path + " " + item.sha + "\n";
+		walker.walk({trees.at(0)}, [&out](const std::string &path,
+			const TreeWalker::Entries &entries) {
+			out += path + " " + entries.at(0)->sha + "\n";
+			return true;
+		});
+		sha = parents.empty() ? std::string() : parents.at(0);
+	}
+	return out;
+}
+
+int
+main(int argc, char **argv)
+{
+	unsigned nthreads = argc > 1 ? std::atoi(argv[1]) : 8;
+	unsigned nobjects = argc > 2 ? std::atoi(argv[2]) : 200;
+
+	fs::path path = fs::temp_directory_path() /
+		("wyag_stress_" + std::to_string(getpid()));
+	try
+	{
+		GitRepository::repo_create(path);
+		GitRepository repo(path);
+
+		// Hashes are computed up front so readers know what to look for
+		std::vector<std::string> shas;
+		for (unsigned i = 0; i < nthreads * nobjects; i++)
+			shas.push_back(write_blob(repo, i, false));
+
+		write_history(repo);
+		std::string history = describe_history(repo);
+		if (history.find("commit ") == std::string::npos)
+			fail("history not written");
+
+		std::vector<std::thread> threads;
+		for (unsigned t = 0; t < nthreads; t++)
+		{
+			threads.emplace_back([&]()
+			{
+				for (unsigned n = 0; n < 1 + nobjects / 50; n++)
+				{
+					if (describe_history(repo) != history)
+					{
+						fail("history read by several threads differs");
+						return;
+					}
+				}
+			});
+		}
+		for (unsigned t = 0; t < nthreads; t++)
+		{
+			threads.emplace_back([&, t]()
+			{
+				for (unsigned n = 0; n < nobjects; n++)
+				{
+					// Each object is written by two threads at once
+					unsigned mine = t * nobjects + n;
+					unsigned other = ((t + 1) % nthreads) * nobjects + n;
+					for (unsigned i : {mine, other})
+					{
+						if (write_blob(repo, i) != shas[i])
+							fail("object_write returned wrong id for blob " +
+								std::to_string(i));
+					}
+
+					// Read whatever other threads have written so far
+					unsigned peek = (mine * 7919) % shas.size();
+					if (repo.has_object(shas[peek]))
+						check_blob(repo, shas[peek], peek);
+				}
+			});
+		}
+		for (auto &thread : threads)
+			thread.join();
+
+		for (unsigned i = 0; i < shas.size(); i++)
+		{
+			if (!repo.has_object(shas[i]))
+				fail("object " + shas[i] + " missing after all writes");
+			else
+				check_blob(repo, shas[i], i);
+		}
+
+		// Objects another process writes after this one read the
+		// directories, straight away and after they look settled
+		for (unsigned round = 0; round < 2; round++)
+		{
+			unsigned first = shas.size() + round * 256;
+			for (unsigned i = first; i < first + 256; i++)
+			{
+				std::string sha = write_blob(repo, i, false);
+				if (repo.has_object(sha))
+					fail("object " + sha + " found before it was written");
+			}
+			if (round == 1)
+				sleep(2);
+			pid_t pid = fork();
+			if (pid == 0)
+			{
+				GitRepository writer(path);
+				for (unsigned i = first; i < first + 256; i++)
+					write_blob(writer, i);
+				_exit(0);
+			}
+			waitpid(pid, nullptr, 0);
+			if (round == 1)
+				sleep(2);
+			for (unsigned i = first; i < first + 256; i++)
+			{
+				std::string sha = write_blob(repo, i, false);
+				if (!repo.has_object(sha))
+					fail("object " + sha + " written by another process not found");
+				else
+					check_blob(repo, sha, i);
+			}
+		}
+
+		for (auto &entry : fs::recursive_directory_iterator(path / ".git" / "objects"))
+		{
+			if (entry.path().filename().string().find("tmp_obj_") == 0)
+				fail("temporary file left behind: " + entry.path().string());
+		}
+	}
+	catch (const std::exception &e)
+	{
+		fail(e.what());
+	}
+
+	fs::remove_all(path);
+	if (failures > 0)
+	{
+		std::cerr << failures << " failures" << std::endl;
+		return 1;
+	}
+	std::cout << "ok: " << nthreads << " threads, " << nobjects <<
+		" objects each" << std::endl;
+	return 0;
+}